@@ -546,14 +546,30 @@ void ArticleRequest::altSearchFinished()
     if( activeDicts.size() <= 1 )
       articleSizeLimit = -1; // Don't collapse article if only one dictionary presented
 
+    unsigned skippedDicts = 0;
+
     for( unsigned x = 0; x < activeDicts.size(); ++x )
     {
       try
       {
-        sptr< Dictionary::DataRequest > r =
-          activeDicts[ x ]->getArticle( wordStd, altsVector,
-                                        gd::toWString( contexts.value( QString::fromStdString( activeDicts[ x ]->getId() ) ) ),
-                                        ignoreDiacritics );
+        bool mayContain = activeDicts[ x ]->mayContainWord( wordStd );
+
+        for( unsigned y = 0; !mayContain && y < altsVector.size(); ++y )
+          mayContain = activeDicts[ x ]->mayContainWord( altsVector[ y ] );
+
+        sptr< Dictionary::DataRequest > r;
+
+        if ( mayContain )
+          r = activeDicts[ x ]->getArticle( wordStd, altsVector,
+                                            gd::toWString( contexts.value( QString::fromStdString( activeDicts[ x ]->getId() ) ) ),
+                                            ignoreDiacritics );
+        else
+        {
+          // The dictionary surely doesn't have the word. An empty request
+          // still goes in, since the requests must match the dictionaries.
+          r = new Dictionary::DataRequestInstant( false );
+          ++skippedDicts;
+        }
 
         connect( r.get(), SIGNAL( finished() ),
                  this, SLOT( bodyFinished() ), Qt::QueuedConnection );
@@ -567,6 +583,9 @@ void ArticleRequest::altSearchFinished()
       }
     }
 
+    GD_DPRINTF( "Skipped %u of %u dictionaries by their headword filters\n",
+                skippedDicts, (unsigned) activeDicts.size() );
+
     bodyFinished(); // Handle any ones which have already finished
   }
 }
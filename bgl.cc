@@ -59,7 +59,7 @@ namespace
   enum
   {
     Signature = 0x584c4742, // BGLX on little-endian, XLGB on big-endian
-    CurrentFormatVersion = 19 + BtreeIndexing::FormatVersion
+    CurrentFormatVersion = 20 + BtreeIndexing::FormatVersion
   };
 
   struct IdxHeader
@@ -78,7 +78,7 @@ namespace
     uint32_t chunksOffset; // The offset to chunks' storage
     uint32_t indexBtreeMaxElements; // Two fields from IndexInfo
     uint32_t indexRootOffset;
-    uint32_t resourceListOffset; // The offset of the list of resources
+    quint64 resourceListOffset; // The offset of the list of resources
     uint32_t resourcesCount; // Number of resources stored
     uint32_t langFrom;  // Source language
     uint32_t langTo;    // Target language
@@ -984,7 +984,8 @@ class BglResourceRequest: public Dictionary::DataRequest
 
   Mutex & idxMutex;
   File::Class & idx;
-  uint32_t resourceListOffset, resourcesCount;
+  quint64 resourceListOffset;
+  uint32_t resourcesCount;
   string name;
 
   QAtomicInt isCancelled;
@@ -994,7 +995,7 @@ public:
 
   BglResourceRequest( Mutex & idxMutex_,
                       File::Class & idx_,
-                      uint32_t resourceListOffset_,
+                      quint64 resourceListOffset_,
                       uint32_t resourcesCount_,
                       string const & name_ ):
     idxMutex( idxMutex_ ),
@@ -1055,7 +1056,7 @@ void BglResourceRequest::run()
     for( size_t x = nameData.size(); x--; )
       nameData[ x ] = tolower( nameData[ x ] );
 
-    uint32_t offset = idx.read< uint32_t >();
+    quint64 offset = idx.read< quint64 >();
 
     if ( string( &nameData.front(), nameData.size() ) == nameLowercased )
     {
@@ -1164,14 +1165,14 @@ sptr< Dictionary::DataRequest > BglDictionary::getResource( string const & name
   class ResourceHandler: public Babylon::ResourceHandler
   {
     File::Class & idxFile;
-    list< pair< string, uint32_t > > resources;
+    list< pair< string, quint64 > > resources;
 
   public:
 
     ResourceHandler( File::Class & idxFile_ ): idxFile( idxFile_ )
     {}
 
-    list< pair< string, uint32_t > > const & getResources() const
+    list< pair< string, quint64 > > const & getResources() const
     { return resources; }
 
   protected:
@@ -1195,7 +1196,7 @@ sptr< Dictionary::DataRequest > BglDictionary::getResource( string const & name
       return;
     }
 
-    resources.push_back( pair< string, uint32_t >( filename, idxFile.tell() ) );
+    resources.push_back( pair< string, quint64 >( filename, idxFile.tell() ) );
 
     idxFile.write< uint32_t >( size );
     idxFile.write< uint32_t >( compressedSize );
@@ -1363,13 +1364,13 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
         idxHeader.resourceListOffset = idx.tell();
         idxHeader.resourcesCount = resourceHandler.getResources().size();
 
-        for( list< pair< string, uint32_t > >::const_iterator j =
+        for( list< pair< string, quint64 > >::const_iterator j =
             resourceHandler.getResources().begin();
              j != resourceHandler.getResources().end(); ++j )
         {
           idx.write< uint32_t >( j->first.size() );
           idx.write( j->first.data(), j->first.size() );
-          idx.write< uint32_t >( j->second );
+          idx.write< quint64 >( j->second );
         }
 
         // That concludes it. Update the header.
@@ -7,9 +7,17 @@
 #include <QRunnable>
 #include <QThreadPool>
 #include <QSemaphore>
+#include <QThread>
+#include <QDir>
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
+#include <deque>
+#include <queue>
+#include <algorithm>
+#include <iterator>
+#include <set>
+#include <QHash>
 #include "gddebug.hh"
 #include "wstring_qt.hh"
 #include "qt4x5.hh"
@@ -36,8 +44,17 @@ struct __LzoInit
 } __lzoInit;
 }
 
-#else
+#endif
+
 #include <zlib.h>
+
+#ifdef __BTREE_USE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#ifdef __BTREE_USE_ZSTD
+#include <zstd.h>
 #endif
 
 namespace BtreeIndexing {
@@ -46,1070 +63,3833 @@ using gd::wstring;
 using gd::wchar;
 using std::pair;
 
+DEF_EX_STR( exInitFailed, "The dictionary couldn't be initialized:", Dictionary::Ex )
+
 enum
 {
   BtreeMinElements = 64,
-  BtreeMaxElements = 4096
+  BtreeMaxElements = 4096,
+
+  // The default size of the uncompressed nodes cache
+  NodeCacheMaxSize = 32 * 1024 * 1024,
+
+  // The upper bits of the compressed size stored for each node hold the
+  // id of the codec used to compress it. Old indices have zero there.
+  NodeCodecShift = 28,
+  NodeCompressedSizeMask = 0x0fffFFFF,
+
+  NodeCodecDefault = 0, // zlib, or LZO if built with __BTREE_USE_LZO
+  NodeCodecLz4 = 1,
+  NodeCodecZstd = 2,
+
+  // LZ4 and zstd levels used to compress the nodes. The higher ones are
+  // much slower to build the index with, while barely saving any space.
+  NodeLz4HcLevel = 9,
+  NodeZstdLevel = 9,
+
+  // The Bloom filters of the keys use this many bits per key and this many
+  // hash functions, which gives less than one percent of false positives
+  FilterBitsPerKey = 10,
+  FilterHashCount = 7,
+
+  // The nodes of the indices with wide addresses are aligned to this many
+  // bytes, so they can be up to 64 GB large
+  NodeAddressShift = 4,
+  NodeAlignment = 1 << NodeAddressShift
 };
 
-BtreeIndex::BtreeIndex():
-  idxFile( 0 ), rootNodeLoaded( false )
+enum
 {
-}
+  // The table of the exact words has at least twice as many slots as there
+  // are words. The words and the slots are addressed with 32-bit offsets, so
+  // the table is only made for this many words and bytes of them at most.
+  ExactWordsMaxCount = 0x4000000,
+  ExactWordsMaxSize = 0x7fffFFFF
+};
 
-BtreeDictionary::BtreeDictionary( string const & id,
-                                  vector< string > const & dictionaryFiles ):
-  Dictionary::Class( id, dictionaryFiles )
-{
-}
+// Marks the slots of the table of the exact words which are empty
+uint32_t const ExactSlotEmpty = 0xffffFFFF;
 
-string const & BtreeDictionary::ensureInitDone()
-{
-  static string empty;
+namespace {
 
-  return empty;
-}
+/// The uncompressed nodes of all the indices. The keys are the index file
+/// ids in the upper 32 bits, and node offsets in the lower ones. The data
+/// stored is the link to the next leaf followed by the node itself.
+LruCache< quint64 > nodeCache( NodeCacheMaxSize );
 
-void BtreeIndex::openIndex( IndexInfo const & indexInfo,
-                            File::Class & file, Mutex & mutex )
+// The filter statistics. They are counted without any locking, and wrap
+// around past 4G lookups.
+QAtomicInt filterLookups, filterSkips;
+
+/// Returns the hash of the utf8-encoded key, as used by the Bloom filters.
+/// The filters are stored in the index files, so this must never change
+/// without bumping FormatVersion.
+quint64 filterHash( string const & key )
 {
-  indexNodeSize = indexInfo.btreeMaxElements;
-  rootOffset = indexInfo.rootOffset;
+  // FNV-1a, followed by a final mix so that all the bits are good
+  quint64 h = Q_UINT64_C( 0xcbf29ce484222325 );
 
-  idxFile = &file;
-  idxFileMutex = &mutex;
+  for( size_t x = 0; x < key.size(); ++x )
+  {
+    h ^= (unsigned char) key[ x ];
+    h *= Q_UINT64_C( 0x100000001b3 );
+  }
 
-  rootNodeLoaded = false;
-  rootNode.clear();
+  h ^= h >> 33;
+  h *= Q_UINT64_C( 0xff51afd7ed558ccd );
+  h ^= h >> 33;
+  h *= Q_UINT64_C( 0xc4ceb9fe1a85ec53 );
+  h ^= h >> 33;
+
+  return h;
 }
 
-vector< WordArticleLink > BtreeIndex::findArticles( wstring const & word, bool ignoreDiacritics )
+/// Returns the bit the n-th hash function of the filter sets for the key
+/// with the given hash. The functions are made out of the two halves of it.
+inline uint32_t filterBit( quint64 hash, unsigned n, uint32_t bitCount )
 {
-  vector< WordArticleLink > result;
+  uint32_t h1 = (uint32_t) hash;
+  uint32_t h2 = (uint32_t)( hash >> 32 ) | 1;
 
-  try
-  {
-    wstring folded = Folding::apply( word );
-    if( folded.empty() )
-      folded = Folding::applyWhitespaceOnly( word );
+  return ( h1 + n * h2 ) % bitCount;
+}
 
-    bool exactMatch;
+enum
+{
+  /// The most characters a single character may turn into when folded.
+  /// This is foldCaseMaxOut of inc_case_folding.hh.
+  MaxFoldedSize = 3,
 
-    vector< char > leaf;
-    uint32_t nextLeaf;
+  /// The n-gram index isn't stored if it grows larger than this many
+  /// trigram-leaf pairs while the index is being built
+  NgramIndexMaxPairs = 16 * 1024 * 1024
+};
 
-    char const * leafEnd;
+/// Returns the hash of the trigram, as used in the n-gram index.
+inline uint32_t trigramHash( wchar a, wchar b, wchar c )
+{
+  quint64 h = ( ( (quint64) a * 0x9E3779B1 + b ) * 0x85EBCA77 + c ) * 0xC2B2AE3D;
 
-    char const * chainOffset = findChainOffsetExactOrPrefix( folded, exactMatch,
-                                                             leaf, nextLeaf,
-                                                             leafEnd );
+  return (uint32_t)( h ^ ( h >> 32 ) );
+}
 
-    if ( chainOffset && exactMatch )
-    {
-      result = readChain( chainOffset );
+/// Decodes the next character of the utf8 string. Returns the number of
+/// bytes it took, or 0 if the string ends in the middle of it.
+inline size_t decodeUtf8Char( char const * in, size_t size, wchar & out )
+{
+  unsigned char c = *in;
+  size_t len;
 
-      antialias( word, result, ignoreDiacritics );
-    }
+  if ( c < 0x80 )
+  {
+    out = c;
+    return 1;
   }
-  catch( std::exception & e )
+  else
+  if ( ( c & 0xE0 ) == 0xC0 )
   {
-    gdWarning( "Articles searching failed, error: %s\n", e.what() );
-    result.clear();
+    out = c & 0x1F;
+    len = 2;
   }
-  catch(...)
+  else
+  if ( ( c & 0xF0 ) == 0xE0 )
   {
-    qWarning( "Articles searching failed\n" );
-    result.clear();
+    out = c & 0x0F;
+    len = 3;
+  }
+  else
+  {
+    out = c & 0x07;
+    len = 4;
   }
 
-  return result;
+  if ( len > size )
+    return 0;
+
+  for( size_t x = 1; x < len; ++x )
+    out = ( out << 6 ) | ( in[ x ] & 0x3F );
+
+  return len;
 }
 
-class BtreeWordSearchRunnable: public QRunnable
+}
+
+/// A DFA which accepts the folded keys of the headwords that may match a
+/// wildcard pattern, built lazily out of the pattern's NFA. The pattern must
+/// be folded with the wildcards preserved. Since folding drops whitespace
+/// and punctuation and may turn one character into several, '?' and sets
+/// match anywhere from none to MaxFoldedSize characters, and escaped
+/// punctuation doesn't match anything. The matching is only anchored at
+/// the beginning, just like the final check of the headwords is, so a key
+/// is accepted as soon as its prefix is.
+class WildcardAutomaton
 {
-  BtreeWordSearchRequest & r;
-  QSemaphore & hasExited;
-  
 public:
 
-  BtreeWordSearchRunnable( BtreeWordSearchRequest & r_,
-                           QSemaphore & hasExited_ ): r( r_ ),
-                                                      hasExited( hasExited_ )
-  {}
-
-  ~BtreeWordSearchRunnable()
+  enum
   {
-    hasExited.release();
-  }
-  
-  virtual void run();
-};
+    Dead = -1
+  };
 
-void BtreeWordSearchRunnable::run()
-{
-  r.run();
-}
+  explicit WildcardAutomaton( wstring const & foldedPattern );
 
-BtreeWordSearchRequest::BtreeWordSearchRequest( BtreeDictionary & dict_,
-                                                wstring const & str_,
-                                                unsigned minLength_,
-                                                int maxSuffixVariation_,
-                                                bool allowMiddleMatches_,
-                                                unsigned long maxResults_,
-                                                bool startRunnable ):
-  dict( dict_ ), str( str_ ),
-  maxResults( maxResults_ ),
-  minLength( minLength_ ),
-  maxSuffixVariation( maxSuffixVariation_ ),
-  allowMiddleMatches( allowMiddleMatches_ )
-{
-  if( startRunnable )
-  {
-    QThreadPool::globalInstance()->start(
-      new BtreeWordSearchRunnable( *this, hasExited ) );
-  }
-}
+  int start() const
+  { return 0; }
 
-void BtreeWordSearchRequest::findMatches()
-{
-  if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+  bool isAccepting( int state ) const
+  { return state != Dead && accepting[ state ]; }
+
+  /// Feeds the utf8 string to the automaton, beginning from the given state.
+  /// Returns the resulting state. Stops early once it's dead or accepting.
+  int run( int state, char const * utf8, size_t size );
+
+  /// Returns true if the pattern begins with a wildcard.
+  bool startsWithWildcard() const
+  { return items.empty() || items[ 0 ].type != Literal; }
+
+  /// Returns the hashes of all the trigrams of the literal parts of the
+  /// pattern.
+  vector< uint32_t > const & getTrigrams() const
+  { return trigrams; }
+
+private:
+
+  enum ItemType
   {
-    finish();
-    return;
-  }
+    Literal,
+    AnyChar, // Matches one character or none
+    AnyString
+  };
 
-  if ( dict.ensureInitDone().size() )
+  struct Item
   {
-    setErrorString( QString::fromUtf8( dict.ensureInitDone().c_str() ) );
-    finish();
-    return;
-  }
-  
-#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
-  QRegularExpression regexp;
-#else
-  QRegExp regexp;
-#endif
-  bool useWildcards = false;
-  if( allowMiddleMatches )
-    useWildcards = ( str.find( '*' ) != wstring::npos ||
-                     str.find( '?' ) != wstring::npos ||
-                     str.find( '[' ) != wstring::npos ||
-                     str.find( ']' ) != wstring::npos );
+    ItemType type;
+    wchar ch;
 
-  wstring folded = Folding::apply( str );
+    Item( ItemType type_, wchar ch_ = 0 ): type( type_ ), ch( ch_ )
+    {}
+  };
 
-  int minMatchLength = 0;
+  vector< Item > items;
+  vector< uint32_t > trigrams;
 
-  if( useWildcards )
-  {
-#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
-    regexp.setPattern( wildcardsToRegexp( gd::toQString( Folding::applyDiacriticsOnly( Folding::applySimpleCaseOnly( str ) ) ) ) );
-    if( !regexp.isValid() )
-      regexp.setPattern( QRegularExpression::escape( regexp.pattern() ) );
-    regexp.setPatternOptions( QRegularExpression::CaseInsensitiveOption );
-#else
-    regexp.setPattern( gd::toQString( Folding::applyDiacriticsOnly( Folding::applySimpleCaseOnly( str ) ) ) );
-    regexp.setPatternSyntax( QRegExp::WildcardUnix );
-    regexp.setCaseSensitivity( Qt::CaseInsensitive );
-#endif
+  // The DFA states, each being the set of the NFA positions, one more than
+  // there are items, the last one being the final one.
+  vector< vector< char > > states;
+  vector< char > accepting;
+  map< vector< char >, int > stateIds;
+  QHash< quint64, int > transitions;
 
-    bool bNoLetters = folded.empty();
-    wstring foldedWithWildcards;
+  /// Adds all the positions reachable without consuming anything, and
+  /// returns the id of the resulting state, adding it if it's new.
+  int getState( vector< char > & positions );
 
-    if( bNoLetters )
-      foldedWithWildcards = Folding::applyWhitespaceOnly( str );
-    else
-      foldedWithWildcards = Folding::apply( str, useWildcards );
+  int step( int state, wchar ch );
+};
 
-    // Calculate minimum match length
+WildcardAutomaton::WildcardAutomaton( wstring const & pattern )
+{
+  wstring literal;
 
-    bool insideSet = false;
-    bool escaped = false;
-    for( wstring::size_type x = 0; x < foldedWithWildcards.size(); x++ )
-    {
-      wchar ch = foldedWithWildcards[ x ];
+  for( size_t x = 0; x < pattern.size(); ++x )
+  {
+    wchar ch = pattern[ x ];
 
-      if( ch == L'\\' && !escaped )
+    if ( ch == '\\' )
+    {
+      // Escaped wildcards are punctuation, which isn't there in the keys
+      if ( ++x < pattern.size() )
       {
-        escaped = true;
-        continue;
-      }
+        ch = pattern[ x ];
 
-      if( ch == L']' && !escaped )
-      {
-        insideSet = false;
-        continue;
+        if ( ch != '\\' && ch != '*' && ch != '?' && ch != '[' && ch != ']' )
+        {
+          items.push_back( Item( Literal, ch ) );
+          literal.push_back( ch );
+        }
       }
 
-      if( insideSet )
-      {
-        escaped = false;
-        continue;
-      }
+      continue;
+    }
 
-      if( ch == L'[' && !escaped )
+    if ( ch == '*' || ch == '?' || ch == '[' )
+    {
+      if ( ch == '[' )
       {
-        minMatchLength += 1;
-        insideSet = true;
-        continue;
-      }
+        // An unterminated set is matched literally, so it's punctuation
+        size_t end = pattern.find( ']', x + 1 );
 
-      if( ch == L'*' && !escaped )
-        continue;
+        if ( end == wstring::npos )
+          continue;
 
-      escaped = false;
-      minMatchLength += 1;
-    }
+        x = end;
+      }
 
-    // Fill first match chars
+      for( size_t y = 3; y <= literal.size(); ++y )
+        trigrams.push_back( trigramHash( literal[ y - 3 ], literal[ y - 2 ], literal[ y - 1 ] ) );
 
-    folded.clear();
-    folded.reserve( foldedWithWildcards.size() );
-    escaped = false;
-    for( wstring::size_type x = 0; x < foldedWithWildcards.size(); x++ )
-    {
-      wchar ch = foldedWithWildcards[ x ];
+      literal.clear();
 
-      if( escaped )
+      if ( ch == '*' )
       {
-        if( bNoLetters || ( ch != L'*' && ch != L'?' && ch != L'[' && ch != L']' ) )
-          folded.push_back( ch );
-        escaped = false;
-        continue;
+        if ( items.empty() || items.back().type != AnyString )
+          items.push_back( Item( AnyString ) );
       }
+      else
+        for( int y = 0; y < MaxFoldedSize; ++y )
+          items.push_back( Item( AnyChar ) );
 
-      if( ch == L'\\' )
-      {
-        if( bNoLetters || folded.empty() )
-        {
-          escaped = true;
-          continue;
-        }
-        else
-          break;
-      }
+      continue;
+    }
 
-      if( ch == '*' || ch == '?' || ch == '[' || ch == ']' )
-        break;
+    if ( ch == ']' )
+      continue;
 
-      folded.push_back( ch );
-    }
-  }
-  else
-  {
-    if( folded.empty() )
-      folded = Folding::applyWhitespaceOnly( str );
+    items.push_back( Item( Literal, ch ) );
+    literal.push_back( ch );
   }
 
-  int initialFoldedSize = folded.size();
+  for( size_t y = 3; y <= literal.size(); ++y )
+    trigrams.push_back( trigramHash( literal[ y - 3 ], literal[ y - 2 ], literal[ y - 1 ] ) );
 
-  int charsLeftToChop = 0;
+  std::sort( trigrams.begin(), trigrams.end() );
+  trigrams.erase( std::unique( trigrams.begin(), trigrams.end() ), trigrams.end() );
 
-  if ( maxSuffixVariation >= 0 )
+  // Anything may follow the pattern
+  if ( items.empty() || items.back().type != AnyString )
+    items.push_back( Item( AnyString ) );
+
+  vector< char > positions( items.size() + 1, 0 );
+
+  positions[ 0 ] = 1;
+
+  getState( positions );
+}
+
+int WildcardAutomaton::getState( vector< char > & positions )
+{
+  bool empty = true;
+
+  for( size_t x = 0; x < items.size(); ++x )
   {
-    charsLeftToChop = initialFoldedSize - (int)minLength;
+    if ( !positions[ x ] )
+      continue;
 
-    if ( charsLeftToChop < 0 )
-      charsLeftToChop = 0;
-    else
-    if ( charsLeftToChop > maxSuffixVariation )
-      charsLeftToChop = maxSuffixVariation;
+    empty = false;
+
+    if ( items[ x ].type != Literal )
+      positions[ x + 1 ] = 1;
   }
 
-  try
-  {
-    for( ; ; )
-    {
-      bool exactMatch;
-      vector< char > leaf;
-      uint32_t nextLeaf;
-      char const * leafEnd;
+  if ( empty && !positions[ items.size() ] )
+    return Dead;
 
-      char const * chainOffset = dict.findChainOffsetExactOrPrefix( folded, exactMatch,
-                                                                    leaf, nextLeaf,
-                                                                    leafEnd );
+  map< vector< char >, int >::const_iterator i = stateIds.find( positions );
 
-      if ( chainOffset )
-      for( ; ; )
-      {
-        if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-          break;
+  if ( i != stateIds.end() )
+    return i->second;
 
-        //DPRINTF( "offset = %u, size = %u\n", chainOffset - &leaf.front(), leaf.size() );
+  int id = states.size();
 
-        vector< WordArticleLink > chain = dict.readChain( chainOffset );
+  states.push_back( positions );
+  accepting.push_back( positions[ items.size() ] );
+  stateIds[ positions ] = id;
 
-        wstring chainHead = Utf8::decode( chain[ 0 ].word );
+  return id;
+}
 
-        wstring resultFolded = Folding::apply( chainHead );
-        if( resultFolded.empty() )
-          resultFolded = Folding::applyWhitespaceOnly( chainHead );
+int WildcardAutomaton::step( int state, wchar ch )
+{
+  quint64 key = ( (quint64) state << 32 ) | (quint32) ch;
 
-        if ( ( useWildcards && folded.empty() ) ||
-             ( resultFolded.size() >= folded.size()
-               && !resultFolded.compare( 0, folded.size(), folded ) ) )
-        {
-          // Exact or prefix match
+  QHash< quint64, int >::const_iterator i = transitions.constFind( key );
 
-          Mutex::Lock _( dataMutex );
+  if ( i != transitions.constEnd() )
+    return i.value();
 
-          for( unsigned x = 0; x < chain.size(); ++x )
-          {
-            if( useWildcards )
-            {
-              wstring word = Utf8::decode( chain[ x ].prefix + chain[ x ].word );
-              wstring result = Folding::applyDiacriticsOnly( word );
-#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
-              if( result.size() >= (wstring::size_type)minMatchLength )
-              {
-                QRegularExpressionMatch match = regexp.match( gd::toQString( result ) );
-                if( match.hasMatch() && match.capturedStart() == 0 )
-                {
-                  addMatch( word );
-                }
-              }
-#else
-              if( result.size() >= (wstring::size_type)minMatchLength
-                  && regexp.indexIn( gd::toQString( result ) ) == 0
-                  && regexp.matchedLength() >= minMatchLength )
-              {
-                addMatch( word );
-              }
-#endif
-            }
-            else
-            {
-              // Skip middle matches, if requested. If suffix variation is specified,
-              // make sure the string isn't larger than requested.
-              if ( ( allowMiddleMatches || Folding::apply( Utf8::decode( chain[ x ].prefix ) ).empty() ) &&
-                   ( maxSuffixVariation < 0 || (int)resultFolded.size() - initialFoldedSize <= maxSuffixVariation ) )
-                  addMatch( Utf8::decode( chain[ x ].prefix + chain[ x ].word ) );
-            }
-          }
+  vector< char > const & from = states[ state ];
+  vector< char > to( from.size(), 0 );
 
-          if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-            break;
+  for( size_t x = 0; x < items.size(); ++x )
+  {
+    if ( !from[ x ] )
+      continue;
 
-          if ( matches.size() >= maxResults )
-          {
-            // For now we actually allow more than maxResults if the last
-            // chain yield more than one result. That's ok and maybe even more
-            // desirable.
-            break;
-          }
-        }
-        else
-          // Neither exact nor a prefix match, end this
-          break;
+    switch( items[ x ].type )
+    {
+      case Literal:
+        if ( items[ x ].ch == ch )
+          to[ x + 1 ] = 1;
+        break;
 
-        // Fetch new leaf if we're out of chains here
+      case AnyChar:
+        to[ x + 1 ] = 1;
+        break;
 
-        if ( chainOffset >= leafEnd )
-        {
-          // We're past the current leaf, fetch the next one
+      case AnyString:
+        to[ x ] = 1;
+        break;
+    }
+  }
 
-          //DPRINTF( "advancing\n" );
+  int result = getState( to );
 
-          if ( nextLeaf )
-          {
-            Mutex::Lock _( *dict.idxFileMutex );
+  transitions.insert( key, result );
 
-            dict.readNode( nextLeaf, leaf );
-            leafEnd = &leaf.front() + leaf.size();
+  return result;
+}
 
-            nextLeaf = dict.idxFile->read< uint32_t >();
-            chainOffset = &leaf.front() + sizeof( uint32_t );
+int WildcardAutomaton::run( int state, char const * utf8, size_t size )
+{
+  while( size && state != Dead && !accepting[ state ] )
+  {
+    wchar ch;
 
-            uint32_t leafEntries = *(uint32_t *)&leaf.front();
+    size_t len = decodeUtf8Char( utf8, size, ch );
 
-            if ( leafEntries == 0xffffFFFF )
-            {
-              //DPRINTF( "bah!\n" );
-              exit( 1 );
-            }
-          }
-          else
-            break; // That was the last leaf
-        }
-      }
+    if ( !len )
+      break;
 
-      if ( charsLeftToChop && !Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-      {
-        --charsLeftToChop;
-        folded.resize( folded.size() - 1 );
-      }
-      else
-        break;
-    }
-  }
-  catch( std::exception & e )
-  {
-    qWarning( "Index searching failed: \"%s\", error: %s\n",
-              dict.getName().c_str(), e.what() );
-  }
-  catch(...)
-  {
-    gdWarning( "Index searching failed: \"%s\"\n", dict.getName().c_str() );
+    state = step( state, ch );
+
+    utf8 += len;
+    size -= len;
   }
+
+  return state;
 }
 
-void BtreeWordSearchRequest::run()
+/// A Levenshtein automaton, which tells how far the keys fed to it are from
+/// the given folded word. Its states are the rows of the usual distance
+/// matrix: each holds the distances between the prefixes of the word and the
+/// part of the key fed so far, capped at one more than the maximum distance.
+/// Once the whole row is over the maximum, no continuation of the key can
+/// get close enough to the word, so the state is dead.
+class LevenshteinAutomaton
 {
-  if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-  {
-    finish();
-    return;
-  }
+public:
 
-  if ( dict.ensureInitDone().size() )
-  {
-    setErrorString( QString::fromUtf8( dict.ensureInitDone().c_str() ) );
-    finish();
-    return;
-  }
+  typedef vector< unsigned > Row;
 
-  findMatches();
+  LevenshteinAutomaton( wstring const & word_, unsigned maxDistance_ ):
+    word( word_ ), maxDistance( maxDistance_ )
+  {}
 
-  finish();
-}
+  /// Sets the row to the initial state.
+  void start( Row & row ) const;
 
-BtreeWordSearchRequest::~BtreeWordSearchRequest()
-{
-  isCancelled.ref();
-  hasExited.acquire();
-}
+  /// Computes the state after one more character. Returns false if it is
+  /// dead.
+  bool step( Row const & from, wchar ch, Row & to ) const;
 
-sptr< Dictionary::WordSearchRequest > BtreeDictionary::prefixMatch(
-  wstring const & str, unsigned long maxResults )
-  THROW_SPEC( std::exception )
-{
-  return new BtreeWordSearchRequest( *this, str, 0, -1, true, maxResults );
-}
+  /// Feeds the utf8 string to the automaton, updating the row. Returns
+  /// false if it died on the way.
+  bool run( Row & row, char const * utf8, size_t size ) const;
 
-sptr< Dictionary::WordSearchRequest > BtreeDictionary::stemmedMatch(
-  wstring const & str, unsigned minLength, unsigned maxSuffixVariation,
-  unsigned long maxResults )
-  THROW_SPEC( std::exception )
+  /// The distance between the word and the key fed, if it is within the
+  /// maximum. Larger ones are all reported as one more than the maximum.
+  unsigned distance( Row const & row ) const
+  { return row.back(); }
+
+  unsigned getMaxDistance() const
+  { return maxDistance; }
+
+private:
+
+  wstring word;
+  unsigned maxDistance;
+};
+
+void LevenshteinAutomaton::start( Row & row ) const
 {
-  return new BtreeWordSearchRequest( *this, str, minLength, (int)maxSuffixVariation,
-                                     false, maxResults );
+  row.resize( word.size() + 1 );
+
+  for( size_t x = 0; x < row.size(); ++x )
+    row[ x ] = x <= maxDistance ? x : maxDistance + 1;
 }
 
-void BtreeIndex::readNode( uint32_t offset, vector< char > & out )
+bool LevenshteinAutomaton::step( Row const & from, wchar ch, Row & to ) const
 {
-  idxFile->seek( offset );
+  unsigned const cap = maxDistance + 1;
 
-  uint32_t uncompressedSize = idxFile->read< uint32_t >();
-  uint32_t compressedSize = idxFile->read< uint32_t >();
+  to.resize( from.size() );
 
-  //DPRINTF( "%x,%x\n", uncompressedSize, compressedSize );
+  to[ 0 ] = from[ 0 ] < cap ? from[ 0 ] + 1 : cap;
 
-  out.resize( uncompressedSize );
+  unsigned best = to[ 0 ];
 
-  vector< unsigned char > compressedData( compressedSize );
+  for( size_t x = 1; x < to.size(); ++x )
+  {
+    // Substitution or match, then deletion and insertion
+    unsigned value = from[ x - 1 ] + ( word[ x - 1 ] == ch ? 0 : 1 );
 
-  idxFile->read( &compressedData.front(), compressedData.size() );
+    if ( from[ x ] + 1 < value )
+      value = from[ x ] + 1;
 
-  #ifdef __BTREE_USE_LZO
+    if ( to[ x - 1 ] + 1 < value )
+      value = to[ x - 1 ] + 1;
 
-  lzo_uint decompressedLength = out.size();
+    if ( value > cap )
+      value = cap;
 
-  if ( lzo1x_decompress( &compressedData.front(), compressedData.size(),
-                         (unsigned char *)&out.front(), &decompressedLength, 0 )
-       != LZO_E_OK || decompressedLength != out.size() )
-    throw exFailedToDecompressNode();
+    to[ x ] = value;
 
-  #else
+    if ( value < best )
+      best = value;
+  }
+
+  return best <= maxDistance;
+}
 
-  unsigned long decompressedLength = out.size();
+bool LevenshteinAutomaton::run( Row & row, char const * utf8, size_t size ) const
+{
+  Row next;
 
-  if ( uncompress( (unsigned char *)&out.front(),
-                   &decompressedLength,
-                   &compressedData.front(),
-                   compressedData.size() ) != Z_OK ||
-       decompressedLength != out.size() )
-    throw exFailedToDecompressNode();
-  #endif
+  while( size )
+  {
+    wchar ch;
+
+    size_t len = decodeUtf8Char( utf8, size, ch );
+
+    if ( !len )
+      break;
+
+    bool alive = step( row, ch, next );
+
+    row.swap( next );
+
+    if ( !alive )
+      return false;
+
+    utf8 += len;
+    size -= len;
+  }
+
+  return true;
 }
 
-char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
-                                                       bool & exactMatch,
-                                                       vector< char > & extLeaf,
-                                                       uint32_t & nextLeaf,
-                                                       char const * & leafEnd )
+/// Maps the trigrams of the keys to the leaves having them, so that the
+/// wildcard searches which begin with a wildcard only need to look through
+/// the leaves having all the trigrams of the pattern. The trigrams are
+/// stored as hashes, so a collision may only add a leaf to look through.
+class NgramIndex
 {
-  if ( !idxFile )
-    throw exIndexWasNotOpened();
-  
-  Mutex::Lock _( *idxFileMutex );
-  
-  // Lookup the index by traversing the index btree
+public:
 
-  vector< wchar > wcharBuffer;
+  /// The offsets of all the leaves, in order. The leaves are referred to by
+  /// their numbers in here.
+  vector< uint32_t > leafOffsets;
 
-  exactMatch = false;
+  /// Stores the postings, given as hashes in the upper 32 bits and leaf
+  /// numbers in the lower ones. They must be sorted and unique.
+  void setPostings( vector< quint64 > const & );
 
-  // Read a node
+  /// Finds the offsets of the leaves which have all the given trigrams.
+  void findLeaves( vector< uint32_t > const & trigrams, vector< uint32_t > & offsets ) const;
 
-  uint32_t currentNodeOffset = rootOffset;
+  /// Serializes the index, as stored in the index file.
+  void save( vector< unsigned char > & ) const;
+
+  /// Loads the index saved by save(). Returns false if the data is corrupt.
+  bool load( unsigned char const * data, size_t size );
+
+private:
+
+  // The distinct hashes, sorted, and where their postings begin. The
+  // postings are the deltas of the leaf numbers, varint-encoded.
+  vector< uint32_t > hashes, postingStarts;
+  vector< unsigned char > postings;
+};
+
+void NgramIndex::setPostings( vector< quint64 > const & pairs )
+{
+  uint32_t prevLeaf = 0;
 
-  if ( !rootNodeLoaded )
+  for( size_t x = 0; x < pairs.size(); ++x )
   {
-    // Time to load our root node. We do it only once, at the first request.
-    readNode( rootOffset, rootNode );
-    rootNodeLoaded = true;
+    uint32_t hash = pairs[ x ] >> 32;
+    uint32_t leaf = (uint32_t) pairs[ x ];
+
+    if ( hashes.empty() || hashes.back() != hash )
+    {
+      hashes.push_back( hash );
+      postingStarts.push_back( postings.size() );
+      prevLeaf = 0;
+    }
+
+    uint32_t delta = leaf - prevLeaf;
+
+    prevLeaf = leaf;
+
+    while( delta >= 0x80 )
+    {
+      postings.push_back( ( delta & 0x7F ) | 0x80 );
+      delta >>= 7;
+    }
+
+    postings.push_back( delta );
   }
 
-  char const * leaf = &rootNode.front();
-  leafEnd = leaf + rootNode.size();
+  postingStarts.push_back( postings.size() );
+}
 
-  if( target.empty() )
+void NgramIndex::findLeaves( vector< uint32_t > const & trigrams,
+                             vector< uint32_t > & offsets ) const
+{
+  vector< uint32_t > leaves, found, common;
+
+  for( size_t x = 0; x < trigrams.size(); ++x )
   {
-    //For empty target string we return first chain in index
-    for( ; ; )
+    vector< uint32_t >::const_iterator i =
+      std::lower_bound( hashes.begin(), hashes.end(), trigrams[ x ] );
+
+    found.clear();
+
+    if ( i != hashes.end() && *i == trigrams[ x ] )
     {
-      uint32_t leafEntries = *(uint32_t *)leaf;
+      size_t n = i - hashes.begin();
 
-      if ( leafEntries == 0xffffFFFF )
-      {
-        // A node
-        currentNodeOffset = *( (uint32_t *)leaf + 1 );
-        readNode( currentNodeOffset, extLeaf );
-        leaf = &extLeaf.front();
-        leafEnd = leaf + extLeaf.size();
-        nextLeaf = idxFile->read< uint32_t >();
-      }
-      else
+      unsigned char const * ptr = &postings.front() + postingStarts[ n ];
+      unsigned char const * end = &postings.front() + postingStarts[ n + 1 ];
+
+      uint32_t leaf = 0;
+
+      while( ptr != end )
       {
-        // A leaf
-        if( currentNodeOffset == rootOffset )
+        uint32_t delta = 0;
+
+        for( int shift = 0; ; shift += 7 )
         {
-          // Only one leaf in index, there's no next leaf
-          nextLeaf = 0;
+          delta |= (uint32_t)( *ptr & 0x7F ) << shift;
+
+          if ( !( *ptr++ & 0x80 ) )
+            break;
         }
-        if( !leafEntries )
-          return 0;
 
-        return leaf + sizeof( uint32_t );
+        leaf += delta;
+        found.push_back( leaf );
       }
     }
+
+    if ( !x )
+      leaves.swap( found );
+    else
+    {
+      common.clear();
+      std::set_intersection( leaves.begin(), leaves.end(), found.begin(), found.end(),
+                             std::back_inserter( common ) );
+      leaves.swap( common );
+    }
+
+    if ( leaves.empty() )
+      break;
   }
 
-  for( ; ; )
-  {
-    // Is it a leaf or a node?
+  offsets.clear();
+  offsets.reserve( leaves.size() );
 
-    uint32_t leafEntries = *(uint32_t *)leaf;
+  for( size_t x = 0; x < leaves.size(); ++x )
+    if ( leaves[ x ] < leafOffsets.size() )
+      offsets.push_back( leafOffsets[ leaves[ x ] ] );
+}
 
-    if ( leafEntries == 0xffffFFFF )
-    {
-      // A node
+void NgramIndex::save( vector< unsigned char > & out ) const
+{
+  // The counts come first, then the leaf offsets, the hashes, where their
+  // postings begin and the postings themselves
+  uint32_t counts[ 3 ] = { (uint32_t) leafOffsets.size(), (uint32_t) hashes.size(),
+                           (uint32_t) postings.size() };
 
-      //DPRINTF( "=>a node\n" );
+  out.resize( sizeof( counts ) + ( leafOffsets.size() + hashes.size() +
+                                   postingStarts.size() ) * sizeof( uint32_t ) +
+              postings.size() );
 
-      uint32_t const * offsets = (uint32_t *)leaf + 1;
+  unsigned char * ptr = &out.front();
 
-      char const * ptr = leaf + sizeof( uint32_t ) +
-                         ( indexNodeSize + 1 ) * sizeof( uint32_t );
+  memcpy( ptr, counts, sizeof( counts ) );
+  ptr += sizeof( counts );
 
-      // ptr now points to a span of zero-separated strings, up to leafEnd.
-      // We find our match using a binary search.
+  if ( leafOffsets.size() )
+    memcpy( ptr, &leafOffsets.front(), leafOffsets.size() * sizeof( uint32_t ) );
+  ptr += leafOffsets.size() * sizeof( uint32_t );
 
-      char const * closestString;
+  if ( hashes.size() )
+    memcpy( ptr, &hashes.front(), hashes.size() * sizeof( uint32_t ) );
+  ptr += hashes.size() * sizeof( uint32_t );
 
-      int compareResult;
+  memcpy( ptr, &postingStarts.front(), postingStarts.size() * sizeof( uint32_t ) );
+  ptr += postingStarts.size() * sizeof( uint32_t );
 
-      char const * window = ptr;
-      unsigned windowSize = leafEnd - ptr;
+  if ( postings.size() )
+    memcpy( ptr, &postings.front(), postings.size() );
+}
 
-      for( ; ; )
-      {  
-        // We boldly shoot in the middle of the whole mess, and then adjust
-        // to the beginning of the string that we've hit.
-        char const * testPoint = window + windowSize/2;
-  
-        closestString = testPoint;
-  
-        while( closestString > ptr && closestString[ -1 ] )
-          --closestString;
-  
-        size_t wordSize = strlen( closestString );
-  
-        if ( wcharBuffer.size() <= wordSize )
-          wcharBuffer.resize( wordSize + 1 );
-  
-        long result = Utf8::decode( closestString, wordSize, &wcharBuffer.front() );
+bool NgramIndex::load( unsigned char const * data, size_t size )
+{
+  uint32_t counts[ 3 ];
 
-        if ( result < 0 )
-          throw Utf8::exCantDecode( closestString );
-  
-        wcharBuffer[ result ] = 0;
+  if ( size < sizeof( counts ) )
+    return false;
 
-        //DPRINTF( "Checking against %s\n", closestString );
+  memcpy( counts, data, sizeof( counts ) );
 
-        compareResult = target.compare( &wcharBuffer.front() );
-  
-        if ( !compareResult )
-        {
-          // The target string matches the current one. Finish the search.
-          break;
-        }
-        if ( compareResult < 0 )
-        {
-          // The target string is smaller than the current one.
-          // Go to the left.
-          windowSize = closestString - window;
+  if ( size != sizeof( counts ) + ( (quint64) counts[ 0 ] + (quint64) counts[ 1 ] * 2 + 1 ) *
+               sizeof( uint32_t ) + counts[ 2 ] )
+    return false;
 
-          if ( !windowSize )
-            break;
-        }
-        else
-        {
-          // The target string is larger than the current one.
-          // Go to the right.
-          windowSize -= ( closestString - window )  + wordSize + 1;
-          window = closestString + wordSize + 1;
+  unsigned char const * ptr = data + sizeof( counts );
 
-          if ( !windowSize )
-            break;
-        }
-      }
+  leafOffsets.resize( counts[ 0 ] );
+  hashes.resize( counts[ 1 ] );
+  postingStarts.resize( counts[ 1 ] + 1 );
+  postings.resize( counts[ 2 ] );
 
-      #if 0
-      DPRINTF( "The winner is %s, compareResult = %d\n", closestString, compareResult );
+  if ( leafOffsets.size() )
+    memcpy( &leafOffsets.front(), ptr, leafOffsets.size() * sizeof( uint32_t ) );
+  ptr += leafOffsets.size() * sizeof( uint32_t );
 
-      if ( closestString != ptr )
-      {
-        char const * left = closestString -1;
+  if ( hashes.size() )
+    memcpy( &hashes.front(), ptr, hashes.size() * sizeof( uint32_t ) );
+  ptr += hashes.size() * sizeof( uint32_t );
 
-        while( left != ptr && left[ -1 ] )
-          --left;
+  memcpy( &postingStarts.front(), ptr, postingStarts.size() * sizeof( uint32_t ) );
+  ptr += postingStarts.size() * sizeof( uint32_t );
 
-        DPRINTF( "To the left: %s\n", left );
-      }
-      else
-        DPRINTF( "To the lest -- nothing\n" );
+  if ( postings.size() )
+    memcpy( &postings.front(), ptr, postings.size() );
 
-      char const * right = closestString + strlen( closestString ) + 1;
+  // findLeaves() relies on the postings being within bounds
+  for( size_t x = 0; x < postingStarts.size(); ++x )
+    if ( postingStarts[ x ] > postings.size() ||
+         ( x && postingStarts[ x ] < postingStarts[ x - 1 ] ) )
+      return false;
 
-      if ( right != leafEnd )
-      {
-        DPRINTF( "To the right: %s\n", right );
-      }
-      else
-        DPRINTF( "To the right -- nothing\n" );
-      #endif
+  return true;
+}
 
-      // Now, whatever the outcome (compareResult) is, we need to find
-      // entry number for the closestMatch string.
-       
-      unsigned entry = 0;
 
-      for( char const * next = ptr; next != closestString;
-           next += strlen( next ) + 1, ++entry ) ;
+NodeCacheStats getNodeCacheStats()
+{
+  return nodeCache.getStats();
+}
 
-      // Ok, now check the outcome
+HeadwordFilterStats getHeadwordFilterStats()
+{
+  HeadwordFilterStats result;
 
-      if ( !compareResult )
-      {
-        // The target string matches the one found.
-        // Go to the right, since it's there where we store such results.
-        currentNodeOffset = offsets[ entry + 1 ];
-      }
-      if ( compareResult < 0 )
-      {
-        // The target string is smaller than the one found.
-        // Go to the left.
-        currentNodeOffset = offsets[ entry ];
-      }
-      else
-      {
-        // The target string is larger than the one found.
-        // Go to the right.
-        currentNodeOffset = offsets[ entry + 1 ];
-      }
+  result.lookups = (unsigned) Qt4x5::AtomicInt::loadAcquire( filterLookups );
+  result.skips = (unsigned) Qt4x5::AtomicInt::loadAcquire( filterSkips );
 
-      //DPRINTF( "reading node at %x\n", currentNodeOffset );
-      readNode( currentNodeOffset, extLeaf );
-      leaf = &extLeaf.front();
-      leafEnd = leaf + extLeaf.size();
-    }
-    else
-    {
-      //DPRINTF( "=>a leaf\n" );
-      // A leaf
+  return result;
+}
 
-      // If this leaf is the root, there's no next leaf, it just can't be.
-      // We do this check because the file's position indicator just won't
-      // be in the right place for root node anyway, since we precache it.
-      nextLeaf = ( currentNodeOffset != rootOffset ? idxFile->read< uint32_t >() : 0 );
+void setNodeCacheMaxSize( size_t value )
+{
+  nodeCache.setMaxBytes( value );
+}
 
-      if ( !leafEntries )
-      {
-        // Empty leaf? This may only be possible for entirely empty trees only.
-        if ( currentNodeOffset != rootOffset )
-          throw exCorruptedChainData();
-        else
-          return 0; // No match
-      }
+BtreeIndex::BtreeIndex():
+  idxFile( 0 ), nodeAddressShift( 0 ), rootNodeLoaded( 0 ), idxFileMap( 0 ),
+  idxFileMapSize( 0 ), idxFileId( 0 ), filterLoaded( 0 ), filterBits( 0 ), filterBitCount( 0 ),
+  filterHashCount( 0 ),
+  exactSlots( 0 ), exactSlotCount( 0 ), exactEntries( 0 ), exactEntriesSize( 0 )
+{
+}
 
-      // Build an array containing all chain pointers
-      char const * ptr = leaf + sizeof( uint32_t );
+BtreeIndex::~BtreeIndex()
+{
+}
 
-      uint32_t chainSize;
+BtreeDictionary::BtreeDictionary( string const & id,
+                                  vector< string > const & dictionaryFiles ):
+  Dictionary::Class( id, dictionaryFiles )
+{
+}
 
-      vector< char const * > chainOffsets( leafEntries );
+string const & BtreeDictionary::ensureInitDone()
+{
+  static string empty;
 
-      {
-        char const ** nextOffset = &chainOffsets.front();
+  return empty;
+}
 
-        while( leafEntries-- )
-        {
-          *nextOffset++ = ptr;
+void BtreeDictionary::copyHeadwordsTo( IndexedWords & words, uint32_t articleOffset,
+                                       QAtomicInt * isCancelled )
+{
+  if ( ensureInitDone().size() )
+    throw exInitFailed( ensureInitDone() );
 
-          memcpy( &chainSize, ptr, sizeof( uint32_t ) );
+  copyChainsTo( words, articleOffset, isCancelled );
+}
 
-          //DPRINTF( "%s + %s\n", ptr + sizeof( uint32_t ), ptr + sizeof( uint32_t ) + strlen( ptr + sizeof( uint32_t ) ) + 1 );
+void BtreeDictionary::copyHeadwordsFromFile( string const & indexFile,
+                                             IndexInfo const & indexInfo,
+                                             IndexedWords & words,
+                                             uint32_t articleOffset,
+                                             QAtomicInt * isCancelled )
+{
+  File::Class file( indexFile, "rb" );
+  Mutex mutex;
+  BtreeIndex index;
 
-          ptr += sizeof( uint32_t ) + chainSize;
-        }
-      }
+  index.openIndex( indexInfo, file, mutex );
+  index.copyChainsTo( words, articleOffset, isCancelled );
+}
 
-      // Now do a binary search in it, aiming to find where our target
-      // string lands.
+void BtreeIndex::openIndex( IndexInfo const & indexInfo,
+                            File::Class & file, Mutex & mutex )
+{
+  indexNodeSize = indexInfo.btreeMaxElements &
+                  ~(uint32_t)( BtreeWideAddresses | BtreeExactWords | BtreeNgrams );
+  rootOffset = indexInfo.rootOffset;
+  nodeAddressShift = ( indexInfo.btreeMaxElements & BtreeWideAddresses ) ?
+                     NodeAddressShift : 0;
 
-      char const ** window = &chainOffsets.front();
-      unsigned windowSize = chainOffsets.size();
+  idxFile = &file;
+  idxFileMutex = &mutex;
 
-      for( ; ; )
-      {
-        //DPRINTF( "window = %u, ws = %u\n", window - &chainOffsets.front(), windowSize );
+  rootNodeLoaded.fetchAndStoreRelease( 0 );
+  rootNode.clear();
 
-        char const ** chainToCheck = window + windowSize/2;
-        ptr = *chainToCheck;
-  
-        memcpy( &chainSize, ptr, sizeof( uint32_t ) );
-        ptr += sizeof( uint32_t );
-  
-        size_t wordSize = strlen( ptr );
-  
-        if ( wcharBuffer.size() <= wordSize )
-          wcharBuffer.resize( wordSize + 1 );
-  
-        //DPRINTF( "checking against word %s, left = %u\n", ptr, leafEntries );
-  
-        long result = Utf8::decode( ptr, wordSize, &wcharBuffer.front() );
-  
-        if ( result < 0 )
-          throw Utf8::exCantDecode( ptr );
-  
-        wcharBuffer[ result ] = 0;
-  
-        wstring foldedWord = Folding::apply( &wcharBuffer.front() );
-        if( foldedWord.empty() )
-          foldedWord = Folding::applyWhitespaceOnly( &wcharBuffer.front() );
-  
-        int compareResult = target.compare( foldedWord );
-  
-        if ( !compareResult )
-        {
-          // Exact match -- return and be done
-          exactMatch = true;
-  
-          return ptr - sizeof( uint32_t );
-        }
-        else
-        if ( compareResult < 0 )
-        {
-          // The target string is smaller than the current one.
-          // Go to the first half
-           
-          windowSize /= 2;
+  idxFileMap = 0;
+  idxFileMapSize = 0;
 
-          if ( !windowSize )
-          {
-            // That finishes our search. Since our target string
-            // landed before the last tested chain, we return a possible
-            // prefix match against that chain.
-            return ptr - sizeof( uint32_t );
-          }
-        }
-        else
-        {
-          // The target string is larger than the current one.
-          // Go to the second half
+  idxFileId = getCachedFileId( file.file() );
 
-          windowSize -= windowSize/2 + 1;
+#ifndef NO_BTREE_MMAP
+  // Try mapping the whole file. The mapping lives as long as the file stays
+  // open, and lets concurrent lookups proceed without serializing on the
+  // file mutex. If it fails (e.g. no address space left on 32-bit systems),
+  // we just fall back to the regular reads.
+  QFile & f = file.file();
 
-          if ( !windowSize )
-          {
-            // That finishes our search. Since our target string
-            // landed after the last tested chain, we return the next
-            // chain. If there's no next chain in this leaf, this
-            // would mean the first element in the next leaf.
-            if ( chainToCheck == &chainOffsets.back() )
-            {
-              if ( nextLeaf )
-              {
-                readNode( nextLeaf, extLeaf );
-  
-                leafEnd = &extLeaf.front() + extLeaf.size();
-  
-                nextLeaf = idxFile->read< uint32_t >();
-  
-                return &extLeaf.front() + sizeof( uint32_t );
-              }
-              else
-                return 0; // This was the last leaf
-            }
-            else
-              return chainToCheck[ 1 ];
-          }
+  qint64 size = f.size();
 
-          window = chainToCheck + 1;
-        }
-      }
-    }
+  if ( size > 0 && (quint64) size <= (size_t) -1 )
+  {
+    idxFileMap = f.map( 0, size );
+
+    if ( idxFileMap )
+      idxFileMapSize = size;
+    else
+      GD_DPRINTF( "Btree: can't map index file, using regular reads\n" );
   }
+#endif
+
+  loadFilter();
+
+  exactSlots = 0;
+  exactSlotCount = 0;
+  exactEntries = 0;
+  exactEntriesSize = 0;
+  exactWordsData.clear();
+
+  if ( indexInfo.btreeMaxElements & BtreeExactWords )
+    loadExactWords();
+
+  ngramIndex.reset();
+
+  if ( indexInfo.btreeMaxElements & BtreeNgrams )
+    loadNgramIndex( indexInfo.btreeMaxElements & BtreeExactWords );
 }
 
-vector< WordArticleLink > BtreeIndex::readChain( char const * & ptr )
+void BtreeIndex::loadFilter()
 {
-  uint32_t chainSize;
+  filterLoaded.fetchAndStoreRelease( 0 );
 
-  memcpy( &chainSize, ptr, sizeof( uint32_t ) );
+  filterBits = 0;
+  filterBitCount = 0;
+  filterHashCount = 0;
+  filterData.clear();
 
-  ptr += sizeof( uint32_t );
+  try
+  {
+    // The filter is followed by its size, right before the root node
+    quint64 rootPosition = (quint64) rootOffset << nodeAddressShift;
 
-  vector< WordArticleLink > result;
+    if ( rootPosition < sizeof( uint32_t ) )
+      throw exCorruptedChainData();
 
-  while( chainSize )
-  {
-    string str = ptr;
-    ptr += str.size() + 1;
+    quint64 sizeOffset = rootPosition - sizeof( uint32_t );
+    uint32_t size, bitCount, hashCount;
+    unsigned char const * bits;
 
-    string prefix = ptr;
-    ptr += prefix.size() + 1;
+    if ( idxFileMap )
+    {
+      if ( rootPosition > idxFileMapSize )
+        throw exCorruptedChainData();
 
-    uint32_t articleOffset;
+      memcpy( &size, idxFileMap + sizeOffset, sizeof( uint32_t ) );
 
-    memcpy( &articleOffset, ptr, sizeof( uint32_t ) );
+      if ( size < sizeof( uint32_t ) * 2 || size > sizeOffset )
+        throw exCorruptedChainData();
 
-    ptr += sizeof( uint32_t );
+      unsigned char const * ptr = idxFileMap + sizeOffset - size;
 
-    result.push_back( WordArticleLink( str, articleOffset, prefix ) );
+      memcpy( &bitCount, ptr, sizeof( uint32_t ) );
+      memcpy( &hashCount, ptr + sizeof( uint32_t ), sizeof( uint32_t ) );
 
-    if ( chainSize < str.size() + 1 + prefix.size() + 1 + sizeof( uint32_t ) )
-      throw exCorruptedChainData();
+      bits = ptr + sizeof( uint32_t ) * 2;
+    }
     else
-      chainSize -= str.size() + 1 + prefix.size() + 1 + sizeof( uint32_t );
+    {
+      Mutex::Lock _( *idxFileMutex );
+
+      idxFile->seek( sizeOffset );
+
+      size = idxFile->read< uint32_t >();
+
+      if ( size < sizeof( uint32_t ) * 2 || size > sizeOffset )
+        throw exCorruptedChainData();
+
+      idxFile->seek( sizeOffset - size );
+
+      bitCount = idxFile->read< uint32_t >();
+      hashCount = idxFile->read< uint32_t >();
+
+      filterData.resize( size - sizeof( uint32_t ) * 2 );
+
+      if ( filterData.size() )
+        idxFile->read( &filterData.front(), filterData.size() );
+
+      bits = filterData.empty() ? 0 : &filterData.front();
+    }
+
+    if ( !bitCount || !hashCount ||
+         size - sizeof( uint32_t ) * 2 != ( (quint64) bitCount + 7 ) / 8 )
+      throw exCorruptedChainData();
+
+    filterBits = bits;
+    filterBitCount = bitCount;
+    filterHashCount = hashCount;
+
+    // Only now the filter can be used by the lookups on the other threads
+    filterLoaded.fetchAndStoreRelease( 1 );
   }
+  catch( std::exception & e )
+  {
+    gdWarning( "Btree: can't load the headword filter, error: %s\n", e.what() );
 
-  return result;
+    filterBits = 0;
+    filterBitCount = 0;
+    filterHashCount = 0;
+    filterData.clear();
+  }
 }
 
-void BtreeIndex::antialias( wstring const & str,
-                            vector< WordArticleLink > & chain,
-                            bool ignoreDiacritics )
+void BtreeIndex::loadExactWords()
 {
-  wstring caseFolded = Folding::applySimpleCaseOnly( gd::normalize( str ) );
-  if( ignoreDiacritics )
-    caseFolded = Folding::applyDiacriticsOnly( caseFolded );
-
-  for( unsigned x = chain.size(); x--; )
+  try
   {
-    // If after applying case folding to each word they wouldn't match, we
-    // drop the entry.
-    wstring entry = Folding::applySimpleCaseOnly( gd::normalize( Utf8::decode( chain[ x ].prefix + chain[ x ].word ) ) );
-    if( ignoreDiacritics )
-      entry = Folding::applyDiacriticsOnly( entry );
+    // The table is followed by its size, right before the filter, which is
+    // followed by its size, right before the root node
+    quint64 rootPosition = (quint64) rootOffset << nodeAddressShift;
+    uint32_t filterSize, size;
 
-    if ( entry != caseFolded )
-      chain.erase( chain.begin() + x );
+    if ( idxFileMap && rootPosition > idxFileMapSize )
+      throw exCorruptedChainData();
+
+    if ( rootPosition < sizeof( uint32_t ) )
+      throw exCorruptedChainData();
+
+    quint64 filterSizeOffset = rootPosition - sizeof( uint32_t );
+
+    Mutex::Lock _( *idxFileMutex );
+
+    if ( idxFileMap )
+      memcpy( &filterSize, idxFileMap + filterSizeOffset, sizeof( uint32_t ) );
     else
-    if ( chain[ x ].prefix.size() ) // If there's a prefix, merge it with the word,
-                                    // since it's what dictionaries expect
     {
-      chain[ x ].word.insert( 0, chain[ x ].prefix );
-      chain[ x ].prefix.clear();
+      idxFile->seek( filterSizeOffset );
+      filterSize = idxFile->read< uint32_t >();
+    }
+
+    if ( (quint64) filterSize + sizeof( uint32_t ) > filterSizeOffset )
+      throw exCorruptedChainData();
+
+    quint64 sizeOffset = filterSizeOffset - filterSize - sizeof( uint32_t );
+
+    if ( idxFileMap )
+      memcpy( &size, idxFileMap + sizeOffset, sizeof( uint32_t ) );
+    else
+    {
+      idxFile->seek( sizeOffset );
+      size = idxFile->read< uint32_t >();
+    }
+
+    if ( size < sizeof( uint32_t ) * 2 || size > sizeOffset )
+      throw exCorruptedChainData();
+
+    unsigned char const * table;
+
+    if ( idxFileMap )
+      table = idxFileMap + sizeOffset - size;
+    else
+    {
+      exactWordsData.resize( size );
+      idxFile->seek( sizeOffset - size );
+      idxFile->read( &exactWordsData.front(), size );
+      table = &exactWordsData.front();
     }
+
+    // The entries come first, then the slots, then their numbers
+    uint32_t slotCount, entriesSize;
+
+    memcpy( &slotCount, table + size - sizeof( uint32_t ) * 2, sizeof( uint32_t ) );
+    memcpy( &entriesSize, table + size - sizeof( uint32_t ), sizeof( uint32_t ) );
+
+    if ( !slotCount || ( slotCount & ( slotCount - 1 ) ) ||
+         (quint64) entriesSize + (quint64) slotCount * sizeof( uint32_t ) * 2 +
+         sizeof( uint32_t ) * 2 != size )
+      throw exCorruptedChainData();
+
+    exactEntries = table;
+    exactEntriesSize = entriesSize;
+    exactSlots = table + entriesSize;
+    exactSlotCount = slotCount;
+  }
+  catch( std::exception & e )
+  {
+    gdWarning( "Btree: can't load the table of exact words, error: %s\n", e.what() );
+
+    exactSlots = 0;
+    exactSlotCount = 0;
+    exactEntries = 0;
+    exactEntriesSize = 0;
+    exactWordsData.clear();
+  }
+}
+
+uint32_t BtreeIndex::readIndexUint32( quint64 offset )
+{
+  uint32_t result;
+
+  if ( idxFileMap )
+  {
+    if ( offset + sizeof( uint32_t ) > idxFileMapSize )
+      throw exCorruptedChainData();
+
+    memcpy( &result, idxFileMap + offset, sizeof( uint32_t ) );
+  }
+  else
+  {
+    idxFile->seek( offset );
+    result = idxFile->read< uint32_t >();
+  }
+
+  return result;
+}
+
+void BtreeIndex::loadNgramIndex( bool hasExactWords )
+{
+  try
+  {
+    // The n-gram index is followed by its size, right before the table of
+    // the exact words if there's one, and the filter otherwise. Each of them
+    // is followed by its size as well.
+    quint64 sizeOffset = (quint64) rootOffset << nodeAddressShift;
+
+    Mutex::Lock _( *idxFileMutex );
+
+    for( int x = hasExactWords ? 2 : 1; x--; )
+    {
+      if ( sizeOffset < sizeof( uint32_t ) )
+        throw exCorruptedChainData();
+
+      sizeOffset -= sizeof( uint32_t );
+
+      uint32_t size = readIndexUint32( sizeOffset );
+
+      if ( (quint64) size + sizeof( uint32_t ) > sizeOffset )
+        throw exCorruptedChainData();
+
+      sizeOffset -= size;
+    }
+
+    if ( sizeOffset < sizeof( uint32_t ) )
+      throw exCorruptedChainData();
+
+    sizeOffset -= sizeof( uint32_t );
+
+    uint32_t size = readIndexUint32( sizeOffset );
+
+    if ( size > sizeOffset )
+      throw exCorruptedChainData();
+
+    sptr< NgramIndex > result = new NgramIndex;
+    bool loaded;
+
+    if ( idxFileMap )
+      loaded = result->load( idxFileMap + sizeOffset - size, size );
+    else
+    {
+      vector< unsigned char > data( size );
+
+      idxFile->seek( sizeOffset - size );
+
+      if ( size )
+        idxFile->read( &data.front(), size );
+
+      loaded = result->load( data.empty() ? 0 : &data.front(), size );
+    }
+
+    if ( !loaded )
+      throw exCorruptedChainData();
+
+    ngramIndex = result;
+  }
+  catch( std::exception & e )
+  {
+    gdWarning( "Btree: can't load the n-gram index, error: %s\n", e.what() );
+  }
+}
+
+bool BtreeIndex::findExactWord( string const & word, uint32_t & articleOffset ) const
+{
+  if ( !exactSlotCount )
+    return false;
+
+  quint64 hash = filterHash( word );
+  uint32_t mask = exactSlotCount - 1;
+
+  // Linear probing, till the word or an empty slot is found
+  for( uint32_t slot = (uint32_t)( hash >> 32 ) & mask, probes = 0;
+       probes < exactSlotCount; slot = ( slot + 1 ) & mask, ++probes )
+  {
+    uint32_t slotHash, entryOffset;
+
+    memcpy( &slotHash, exactSlots + slot * sizeof( uint32_t ) * 2, sizeof( uint32_t ) );
+    memcpy( &entryOffset, exactSlots + slot * sizeof( uint32_t ) * 2 + sizeof( uint32_t ),
+            sizeof( uint32_t ) );
+
+    if ( entryOffset == ExactSlotEmpty )
+      break;
+
+    // Each entry is the article offset followed by the zero-terminated word
+    if ( slotHash != (uint32_t) hash ||
+         (quint64) entryOffset + sizeof( uint32_t ) + word.size() + 1 > exactEntriesSize )
+      continue;
+
+    unsigned char const * entry = exactEntries + entryOffset;
+
+    if ( memcmp( entry + sizeof( uint32_t ), word.c_str(), word.size() + 1 ) == 0 )
+    {
+      memcpy( &articleOffset, entry, sizeof( uint32_t ) );
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool BtreeIndex::findFile( wstring const & name, uint32_t & articleOffset )
+{
+  if ( findExactWord( Utf8::encode( name ), articleOffset ) )
+    return true;
+
+  vector< WordArticleLink > links = findArticles( name );
+
+  if ( links.empty() )
+    return false;
+
+  articleOffset = links[ 0 ].articleOffset;
+
+  return true;
+}
+
+bool BtreeIndex::mayContainKey( string const & key )
+{
+  // Until the deferred init loads the filter, any key may be there
+  if ( !Qt4x5::AtomicInt::loadAcquire( filterLoaded ) )
+    return true;
+
+  quint64 hash = filterHash( key );
+
+  bool result = true;
+
+  for( unsigned n = 0; n < filterHashCount; ++n )
+  {
+    uint32_t bit = filterBit( hash, n, filterBitCount );
+
+    if ( !( filterBits[ bit >> 3 ] & ( 1 << ( bit & 7 ) ) ) )
+    {
+      result = false;
+      break;
+    }
+  }
+
+  filterLookups.fetchAndAddRelaxed( 1 );
+
+  if ( !result )
+    filterSkips.fetchAndAddRelaxed( 1 );
+
+  return result;
+}
+
+bool BtreeIndex::mayContainWord( wstring const & word )
+{
+  wstring folded = Folding::apply( word );
+  if( folded.empty() )
+    folded = Folding::applyWhitespaceOnly( word );
+
+  return mayContainKey( Utf8::encode( folded ) );
+}
+
+vector< WordArticleLink > BtreeIndex::findArticles( wstring const & word, bool ignoreDiacritics )
+{
+  vector< WordArticleLink > result;
+
+  try
+  {
+    wstring folded = Folding::apply( word );
+    if( folded.empty() )
+      folded = Folding::applyWhitespaceOnly( word );
+
+    if ( !mayContainKey( Utf8::encode( folded ) ) )
+      return result;
+
+    bool exactMatch;
+
+    vector< char > leaf;
+    uint32_t nextLeaf;
+
+    char const * leafEnd;
+
+    char const * chainOffset = findChainOffsetExactOrPrefix( folded, exactMatch,
+                                                             leaf, nextLeaf,
+                                                             leafEnd );
+
+    if ( chainOffset && exactMatch )
+    {
+      result = readChain( chainOffset );
+
+      antialias( word, result, ignoreDiacritics );
+    }
+  }
+  catch( std::exception & e )
+  {
+    gdWarning( "Articles searching failed, error: %s\n", e.what() );
+    result.clear();
+  }
+  catch(...)
+  {
+    qWarning( "Articles searching failed\n" );
+    result.clear();
+  }
+
+  return result;
+}
+
+namespace {
+
+/// Returns the number of characters in the given utf8 string.
+int utf8Length( string const & str )
+{
+  int result = 0;
+
+  for( string::size_type x = 0; x < str.size(); ++x )
+    if ( ( (unsigned char) str[ x ] & 0xC0 ) != 0x80 )
+      ++result;
+
+  return result;
+}
+
+}
+
+class BtreeWordSearchRunnable: public QRunnable
+{
+  BtreeWordSearchRequest & r;
+  QSemaphore & hasExited;
+  
+public:
+
+  BtreeWordSearchRunnable( BtreeWordSearchRequest & r_,
+                           QSemaphore & hasExited_ ): r( r_ ),
+                                                      hasExited( hasExited_ )
+  {}
+
+  ~BtreeWordSearchRunnable()
+  {
+    hasExited.release();
+  }
+  
+  virtual void run();
+};
+
+void BtreeWordSearchRunnable::run()
+{
+  r.run();
+}
+
+BtreeWordSearchRequest::BtreeWordSearchRequest( BtreeDictionary & dict_,
+                                                wstring const & str_,
+                                                unsigned minLength_,
+                                                int maxSuffixVariation_,
+                                                bool allowMiddleMatches_,
+                                                unsigned long maxResults_,
+                                                bool startRunnable ):
+  dict( dict_ ), str( str_ ),
+  maxResults( maxResults_ ),
+  minLength( minLength_ ),
+  maxSuffixVariation( maxSuffixVariation_ ),
+  allowMiddleMatches( allowMiddleMatches_ ),
+  minMatchLength( 0 )
+{
+  if( startRunnable )
+  {
+    QThreadPool::globalInstance()->start(
+      new BtreeWordSearchRunnable( *this, hasExited ) );
+  }
+}
+
+void BtreeWordSearchRequest::findMatches()
+{
+  if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+  {
+    finish();
+    return;
+  }
+
+  if ( dict.ensureInitDone().size() )
+  {
+    setErrorString( QString::fromUtf8( dict.ensureInitDone().c_str() ) );
+    finish();
+    return;
+  }
+  
+  bool useWildcards = false;
+  if( allowMiddleMatches )
+    useWildcards = ( str.find( '*' ) != wstring::npos ||
+                     str.find( '?' ) != wstring::npos ||
+                     str.find( '[' ) != wstring::npos ||
+                     str.find( ']' ) != wstring::npos );
+
+  wstring folded = Folding::apply( str );
+  wstring foldedWithWildcards;
+
+  minMatchLength = 0;
+
+  if( useWildcards )
+  {
+#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
+    regexp.setPattern( wildcardsToRegexp( gd::toQString( Folding::applyDiacriticsOnly( Folding::applySimpleCaseOnly( str ) ) ) ) );
+    if( !regexp.isValid() )
+      regexp.setPattern( QRegularExpression::escape( regexp.pattern() ) );
+    regexp.setPatternOptions( QRegularExpression::CaseInsensitiveOption );
+#else
+    regexp.setPattern( gd::toQString( Folding::applyDiacriticsOnly( Folding::applySimpleCaseOnly( str ) ) ) );
+    regexp.setPatternSyntax( QRegExp::WildcardUnix );
+    regexp.setCaseSensitivity( Qt::CaseInsensitive );
+#endif
+
+    bool bNoLetters = folded.empty();
+
+    if( bNoLetters )
+      foldedWithWildcards = Folding::applyWhitespaceOnly( str );
+    else
+      foldedWithWildcards = Folding::apply( str, useWildcards );
+
+    // Calculate minimum match length
+
+    bool insideSet = false;
+    bool escaped = false;
+    for( wstring::size_type x = 0; x < foldedWithWildcards.size(); x++ )
+    {
+      wchar ch = foldedWithWildcards[ x ];
+
+      if( ch == L'\\' && !escaped )
+      {
+        escaped = true;
+        continue;
+      }
+
+      if( ch == L']' && !escaped )
+      {
+        insideSet = false;
+        continue;
+      }
+
+      if( insideSet )
+      {
+        escaped = false;
+        continue;
+      }
+
+      if( ch == L'[' && !escaped )
+      {
+        minMatchLength += 1;
+        insideSet = true;
+        continue;
+      }
+
+      if( ch == L'*' && !escaped )
+        continue;
+
+      escaped = false;
+      minMatchLength += 1;
+    }
+  }
+  else
+  {
+    if( folded.empty() )
+      folded = Folding::applyWhitespaceOnly( str );
+  }
+
+  int initialFoldedSize = folded.size();
+
+  int charsLeftToChop = 0;
+
+  if ( maxSuffixVariation >= 0 )
+  {
+    charsLeftToChop = initialFoldedSize - (int)minLength;
+
+    if ( charsLeftToChop < 0 )
+      charsLeftToChop = 0;
+    else
+    if ( charsLeftToChop > maxSuffixVariation )
+      charsLeftToChop = maxSuffixVariation;
+  }
+
+  try
+  {
+    if ( useWildcards )
+    {
+      // The chains which may match are found by the automaton built out of
+      // the pattern, and then visitChain() checks their headwords.
+      dict.findWildcardChains( foldedWithWildcards, *this );
+      return;
+    }
+
+    for( ; ; )
+    {
+      bool exactMatch;
+      vector< char > leaf;
+      uint32_t nextLeaf;
+      char const * leafEnd;
+      string chainKey;
+
+      char const * chainOffset = dict.findChainOffsetExactOrPrefix( folded, exactMatch,
+                                                                    leaf, nextLeaf,
+                                                                    leafEnd, &chainKey );
+
+      // The keys stored in the leaves are already folded, so they are
+      // matched against the folded string bytewise.
+      string foldedUtf8 = Utf8::encode( folded );
+
+      if ( chainOffset )
+      for( ; ; )
+      {
+        if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+          break;
+
+        //DPRINTF( "offset = %u, size = %u\n", chainOffset - &leaf.front(), leaf.size() );
+
+        if ( chainKey.size() >= foldedUtf8.size()
+             && !chainKey.compare( 0, foldedUtf8.size(), foldedUtf8 ) )
+        {
+          // Exact or prefix match
+
+          ChainCursor links( chainOffset );
+
+          chainOffset = links.chainEnd();
+
+          int resultFoldedSize = utf8Length( chainKey );
+
+          Mutex::Lock _( dataMutex );
+
+          while( links.next() )
+          {
+            // Skip middle matches, if requested. If suffix variation is specified,
+            // make sure the string isn't larger than requested.
+            if ( ( maxSuffixVariation < 0 || resultFoldedSize - initialFoldedSize <= maxSuffixVariation ) &&
+                 acceptsArticle( links.articleOffset() ) &&
+                 ( allowMiddleMatches || !links.prefixSize() ||
+                   Folding::apply( Utf8::decode( string( links.prefix(), links.prefixSize() ) ) ).empty() ) )
+            {
+              headword.clear();
+              links.appendHeadword( headword );
+
+              addFoundWord( Utf8::decode( headword ) );
+            }
+          }
+
+          if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+            break;
+
+          if ( matches.size() >= maxResults )
+          {
+            // For now we actually allow more than maxResults if the last
+            // chain yield more than one result. That's ok and maybe even more
+            // desirable.
+            break;
+          }
+        }
+        else
+          // Neither exact nor a prefix match, end this
+          break;
+
+        // Fetch new leaf if we're out of chains here
+
+        if ( chainOffset >= leafEnd )
+        {
+          // We're past the current leaf, fetch the next one
+
+          //DPRINTF( "advancing\n" );
+
+          if ( nextLeaf )
+          {
+            dict.readNode( nextLeaf, leaf, &nextLeaf );
+            leafEnd = &leaf.front() + leaf.size();
+
+            chainOffset = &leaf.front() + sizeof( uint32_t );
+
+            uint32_t leafEntries = *(uint32_t *)&leaf.front();
+
+            if ( leafEntries == 0xffffFFFF )
+            {
+              //DPRINTF( "bah!\n" );
+              exit( 1 );
+            }
+          }
+          else
+            break; // That was the last leaf
+        }
+
+        dict.readChainKey( chainOffset, chainKey );
+      }
+
+      if ( charsLeftToChop && !Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+      {
+        --charsLeftToChop;
+        folded.resize( folded.size() - 1 );
+      }
+      else
+        break;
+    }
+  }
+  catch( std::exception & e )
+  {
+    qWarning( "Index searching failed: \"%s\", error: %s\n",
+              dict.getName().c_str(), e.what() );
+  }
+  catch(...)
+  {
+    gdWarning( "Index searching failed: \"%s\"\n", dict.getName().c_str() );
+  }
+}
+
+bool BtreeWordSearchRequest::visitChain( char const * chain )
+{
+  if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+    return false;
+
+  ChainCursor links( chain );
+
+  Mutex::Lock _( dataMutex );
+
+  while( links.next() )
+  {
+    if ( !acceptsArticle( links.articleOffset() ) )
+      continue;
+
+    headword.clear();
+    links.appendHeadword( headword );
+
+    wstring word = Utf8::decode( headword );
+    wstring result = Folding::applyDiacriticsOnly( word );
+#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
+    if( result.size() >= (wstring::size_type)minMatchLength )
+    {
+      QRegularExpressionMatch match = regexp.match( gd::toQString( result ) );
+      if( match.hasMatch() && match.capturedStart() == 0 )
+      {
+        addFoundWord( word );
+      }
+    }
+#else
+    if( result.size() >= (wstring::size_type)minMatchLength
+        && regexp.indexIn( gd::toQString( result ) ) == 0
+        && regexp.matchedLength() >= minMatchLength )
+    {
+      addFoundWord( word );
+    }
+#endif
+  }
+
+  // For now we actually allow more than maxResults if the last chain yield
+  // more than one result, just like the prefix search does.
+  return matches.size() < maxResults;
+}
+
+void BtreeWordSearchRequest::run()
+{
+  if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+  {
+    finish();
+    return;
+  }
+
+  if ( dict.ensureInitDone().size() )
+  {
+    setErrorString( QString::fromUtf8( dict.ensureInitDone().c_str() ) );
+    finish();
+    return;
+  }
+
+  findMatches();
+
+  finish();
+}
+
+BtreeWordSearchRequest::~BtreeWordSearchRequest()
+{
+  isCancelled.ref();
+  hasExited.acquire();
+}
+
+sptr< Dictionary::WordSearchRequest > BtreeDictionary::prefixMatch(
+  wstring const & str, unsigned long maxResults )
+  THROW_SPEC( std::exception )
+{
+  return new BtreeWordSearchRequest( *this, str, 0, -1, true, maxResults );
+}
+
+sptr< Dictionary::WordSearchRequest > BtreeDictionary::stemmedMatch(
+  wstring const & str, unsigned minLength, unsigned maxSuffixVariation,
+  unsigned long maxResults )
+  THROW_SPEC( std::exception )
+{
+  return new BtreeWordSearchRequest( *this, str, minLength, (int)maxSuffixVariation,
+                                     false, maxResults );
+}
+
+sptr< Dictionary::WordSearchRequest > BtreeDictionary::fuzzyMatch(
+  wstring const & str, unsigned maxDistance, unsigned long maxResults )
+  THROW_SPEC( std::exception )
+{
+  return new BtreeFuzzySearchRequest( *this, str, maxDistance, maxResults );
+}
+
+BtreeFuzzySearchRequest::BtreeFuzzySearchRequest( BtreeDictionary & dict_,
+                                                  wstring const & str_,
+                                                  unsigned maxDistance_,
+                                                  unsigned long maxResults_ ):
+  BtreeWordSearchRequest( dict_, str_, 0, -1, false, maxResults_, false ),
+  maxDistance( maxDistance_ ), currentDistance( 0 )
+{
+  QThreadPool::globalInstance()->start(
+    new BtreeWordSearchRunnable( *this, hasExited ) );
+}
+
+void BtreeFuzzySearchRequest::findMatches()
+{
+  try
+  {
+    wstring folded = Folding::apply( str );
+
+    if ( folded.empty() )
+      return;
+
+    // Anything would be that close to a short word
+    unsigned distanceLimit = maxDistance < folded.size() ? maxDistance : folded.size() - 1;
+
+    // Each search only finds the keys at the exact distance, so the closest
+    // matches come first, and we can stop as soon as there are enough of them
+    for( currentDistance = 0; currentDistance <= distanceLimit; ++currentDistance )
+    {
+      if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+        break;
+
+      dict.findFuzzyChains( folded, currentDistance, *this );
+
+      Mutex::Lock _( dataMutex );
+
+      if ( matches.size() >= maxResults )
+        break;
+    }
+  }
+  catch( std::exception & e )
+  {
+    qWarning( "Index searching failed: \"%s\", error: %s\n",
+              dict.getName().c_str(), e.what() );
+  }
+  catch(...)
+  {
+    gdWarning( "Index searching failed: \"%s\"\n", dict.getName().c_str() );
+  }
+}
+
+bool BtreeFuzzySearchRequest::visitChain( char const * chain )
+{
+  if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+    return false;
+
+  ChainCursor links( chain );
+
+  Mutex::Lock _( dataMutex );
+
+  while( links.next() )
+  {
+    // The keys of the middle matches are only the tails of their headwords
+    if ( links.prefixSize() || !acceptsArticle( links.articleOffset() ) )
+      continue;
+
+    headword.clear();
+    links.appendHeadword( headword );
+
+    addMatch( Dictionary::WordMatch( Utf8::decode( headword ), -(int)currentDistance ) );
+  }
+
+  return matches.size() < maxResults;
+}
+
+/// Uncompresses the node data to the given vector, which must already be
+/// sized to hold the uncompressed data. The codec is the one recorded in the
+/// node's compressed size.
+static void uncompressNode( unsigned codec, unsigned char const * compressedData,
+                            size_t compressedSize, vector< char > & out )
+{
+  switch( codec )
+  {
+    case NodeCodecDefault:
+    {
+      #ifdef __BTREE_USE_LZO
+
+      lzo_uint decompressedLength = out.size();
+
+      if ( lzo1x_decompress( compressedData, compressedSize,
+                             (unsigned char *)&out.front(), &decompressedLength, 0 )
+           != LZO_E_OK || decompressedLength != out.size() )
+        throw exFailedToDecompressNode();
+
+      #else
+
+      unsigned long decompressedLength = out.size();
+
+      if ( uncompress( (unsigned char *)&out.front(),
+                       &decompressedLength,
+                       compressedData,
+                       compressedSize ) != Z_OK ||
+           decompressedLength != out.size() )
+        throw exFailedToDecompressNode();
+      #endif
+
+      return;
+    }
+
+    #ifdef __BTREE_USE_LZ4
+    case NodeCodecLz4:
+    {
+      if ( LZ4_decompress_safe( (char const *)compressedData, &out.front(),
+                                compressedSize, out.size() ) != (int)out.size() )
+        throw exFailedToDecompressNode();
+
+      return;
+    }
+    #endif
+
+    #ifdef __BTREE_USE_ZSTD
+    case NodeCodecZstd:
+    {
+      size_t result = ZSTD_decompress( &out.front(), out.size(),
+                                       compressedData, compressedSize );
+
+      if ( ZSTD_isError( result ) || result != out.size() )
+        throw exFailedToDecompressNode();
+
+      return;
+    }
+    #endif
+
+    default:
+      // Either garbage or a codec we were built without
+      throw exFailedToDecompressNode();
+  }
+}
+
+/// Compresses the node data with the codec chosen at build time. Returns the
+/// value to be stored as the node's compressed size, which has the codec id
+/// in its upper bits.
+static uint32_t compressNode( vector< unsigned char > const & uncompressedData,
+                              vector< unsigned char > & compressedData )
+{
+  #if defined( __BTREE_USE_ZSTD )
+
+  compressedData.resize( ZSTD_compressBound( uncompressedData.size() ) );
+
+  size_t compressedSize = ZSTD_compress( &compressedData.front(), compressedData.size(),
+                                         &uncompressedData.front(), uncompressedData.size(),
+                                         NodeZstdLevel );
+
+  if ( ZSTD_isError( compressedSize ) )
+  {
+    qFatal( "Failed to compress btree node." );
+    abort();
+  }
+
+  unsigned codec = NodeCodecZstd;
+
+  #elif defined( __BTREE_USE_LZ4 )
+
+  compressedData.resize( LZ4_compressBound( uncompressedData.size() ) );
+
+  int compressedSize = LZ4_compress_HC( (char const *)&uncompressedData.front(),
+                                        (char *)&compressedData.front(),
+                                        uncompressedData.size(), compressedData.size(),
+                                        NodeLz4HcLevel );
+
+  if ( compressedSize <= 0 )
+  {
+    qFatal( "Failed to compress btree node." );
+    abort();
+  }
+
+  unsigned codec = NodeCodecLz4;
+
+  #elif defined( __BTREE_USE_LZO )
+
+  compressedData.resize( uncompressedData.size() + uncompressedData.size() / 16 + 64 + 3 );
+
+  char workMem[ LZO1X_1_MEM_COMPRESS ];
+
+  lzo_uint compressedSize;
+
+  if ( lzo1x_1_compress( &uncompressedData.front(), uncompressedData.size(),
+                         &compressedData.front(), &compressedSize, workMem )
+       != LZO_E_OK )
+  {
+    GD_FDPRINTF( stderr, "Failed to compress btree node.\n" );
+    abort();
+  }
+
+  unsigned codec = NodeCodecDefault;
+
+  #else
+
+  compressedData.resize( compressBound( uncompressedData.size() ) );
+
+  unsigned long compressedSize = compressedData.size();
+
+  if ( compress( &compressedData.front(), &compressedSize,
+                 &uncompressedData.front(), uncompressedData.size() ) != Z_OK )
+  {
+    qFatal( "Failed to compress btree node." );
+    abort();
+  }
+
+  unsigned codec = NodeCodecDefault;
+
+  #endif
+
+  if ( (size_t) compressedSize > NodeCompressedSizeMask )
+  {
+    qFatal( "Btree node is too large." );
+    abort();
+  }
+
+  compressedData.resize( compressedSize );
+
+  return (uint32_t) compressedSize | ( codec << NodeCodecShift );
+}
+
+void BtreeIndex::readNode( uint32_t offset, vector< char > & out, uint32_t * nextLeaf )
+{
+  quint64 key = ( (quint64) idxFileId << 32 ) | offset;
+
+  QByteArray cached;
+
+  uint32_t link;
+
+  if ( nodeCache.find( key, cached ) )
+  {
+    memcpy( &link, cached.constData(), sizeof( uint32_t ) );
+
+    out.assign( cached.constData() + sizeof( uint32_t ),
+                cached.constData() + cached.size() );
+  }
+  else
+  {
+    readNodeUncached( offset, out, link );
+
+    cached.resize( sizeof( uint32_t ) + out.size() );
+
+    memcpy( cached.data(), &link, sizeof( uint32_t ) );
+    memcpy( cached.data() + sizeof( uint32_t ), &out.front(), out.size() );
+
+    nodeCache.insert( key, cached );
+  }
+
+  if ( nextLeaf )
+    *nextLeaf = link;
+}
+
+void BtreeIndex::readNodeUncached( uint32_t offset, vector< char > & out,
+                                   uint32_t & nextLeaf )
+{
+  uint32_t uncompressedSize, compressedSize;
+  unsigned codec;
+
+  // The link which would follow the node if it was a leaf
+  uint32_t leafLink = 0;
+  bool hasLeafLink;
+
+  quint64 position = (quint64) offset << nodeAddressShift;
+
+  if ( idxFileMap )
+  {
+    if ( position + sizeof( uint32_t ) * 2 > idxFileMapSize )
+      throw exCorruptedChainData();
+
+    unsigned char const * ptr = idxFileMap + position;
+
+    memcpy( &uncompressedSize, ptr, sizeof( uint32_t ) );
+    memcpy( &compressedSize, ptr + sizeof( uint32_t ), sizeof( uint32_t ) );
+
+    codec = compressedSize >> NodeCodecShift;
+    compressedSize &= NodeCompressedSizeMask;
+
+    ptr += sizeof( uint32_t ) * 2;
+
+    if ( compressedSize > idxFileMapSize - ( ptr - idxFileMap ) )
+      throw exCorruptedChainData();
+
+    //DPRINTF( "%x,%x\n", uncompressedSize, compressedSize );
+
+    out.resize( uncompressedSize );
+
+    uncompressNode( codec, ptr, compressedSize, out );
+
+    ptr += compressedSize;
+
+    hasLeafLink = ( idxFileMapSize - ( ptr - idxFileMap ) >= sizeof( uint32_t ) );
+
+    if ( hasLeafLink )
+      memcpy( &leafLink, ptr, sizeof( uint32_t ) );
+  }
+  else
+  {
+    vector< unsigned char > compressedData;
+
+    {
+      Mutex::Lock _( *idxFileMutex );
+
+      idxFile->seek( position );
+
+      uncompressedSize = idxFile->read< uint32_t >();
+      compressedSize = idxFile->read< uint32_t >();
+
+      codec = compressedSize >> NodeCodecShift;
+      compressedSize &= NodeCompressedSizeMask;
+
+      //DPRINTF( "%x,%x\n", uncompressedSize, compressedSize );
+
+      compressedData.resize( compressedSize );
+
+      idxFile->read( &compressedData.front(), compressedData.size() );
+
+      // We don't know yet whether it is a leaf or not, so we grab the link
+      // anyway. Note that the root node may well be the last one in file.
+      hasLeafLink = idxFile->readRecords( &leafLink, sizeof( leafLink ), 1 ) == 1;
+    }
+
+    out.resize( uncompressedSize );
+
+    uncompressNode( codec, &compressedData.front(), compressedData.size(), out );
+  }
+
+  if ( out.size() < sizeof( uint32_t ) )
+    throw exCorruptedChainData();
+
+  uint32_t leafEntries;
+
+  memcpy( &leafEntries, &out.front(), sizeof( uint32_t ) );
+
+  if ( leafEntries == 0xffffFFFF )
+    nextLeaf = 0; // A node, there's no link
+  else
+  if ( hasLeafLink )
+    nextLeaf = leafLink;
+  else
+    throw exCorruptedChainData();
+}
+
+void BtreeIndex::loadRootNode()
+{
+  if ( Qt4x5::AtomicInt::loadAcquire( rootNodeLoaded ) )
+    return;
+
+  Mutex::Lock _( rootNodeMutex );
+
+  if ( !Qt4x5::AtomicInt::loadAcquire( rootNodeLoaded ) )
+  {
+    // Time to load our root node. We do it only once, at the first request.
+    // It is kept here permanently, so there's no point in caching it.
+    uint32_t nextLeaf;
+
+    readNodeUncached( rootOffset, rootNode, nextLeaf );
+    rootNodeLoaded.fetchAndStoreRelease( 1 );
+  }
+}
+
+char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
+                                                       bool & exactMatch,
+                                                       vector< char > & extLeaf,
+                                                       uint32_t & nextLeaf,
+                                                       char const * & leafEnd,
+                                                       string * chainKey )
+{
+  if ( !idxFile )
+    throw exIndexWasNotOpened();
+
+  // Lookup the index by traversing the index btree
+
+  vector< wchar > wcharBuffer;
+
+  exactMatch = false;
+
+  // Read a node
+
+  uint32_t currentNodeOffset = rootOffset;
+
+  loadRootNode();
+
+  // If the root is a leaf, there's no next leaf, it just can't be.
+  nextLeaf = 0;
+
+  char const * leaf = &rootNode.front();
+  leafEnd = leaf + rootNode.size();
+
+  if( target.empty() )
+  {
+    //For empty target string we return first chain in index
+    for( ; ; )
+    {
+      uint32_t leafEntries = *(uint32_t *)leaf;
+
+      if ( leafEntries == 0xffffFFFF )
+      {
+        // A node
+        currentNodeOffset = *( (uint32_t *)leaf + 1 );
+        readNode( currentNodeOffset, extLeaf, &nextLeaf );
+        leaf = &extLeaf.front();
+        leafEnd = leaf + extLeaf.size();
+      }
+      else
+      {
+        // A leaf
+        if( !leafEntries )
+          return 0;
+
+        if ( chainKey )
+          readChainKey( leaf + sizeof( uint32_t ), *chainKey );
+
+        return leaf + sizeof( uint32_t );
+      }
+    }
+  }
+
+  for( ; ; )
+  {
+    // Is it a leaf or a node?
+
+    uint32_t leafEntries = *(uint32_t *)leaf;
+
+    if ( leafEntries == 0xffffFFFF )
+    {
+      // A node
+
+      //DPRINTF( "=>a node\n" );
+
+      uint32_t const * offsets = (uint32_t *)leaf + 1;
+
+      char const * ptr = leaf + sizeof( uint32_t ) +
+                         ( indexNodeSize + 1 ) * sizeof( uint32_t );
+
+      // ptr now points to a span of zero-separated strings, up to leafEnd.
+      // We find our match using a binary search.
+
+      char const * closestString;
+
+      int compareResult;
+
+      char const * window = ptr;
+      unsigned windowSize = leafEnd - ptr;
+
+      for( ; ; )
+      {  
+        // We boldly shoot in the middle of the whole mess, and then adjust
+        // to the beginning of the string that we've hit.
+        char const * testPoint = window + windowSize/2;
+  
+        closestString = testPoint;
+  
+        while( closestString > ptr && closestString[ -1 ] )
+          --closestString;
+  
+        size_t wordSize = strlen( closestString );
+  
+        if ( wcharBuffer.size() <= wordSize )
+          wcharBuffer.resize( wordSize + 1 );
+  
+        long result = Utf8::decode( closestString, wordSize, &wcharBuffer.front() );
+
+        if ( result < 0 )
+          throw Utf8::exCantDecode( closestString );
+  
+        wcharBuffer[ result ] = 0;
+
+        //DPRINTF( "Checking against %s\n", closestString );
+
+        compareResult = target.compare( &wcharBuffer.front() );
+  
+        if ( !compareResult )
+        {
+          // The target string matches the current one. Finish the search.
+          break;
+        }
+        if ( compareResult < 0 )
+        {
+          // The target string is smaller than the current one.
+          // Go to the left.
+          windowSize = closestString - window;
+
+          if ( !windowSize )
+            break;
+        }
+        else
+        {
+          // The target string is larger than the current one.
+          // Go to the right.
+          windowSize -= ( closestString - window )  + wordSize + 1;
+          window = closestString + wordSize + 1;
+
+          if ( !windowSize )
+            break;
+        }
+      }
+
+      #if 0
+      DPRINTF( "The winner is %s, compareResult = %d\n", closestString, compareResult );
+
+      if ( closestString != ptr )
+      {
+        char const * left = closestString -1;
+
+        while( left != ptr && left[ -1 ] )
+          --left;
+
+        DPRINTF( "To the left: %s\n", left );
+      }
+      else
+        DPRINTF( "To the lest -- nothing\n" );
+
+      char const * right = closestString + strlen( closestString ) + 1;
+
+      if ( right != leafEnd )
+      {
+        DPRINTF( "To the right: %s\n", right );
+      }
+      else
+        DPRINTF( "To the right -- nothing\n" );
+      #endif
+
+      // Now, whatever the outcome (compareResult) is, we need to find
+      // entry number for the closestMatch string.
+       
+      unsigned entry = 0;
+
+      for( char const * next = ptr; next != closestString;
+           next += strlen( next ) + 1, ++entry ) ;
+
+      // Ok, now check the outcome
+
+      if ( !compareResult )
+      {
+        // The target string matches the one found.
+        // Go to the right, since it's there where we store such results.
+        currentNodeOffset = offsets[ entry + 1 ];
+      }
+      if ( compareResult < 0 )
+      {
+        // The target string is smaller than the one found.
+        // Go to the left.
+        currentNodeOffset = offsets[ entry ];
+      }
+      else
+      {
+        // The target string is larger than the one found.
+        // Go to the right.
+        currentNodeOffset = offsets[ entry + 1 ];
+      }
+
+      //DPRINTF( "reading node at %x\n", currentNodeOffset );
+      readNode( currentNodeOffset, extLeaf, &nextLeaf );
+      leaf = &extLeaf.front();
+      leafEnd = leaf + extLeaf.size();
+    }
+    else
+    {
+      //DPRINTF( "=>a leaf\n" );
+      // A leaf
+
+      // The nextLeaf was already set when reading this leaf. If this leaf
+      // is the root, it stays zero.
+
+      if ( !leafEntries )
+      {
+        // Empty leaf? This may only be possible for entirely empty trees only.
+        if ( currentNodeOffset != rootOffset )
+          throw exCorruptedChainData();
+        else
+          return 0; // No match
+      }
+
+      // Build an array containing all chain pointers, and restore the keys
+      // of all the chains, one after another, so they could be compared
+      // to the target as they are.
+      char const * ptr = leaf + sizeof( uint32_t );
+
+      uint32_t chainSize;
+
+      vector< char const * > chainOffsets( leafEntries );
+      vector< uint32_t > keyOffsets( leafEntries + 1 );
+
+      string key, keys;
+
+      for( uint32_t x = 0; x < leafEntries; ++x )
+      {
+        if ( ptr + sizeof( uint16_t ) >= leafEnd )
+          throw exCorruptedChainData();
+
+        chainOffsets[ x ] = ptr;
+
+        readChainKey( ptr, key );
+
+        keyOffsets[ x ] = keys.size();
+        keys.append( key );
+
+        ptr += sizeof( uint16_t );
+        ptr += strlen( ptr ) + 1;
+
+        memcpy( &chainSize, ptr, sizeof( uint32_t ) );
+
+        ptr += sizeof( uint32_t ) + chainSize;
+      }
+
+      keyOffsets[ leafEntries ] = keys.size();
+
+      // Now do a binary search in it, aiming to find where our target
+      // string lands. The keys are compared bytewise, which is the order
+      // they were sorted in when building.
+
+      string targetUtf8 = Utf8::encode( target );
+
+      unsigned window = 0;
+      unsigned windowSize = leafEntries;
+
+      for( ; ; )
+      {
+        unsigned chainToCheck = window + windowSize/2;
+
+        int compareResult = targetUtf8.compare( 0, string::npos,
+                                                keys.data() + keyOffsets[ chainToCheck ],
+                                                keyOffsets[ chainToCheck + 1 ] - keyOffsets[ chainToCheck ] );
+
+        if ( !compareResult )
+        {
+          // Exact match -- return and be done
+          exactMatch = true;
+
+          if ( chainKey )
+            chainKey->assign( keys, keyOffsets[ chainToCheck ],
+                              keyOffsets[ chainToCheck + 1 ] - keyOffsets[ chainToCheck ] );
+
+          return chainOffsets[ chainToCheck ];
+        }
+        else
+        if ( compareResult < 0 )
+        {
+          // The target string is smaller than the current one.
+          // Go to the first half
+
+          windowSize /= 2;
+
+          if ( !windowSize )
+          {
+            // That finishes our search. Since our target string
+            // landed before the last tested chain, we return a possible
+            // prefix match against that chain.
+            if ( chainKey )
+              chainKey->assign( keys, keyOffsets[ chainToCheck ],
+                                keyOffsets[ chainToCheck + 1 ] - keyOffsets[ chainToCheck ] );
+
+            return chainOffsets[ chainToCheck ];
+          }
+        }
+        else
+        {
+          // The target string is larger than the current one.
+          // Go to the second half
+
+          windowSize -= windowSize/2 + 1;
+
+          if ( !windowSize )
+          {
+            // That finishes our search. Since our target string
+            // landed after the last tested chain, we return the next
+            // chain. If there's no next chain in this leaf, this
+            // would mean the first element in the next leaf.
+            if ( chainToCheck + 1 == leafEntries )
+            {
+              if ( nextLeaf )
+              {
+                readNode( nextLeaf, extLeaf, &nextLeaf );
+  
+                leafEnd = &extLeaf.front() + extLeaf.size();
+
+                if ( chainKey )
+                  readChainKey( &extLeaf.front() + sizeof( uint32_t ), *chainKey );
+  
+                return &extLeaf.front() + sizeof( uint32_t );
+              }
+              else
+                return 0; // This was the last leaf
+            }
+            else
+            {
+              if ( chainKey )
+                chainKey->assign( keys, keyOffsets[ chainToCheck + 1 ],
+                                  keyOffsets[ chainToCheck + 2 ] - keyOffsets[ chainToCheck + 1 ] );
+
+              return chainOffsets[ chainToCheck + 1 ];
+            }
+          }
+
+          window = chainToCheck + 1;
+        }
+      }
+    }
+  }
+}
+
+ChainCursor::ChainCursor( char const * chain ):
+  currentWord( 0 ), currentPrefix( 0 ), currentWordSize( 0 ),
+  currentPrefixSize( 0 ), currentArticleOffset( 0 )
+{
+  // Skip the key, see BtreeIndex::readChainKey()
+  ptr = chain + sizeof( uint16_t );
+  ptr += strlen( ptr ) + 1;
+
+  uint32_t chainSize;
+
+  memcpy( &chainSize, ptr, sizeof( uint32_t ) );
+
+  ptr += sizeof( uint32_t );
+
+  end = ptr + chainSize;
+}
+
+bool ChainCursor::next()
+{
+  if ( ptr >= end )
+    return false;
+
+  currentWord = ptr;
+  currentWordSize = strlen( ptr );
+
+  currentPrefix = currentWord + currentWordSize + 1;
+  currentPrefixSize = strlen( currentPrefix );
+
+  ptr = currentPrefix + currentPrefixSize + 1;
+
+  if ( ptr + sizeof( uint32_t ) > end )
+    throw exCorruptedChainData();
+
+  memcpy( &currentArticleOffset, ptr, sizeof( uint32_t ) );
+
+  ptr += sizeof( uint32_t );
+
+  return true;
+}
+
+vector< WordArticleLink > BtreeIndex::readChain( char const * & ptr )
+{
+  ChainCursor links( ptr );
+
+  vector< WordArticleLink > result;
+
+  while( links.next() )
+    result.push_back( WordArticleLink( string( links.word(), links.wordSize() ),
+                                       links.articleOffset(),
+                                       string( links.prefix(), links.prefixSize() ) ) );
+
+  ptr = links.chainEnd();
+
+  return result;
+}
+
+void BtreeIndex::readChainKey( char const * chain, string & key )
+{
+  // The number of leading bytes shared with the previous key comes first,
+  // followed by the zero-terminated rest of the key.
+  uint16_t shared;
+
+  memcpy( &shared, chain, sizeof( uint16_t ) );
+
+  if ( shared > key.size() )
+    throw exCorruptedChainData();
+
+  char const * suffix = chain + sizeof( uint16_t );
+
+  key.resize( shared );
+  key.append( suffix, strlen( suffix ) );
+}
+
+namespace {
+
+/// Returns the size of the common prefix of the two keys, which is known to
+/// be at least prefixSize, not breaking any utf8 sequences. If either key is
+/// missing, that is, unbounded, prefixSize is returned.
+size_t commonKeyPrefix( char const * low, char const * high, size_t prefixSize )
+{
+  if ( !low || !high )
+    return prefixSize;
+
+  size_t common = 0;
+
+  while( low[ common ] && low[ common ] == high[ common ] )
+    ++common;
+
+  while( common > prefixSize && ( low[ common ] & 0xC0 ) == 0x80 )
+    --common;
+
+  return common > prefixSize ? common : prefixSize;
+}
+
+}
+
+void BtreeIndex::findWildcardChains( wstring const & foldedPattern,
+                                     ChainVisitor & visitor )
+{
+  if ( !idxFile )
+    throw exIndexWasNotOpened();
+
+  WildcardAutomaton automaton( foldedPattern );
+
+  if ( automaton.startsWithWildcard() && !automaton.getTrigrams().empty() )
+  {
+    // Pruning by the keys wouldn't help much here, since any key may begin
+    // a match. Look through the leaves having the trigrams instead.
+    NgramIndex const * ngrams = ngramIndex.get();
+
+    if ( ngrams )
+    {
+      vector< uint32_t > leaves;
+
+      ngrams->findLeaves( automaton.getTrigrams(), leaves );
+
+      vector< char > leaf;
+
+      for( size_t x = 0; x < leaves.size(); ++x )
+      {
+        readNode( leaves[ x ], leaf );
+
+        if ( !findWildcardChainsInLeaf( &leaf.front(), leaf.size(), automaton,
+                                        automaton.start(), 0, visitor ) )
+          break;
+      }
+
+      return;
+    }
+  }
+
+  loadRootNode();
+
+  findWildcardChainsInNode( &rootNode.front(), rootNode.size(), 0, 0,
+                            automaton, automaton.start(), 0, visitor );
+}
+
+bool BtreeIndex::findWildcardChainsInNode( char const * node, size_t nodeSize,
+                                           char const * low, char const * high,
+                                           WildcardAutomaton & automaton,
+                                           int state, size_t prefixSize,
+                                           ChainVisitor & visitor )
+{
+  if ( *(uint32_t const *)node != 0xffffFFFF )
+    return findWildcardChainsInLeaf( node, nodeSize, automaton, state,
+                                     prefixSize, visitor );
+
+  uint32_t const * offsets = (uint32_t const *)node + 1;
+
+  // The separators follow the offsets. Each one is the first key of the
+  // child to its right.
+  char const * separator = node + sizeof( uint32_t ) +
+                           ( indexNodeSize + 1 ) * sizeof( uint32_t );
+
+  char const * nodeEnd = node + nodeSize;
+
+  char const * childLow = low;
+
+  vector< char > child;
+
+  for( uint32_t x = 0; x <= indexNodeSize; ++x )
+  {
+    char const * childHigh = high;
+
+    if ( x < indexNodeSize )
+    {
+      if ( separator >= nodeEnd )
+        throw exCorruptedChainData();
+
+      childHigh = separator;
+      separator += strlen( separator ) + 1;
+    }
+
+    // All the keys between two others share their common prefix, so if the
+    // automaton dies on it, there are no matches in the child at all.
+    size_t childPrefixSize = commonKeyPrefix( childLow, childHigh, prefixSize );
+
+    int childState = state;
+
+    if ( childPrefixSize > prefixSize )
+      childState = automaton.run( state, childLow + prefixSize,
+                                  childPrefixSize - prefixSize );
+
+    if ( childState != WildcardAutomaton::Dead )
+    {
+      readNode( offsets[ x ], child );
+
+      if ( !findWildcardChainsInNode( &child.front(), child.size(), childLow,
+                                      childHigh, automaton, childState,
+                                      childPrefixSize, visitor ) )
+        return false;
+    }
+
+    childLow = childHigh;
+  }
+
+  return true;
+}
+
+bool BtreeIndex::findWildcardChainsInLeaf( char const * leaf, size_t leafSize,
+                                           WildcardAutomaton & automaton,
+                                           int state, size_t prefixSize,
+                                           ChainVisitor & visitor )
+{
+  uint32_t leafEntries = *(uint32_t const *)leaf;
+
+  if ( leafEntries == 0xffffFFFF )
+    throw exCorruptedChainData();
+
+  char const * ptr = leaf + sizeof( uint32_t );
+  char const * leafEnd = leaf + leafSize;
+
+  string key;
+
+  while( leafEntries-- )
+  {
+    if ( ptr >= leafEnd )
+      throw exCorruptedChainData();
+
+    bool matches = automaton.isAccepting( state );
+
+    if ( !matches )
+    {
+      readChainKey( ptr, key );
+
+      if ( key.size() >= prefixSize )
+        matches = automaton.isAccepting(
+          automaton.run( state, key.data() + prefixSize, key.size() - prefixSize ) );
+    }
+
+    char const * nextChain = ChainCursor( ptr ).chainEnd();
+
+    if ( matches && !visitor.visitChain( ptr ) )
+      return false;
+
+    ptr = nextChain;
+  }
+
+  return true;
+}
+
+void BtreeIndex::findFuzzyChains( wstring const & foldedWord, unsigned distance,
+                                  ChainVisitor & visitor )
+{
+  if ( !idxFile )
+    throw exIndexWasNotOpened();
+
+  LevenshteinAutomaton automaton( foldedWord, distance );
+
+  LevenshteinAutomaton::Row row;
+
+  automaton.start( row );
+
+  loadRootNode();
+
+  findFuzzyChainsInNode( &rootNode.front(), rootNode.size(), 0, 0,
+                         automaton, row, 0, visitor );
+}
+
+bool BtreeIndex::findFuzzyChainsInNode( char const * node, size_t nodeSize,
+                                        char const * low, char const * high,
+                                        LevenshteinAutomaton const & automaton,
+                                        vector< unsigned > const & row,
+                                        size_t prefixSize, ChainVisitor & visitor )
+{
+  if ( *(uint32_t const *)node != 0xffffFFFF )
+    return findFuzzyChainsInLeaf( node, nodeSize, automaton, row, prefixSize,
+                                  visitor );
+
+  uint32_t const * offsets = (uint32_t const *)node + 1;
+
+  char const * separator = node + sizeof( uint32_t ) +
+                           ( indexNodeSize + 1 ) * sizeof( uint32_t );
+
+  char const * nodeEnd = node + nodeSize;
+
+  char const * childLow = low;
+
+  vector< char > child;
+  LevenshteinAutomaton::Row childRow;
+
+  for( uint32_t x = 0; x <= indexNodeSize; ++x )
+  {
+    char const * childHigh = high;
+
+    if ( x < indexNodeSize )
+    {
+      if ( separator >= nodeEnd )
+        throw exCorruptedChainData();
+
+      childHigh = separator;
+      separator += strlen( separator ) + 1;
+    }
+
+    // If all the keys of the child begin too far from the word, skip it
+    size_t childPrefixSize = commonKeyPrefix( childLow, childHigh, prefixSize );
+
+    childRow = row;
+
+    if ( childPrefixSize == prefixSize ||
+         automaton.run( childRow, childLow + prefixSize, childPrefixSize - prefixSize ) )
+    {
+      readNode( offsets[ x ], child );
+
+      if ( !findFuzzyChainsInNode( &child.front(), child.size(), childLow,
+                                   childHigh, automaton, childRow,
+                                   childPrefixSize, visitor ) )
+        return false;
+    }
+
+    childLow = childHigh;
+  }
+
+  return true;
+}
+
+bool BtreeIndex::findFuzzyChainsInLeaf( char const * leaf, size_t leafSize,
+                                        LevenshteinAutomaton const & automaton,
+                                        vector< unsigned > const & row,
+                                        size_t prefixSize, ChainVisitor & visitor )
+{
+  uint32_t leafEntries = *(uint32_t const *)leaf;
+
+  if ( leafEntries == 0xffffFFFF )
+    throw exCorruptedChainData();
+
+  char const * ptr = leaf + sizeof( uint32_t );
+  char const * leafEnd = leaf + leafSize;
+
+  string key;
+
+  // The rows after each character of the current key past the prefix, and
+  // where those characters end. The keys are front-coded, so the rows of
+  // the part shared with the previous key are reused as they are.
+  vector< LevenshteinAutomaton::Row > rows( 1, row );
+  vector< size_t > ends( 1, prefixSize );
+  size_t depth = 0;
+  bool dead = false; // Whether the automaton died at the current depth
+
+  while( leafEntries-- )
+  {
+    if ( ptr >= leafEnd )
+      throw exCorruptedChainData();
+
+    readChainKey( ptr, key );
+
+    uint16_t shared;
+
+    memcpy( &shared, ptr, sizeof( shared ) );
+
+    while( depth && ends[ depth ] > shared )
+    {
+      --depth;
+      dead = false;
+    }
+
+    bool matches = false;
+
+    if ( key.size() >= prefixSize )
+    {
+      size_t pos = ends[ depth ];
+
+      while( !dead && pos < key.size() )
+      {
+        wchar ch;
+
+        size_t len = decodeUtf8Char( key.data() + pos, key.size() - pos, ch );
+
+        if ( !len )
+          break;
+
+        if ( ++depth == rows.size() )
+        {
+          rows.push_back( LevenshteinAutomaton::Row() );
+          ends.push_back( 0 );
+        }
+
+        dead = !automaton.step( rows[ depth - 1 ], ch, rows[ depth ] );
+
+        pos += len;
+        ends[ depth ] = pos;
+      }
+
+      // Closer keys were found by the searches for smaller distances
+      matches = !dead && pos == key.size() &&
+                automaton.distance( rows[ depth ] ) == automaton.getMaxDistance();
+    }
+
+    char const * nextChain = ChainCursor( ptr ).chainEnd();
+
+    if ( matches && !visitor.visitChain( ptr ) )
+      return false;
+
+    ptr = nextChain;
+  }
+
+  return true;
+}
+
+void BtreeIndex::antialias( wstring const & str,
+                            vector< WordArticleLink > & chain,
+                            bool ignoreDiacritics )
+{
+  wstring caseFolded = Folding::applySimpleCaseOnly( gd::normalize( str ) );
+  if( ignoreDiacritics )
+    caseFolded = Folding::applyDiacriticsOnly( caseFolded );
+
+  for( unsigned x = chain.size(); x--; )
+  {
+    // If after applying case folding to each word they wouldn't match, we
+    // drop the entry.
+    wstring entry = Folding::applySimpleCaseOnly( gd::normalize( Utf8::decode( chain[ x ].prefix + chain[ x ].word ) ) );
+    if( ignoreDiacritics )
+      entry = Folding::applyDiacriticsOnly( entry );
+
+    if ( entry != caseFolded )
+      chain.erase( chain.begin() + x );
+    else
+    if ( chain[ x ].prefix.size() ) // If there's a prefix, merge it with the word,
+                                    // since it's what dictionaries expect
+    {
+      chain[ x ].word.insert( 0, chain[ x ].prefix );
+      chain[ x ].prefix.clear();
+    }
+  }
+}
+
+
+namespace {
+
+enum
+{
+  /// The size of the buffers used to write and read the runs of the words
+  RunBufferSize = 256 * 1024,
+
+  /// An estimate of the memory a map node takes besides the key and the
+  /// value themselves: the tree links and the allocation overhead.
+  MapNodeOverhead = 4 * sizeof( void * ) + 16
+};
+
+Mutex indexingMemoryMutex;
+size_t indexingMemoryLimit = 0;
+QString indexingTempDir;
+
+/// Creates and opens a new temporary file for a run of the words.
+sptr< QTemporaryFile > createRunFile()
+{
+  QString dir;
+
+  {
+    Mutex::Lock _( indexingMemoryMutex );
+    dir = indexingTempDir;
+  }
+
+  if ( dir.isEmpty() )
+    dir = QDir::tempPath();
+
+  sptr< QTemporaryFile > file = new QTemporaryFile( dir + "/gd_words_XXXXXX" );
+
+  if ( !file->open() )
+    throw exCantUseTempFile();
+
+  return file;
+}
+
+/// Sequential access to the words being indexed, in their sorted order.
+class WordsCursor
+{
+public:
+
+  virtual ~WordsCursor()
+  {}
+
+  virtual bool atEnd() const = 0;
+
+  /// The folded word and its chain. These are only valid until next() is
+  /// called.
+  virtual string const & key() const = 0;
+  virtual vector< WordArticleLink > const & chain() const = 0;
+
+  virtual void next() = 0;
+};
+
+/// Goes through the words held in the map itself.
+class MapCursor: public WordsCursor
+{
+public:
+
+  MapCursor( IndexedWords const & words ):
+    i( words.begin() ), begin( words.begin() ), end( words.end() )
+  {}
+
+  /// Goes back to the first word.
+  void rewind()
+  { i = begin; }
+
+  virtual bool atEnd() const
+  { return i == end; }
+
+  virtual string const & key() const
+  { return i->first; }
+
+  virtual vector< WordArticleLink > const & chain() const
+  { return i->second; }
+
+  virtual void next()
+  { ++i; }
+
+private:
+
+  IndexedWords::const_iterator i, begin, end;
+};
+
+/// Writes the words out to a run file. Each entry consists of the key, the
+/// number of links in its chain, and the word, the prefix and the article
+/// offset of each link. All strings are preceded by their sizes.
+class RunWriter
+{
+public:
+
+  RunWriter( QFile & file_ ): file( file_ )
+  { buffer.reserve( RunBufferSize ); }
+
+  void add( string const & key, vector< WordArticleLink > const & chain );
+
+  /// Writes out what's left in the buffer. Must be called once all the
+  /// words are added.
+  void flush();
+
+private:
+
+  QFile & file;
+  vector< char > buffer;
+
+  void put( void const * data, size_t size )
+  { buffer.insert( buffer.end(), ( char const * ) data, ( char const * ) data + size ); }
+
+  void put( string const & str )
+  {
+    uint32_t size = str.size();
+
+    put( &size, sizeof( size ) );
+    put( str.data(), size );
+  }
+};
+
+void RunWriter::add( string const & key, vector< WordArticleLink > const & chain )
+{
+  put( key );
+
+  uint32_t chainSize = chain.size();
+
+  put( &chainSize, sizeof( chainSize ) );
+
+  for( unsigned x = 0; x < chain.size(); ++x )
+  {
+    put( chain[ x ].word );
+    put( chain[ x ].prefix );
+    put( &chain[ x ].articleOffset, sizeof( uint32_t ) );
+  }
+
+  if ( buffer.size() >= RunBufferSize )
+    flush();
+}
+
+void RunWriter::flush()
+{
+  if ( buffer.empty() )
+    return;
+
+  if ( file.write( &buffer.front(), buffer.size() ) != ( qint64 ) buffer.size() )
+    throw exCantUseTempFile();
+
+  buffer.clear();
+}
+
+/// Reads the words back from a run file, from its beginning.
+class RunCursor: public WordsCursor
+{
+public:
+
+  RunCursor( QFile & );
+
+  virtual bool atEnd() const
+  { return isAtEnd; }
+
+  virtual string const & key() const
+  { return currentKey; }
+
+  virtual vector< WordArticleLink > const & chain() const
+  { return currentChain; }
+
+  virtual void next();
+
+private:
+
+  QFile & file;
+  vector< char > buffer;
+  size_t bufferPos, bufferEnd;
+  bool isAtEnd;
+
+  string currentKey;
+  vector< WordArticleLink > currentChain;
+
+  /// Reads the given number of bytes. Returns false if the file ends right
+  /// before them, throws if it ends in the middle.
+  bool get( void * data, size_t size );
+
+  void getAll( void * data, size_t size )
+  {
+    if ( !get( data, size ) )
+      throw exCantUseTempFile();
+  }
+
+  void getString( string & );
+};
+
+RunCursor::RunCursor( QFile & file_ ): file( file_ ), buffer( RunBufferSize ),
+  bufferPos( 0 ), bufferEnd( 0 ), isAtEnd( false )
+{
+  if ( !file.seek( 0 ) )
+    throw exCantUseTempFile();
+
+  next();
+}
+
+bool RunCursor::get( void * data, size_t size )
+{
+  char * out = ( char * ) data;
+
+  while( size )
+  {
+    if ( bufferPos == bufferEnd )
+    {
+      qint64 result = file.read( &buffer.front(), buffer.size() );
+
+      if ( result < 0 || ( !result && out != data ) )
+        throw exCantUseTempFile();
+
+      if ( !result )
+        return false;
+
+      bufferPos = 0;
+      bufferEnd = result;
+    }
+
+    size_t toCopy = bufferEnd - bufferPos;
+
+    if ( toCopy > size )
+      toCopy = size;
+
+    memcpy( out, &buffer[ bufferPos ], toCopy );
+
+    out += toCopy;
+    bufferPos += toCopy;
+    size -= toCopy;
+  }
+
+  return true;
+}
+
+void RunCursor::getString( string & str )
+{
+  uint32_t size;
+
+  getAll( &size, sizeof( size ) );
+
+  str.resize( size );
+
+  if ( size )
+    getAll( &str[ 0 ], size );
+}
+
+void RunCursor::next()
+{
+  uint32_t keySize;
+
+  if ( !get( &keySize, sizeof( keySize ) ) )
+  {
+    isAtEnd = true;
+    return;
+  }
+
+  currentKey.resize( keySize );
+
+  if ( keySize )
+    getAll( &currentKey[ 0 ], keySize );
+
+  uint32_t chainSize;
+
+  getAll( &chainSize, sizeof( chainSize ) );
+
+  currentChain.resize( chainSize );
+
+  for( unsigned x = 0; x < chainSize; ++x )
+  {
+    getString( currentChain[ x ].word );
+    getString( currentChain[ x ].prefix );
+    getAll( &currentChain[ x ].articleOffset, sizeof( uint32_t ) );
+  }
+}
+
+typedef std::pair< WordsCursor *, size_t > MergeEntry;
+
+/// Orders the cursors being merged by their current keys, and the ones with
+/// the same keys by the order their runs were made in. The priority queue
+/// keeps the largest element on top, hence the reversed comparison.
+struct MergeOrder
+{
+  bool operator () ( MergeEntry const & a, MergeEntry const & b ) const
+  {
+    int result = a.first->key().compare( b.first->key() );
+
+    return result > 0 || ( !result && a.second > b.second );
+  }
+};
+
+/// Merges the spilled runs and the words still held in memory into a single
+/// run written to the given file. The chains of the same key are joined in
+/// the order the runs were made, which is the order their links were added
+/// in, and addWord()'s limit on middle matches is applied to the result.
+/// Empty keys are dropped. Returns the number of keys written.
+size_t mergeRuns( IndexedWords const & indexedWords, QFile & output )
+{
+  vector< sptr< QTemporaryFile > > const & runs = indexedWords.getSpilledRuns();
+
+  // The words in memory are the most recent ones, so they go last
+  vector< sptr< WordsCursor > > cursors;
+
+  for( unsigned x = 0; x < runs.size(); ++x )
+    cursors.push_back( new RunCursor( *runs[ x ] ) );
+
+  cursors.push_back( new MapCursor( indexedWords ) );
+
+  std::priority_queue< MergeEntry, vector< MergeEntry >, MergeOrder > queue;
+
+  for( unsigned x = 0; x < cursors.size(); ++x )
+    if ( !cursors[ x ]->atEnd() )
+      queue.push( MergeEntry( cursors[ x ].get(), x ) );
+
+  RunWriter writer( output );
+
+  string key;
+  vector< WordArticleLink > chain;
+  size_t keysWritten = 0;
+
+  while( !queue.empty() )
+  {
+    key = queue.top().first->key();
+    chain.clear();
+
+    while( !queue.empty() && queue.top().first->key() == key )
+    {
+      MergeEntry entry = queue.top();
+
+      queue.pop();
+
+      vector< WordArticleLink > const & links = entry.first->chain();
+
+      for( unsigned x = 0; x < links.size(); ++x )
+      {
+        // Don't overpopulate chains with middle matches
+        if ( chain.size() < 1024 || links[ x ].prefix.empty() )
+          chain.push_back( links[ x ] );
+      }
+
+      entry.first->next();
+
+      if ( !entry.first->atEnd() )
+        queue.push( entry );
+    }
+
+    if ( key.empty() )
+      continue;
+
+    writer.add( key, chain );
+
+    ++keysWritten;
+  }
+
+  writer.flush();
+
+  return keysWritten;
+}
+
+/// Compresses a single node. Runs in the pool of the BtreeBuilder.
+class NodeCompressor: public QRunnable
+{
+public:
+
+  vector< unsigned char > uncompressedData, compressedData;
+  uint32_t uncompressedSize, compressedSize;
+  QSemaphore done;
+
+  NodeCompressor()
+  { setAutoDelete( false ); }
+
+  virtual void run();
+};
+
+void NodeCompressor::run()
+{
+  compressedSize = compressNode( uncompressedData, compressedData );
+
+  uncompressedSize = uncompressedData.size();
+
+  // Release the memory early, the job may wait in the queue for a while
+  vector< unsigned char >().swap( uncompressedData );
+
+  done.release();
+}
+
+DEF_EX( exNodeAddressOverflow, "The btree index is too large to be addressed", Dictionary::Ex )
+
+/// Builds the btree. The nodes are serialized in order on the calling thread,
+/// compressed on a pool of worker threads, and written out in the very same
+/// order as they were serialized. The result is therefore byte-for-byte the
+/// same as if everything was done sequentially.
+class BtreeBuilder
+{
+public:
+
+  /// If wide is true, the nodes are aligned and addressed in the units of
+  /// the alignment, see IndexInfo. If exactWords is true, the table of the
+  /// exact words is written along with the filter, unless it would take more
+  /// than exactWordsMemoryLimit bytes to build (zero means no limit), and if
+  /// ngrams is, the n-gram index of the keys.
+  BtreeBuilder( File::Class & file, size_t maxElements, bool wide, bool exactWords,
+                size_t exactWordsMemoryLimit, bool ngrams );
+
+  ~BtreeBuilder();
+
+  /// Builds the whole tree out of the next indexSize words of the cursor.
+  /// Returns the address of the root node. The Bloom filter of all the keys
+  /// is written right before the root node, followed by its size. Throws
+  /// exNodeAddressOverflow if the addresses don't fit in 32 bits.
+  uint32_t build( WordsCursor & words, size_t indexSize );
+
+  /// Returns true if the table of the exact words was written. It isn't if
+  /// it wasn't asked for, or if there turned out to be too many words.
+  bool hasExactWords() const
+  { return !exactTable.empty(); }
+
+  /// Returns true if the n-gram index was written. It isn't if it wasn't
+  /// asked for, if the tree has just one leaf, or if it turned out too large.
+  bool hasNgrams() const
+  { return !ngramData.empty(); }
+
+private:
+
+  /// A node which was serialized, but not yet written
+  struct PendingNode
+  {
+    bool isLeaf, isRoot;
+
+    // For leaves, the compression job
+    NodeCompressor * compressor;
+
+    // For nodes, the uncompressed data, with the children offsets still to
+    // be filled in, and the ids of the children.
+    vector< unsigned char > data;
+    vector< size_t > children;
+
+    PendingNode(): compressor( 0 )
+    {}
+
+    ~PendingNode()
+    { delete compressor; }
+  };
+
+  File::Class & file;
+  size_t maxElements;
+  unsigned addressShift;
+
+  QThreadPool pool;
+
+  // The nodes serialized but not yet written out, in order
+  std::deque< sptr< PendingNode > > pending;
+
+  // Addresses of the nodes written so far, indexed by node ids
+  vector< uint32_t > offsets;
+
+  // Where to write the address of the next leaf for the previous leaf
+  quint64 lastLeafLinkOffset;
+
+  // How deep buildNode() currently is, so that the root can be told
+  unsigned depth;
+
+  // The Bloom filter of the keys, filled as the leaves are serialized
+  vector< unsigned char > filter;
+  uint32_t filterBitCount;
+
+  void addToFilter( string const & key );
+  void writeFilter();
+
+  // The exact words of the links, collected as the leaves are serialized if
+  // their table is to be written. The entries are the article offsets, each
+  // followed by the zero-terminated word.
+  struct ExactWord
+  {
+    quint64 hash;
+    uint32_t entryOffset;
+  };
+
+  bool collectExactWords;
+  size_t exactWordsMemoryLimit;
+  vector< ExactWord > exactWords;
+  vector< unsigned char > exactEntries;
+
+  // The table of the exact words, as written before the filter
+  vector< unsigned char > exactTable;
+
+  void addExactWord( WordArticleLink const & );
+
+  /// Makes exactTable out of the words collected.
+  void buildExactTable();
+
+  // The trigrams of the keys, as the hashes in the upper 32 bits and the
+  // leaf numbers in the lower ones, collected as the leaves are serialized
+  // if the n-gram index is to be written, and the offsets of the leaves
+  bool collectNgrams;
+  vector< quint64 > ngramPairs;
+  uint32_t leafCount;
+  vector< uint32_t > leafOffsets;
+
+  // The n-gram index, as written before the table of the exact words
+  vector< unsigned char > ngramData;
+
+  /// Adds the trigrams of the keys of the next leaf.
+  void addLeafNgrams( vector< uint32_t > & trigrams );
+
+  /// Makes ngramData out of the trigrams collected.
+  void buildNgramData();
+
+  /// Recursively serializes the node consisting of the next indexSize words,
+  /// advancing the cursor past them. Returns the node id.
+  size_t buildNode( WordsCursor & words, size_t indexSize );
+
+  /// Queues the node for writing, writing out what's already done.
+  size_t addPending( sptr< PendingNode > const & );
+
+  /// Writes out the nodes at the front of the queue. If all is true, waits
+  /// for and writes out all of them, otherwise just the ones which are
+  /// already compressed, and also waits if too many of them are pending.
+  void writePending( bool all );
+
+  void writeNode( PendingNode & );
+};
+
+BtreeBuilder::BtreeBuilder( File::Class & file_, size_t maxElements_, bool wide,
+                            bool exactWords_, size_t exactWordsMemoryLimit_,
+                            bool ngrams ):
+  file( file_ ), maxElements( maxElements_ ),
+  addressShift( wide ? NodeAddressShift : 0 ), lastLeafLinkOffset( 0 ),
+  depth( 0 ), filterBitCount( 0 ), collectExactWords( exactWords_ ),
+  exactWordsMemoryLimit( exactWordsMemoryLimit_ ), collectNgrams( ngrams ), leafCount( 0 )
+{
+  pool.setMaxThreadCount( QThread::idealThreadCount() );
+}
+
+BtreeBuilder::~BtreeBuilder()
+{
+  // This only happens if we're unwinding due to an exception
+  pool.waitForDone();
+
+  pending.clear();
+}
+
+uint32_t BtreeBuilder::build( WordsCursor & words, size_t indexSize )
+{
+  quint64 bitCount = (quint64) indexSize * FilterBitsPerKey;
+
+  if ( bitCount < 64 )
+    bitCount = 64;
+  else
+  if ( bitCount > 0x80000000 )
+    bitCount = 0x80000000;
+
+  filterBitCount = bitCount;
+  filter.assign( ( bitCount + 7 ) / 8, 0 );
+
+  size_t rootId = buildNode( words, indexSize );
+
+  writePending( true );
+
+  return offsets[ rootId ];
+}
+
+size_t BtreeBuilder::buildNode( WordsCursor & words, size_t indexSize )
+{
+  // Held here until it's pending, so that it gets freed should building any
+  // of its children throw
+  sptr< PendingNode > node = new PendingNode;
+
+  node->isLeaf = indexSize <= maxElements;
+  node->isRoot = !depth;
+
+  ++depth;
+
+  if ( node->isLeaf )
+  {
+    // A leaf.
+
+    NodeCompressor * compressor = new NodeCompressor;
+
+    node->compressor = compressor;
+
+    vector< unsigned char > & uncompressedData = compressor->uncompressedData;
+
+    // The words can only be gone through once, so each chain is sized right
+    // when it is appended.
+    uncompressedData.resize( sizeof( uint32_t ) );
+
+    // First uint32_t indicates that this is a leaf.
+    *(uint32_t *)&uncompressedData.front() = indexSize;
+
+    string prevKey;
+    vector< uint32_t > trigrams;
+    vector< wchar > chars;
+
+    for( unsigned x = indexSize; x--; words.next() )
+    {
+      // The key, front-coded against the previous one. See
+      // BtreeIndex::readChainKey().
+
+      string const & key = words.key();
+
+      addToFilter( key );
+
+      if ( collectNgrams )
+      {
+        chars.clear();
+
+        wchar ch;
+
+        for( size_t y = 0, len; y < key.size(); y += len )
+        {
+          len = decodeUtf8Char( key.data() + y, key.size() - y, ch );
+
+          if ( !len )
+            break;
+
+          chars.push_back( ch );
+        }
+
+        for( size_t y = 2; y < chars.size(); ++y )
+          trigrams.push_back( trigramHash( chars[ y - 2 ], chars[ y - 1 ], chars[ y ] ) );
+      }
+
+      uint16_t shared = 0;
+
+      while( shared < prevKey.size() && shared < key.size() &&
+             shared < 0xFFFF && prevKey[ shared ] == key[ shared ] )
+        ++shared;
+
+      vector< WordArticleLink > const & chain = words.chain();
+
+      if ( collectExactWords )
+        for( unsigned y = 0; y < chain.size(); ++y )
+          addExactWord( chain[ y ] );
+
+      uint32_t size = 0;
+
+      for( unsigned y = 0; y < chain.size(); ++y )
+        size += chain[ y ].word.size() + 1 + chain[ y ].prefix.size() + 1 + sizeof( uint32_t );
+
+      size_t prevSize = uncompressedData.size();
+
+      uncompressedData.resize( prevSize + sizeof( uint16_t ) + key.size() - shared + 1 +
+                               sizeof( uint32_t ) + size );
+
+      unsigned char * ptr = &uncompressedData.front() + prevSize;
+
+      memcpy( ptr, &shared, sizeof( uint16_t ) );
+      ptr += sizeof( uint16_t );
+
+      memcpy( ptr, key.c_str() + shared, key.size() - shared + 1 );
+      ptr += key.size() - shared + 1;
+
+      prevKey = key;
+
+      memcpy( ptr, &size, sizeof( uint32_t ) );
+      ptr += sizeof( uint32_t );
+
+      for( unsigned y = 0; y < chain.size(); ++y )
+      {
+        memcpy( ptr, chain[ y ].word.c_str(), chain[ y ].word.size() + 1 );
+        ptr += chain[ y ].word.size() + 1;
+
+        memcpy( ptr, chain[ y ].prefix.c_str(), chain[ y ].prefix.size() + 1 );
+        ptr += chain[ y ].prefix.size() + 1;
+
+        memcpy( ptr, &(chain[ y ].articleOffset), sizeof( uint32_t ) );
+        ptr += sizeof( uint32_t );
+      }
+    }
+
+    if ( collectNgrams )
+      addLeafNgrams( trigrams );
+
+    pool.start( compressor );
+  }
+  else
+  {
+    // A node which will have children.
+
+    vector< unsigned char > & uncompressedData = node->data;
+
+    uncompressedData.resize( sizeof( uint32_t ) + ( maxElements + 1 ) * sizeof( uint32_t ) );
+
+    // First uint32_t indicates that this is a node.
+    *(uint32_t *)&uncompressedData.front() = 0xffffFFFF;
+
+    unsigned prevEntry = 0;
+
+    for( unsigned x = 0; x < maxElements; ++x )
+    {
+      unsigned curEntry = (uint64_t) indexSize * ( x + 1 ) / ( maxElements + 1 );
+
+      node->children.push_back( buildNode( words, curEntry - prevEntry ) );
+
+      size_t sz = words.key().size() + 1;
+
+      size_t prevSize = uncompressedData.size();
+      uncompressedData.resize( prevSize + sz );
+
+      memcpy( &uncompressedData.front() + prevSize, words.key().c_str(),
+              sz );
+
+      prevEntry = curEntry;
+    }
+
+    // Rightmost child
+    node->children.push_back( buildNode( words, indexSize - prevEntry ) );
+  }
+
+  --depth;
+
+  return addPending( node );
+}
+
+void BtreeBuilder::addToFilter( string const & key )
+{
+  quint64 hash = filterHash( key );
+
+  for( unsigned n = 0; n < FilterHashCount; ++n )
+  {
+    uint32_t bit = filterBit( hash, n, filterBitCount );
+
+    filter[ bit >> 3 ] |= 1 << ( bit & 7 );
   }
 }
 
+void BtreeBuilder::writeFilter()
+{
+  file.write< uint32_t >( filterBitCount );
+  file.write< uint32_t >( FilterHashCount );
+  file.write( &filter.front(), filter.size() );
+  file.write< uint32_t >( sizeof( uint32_t ) * 2 + filter.size() );
+}
 
-/// A function which recursively creates btree node.
-/// The nextIndex iterator is being iterated over and increased when building
-/// leaf nodes.
-static uint32_t buildBtreeNode( IndexedWords::const_iterator & nextIndex,
-                                size_t indexSize,
-                                File::Class & file, size_t maxElements,
-                                uint32_t & lastLeafLinkOffset )
+void BtreeBuilder::addExactWord( WordArticleLink const & link )
 {
-  // We compress all the node data. This buffer would hold it.
-  vector< unsigned char > uncompressedData;
+  string word = link.prefix + link.word;
 
-  bool isLeaf = indexSize <= maxElements;
+  size_t entriesSize = exactEntries.size() + sizeof( uint32_t ) + word.size() + 1;
 
-  if ( isLeaf )
+  // At its largest, when the table gets built, the memory taken is the
+  // entries twice, since they are copied into it, and the words collected,
+  // along with up to four slots for each
+  quint64 memoryNeeded = (quint64) entriesSize * 2 +
+                         (quint64)( exactWords.size() + 1 ) *
+                         ( sizeof( ExactWord ) + sizeof( uint32_t ) * 2 * 4 );
+
+  if ( exactWords.size() >= ExactWordsMaxCount || entriesSize > ExactWordsMaxSize ||
+       ( exactWordsMemoryLimit && memoryNeeded > exactWordsMemoryLimit ) )
   {
-    // A leaf.
+    GD_DPRINTF( "Btree: too many words for the table of exact words\n" );
 
-    uint32_t totalChainsLength = 0;
+    collectExactWords = false;
+    vector< ExactWord >().swap( exactWords );
+    vector< unsigned char >().swap( exactEntries );
+    return;
+  }
 
-    IndexedWords::const_iterator nextWord = nextIndex;
+  ExactWord exactWord;
 
-    for( unsigned x = indexSize; x--; ++nextWord )
-    {
-      totalChainsLength += sizeof( uint32_t );
+  exactWord.hash = filterHash( word );
+  exactWord.entryOffset = exactEntries.size();
 
-      vector< WordArticleLink > const & chain = nextWord->second;
+  exactWords.push_back( exactWord );
 
-      for( unsigned y = 0; y < chain.size(); ++y )
-        totalChainsLength += chain[ y ].word.size() + 1 + chain[ y ].prefix.size() + 1 + sizeof( uint32_t );
-    }
+  exactEntries.resize( exactEntries.size() + sizeof( uint32_t ) + word.size() + 1 );
 
-    uncompressedData.resize( sizeof( uint32_t ) + totalChainsLength );
+  unsigned char * ptr = &exactEntries.front() + exactWord.entryOffset;
 
-    // First uint32_t indicates that this is a leaf.
-    *(uint32_t *)&uncompressedData.front() = indexSize;
+  memcpy( ptr, &link.articleOffset, sizeof( uint32_t ) );
+  memcpy( ptr + sizeof( uint32_t ), word.c_str(), word.size() + 1 );
+}
 
-    unsigned char * ptr = &uncompressedData.front() + sizeof( uint32_t );
+void BtreeBuilder::buildExactTable()
+{
+  exactTable.clear();
 
-    for( unsigned x = indexSize; x--; ++nextIndex )
-    {
-      vector< WordArticleLink > const & chain = nextIndex->second;
+  if ( !collectExactWords || exactWords.empty() )
+    return;
 
-      unsigned char * saveSizeHere = ptr;
+  uint32_t slotCount = 2;
 
-      ptr += sizeof( uint32_t );
+  while( slotCount < exactWords.size() * 2 )
+    slotCount *= 2;
 
-      uint32_t size = 0;
+  uint32_t mask = slotCount - 1;
+  size_t slotsOffset = exactEntries.size();
 
-      for( unsigned y = 0; y < chain.size(); ++y )
-      {
-        memcpy( ptr, chain[ y ].word.c_str(), chain[ y ].word.size() + 1 );
-        ptr += chain[ y ].word.size() + 1;
+  exactTable.resize( slotsOffset + (size_t) slotCount * sizeof( uint32_t ) * 2 +
+                     sizeof( uint32_t ) * 3 );
 
-        memcpy( ptr, chain[ y ].prefix.c_str(), chain[ y ].prefix.size() + 1 );
-        ptr += chain[ y ].prefix.size() + 1;
+  unsigned char * slotData = &exactTable.front() + slotsOffset;
 
-        memcpy( ptr, &(chain[ y ].articleOffset), sizeof( uint32_t ) );
-        ptr += sizeof( uint32_t );
+  if ( slotsOffset )
+    memcpy( &exactTable.front(), &exactEntries.front(), slotsOffset );
 
-        size += chain[ y ].word.size() + 1 + chain[ y ].prefix.size() + 1 + sizeof( uint32_t );
+  memset( slotData, 0xff, (size_t) slotCount * sizeof( uint32_t ) * 2 );
+
+  // The words are inserted in the order of the index, so of the ones which
+  // are the same, the first one is found, as with findArticles()
+  for( size_t x = 0; x < exactWords.size(); ++x )
+  {
+    ExactWord const & exactWord = exactWords[ x ];
+    uint32_t hash = (uint32_t) exactWord.hash;
+    char const * word = (char const *) &exactEntries.front() + exactWord.entryOffset +
+                        sizeof( uint32_t );
+
+    for( uint32_t slot = (uint32_t)( exactWord.hash >> 32 ) & mask; ; slot = ( slot + 1 ) & mask )
+    {
+      unsigned char * ptr = slotData + slot * sizeof( uint32_t ) * 2;
+      uint32_t slotHash, entryOffset;
+
+      memcpy( &slotHash, ptr, sizeof( uint32_t ) );
+      memcpy( &entryOffset, ptr + sizeof( uint32_t ), sizeof( uint32_t ) );
+
+      if ( entryOffset == ExactSlotEmpty )
+      {
+        memcpy( ptr, &hash, sizeof( uint32_t ) );
+        memcpy( ptr + sizeof( uint32_t ), &exactWord.entryOffset, sizeof( uint32_t ) );
+        break;
       }
 
-      memcpy( saveSizeHere, &size, sizeof( uint32_t ) );
+      if ( slotHash == hash &&
+           strcmp( (char const *) &exactEntries.front() + entryOffset + sizeof( uint32_t ),
+                   word ) == 0 )
+        break;
     }
   }
-  else
+
+  unsigned char * ptr = slotData + (size_t) slotCount * sizeof( uint32_t ) * 2;
+  uint32_t entriesSize = slotsOffset;
+  uint32_t size = exactTable.size() - sizeof( uint32_t );
+
+  memcpy( ptr, &slotCount, sizeof( uint32_t ) );
+  memcpy( ptr + sizeof( uint32_t ), &entriesSize, sizeof( uint32_t ) );
+  memcpy( ptr + sizeof( uint32_t ) * 2, &size, sizeof( uint32_t ) );
+
+  vector< ExactWord >().swap( exactWords );
+  vector< unsigned char >().swap( exactEntries );
+}
+
+void BtreeBuilder::addLeafNgrams( vector< uint32_t > & trigrams )
+{
+  std::sort( trigrams.begin(), trigrams.end() );
+  trigrams.erase( std::unique( trigrams.begin(), trigrams.end() ), trigrams.end() );
+
+  if ( ngramPairs.size() + trigrams.size() > NgramIndexMaxPairs )
   {
-    // A node which will have children.
+    GD_DPRINTF( "Btree: the n-gram index is too large, not storing it\n" );
 
-    uncompressedData.resize( sizeof( uint32_t ) + ( maxElements + 1 ) * sizeof( uint32_t ) );
+    collectNgrams = false;
+    vector< quint64 >().swap( ngramPairs );
+    vector< uint32_t >().swap( leafOffsets );
+    return;
+  }
 
-    // First uint32_t indicates that this is a node.
-    *(uint32_t *)&uncompressedData.front() = 0xffffFFFF;
+  for( size_t x = 0; x < trigrams.size(); ++x )
+    ngramPairs.push_back( ( (quint64) trigrams[ x ] << 32 ) | leafCount );
 
-    unsigned prevEntry = 0;
+  ++leafCount;
+}
 
-    for( unsigned x = 0; x < maxElements; ++x )
-    {
-      unsigned curEntry = (uint64_t) indexSize * ( x + 1 ) / ( maxElements + 1 );
+void BtreeBuilder::buildNgramData()
+{
+  ngramData.clear();
 
-      uint32_t offset = buildBtreeNode( nextIndex,
-                                        curEntry - prevEntry,
-                                        file, maxElements,
-                                        lastLeafLinkOffset );
+  // With a single leaf, there's nothing to narrow the search down to
+  if ( !collectNgrams || leafOffsets.size() < 2 )
+    return;
 
-      memcpy( &uncompressedData.front() + sizeof( uint32_t ) + x * sizeof( uint32_t ), &offset, sizeof( uint32_t ) );
+  std::sort( ngramPairs.begin(), ngramPairs.end() );
 
-      size_t sz = nextIndex->first.size() + 1;
+  NgramIndex ngrams;
 
-      size_t prevSize = uncompressedData.size();
-      uncompressedData.resize( prevSize + sz );
+  ngrams.leafOffsets.swap( leafOffsets );
+  ngrams.setPostings( ngramPairs );
 
-      memcpy( &uncompressedData.front() + prevSize, nextIndex->first.c_str(),
-              sz );
+  vector< quint64 >().swap( ngramPairs );
 
-      prevEntry = curEntry;
-    }
+  ngrams.save( ngramData );
 
-    // Rightmost child
-    uint32_t offset = buildBtreeNode( nextIndex,
-                                      indexSize - prevEntry,
-                                      file, maxElements,
-                                      lastLeafLinkOffset );
-    memcpy( &uncompressedData.front() + sizeof( uint32_t ) +
-            maxElements * sizeof( uint32_t ), &offset, sizeof( offset ) );
+  uint32_t size = ngramData.size();
+
+  ngramData.resize( ngramData.size() + sizeof( uint32_t ) );
+  memcpy( &ngramData.front() + size, &size, sizeof( uint32_t ) );
+
+  GD_DPRINTF( "Btree: built an n-gram index of %u leaves, %u bytes\n",
+              (unsigned) ngrams.leafOffsets.size(), (unsigned) size );
+}
+
+size_t BtreeBuilder::addPending( sptr< PendingNode > const & node )
+{
+  pending.push_back( node );
+
+  writePending( false );
+
+  // Nodes are written in the order they were added, so the id is the total
+  // number of nodes added so far.
+  return offsets.size() + pending.size() - 1;
+}
+
+void BtreeBuilder::writePending( bool all )
+{
+  // Don't let the serialization get too far ahead of the writing
+  size_t maxPending = pool.maxThreadCount() * 4;
+
+  while( !pending.empty() )
+  {
+    sptr< PendingNode > node = pending.front();
+
+    if ( node->isLeaf && !all && pending.size() <= maxPending &&
+         !node->compressor->done.tryAcquire() )
+      break;
+
+    if ( node->isLeaf && ( all || pending.size() > maxPending ) )
+      node->compressor->done.acquire();
+
+    // Should it throw, the node is still pending, and gets freed with it
+    writeNode( *node );
+
+    pending.pop_front();
   }
+}
 
-  // Save the result.
+void BtreeBuilder::writeNode( PendingNode & node )
+{
+  vector< unsigned char > localCompressedData;
 
-  #ifdef __BTREE_USE_LZO
+  vector< unsigned char > const * compressedData;
+  uint32_t uncompressedSize, compressedSize;
 
-  vector< unsigned char > compressedData( uncompressedData.size() + uncompressedData.size() / 16 + 64 + 3 );
+  if ( node.isLeaf )
+  {
+    compressedData = &node.compressor->compressedData;
+    uncompressedSize = node.compressor->uncompressedSize;
+    compressedSize = node.compressor->compressedSize;
+  }
+  else
+  {
+    // All the children were written before us, so their offsets are known
+    for( size_t x = 0; x < node.children.size(); ++x )
+      memcpy( &node.data.front() + sizeof( uint32_t ) + x * sizeof( uint32_t ),
+              &offsets[ node.children[ x ] ], sizeof( uint32_t ) );
+
+    compressedSize = compressNode( node.data, localCompressedData );
+    uncompressedSize = node.data.size();
+    compressedData = &localCompressedData;
+  }
 
-  char workMem[ LZO1X_1_MEM_COMPRESS ];
+  // Save the result.
 
-  lzo_uint compressedSize;
+  quint64 position = file.tell();
 
-  if ( lzo1x_1_compress( &uncompressedData.front(), uncompressedData.size(),
-                         &compressedData.front(), &compressedSize, workMem )
-       != LZO_E_OK )
+  // The root is preceded by the filter, that by the table of the exact
+  // words, if there's one, and that by the n-gram index, if there's one
+  if ( node.isRoot )
   {
-    FDPRINTF( stderr, "Failed to compress btree node.\n" );
-    abort();
+    buildExactTable();
+    buildNgramData();
   }
 
-  #else
+  size_t filterBlockSize = node.isRoot ?
+                           ngramData.size() + exactTable.size() +
+                           sizeof( uint32_t ) * 3 + filter.size() : 0;
 
-  vector< unsigned char > compressedData( compressBound( uncompressedData.size() ) );
+  if ( addressShift )
+  {
+    static char const zeros[ NodeAlignment ] = { 0 };
 
-  unsigned long compressedSize = compressedData.size();
+    size_t padding = ( NodeAlignment - ( position + filterBlockSize ) % NodeAlignment ) %
+                     NodeAlignment;
 
-  if ( compress( &compressedData.front(), &compressedSize,
-                 &uncompressedData.front(), uncompressedData.size() ) != Z_OK )
+    if ( padding )
+      file.write( zeros, padding );
+
+    position += padding;
+  }
+
+  quint64 offset = ( position + filterBlockSize ) >> addressShift;
+
+  if ( offset > 0xffffFFFF )
+    throw exNodeAddressOverflow();
+
+  // The root is the last node written, so the filter is complete by now
+  if ( node.isRoot )
   {
-    qFatal( "Failed to compress btree node." );
-    abort();
+    if ( ngramData.size() )
+      file.write( &ngramData.front(), ngramData.size() );
+
+    if ( exactTable.size() )
+      file.write( &exactTable.front(), exactTable.size() );
+
+    writeFilter();
   }
 
-  #endif
+  offsets.push_back( offset );
 
-  uint32_t offset = file.tell();
+  if ( node.isLeaf && collectNgrams )
+    leafOffsets.push_back( offset );
 
-  file.write< uint32_t >( uncompressedData.size() );
+  file.write< uint32_t >( uncompressedSize );
   file.write< uint32_t >( compressedSize );
-  file.write( &compressedData.front(), compressedSize );
+  file.write( &compressedData->front(), compressedData->size() );
 
-  if ( isLeaf )
+  if ( node.isLeaf )
   {
     // A link to the next leef, which is zero and which will be updated
     // should we happen to have another leaf.
     
     file.write( ( uint32_t ) 0 );
 
-    uint32_t here = file.tell();
+    quint64 here = file.tell();
 
     if ( lastLeafLinkOffset )
     {
-      // Update the previous leaf to have the offset of this one.
+      // Update the previous leaf to have the address of this one.
       file.seek( lastLeafLinkOffset );
-      file.write( offset );
+      file.write( (uint32_t) offset );
       file.seek( here );
     }
 
     // Make sure next leaf knows where to write its offset for us.
     lastLeafLinkOffset = here - sizeof( uint32_t );
   }
+}
+
+}
+
+IndexedWords::IndexedWords(): memoryLimit( 0 ), memoryUsed( 0 )
+{
+}
+
+void IndexedWords::enableSpilling()
+{
+  Mutex::Lock _( indexingMemoryMutex );
+
+  memoryLimit = indexingMemoryLimit;
+}
+
+void IndexedWords::clear()
+{
+  map< string, vector< WordArticleLink > >::clear();
+
+  spilledRuns.clear();
+  memoryUsed = 0;
+}
+
+void IndexedWords::accountFor( string const & key, bool isNewKey,
+                               WordArticleLink const & link )
+{
+  if ( isNewKey )
+    memoryUsed += sizeof( value_type ) + MapNodeOverhead + key.size();
+
+  memoryUsed += sizeof( WordArticleLink ) + link.word.size() + link.prefix.size();
+}
+
+void IndexedWords::spillIfNeeded()
+{
+  if ( !memoryLimit || memoryUsed <= memoryLimit )
+    return;
+
+  sptr< QTemporaryFile > run = createRunFile();
+
+  RunWriter writer( *run );
+
+  for( const_iterator i = begin(); i != end(); ++i )
+    writer.add( i->first, i->second );
+
+  writer.flush();
 
-  return offset;
+  GD_DPRINTF( "Spilled %u words to %s\n", (unsigned) size(),
+              run->fileName().toLocal8Bit().data() );
+
+  spilledRuns.push_back( run );
+
+  map< string, vector< WordArticleLink > >::clear();
+  memoryUsed = 0;
+}
+
+void setIndexingMemoryLimit( size_t bytes, QString const & tempDir )
+{
+  Mutex::Lock _( indexingMemoryMutex );
+
+  indexingMemoryLimit = bytes;
+  indexingTempDir = tempDir;
 }
 
 void IndexedWords::addWord( wstring const & word, uint32_t articleOffset, unsigned int maxHeadwordSize )
 {
+  spillIfNeeded();
+
   wchar const * wordBegin = word.c_str();
   string::size_type wordSize = word.size();
 
@@ -1162,11 +3942,13 @@ void IndexedWords::addWord( wstring const & word, uint32_t articleOffset, unsign
               wstring folded = Folding::applyWhitespaceOnly( wstring( wordBegin, wordSize ) );
               if( !folded.empty() )
               {
-                  iterator i = insert(
+                  std::pair< iterator, bool > inserted = insert(
                     IndexedWords::value_type(
                       string( &utfBuffer.front(),
                               Utf8::encode( folded.data(), folded.size(), &utfBuffer.front() ) ),
-                      vector< WordArticleLink >() ) ).first;
+                      vector< WordArticleLink >() ) );
+
+                  iterator i = inserted.first;
 
                   // Try to conserve memory somewhat -- slow insertions are ok
                   i->second.reserve( i->second.size() + 1 );
@@ -1175,6 +3957,9 @@ void IndexedWords::addWord( wstring const & word, uint32_t articleOffset, unsign
                                   Utf8::encode( wordBegin, wordSize, &utfBuffer.front() ) );
                   string utfPrefix;
                   i->second.push_back( WordArticleLink( utfWord, articleOffset, utfPrefix ) );
+
+                  if ( memoryLimit )
+                    accountFor( i->first, inserted.second, i->second.back() );
               }
           }
           return;
@@ -1187,11 +3972,13 @@ void IndexedWords::addWord( wstring const & word, uint32_t articleOffset, unsign
     // Insert this word
     wstring folded = Folding::apply( nextChar );
     
-    iterator i = insert(
+    std::pair< iterator, bool > inserted = insert(
       IndexedWords::value_type(
         string( &utfBuffer.front(),
                 Utf8::encode( folded.data(), folded.size(), &utfBuffer.front() ) ),
-        vector< WordArticleLink >() ) ).first;
+        vector< WordArticleLink >() ) );
+
+    iterator i = inserted.first;
 
     if ( ( i->second.size() < 1024 ) || ( nextChar == wordBegin ) ) // Don't overpopulate chains with middle matches
     {
@@ -1205,6 +3992,9 @@ void IndexedWords::addWord( wstring const & word, uint32_t articleOffset, unsign
                         Utf8::encode( wordBegin, nextChar - wordBegin, &utfBuffer.front() ) );
   
       i->second.push_back( WordArticleLink( utfWord, articleOffset, utfPrefix ) );
+
+      if ( memoryLimit )
+        accountFor( i->first, inserted.second, i->second.back() );
     }
 
     wordsAdded += 1;
@@ -1223,31 +4013,86 @@ void IndexedWords::addWord( wstring const & word, uint32_t articleOffset, unsign
 
 void IndexedWords::addSingleWord( wstring const & word, uint32_t articleOffset )
 {
+  spillIfNeeded();
+
   wstring folded = Folding::apply( word );
   if( folded.empty() )
       folded = Folding::applyWhitespaceOnly( word );
-  operator []( Utf8::encode( folded ) ).push_back(
+
+  std::pair< iterator, bool > inserted =
+    insert( IndexedWords::value_type( Utf8::encode( folded ), vector< WordArticleLink >() ) );
+
+  inserted.first->second.push_back(
     WordArticleLink( Utf8::encode( word ), articleOffset ) );
+
+  if ( memoryLimit )
+    accountFor( inserted.first->first, inserted.second, inserted.first->second.back() );
+}
+
+void IndexedWords::addLink( string const & key, WordArticleLink const & link )
+{
+  spillIfNeeded();
+
+  if ( key.empty() )
+    return;
+
+  std::pair< iterator, bool > inserted =
+    insert( IndexedWords::value_type( key, vector< WordArticleLink >() ) );
+
+  iterator i = inserted.first;
+
+  // Don't overpopulate chains with middle matches
+  if ( i->second.size() < 1024 || link.prefix.empty() )
+  {
+    i->second.push_back( link );
+
+    if ( memoryLimit )
+      accountFor( i->first, inserted.second, i->second.back() );
+  }
 }
 
-IndexInfo buildIndex( IndexedWords const & indexedWords, File::Class & file )
+IndexInfo buildIndex( IndexedWords const & indexedWords, File::Class & file,
+                      size_t btreeMaxElements, bool exactWords )
 {
-  size_t indexSize = indexedWords.size();
-  IndexedWords::const_iterator nextIndex = indexedWords.begin();
+  size_t indexSize;
+
+  MapCursor mapCursor( indexedWords );
+  WordsCursor * words = &mapCursor;
+
+  sptr< QTemporaryFile > mergedRun;
+  sptr< RunCursor > runCursor;
 
   // Skip any empty words. No point in indexing those, and some dictionaries
   // are known to have buggy empty-word entries (Stardict's jargon for instance).
 
-  while( indexSize && nextIndex->first.empty() )
+  if ( indexedWords.getSpilledRuns().empty() )
   {
-    indexSize--;
-    ++nextIndex;
+    indexSize = indexedWords.size();
+
+    while( indexSize && mapCursor.key().empty() )
+    {
+      indexSize--;
+      mapCursor.next();
+    }
   }
+  else
+  {
+    // The shape of the tree depends on the total number of words, so the
+    // runs are merged into a single one first, and then read back from it.
+    mergedRun = createRunFile();
+
+    indexSize = mergeRuns( indexedWords, *mergedRun );
 
-  // We try to stick to two-level tree for most dictionaries. Try finding
-  // the right size for it.
+    runCursor = new RunCursor( *mergedRun );
+    words = runCursor.get();
+  }
 
-  size_t btreeMaxElements = ( (size_t) sqrt( (double) indexSize ) ) + 1;
+  if ( !btreeMaxElements )
+  {
+    // We try to stick to two-level tree for most dictionaries. Try finding
+    // the right size for it.
+    btreeMaxElements = ( (size_t) sqrt( (double) indexSize ) ) + 1;
+  }
 
   if ( btreeMaxElements < BtreeMinElements )
     btreeMaxElements = BtreeMinElements;
@@ -1257,14 +4102,58 @@ IndexInfo buildIndex( IndexedWords const & indexedWords, File::Class & file )
 
   GD_DPRINTF( "Building a tree of %u elements\n", (unsigned) btreeMaxElements );
 
+  // The table of the exact words can't be spilled, so it is left out if it
+  // would take more memory than the indexing is allowed to
+  size_t exactWordsMemoryLimit;
+
+  {
+    Mutex::Lock _( indexingMemoryMutex );
+
+    exactWordsMemoryLimit = indexingMemoryLimit;
+  }
+
+  quint64 startOffset = file.tell();
+
+  for( bool wide = false; ; wide = true )
+  {
+    try
+    {
+      BtreeBuilder builder( file, btreeMaxElements, wide, exactWords,
+                            exactWordsMemoryLimit, !exactWords );
+
+      uint32_t rootOffset = builder.build( *words, indexSize );
+
+      return IndexInfo( btreeMaxElements | ( wide ? (uint32_t) BtreeWideAddresses : 0 ) |
+                        ( builder.hasExactWords() ? (uint32_t) BtreeExactWords : 0 ) |
+                        ( builder.hasNgrams() ? (uint32_t) BtreeNgrams : 0 ),
+                        rootOffset );
+    }
+    catch( exNodeAddressOverflow & )
+    {
+      if ( wide )
+        throw;
+    }
 
-  uint32_t lastLeafOffset = 0;
+    // The index reaches past 4 GB, so start over with wide addresses. The
+    // new tree is larger than the part already written, so it overwrites
+    // all of it.
+    GD_DPRINTF( "Rebuilding the tree with wide addresses\n" );
 
-  uint32_t rootOffset = buildBtreeNode( nextIndex, indexSize,
-                                        file, btreeMaxElements,
-                                        lastLeafOffset );
+    file.seek( startOffset );
+
+    if ( runCursor )
+    {
+      runCursor = new RunCursor( *mergedRun );
+      words = runCursor.get();
+    }
+    else
+    {
+      mapCursor.rewind();
 
-  return IndexInfo( btreeMaxElements, rootOffset );
+      while( !mapCursor.atEnd() && mapCursor.key().empty() )
+        mapCursor.next();
+    }
+  }
 }
 
 void BtreeIndex::getAllHeadwords( QSet< QString > & headwords )
@@ -1294,14 +4183,7 @@ void BtreeIndex::findArticleLinks( QVector< WordArticleLink > * articleLinks,
   uint32_t nextLeaf = 0;
   uint32_t leafEntries;
 
-  Mutex::Lock _( *idxFileMutex );
-
-  if ( !rootNodeLoaded )
-  {
-    // Time to load our root node. We do it only once, at the first request.
-    readNode( rootOffset, rootNode );
-    rootNodeLoaded = true;
-  }
+  loadRootNode();
 
   char const * leaf = &rootNode.front();
   char const * leafEnd = leaf + rootNode.size();
@@ -1322,10 +4204,9 @@ void BtreeIndex::findArticleLinks( QVector< WordArticleLink > * articleLinks,
     {
       // A node
       currentNodeOffset = *( (uint32_t *)leaf + 1 );
-      readNode( currentNodeOffset, extLeaf );
+      readNode( currentNodeOffset, extLeaf, &nextLeaf );
       leaf = &extLeaf.front();
       leafEnd = leaf + extLeaf.size();
-      nextLeaf = idxFile->read< uint32_t >();
     }
     else
     {
@@ -1346,44 +4227,51 @@ void BtreeIndex::findArticleLinks( QVector< WordArticleLink > * articleLinks,
 
   // Read all chains
 
+  string headword;
+
   for( ; ; )
   {
-    vector< WordArticleLink > result = readChain( chainPtr );
-
-    if( headwords && static_cast< vector< WordArticleLink >::size_type >( headwords->capacity() ) < headwords->size() + result.size() )
-    {
-      int n = headwords->capacity();
-      headwords->reserve( n + n / 10 );
-    }
-
-    if( offsets && static_cast< vector< WordArticleLink >::size_type >( offsets->capacity() ) < offsets->size() + result.size() )
-    {
-      int n = offsets->capacity();
-      offsets->reserve( n + n / 10 );
-    }
+    ChainCursor links( chainPtr );
 
-    if( articleLinks && static_cast< vector< WordArticleLink >::size_type >( articleLinks->capacity() ) < articleLinks->size() + result.size() )
-    {
-      int n = articleLinks->capacity();
-      articleLinks->reserve( n + n / 10 );
-    }
+    chainPtr = links.chainEnd();
 
-    for( unsigned i = 0; i < result.size(); i++ )
+    while( links.next() )
     {
       if( isCancelled && Qt4x5::AtomicInt::loadAcquire( *isCancelled ) )
         return;
 
+      if( headwords && headwords->capacity() <= headwords->size() )
+      {
+        int n = headwords->capacity();
+        headwords->reserve( n + n / 10 + 1 );
+      }
+
+      if( offsets && offsets->capacity() <= offsets->size() )
+      {
+        int n = offsets->capacity();
+        offsets->reserve( n + n / 10 + 1 );
+      }
+
+      if( articleLinks && articleLinks->capacity() <= articleLinks->size() )
+      {
+        int n = articleLinks->capacity();
+        articleLinks->reserve( n + n / 10 + 1 );
+      }
+
+      headword.clear();
+      links.appendHeadword( headword );
+
       if( headwords )
-        headwords->insert( QString::fromUtf8( ( result[ i ].prefix + result[ i ].word ).c_str() ) );
+        headwords->insert( QString::fromUtf8( headword.data(), headword.size() ) );
 
-      if( offsets && offsets->contains( result[ i ].articleOffset ) )
+      if( offsets && offsets->contains( links.articleOffset() ) )
         continue;
 
       if( offsets )
-        offsets->insert( result[ i ].articleOffset );
+        offsets->insert( links.articleOffset() );
 
       if( articleLinks )
-        articleLinks->push_back( WordArticleLink( result[ i ].prefix + result[ i ].word, result[ i ].articleOffset ) );
+        articleLinks->push_back( WordArticleLink( headword, links.articleOffset() ) );
     }
 
     if ( chainPtr >= leafEnd )
@@ -1392,11 +4280,10 @@ void BtreeIndex::findArticleLinks( QVector< WordArticleLink > * articleLinks,
 
       if ( nextLeaf )
       {
-        readNode( nextLeaf, extLeaf );
+        readNode( nextLeaf, extLeaf, &nextLeaf );
         leaf = &extLeaf.front();
         leafEnd = leaf + extLeaf.size();
 
-        nextLeaf = idxFile->read< uint32_t >();
         chainPtr = leaf + sizeof( uint32_t );
 
         leafEntries = *(uint32_t *)leaf;
@@ -1410,6 +4297,73 @@ void BtreeIndex::findArticleLinks( QVector< WordArticleLink > * articleLinks,
   }
 }
 
+void BtreeIndex::copyChainsTo( IndexedWords & words, uint32_t articleOffset,
+                               QAtomicInt * isCancelled )
+{
+  loadRootNode();
+
+  vector< char > leaf;
+  uint32_t nextLeaf = 0;
+
+  char const * node = &rootNode.front();
+  size_t nodeSize = rootNode.size();
+
+  // Go down to the first leaf
+  while( *(uint32_t const *)node == 0xffffFFFF )
+  {
+    readNode( *( (uint32_t const *)node + 1 ), leaf, &nextLeaf );
+
+    node = &leaf.front();
+    nodeSize = leaf.size();
+  }
+
+  string key;
+  std::set< string > added; // The links of the current chain, as headwords
+
+  for( ; ; )
+  {
+    if ( isCancelled && Qt4x5::AtomicInt::loadAcquire( *isCancelled ) )
+      return;
+
+    uint32_t leafEntries = *(uint32_t const *)node;
+
+    char const * ptr = node + sizeof( uint32_t );
+    char const * leafEnd = node + nodeSize;
+
+    while( leafEntries-- )
+    {
+      if ( ptr >= leafEnd )
+        throw exCorruptedChainData();
+
+      readChainKey( ptr, key );
+
+      ChainCursor links( ptr );
+
+      ptr = links.chainEnd();
+
+      added.clear();
+
+      while( links.next() )
+      {
+        string word( links.word(), links.wordSize() );
+        string prefix( links.prefix(), links.prefixSize() );
+
+        // The prefix can't have a zero byte, so this is unambiguous
+        if ( added.insert( prefix + '\0' + word ).second )
+          words.addLink( key, WordArticleLink( word, articleOffset, prefix ) );
+      }
+    }
+
+    if ( !nextLeaf )
+      break;
+
+    readNode( nextLeaf, leaf, &nextLeaf );
+
+    node = &leaf.front();
+    nodeSize = leaf.size();
+  }
+}
+
 void BtreeIndex::getHeadwordsFromOffsets( QList<uint32_t> & offsets,
                                           QVector<QString> & headwords,
                                           QAtomicInt * isCancelled )
@@ -1420,14 +4374,7 @@ void BtreeIndex::getHeadwordsFromOffsets( QList<uint32_t> & offsets,
 
   qSort( offsets );
 
-  Mutex::Lock _( *idxFileMutex );
-
-  if ( !rootNodeLoaded )
-  {
-    // Time to load our root node. We do it only once, at the first request.
-    readNode( rootOffset, rootNode );
-    rootNodeLoaded = true;
-  }
+  loadRootNode();
 
   char const * leaf = &rootNode.front();
   char const * leafEnd = leaf + rootNode.size();
@@ -1448,10 +4395,9 @@ void BtreeIndex::getHeadwordsFromOffsets( QList<uint32_t> & offsets,
     {
       // A node
       currentNodeOffset = *( (uint32_t *)leaf + 1 );
-      readNode( currentNodeOffset, extLeaf );
+      readNode( currentNodeOffset, extLeaf, &nextLeaf );
       leaf = &extLeaf.front();
       leafEnd = leaf + extLeaf.size();
-      nextLeaf = idxFile->read< uint32_t >();
     }
     else
     {
@@ -1475,21 +4421,28 @@ void BtreeIndex::getHeadwordsFromOffsets( QList<uint32_t> & offsets,
   QList< uint32_t >::Iterator begOffsets = offsets.begin();
   QList< uint32_t >::Iterator endOffsets = offsets.end();
 
+  string headword;
+
   for( ; ; )
   {
-    vector< WordArticleLink > result = readChain( chainPtr );
+    ChainCursor links( chainPtr );
 
-    for( unsigned i = 0; i < result.size(); i++ )
+    chainPtr = links.chainEnd();
+
+    while( links.next() )
     {
       QList< uint32_t >::Iterator it = qBinaryFind( begOffsets, endOffsets,
-                                                    result.at( i ).articleOffset );
+                                                    links.articleOffset() );
 
       if( it != offsets.end() )
       {
         if( isCancelled && Qt4x5::AtomicInt::loadAcquire( *isCancelled ) )
           return;
 
-        headwords.append(  QString::fromUtf8( ( result[ i ].prefix + result[ i ].word ).c_str() ) );
+        headword.clear();
+        links.appendHeadword( headword );
+
+        headwords.append( QString::fromUtf8( headword.data(), headword.size() ) );
         offsets.erase( it );
         begOffsets = offsets.begin();
         endOffsets = offsets.end();
@@ -1508,11 +4461,10 @@ void BtreeIndex::getHeadwordsFromOffsets( QList<uint32_t> & offsets,
 
       if ( nextLeaf )
       {
-        readNode( nextLeaf, extLeaf );
+        readNode( nextLeaf, extLeaf, &nextLeaf );
         leaf = &extLeaf.front();
         leafEnd = leaf + extLeaf.size();
 
-        nextLeaf = idxFile->read< uint32_t >();
         chainPtr = leaf + sizeof( uint32_t );
 
         leafEntries = *(uint32_t *)leaf;
@@ -6,6 +6,8 @@
 
 #include "dictionary.hh"
 #include "file.hh"
+#include "lrucache.hh"
+#include "sptr.hh"
 
 #include <string>
 #include <vector>
@@ -13,6 +15,14 @@
 #include <QVector>
 #include <QSet>
 #include <QList>
+#include <QAtomicInt>
+#include <QString>
+#include <QTemporaryFile>
+#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
+#include <QRegularExpression>
+#else
+#include <QRegExp>
+#endif
 #include "cpp_features.hh"
 
 #if defined( _MSC_VER ) && _MSC_VER < 1800 // VS2012 and older
@@ -30,12 +40,34 @@ using gd::wstring;
 using std::vector;
 using std::map;
 
+enum
+{
+  /// Set in IndexInfo::btreeMaxElements for indices with wide addresses
+  BtreeWideAddresses = 0x80000000,
+  /// Set in IndexInfo::btreeMaxElements for indices which have the table of
+  /// their exact words, see buildIndex()
+  BtreeExactWords = 0x40000000,
+  /// Set in IndexInfo::btreeMaxElements for indices which have the n-gram
+  /// index of their keys, see buildIndex()
+  BtreeNgrams = 0x20000000
+};
+
 enum
 {
   /// This is to be bumped up each time the internal format changes.
   /// The value isn't used here by itself, it is supposed to be added
   /// to each dictionary's internal format version.
-  FormatVersion = 4
+  /// The version also reflects the codec the nodes are compressed with:
+  /// 19 is zlib, 20 is LZ4 (built with CONFIG+=btree_lz4) and 21 is zstd
+  /// (built with CONFIG+=btree_zstd). Each node records its codec, so the
+  /// nodes compressed with any of them are readable by any build.
+#if defined( __BTREE_USE_ZSTD )
+  FormatVersion = 21
+#elif defined( __BTREE_USE_LZ4 )
+  FormatVersion = 20
+#else
+  FormatVersion = 19
+#endif
 };
 
 // These exceptions which might be thrown during the index traversal
@@ -43,6 +75,29 @@ enum
 DEF_EX( exIndexWasNotOpened, "The index wasn't opened", Dictionary::Ex )
 DEF_EX( exFailedToDecompressNode, "Failed to decompress a btree's node", Dictionary::Ex )
 DEF_EX( exCorruptedChainData, "Corrupted chain data in the leaf of a btree encountered", Dictionary::Ex )
+DEF_EX( exCantUseTempFile, "Can't use a temporary file for the words being indexed", Dictionary::Ex )
+
+/// Statistics of the cache of uncompressed nodes, which is shared by all
+/// the indices.
+typedef LruCache< quint64 >::Stats NodeCacheStats;
+
+NodeCacheStats getNodeCacheStats();
+
+/// Sets the maximum total size of the nodes held in the node cache, in bytes.
+/// Zero disables the cache.
+void setNodeCacheMaxSize( size_t );
+
+/// Statistics of the headword filters of all the indices: how many times
+/// they were consulted, and how many of those the lookup could be skipped.
+struct HeadwordFilterStats
+{
+  quint64 lookups, skips;
+
+  HeadwordFilterStats(): lookups( 0 ), skips( 0 )
+  {}
+};
+
+HeadwordFilterStats getHeadwordFilterStats();
 
 /// This structure describes a word linked to its translation. The
 /// translation is represented as an abstract 32-bit offset.
@@ -59,7 +114,13 @@ struct WordArticleLink
   {}
 };
 
-/// Information needed to open the index
+/// Information needed to open the index.
+/// The node offsets stored in the index are 32-bit. Indices which would
+/// otherwise reach past 4 GB are built with wide addresses instead: their
+/// nodes are aligned, and the addresses are in the units of that alignment.
+/// This is flagged by BtreeWideAddresses in btreeMaxElements, and the root
+/// offset is such an address as well, so both still fit the 32-bit fields
+/// the dictionaries store them in.
 struct IndexInfo
 {
   uint32_t btreeMaxElements, rootOffset;
@@ -69,6 +130,71 @@ struct IndexInfo
   {}
 };
 
+/// Goes through the word-article links of a single chain right in the leaf
+/// data, without copying anything. The pointers it gives out are only valid
+/// for as long as the leaf data is.
+class ChainCursor
+{
+public:
+
+  /// Positions the cursor before the first link of the chain at the given
+  /// offset, as returned by BtreeIndex::findChainOffsetExactOrPrefix().
+  explicit ChainCursor( char const * chain );
+
+  /// Advances to the next link. Returns false if there are no more of them.
+  bool next();
+
+  /// The current link, utf8-encoded. The strings are zero-terminated.
+  char const * word() const
+  { return currentWord; }
+  size_t wordSize() const
+  { return currentWordSize; }
+  char const * prefix() const
+  { return currentPrefix; }
+  size_t prefixSize() const
+  { return currentPrefixSize; }
+  uint32_t articleOffset() const
+  { return currentArticleOffset; }
+
+  /// Appends the prefix followed by the word, which together make up the
+  /// headword, to the given string.
+  void appendHeadword( string & out ) const
+  {
+    out.append( currentPrefix, currentPrefixSize );
+    out.append( currentWord, currentWordSize );
+  }
+
+  /// The offset of the next chain in the leaf, if there's any.
+  char const * chainEnd() const
+  { return end; }
+
+private:
+
+  char const * ptr, * end;
+
+  char const * currentWord, * currentPrefix;
+  size_t currentWordSize, currentPrefixSize;
+  uint32_t currentArticleOffset;
+};
+
+/// Receives the chains found by BtreeIndex::findWildcardChains().
+class ChainVisitor
+{
+public:
+
+  virtual ~ChainVisitor()
+  {}
+
+  /// Called with the offset of each chain found, in the order of the index.
+  /// Returning false stops the search.
+  virtual bool visitChain( char const * chain ) = 0;
+};
+
+struct IndexedWords;
+class WildcardAutomaton;
+class LevenshteinAutomaton;
+class NgramIndex;
+
 /// Base btree indexing class which allows using what buildIndex() function
 /// created. It's quite low-lovel and is basically a set of 'bulding blocks'
 /// functions.
@@ -78,15 +204,31 @@ public:
 
   BtreeIndex();
 
+  ~BtreeIndex();
+
   /// Opens the index. The file reference is saved to be used for
   /// subsequent lookups.
-  /// The mutex is the one to be locked when working with the file.
+  /// The mutex is the one to be locked when working with the file. If the
+  /// file can be memory-mapped, the nodes are read straight from the mapping
+  /// and the mutex isn't used for the lookups at all.
   void openIndex( IndexInfo const &, File::Class &, Mutex & );
 
   /// Finds articles that match the given string. A case-insensitive search
   /// is performed.
   vector< WordArticleLink > findArticles( wstring const &, bool ignoreDiacritics = false );
 
+  /// Returns false if findArticles() is sure to find nothing for the given
+  /// word. This only consults the Bloom filter of the keys stored along with
+  /// the index, without reading any nodes.
+  bool mayContainWord( wstring const & );
+
+  /// Finds the article of the given file name, for the indices of resource
+  /// files. If the index has the table of its exact words, the name is looked
+  /// up there first, with neither folding nor reading any nodes. Failing
+  /// that, it is looked up the way findArticles() does it, which also finds
+  /// the names differing in case. Returns false if nothing was found.
+  bool findFile( wstring const & name, uint32_t & articleOffset );
+
   /// Find all unique article links in the index
   void findAllArticleLinks( QVector< WordArticleLink > & articleLinks );
 
@@ -104,6 +246,12 @@ public:
                                 QVector< QString > & headwords,
                                 QAtomicInt * isCancelled = 0 );
 
+  /// Adds all the links of the index to the given words, each under the
+  /// very same key it has here, with its article offset replaced by the
+  /// given one. The links which thus become the same are only added once.
+  void copyChainsTo( IndexedWords &, uint32_t articleOffset,
+                     QAtomicInt * isCancelled = 0 );
+
 protected:
 
   /// Finds the offset in the btree leaf for the given word, either matching
@@ -118,20 +266,51 @@ protected:
   /// case, the returned pointer wouldn't belong to 'leaf' at all. To that end,
   /// the leafEnd pointer always holds the pointer to the first byte outside
   /// the node data.
+  /// If chainKey is given, it receives the folded key of the chain found.
   char const * findChainOffsetExactOrPrefix( wstring const & target,
                                              bool & exactMatch,
                                              vector< char > & leaf,
                                              uint32_t & nextLeaf,
-                                             char const * & leafEnd );
+                                             char const * & leafEnd,
+                                             string * chainKey = 0 );
 
   /// Reads a node or leaf at the given offset. Just uncompresses its data
-  /// to the given vector and does nothing more.
-  void readNode( uint32_t offset, vector< char > & out );
+  /// to the given vector and does nothing more. If nextLeaf is given, it
+  /// receives the link to the next leaf if the node read is a leaf, or zero
+  /// otherwise.
+  /// This function does all the locking it needs by itself. Recently read
+  /// nodes are served from the node cache.
+  void readNode( uint32_t offset, vector< char > & out, uint32_t * nextLeaf = 0 );
+
+  /// Makes sure the root node is loaded to rootNode.
+  void loadRootNode();
 
   /// Reads the word-article links' chain at the given offset. The pointer
-  /// is updated to point to the next chain, if there's any.
+  /// is updated to point to the next chain, if there's any. This copies all
+  /// the links -- use ChainCursor to just go through them.
   vector< WordArticleLink > readChain( char const * & );
 
+  /// Each chain in a leaf begins with its folded key, utf8-encoded and
+  /// front-coded against the key of the previous chain in the same leaf.
+  /// Given the key of the previous chain, this turns it into the key of the
+  /// chain at the given offset. The offset itself is left as it is.
+  static void readChainKey( char const * chain, string & key );
+
+  /// Finds the chains whose keys may match the given wildcard pattern, which
+  /// must be folded with the wildcards preserved. The subtrees whose range of
+  /// keys rules out any match aren't looked into at all. For the patterns
+  /// which begin with a wildcard, the n-gram index is used to only look
+  /// through the leaves having all the trigrams of the pattern. The chains
+  /// are only preselected this way -- the caller still has to match their
+  /// headwords against the pattern.
+  void findWildcardChains( wstring const & foldedPattern, ChainVisitor & );
+
+  /// Finds the chains whose keys are exactly the given Levenshtein distance
+  /// away from the given folded word. The btree is walked with a Levenshtein
+  /// automaton, so the subtrees whose keys all begin too far from the word
+  /// aren't looked into at all.
+  void findFuzzyChains( wstring const & foldedWord, unsigned distance, ChainVisitor & );
+
   /// Drops any alises which arose due to folding. Only case-folded aliases
   /// are left.
   void antialias( wstring const &, vector< WordArticleLink > &, bool ignoreDiactitics );
@@ -145,9 +324,93 @@ private:
 
   uint32_t indexNodeSize;
   uint32_t rootOffset;
-  bool rootNodeLoaded;
+  unsigned nodeAddressShift; // Node addresses are file offsets shifted by this
+  QAtomicInt rootNodeLoaded;
+  Mutex rootNodeMutex;
   vector< char > rootNode; // We load root note here and keep it at all times,
                            // since all searches always start with it.
+
+  // The whole index file mapped to memory, or 0 if it couldn't be mapped.
+  // The nodes are uncompressed directly from there, without any locking.
+  unsigned char const * idxFileMap;
+  size_t idxFileMapSize;
+
+  // Identifies the index file contents in the node cache
+  unsigned idxFileId;
+
+  // The Bloom filter of the keys, which is stored right before the root
+  // node. The bits are either in the mapping or in filterData. The filter is
+  // loaded by the deferred init, while the lookups on the other threads may
+  // already be consulting it, so it is only used once filterLoaded is set.
+  // Until then, or if there is no filter, any key may be in the index.
+  QAtomicInt filterLoaded;
+  unsigned char const * filterBits;
+  uint32_t filterBitCount, filterHashCount;
+  vector< unsigned char > filterData;
+
+  /// Loads the filter. If it can't be loaded, the index is used without it.
+  void loadFilter();
+
+  /// Checks the utf8-encoded folded key against the filter.
+  bool mayContainKey( string const & key );
+
+  // The table of the exact words, which is stored right before the filter
+  // in the indices flagged with BtreeExactWords. It is either in the mapping
+  // or in exactWordsData. If there are no slots, there is no table.
+  unsigned char const * exactSlots;
+  uint32_t exactSlotCount;
+  unsigned char const * exactEntries;
+  uint32_t exactEntriesSize;
+  vector< unsigned char > exactWordsData;
+
+  /// Loads the table of the exact words. If it can't be loaded, the index is
+  /// used without it.
+  void loadExactWords();
+
+  /// Looks the utf8-encoded word up in the table of the exact words.
+  bool findExactWord( string const & word, uint32_t & articleOffset ) const;
+
+  /// Reads the node bypassing the node cache. The nextLeaf always receives
+  /// the link to the next leaf, or zero if the node isn't a leaf.
+  void readNodeUncached( uint32_t offset, vector< char > & out, uint32_t & nextLeaf );
+
+  // The n-gram index of the keys, which is stored right before the table of
+  // the exact words, or the filter, in the indices flagged with BtreeNgrams.
+  // Null if there's none, in which case the wildcard searches which begin
+  // with a wildcard go through all the keys.
+  sptr< NgramIndex > ngramIndex;
+
+  /// Loads the n-gram index. If it can't be loaded, the index is used
+  /// without it.
+  void loadNgramIndex( bool hasExactWords );
+
+  /// Reads a 32-bit value at the given offset, either from the mapping or
+  /// from the file. The file mutex must be held.
+  uint32_t readIndexUint32( quint64 offset );
+
+  /// Recursive parts of findWildcardChains(). The keys of the node lie
+  /// between low and high, either of which may be 0 if there's no bound.
+  /// The state is the one the automaton reached after the first prefixSize
+  /// bytes, which all the keys of the node share. Return false once the
+  /// visitor asks to stop.
+  bool findWildcardChainsInNode( char const * node, size_t nodeSize,
+                                 char const * low, char const * high,
+                                 WildcardAutomaton &, int state, size_t prefixSize,
+                                 ChainVisitor & );
+  bool findWildcardChainsInLeaf( char const * leaf, size_t leafSize,
+                                 WildcardAutomaton &, int state, size_t prefixSize,
+                                 ChainVisitor & );
+
+  /// Recursive parts of findFuzzyChains(), which work the same way as the
+  /// ones of findWildcardChains(). The row is the automaton's state after
+  /// the first prefixSize bytes.
+  bool findFuzzyChainsInNode( char const * node, size_t nodeSize,
+                              char const * low, char const * high,
+                              LevenshteinAutomaton const &, vector< unsigned > const & row,
+                              size_t prefixSize, ChainVisitor & );
+  bool findFuzzyChainsInLeaf( char const * leaf, size_t leafSize,
+                              LevenshteinAutomaton const &, vector< unsigned > const & row,
+                              size_t prefixSize, ChainVisitor & );
 };
 
 /// A base for the dictionary that utilizes a btree index build using
@@ -174,6 +437,22 @@ public:
                                                               unsigned long maxResults )
     THROW_SPEC( std::exception );
 
+  virtual sptr< Dictionary::WordSearchRequest > fuzzyMatch( wstring const &,
+                                                            unsigned maxDistance,
+                                                            unsigned long maxResults )
+    THROW_SPEC( std::exception );
+
+  /// Consults the filter of the index.
+  virtual bool mayContainWord( wstring const & word )
+  { return BtreeIndex::mayContainWord( word ); }
+
+  /// Returns true if all the words prefixMatch() and stemmedMatch() may find
+  /// are in the btree index, so that it can be merged with the indices of the
+  /// other dictionaries and searched instead of them. The default
+  /// implementation returns true.
+  virtual bool hasAllHeadwordsIndexed()
+  { return true; }
+
   virtual bool isLocalDictionary()
   { return true; }
 
@@ -204,15 +483,32 @@ public:
   /// successful, or a human-readable error string otherwise.
   virtual string const & ensureInitDone();
 
+  /// Adds all the headwords of the dictionary to the given words, the way
+  /// copyChainsTo() does. The default implementation completes the init
+  /// first, and throws if it has failed. The dictionaries with deferred init
+  /// override it to read their index by themselves until the init is done,
+  /// so that merging them doesn't get them all initialized.
+  virtual void copyHeadwordsTo( IndexedWords &, uint32_t articleOffset,
+                                QAtomicInt * isCancelled = 0 );
+
 protected:
+
+  /// Does what copyHeadwordsTo() does, out of the index with the given
+  /// info in the given file, which is opened just for that.
+  static void copyHeadwordsFromFile( string const & indexFile, IndexInfo const &,
+                                     IndexedWords &, uint32_t articleOffset,
+                                     QAtomicInt * isCancelled );
+
   Mutex ftsIdxMutex;
   string ftsIdxName;
 
   friend class BtreeWordSearchRequest;
+  friend class BtreeFuzzySearchRequest;
   friend class FTSResultsRequest;
 };
 
-class BtreeWordSearchRequest: public Dictionary::WordSearchRequest
+class BtreeWordSearchRequest: public Dictionary::WordSearchRequest,
+                              protected ChainVisitor
 {
   friend class BtreeWordSearchRunnable;
 protected:
@@ -225,6 +521,28 @@ protected:
   QAtomicInt isCancelled;
   QSemaphore hasExited;
 
+  // The pattern of a wildcard search, which the headwords of the chains
+  // found are matched against in visitChain()
+#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
+  QRegularExpression regexp;
+#else
+  QRegExp regexp;
+#endif
+  int minMatchLength;
+  string headword;
+
+  virtual bool visitChain( char const * chain );
+
+  /// Allows the derivatives to only take some of the links found, by their
+  /// article offsets. The default implementation accepts all of them.
+  virtual bool acceptsArticle( uint32_t )
+  { return true; }
+
+  /// Adds the headword found to the matches, with dataMutex locked. The
+  /// default implementation just calls addMatch().
+  virtual void addFoundWord( wstring const & word )
+  { addMatch( word ); }
+
 public:
 
   BtreeWordSearchRequest( BtreeDictionary & dict_,
@@ -247,6 +565,27 @@ public:
   ~BtreeWordSearchRequest();
 };
 
+/// Finds the headwords within the given Levenshtein distance of the word,
+/// closest ones first. Each match has the negated distance as its weight.
+class BtreeFuzzySearchRequest: public BtreeWordSearchRequest
+{
+  unsigned maxDistance;
+  unsigned currentDistance; // The distance of the chains being visited
+
+protected:
+
+  virtual bool visitChain( char const * chain );
+
+public:
+
+  BtreeFuzzySearchRequest( BtreeDictionary & dict_,
+                           wstring const & str_,
+                           unsigned maxDistance_,
+                           unsigned long maxResults_ );
+
+  virtual void findMatches();
+};
+
 // Everything below is for building the index data.
 
 /// This represents the index in its source form, as a map which binds folded
@@ -255,6 +594,8 @@ public:
 /// sorting, but conserves space.
 struct IndexedWords: public map< string, vector< WordArticleLink > >
 {
+  IndexedWords();
+
   /// Instead of adding to the map directly, use this function. It does folding
   /// itself, and for phrases/sentences it adds additional entries beginning with
   /// each new word.
@@ -263,12 +604,62 @@ struct IndexedWords: public map< string, vector< WordArticleLink > >
   /// Differs from addWord() in that it only adds a single entry. We use this
   /// for zip's file names.
   void addSingleWord( wstring const & word, uint32_t articleOffset );
+
+  /// Adds the link under the given key, which must already be folded and
+  /// utf8-encoded. This is for copying the links between the indices.
+  void addLink( string const & key, WordArticleLink const & );
+
+  /// Allows the words to be moved out to temporary files whenever they take
+  /// more memory than the limit set with setIndexingMemoryLimit(). Each file
+  /// is a sorted run, and buildIndex() merges all of them back together.
+  /// Once spilling is enabled, the map itself may only hold a part of the
+  /// words, so it must only be filled with addWord() and addSingleWord()
+  /// and then passed to buildIndex(), never looked into directly.
+  void enableSpilling();
+
+  /// Removes all the words, including the ones moved out to the files.
+  void clear();
+
+  /// The files with the words moved out of memory, oldest first.
+  vector< sptr< QTemporaryFile > > const & getSpilledRuns() const
+  { return spilledRuns; }
+
+private:
+
+  size_t memoryLimit; // Zero unless spilling is enabled
+  size_t memoryUsed; // An estimate of the memory taken by the map
+  vector< sptr< QTemporaryFile > > spilledRuns;
+
+  /// Moves the words out to a new run if they take too much memory.
+  void spillIfNeeded();
+
+  /// Accounts for the memory taken by a new link and, if isNewKey is true,
+  /// by the new map entry for the given key.
+  void accountFor( string const & key, bool isNewKey, WordArticleLink const & );
 };
 
+/// Sets the limit of the memory taken by the words of the IndexedWords
+/// which have spilling enabled, and by the tables of the exact words being
+/// built, see buildIndex(), in bytes. Zero, which is the default, means
+/// no limit. The temporary files are created in tempDir, or in the system's
+/// temporary directory if it is empty.
+void setIndexingMemoryLimit( size_t bytes, QString const & tempDir );
+
 /// Builds the index, as a compressed btree. Returns IndexInfo.
 /// All the data is stored to the given file, beginning from its current
-/// position.
-IndexInfo buildIndex( IndexedWords const &, File::Class & file );
+/// position. Any spilled runs of the words are merged in on the fly.
+/// The btreeMaxElements is the maximum number of elements in each node. Zero
+/// means it is chosen from the number of words, so that most dictionaries
+/// get a two-level tree.
+/// If exactWords is true, a hash table of all the words just as they were
+/// added, not folded, is stored along with the index, so that
+/// BtreeIndex::findFile() can look them up directly. This is meant for the
+/// indices of the file names in resource containers. The table is left out
+/// if building it would exceed the limit set with setIndexingMemoryLimit().
+/// Otherwise, the n-gram index of the keys is stored, which lets the wildcard
+/// searches beginning with a wildcard only look through some of the leaves.
+IndexInfo buildIndex( IndexedWords const &, File::Class & file,
+                      size_t btreeMaxElements = 0, bool exactWords = false );
 
 }
 
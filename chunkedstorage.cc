@@ -2,19 +2,209 @@
  * Part of GoldenDict. Licensed under GPLv3 or later, see the LICENSE file */
 
 #include "chunkedstorage.hh"
+#include "gddebug.hh"
+#include "sptr.hh"
+#include <QThread>
+#include <QSemaphore>
 #include <zlib.h>
 #include <string.h>
+#include <algorithm>
+
+#ifdef __BTREE_USE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
 
 namespace ChunkedStorage {
 
 enum
 {
-  ChunkMaxSize = 65536 // Can't be more since it would overflow the address
+  ChunkMaxSize = 65536, // Can't be more since it would overflow the address
+
+  // The default size of the decompressed chunks cache
+  ChunkCacheMaxSize = 16 * 1024 * 1024,
+
+  // The chunk tables of the storages using a codec other than zlib have
+  // this bit set in their chunk count, and it is followed by the codec id
+  // and the offset and size of the zstd dictionary, if any. The tables of
+  // zlib storages are left as they always were.
+  ChunkTableExtended = 0x80000000,
+
+  // Set along with ChunkTableExtended when the chunks reach past 4 GB, in
+  // which case the dictionary offset and the chunk offsets are 64-bit.
+  ChunkTableWide = 0x40000000,
+
+  // Written in place of the chunk count when the table itself lies past 4 GB.
+  // It's followed by the 64-bit offset of the table, and is written at the
+  // scratchpad, so the offset returned by finish() still fits in 32 bits.
+  ChunkTableRedirect = 0xffffFFFF,
+
+  // Set along with ChunkTableExtended when the storage has the blocks past
+  // the narrow chunks addressed through a block table. The counts of the
+  // chunks and of the blocks in that table follow the dictionary size.
+  ChunkTableBlocks = 0x20000000,
+
+  ChunkTableFlags = ChunkTableExtended | ChunkTableWide | ChunkTableBlocks,
+
+  // The blocks in the chunks up to this one get addressed directly, with the
+  // chunk number in the upper 16 bits of the address and the offset within
+  // the chunk in the lower ones. The blocks in the chunks past it get the
+  // BlockTableAddress bit set and their index in the block table instead.
+  NarrowChunkMax = 0x7fFF,
+  BlockTableAddress = 0x80000000,
+
+  // The zstd dictionary is trained on this much of the data written first,
+  // and is at most this large. Less data than the minimum isn't worth it.
+  ZstdTrainingSize = 4 * 1024 * 1024,
+  ZstdMinTrainingSize = 128 * 1024,
+  ZstdDictMaxSize = 64 * 1024,
+
+  ZstdLevel = 9
+};
+
+namespace {
+
+/// The pool the chunks of all the writers are compressed on, so that the
+/// writers working at the same time don't each start a thread per core.
+/// Created on first use, and never destroyed, as it may be used until exit.
+Mutex compressionPoolMutex;
+QThreadPool * compressionPool = 0;
+
+QThreadPool & getCompressionPool()
+{
+  Mutex::Lock _( compressionPoolMutex );
+
+  if ( !compressionPool )
+  {
+    compressionPool = new QThreadPool;
+    compressionPool->setMaxThreadCount( QThread::idealThreadCount() );
+  }
+
+  return *compressionPool;
+}
+
+/// The decompressed chunks of all the readers. The keys are the file ids in
+/// the upper 32 bits, and chunk numbers in the lower ones.
+LruCache< quint64 > chunkCache( ChunkCacheMaxSize );
+
+}
+
+ChunkCacheStats getChunkCacheStats()
+{
+  return chunkCache.getStats();
+}
+
+void setChunkCacheMaxSize( size_t value )
+{
+  chunkCache.setMaxBytes( value );
+}
+
+/// Compresses a single chunk. Runs in the shared compression pool.
+class ChunkCompressor: public QRunnable
+{
+public:
+
+  Writer & writer;
+  vector< unsigned char > data, compressedData;
+  size_t uncompressedSize, compressedSize;
+  bool failed;
+  QSemaphore done;
+
+  ChunkCompressor( Writer & writer_ ): writer( writer_ ), uncompressedSize( 0 ),
+    compressedSize( 0 ), failed( false )
+  { setAutoDelete( false ); }
+
+  virtual void run();
+
+private:
+
+  bool compressZlib();
+  bool compressZstd();
 };
 
-Writer::Writer( File::Class & f ):
-  file( f ), chunkStarted( false ), bufferUsed( 0 )
+void ChunkCompressor::run()
 {
+  uncompressedSize = data.size();
+
+  failed = !( writer.codec == CodecZstd ? compressZstd() : compressZlib() );
+
+  // Release the memory early, the chunk may wait to be written for a while
+  vector< unsigned char >().swap( data );
+
+  done.release();
+}
+
+bool ChunkCompressor::compressZlib()
+{
+  compressedData.resize( compressBound( data.size() ) );
+
+  unsigned long size = compressedData.size();
+
+  if ( compress( &compressedData.front(), &size,
+                 data.empty() ? 0 : &data.front(), data.size() ) != Z_OK )
+    return false;
+
+  compressedSize = size;
+
+  return true;
+}
+
+bool ChunkCompressor::compressZstd()
+{
+  #ifdef __BTREE_USE_ZSTD
+  ZSTD_CCtx * cctx = 0;
+
+  {
+    Mutex::Lock _( writer.zstdCctxsMutex );
+
+    if ( writer.zstdCctxs.size() )
+    {
+      cctx = writer.zstdCctxs.back();
+      writer.zstdCctxs.pop_back();
+    }
+  }
+
+  if ( !cctx && !( cctx = ZSTD_createCCtx() ) )
+    return false;
+
+  compressedData.resize( ZSTD_compressBound( data.size() ) );
+
+  void const * src = data.empty() ? 0 : &data.front();
+
+  if ( writer.zstdCdict )
+    compressedSize = ZSTD_compress_usingCDict( cctx, &compressedData.front(),
+                                               compressedData.size(), src, data.size(),
+                                               writer.zstdCdict );
+  else
+    compressedSize = ZSTD_compressCCtx( cctx, &compressedData.front(),
+                                        compressedData.size(), src, data.size(),
+                                        ZstdLevel );
+
+  {
+    Mutex::Lock _( writer.zstdCctxsMutex );
+
+    writer.zstdCctxs.push_back( cctx );
+  }
+
+  return !ZSTD_isError( compressedSize );
+  #else
+  return false;
+  #endif
+}
+
+Writer::Writer( File::Class & f, Codec codec_ ):
+  file( f ), chunkStarted( false ), bufferUsed( 0 ), codec( codec_ ),
+  training( false ), pendingSize( 0 ), dictOffset( 0 ), dictSize( 0 ),
+  zstdCdict( 0 ), pool( getCompressionPool() )
+{
+  #ifdef __BTREE_USE_ZSTD
+  if ( codec == CodecZstd )
+    training = true;
+  #else
+  // Fall back to the only codec we have
+  codec = CodecZlib;
+  #endif
+
   // Create a sratchpad at the beginning of file. We use it to write chunk
   // table if it would fit, in order to save some seek times.
 
@@ -28,6 +218,26 @@ Writer::Writer( File::Class & f ):
   file.write( zero, sizeof( zero ) );
 }
 
+Writer::~Writer()
+{
+  // Only has anything to wait for if we're unwinding due to an exception.
+  // The pool is shared, so each compressor is waited for by itself.
+  while( !compressing.empty() )
+  {
+    compressing.front()->done.acquire();
+
+    delete compressing.front();
+    compressing.pop_front();
+  }
+
+  #ifdef __BTREE_USE_ZSTD
+  for( size_t x = 0; x < zstdCctxs.size(); ++x )
+    ZSTD_freeCCtx( zstdCctxs[ x ] );
+
+  ZSTD_freeCDict( zstdCdict );
+  #endif
+}
+
 uint32_t Writer::startNewBlock()
 {
   if ( bufferUsed >= ChunkMaxSize )
@@ -38,10 +248,29 @@ uint32_t Writer::startNewBlock()
 
   chunkStarted = true;
 
+  if ( training )
+    blockStarts.push_back( bufferUsed );
+
   // The address is comprised of the offset within the chunk (in lower
   // 16 bits, always fits there since ChunkMaxSize-1 does) and the
-  // number of the chunk, which is therefore limited to be 65535 max.
-  return bufferUsed | ( (uint32_t)offsets.size() << 16 );
+  // number of the chunk, as long as it fits in the remaining 15 bits.
+  size_t chunkNumber = offsets.size() + compressing.size() + pendingChunks.size();
+
+  if ( chunkNumber <= NarrowChunkMax )
+    return bufferUsed | ( (uint32_t) chunkNumber << 16 );
+
+  // Past that, the address is the index of the block in the block table
+  if ( blockOffsets.size() >= BlockTableAddress || chunkNumber > 0xffffFFFF )
+    throw exTooManyChunks();
+
+  uint32_t blockIdx = blockOffsets.size();
+
+  if ( blockChunks.empty() || blockChunks.back().second != chunkNumber )
+    blockChunks.push_back( std::make_pair( blockIdx, (uint32_t) chunkNumber ) );
+
+  blockOffsets.push_back( (uint16_t) bufferUsed );
+
+  return BlockTableAddress | blockIdx;
 }
 
 void Writer::addToBlock( void const * data, size_t size )
@@ -61,101 +290,387 @@ void Writer::addToBlock( void const * data, size_t size )
 
 void Writer::saveCurrentChunk()
 {
-  size_t maxCompressedSize = compressBound( bufferUsed );
+  if ( training )
+  {
+    // Hold the chunk back, recording its blocks as the training samples
+    blockStarts.push_back( bufferUsed );
+
+    size_t prev = 0;
+
+    for( size_t x = 0; x < blockStarts.size(); prev = blockStarts[ x++ ] )
+      if ( blockStarts[ x ] > prev )
+        sampleSizes.push_back( blockStarts[ x ] - prev );
 
-  if ( bufferCompressed.size() < maxCompressedSize )
-    bufferCompressed.resize( maxCompressedSize );
+    blockStarts.clear();
 
-  unsigned long compressedSize = bufferCompressed.size();
+    pendingChunks.push_back( vector< unsigned char >( buffer.begin(),
+                                                      buffer.begin() + bufferUsed ) );
+    pendingSize += bufferUsed;
 
-  if ( compress( &bufferCompressed.front(), &compressedSize,
-                 &buffer.front(), bufferUsed ) != Z_OK )
-    throw exFailedToCompressChunk();
+    bufferUsed = 0;
 
-  offsets.push_back( file.tell() );
+    chunkStarted = false;
 
-  file.write( (uint32_t) bufferUsed );
-  file.write( (uint32_t) compressedSize );
-  file.write( &bufferCompressed.front(), compressedSize );
+    if ( pendingSize >= ZstdTrainingSize )
+      trainDictionary();
+
+    return;
+  }
+
+  vector< unsigned char > data( buffer.begin(), buffer.begin() + bufferUsed );
+
+  queueChunk( data );
 
   bufferUsed = 0;
 
   chunkStarted = false;
 }
 
+void Writer::trainDictionary()
+{
+  training = false;
+
+  #ifdef __BTREE_USE_ZSTD
+  if ( pendingSize >= ZstdMinTrainingSize )
+  {
+    vector< unsigned char > samples;
+
+    samples.reserve( pendingSize );
+
+    for( size_t x = 0; x < pendingChunks.size(); ++x )
+      samples.insert( samples.end(), pendingChunks[ x ].begin(), pendingChunks[ x ].end() );
+
+    vector< unsigned char > dict( ZstdDictMaxSize );
+
+    size_t result = ZDICT_trainFromBuffer( &dict.front(), dict.size(),
+                                           &samples.front(), &sampleSizes.front(),
+                                           sampleSizes.size() );
+
+    if ( ZDICT_isError( result ) )
+    {
+      // Too few or too uniform samples, so do without the dictionary
+      GD_DPRINTF( "Can't train the chunk dictionary: %s\n",
+                  ZDICT_getErrorName( result ) );
+    }
+    else
+    {
+      zstdCdict = ZSTD_createCDict( &dict.front(), result, ZstdLevel );
+
+      if ( !zstdCdict )
+        throw exFailedToCompressChunk();
+
+      dictOffset = file.tell();
+      dictSize = result;
+
+      GD_DPRINTF( "Trained a %u byte chunk dictionary on %u samples\n",
+                  (unsigned) result, (unsigned) sampleSizes.size() );
+
+      file.write( &dict.front(), result );
+    }
+  }
+  #endif
+
+  sampleSizes.clear();
+  blockStarts.clear();
+
+  for( size_t x = 0; x < pendingChunks.size(); ++x )
+    queueChunk( pendingChunks[ x ] );
+
+  pendingChunks.clear();
+  pendingSize = 0;
+}
+
+void Writer::queueChunk( vector< unsigned char > & data )
+{
+  ChunkCompressor * compressor = new ChunkCompressor( *this );
+
+  compressor->data.swap( data );
+
+  compressing.push_back( compressor );
+
+  pool.start( compressor );
+
+  writeCompressed( false );
+}
+
+void Writer::writeCompressed( bool all )
+{
+  // Don't let the filling get too far ahead of the writing
+  size_t maxCompressing = pool.maxThreadCount() * 4;
+
+  while( !compressing.empty() )
+  {
+    ChunkCompressor * compressor = compressing.front();
+
+    if ( all || compressing.size() > maxCompressing )
+      compressor->done.acquire();
+    else
+    if ( !compressor->done.tryAcquire() )
+      break;
+
+    // It's done, so it's ours to delete, even should anything throw
+    sptr< ChunkCompressor > holder( compressor );
+
+    compressing.pop_front();
+
+    if ( compressor->failed )
+      throw exFailedToCompressChunk();
+
+    offsets.push_back( file.tell() );
+
+    file.write( (uint32_t) compressor->uncompressedSize );
+    file.write( (uint32_t) compressor->compressedSize );
+    file.write( &compressor->compressedData.front(), compressor->compressedSize );
+  }
+}
+
 uint32_t Writer::finish()
 {
   if ( bufferUsed || chunkStarted )
     saveCurrentChunk();
 
+  if ( training )
+    trainDictionary();
+
+  writeCompressed( true );
+
+  bool wide = ( !offsets.empty() && offsets.back() > 0xffffFFFF ) ||
+              dictOffset > 0xffffFFFF;
+  bool blocks = !blockOffsets.empty();
+  bool extended = wide || blocks || codec != CodecZlib;
+
+  size_t offsetSize = wide ? sizeof( quint64 ) : sizeof( uint32_t );
+
+  size_t tableSize = offsets.size() * offsetSize +
+                     ( extended ? 3 * sizeof( uint32_t ) + offsetSize : sizeof( uint32_t ) );
+
+  if ( blocks )
+    tableSize += 2 * sizeof( uint32_t ) + blockChunks.size() * 2 * sizeof( uint32_t ) +
+                 blockOffsets.size() * sizeof( uint16_t );
+
   bool useScratchPad = false;
-  uint32_t savedOffset = 0;
+  quint64 savedOffset = 0;
 
-  if ( scratchPadSize >= offsets.size() * sizeof( uint32_t ) + sizeof( uint32_t ) )
+  if ( scratchPadSize >= tableSize )
   {
     useScratchPad = true;
     savedOffset = file.tell();
     file.seek( scratchPadOffset );
   }
 
-  uint32_t offset = file.tell();
+  quint64 offset = file.tell();
+
+  if ( extended )
+  {
+    file.write( (uint32_t) offsets.size() | ChunkTableExtended |
+                ( wide ? (uint32_t) ChunkTableWide : 0 ) |
+                ( blocks ? (uint32_t) ChunkTableBlocks : 0 ) );
+    file.write( (uint32_t) codec );
+
+    if ( wide )
+      file.write( dictOffset );
+    else
+      file.write( (uint32_t) dictOffset );
+
+    file.write( dictSize );
+
+    if ( blocks )
+    {
+      file.write( (uint32_t) blockChunks.size() );
+      file.write( (uint32_t) blockOffsets.size() );
+    }
+  }
+  else
+    file.write( (uint32_t) offsets.size() );
+
+  for( size_t x = 0; x < offsets.size(); ++x )
+  {
+    if ( wide )
+      file.write( offsets[ x ] );
+    else
+      file.write( (uint32_t) offsets[ x ] );
+  }
 
-  file.write( (uint32_t) offsets.size() );
+  for( size_t x = 0; x < blockChunks.size(); ++x )
+  {
+    file.write( blockChunks[ x ].first );
+    file.write( blockChunks[ x ].second );
+  }
 
-  if ( offsets.size() )
-    file.write( &offsets.front(), offsets.size() * sizeof( uint32_t ) );
+  if ( blocks )
+    file.write( &blockOffsets.front(), blockOffsets.size() * sizeof( uint16_t ) );
 
   if ( useScratchPad )
     file.seek( savedOffset );
+  else
+  if ( offset > 0xffffFFFF )
+  {
+    // Leave a pointer to the table in the scratchpad instead
+    if ( scratchPadOffset > 0xffffFFFF )
+      throw exTooManyChunks();
+
+    savedOffset = file.tell();
+
+    file.seek( scratchPadOffset );
+    file.write( (uint32_t) ChunkTableRedirect );
+    file.write( offset );
+    file.seek( savedOffset );
+
+    offset = scratchPadOffset;
+  }
 
   offsets.clear();
+  blockChunks.clear();
+  blockOffsets.clear();
   chunkStarted = false;
 
-  return offset;
+  return (uint32_t) offset;
 }
 
-Reader::Reader( File::Class & f, uint32_t offset ): file( f )
+Reader::Reader( File::Class & f, uint32_t offset ): file( f ),
+  fileId( getCachedFileId( f.file() ) ), blockOffsetsOffset( 0 ),
+  blockCount( 0 ), codec( CodecZlib ), zstdDdict( 0 ), zstdDctx( 0 )
 {
   file.seek( offset );
 
   uint32_t size =  file.read< uint32_t >();
-  if ( size == 0 )
-    return;
-  offsets.resize( size );
-  file.read( &offsets.front(), offsets.size() * sizeof( uint32_t ) );
+
+  if ( size == ChunkTableRedirect )
+  {
+    file.seek( file.read< quint64 >() );
+
+    size = file.read< uint32_t >();
+  }
+
+  quint64 dictOffset = 0;
+  uint32_t dictSize = 0;
+  bool wide = false;
+  uint32_t blockChunkCount = 0;
+
+  if ( size & ChunkTableExtended )
+  {
+    wide = size & ChunkTableWide;
+    bool blocks = size & ChunkTableBlocks;
+
+    size &= ~(uint32_t) ChunkTableFlags;
+
+    codec = (Codec) file.read< uint32_t >();
+    dictOffset = wide ? file.read< quint64 >() : file.read< uint32_t >();
+    dictSize = file.read< uint32_t >();
+
+    if ( blocks )
+    {
+      blockChunkCount = file.read< uint32_t >();
+      blockCount = file.read< uint32_t >();
+    }
+  }
+
+  if ( size )
+  {
+    offsets.resize( size );
+
+    if ( wide )
+      file.read( &offsets.front(), offsets.size() * sizeof( quint64 ) );
+    else
+    {
+      vector< uint32_t > narrowOffsets( size );
+
+      file.read( &narrowOffsets.front(), narrowOffsets.size() * sizeof( uint32_t ) );
+
+      offsets.assign( narrowOffsets.begin(), narrowOffsets.end() );
+    }
+  }
+
+  if ( blockChunkCount )
+  {
+    // The chunks of the block table are kept, the offsets of the blocks
+    // within them are only read when needed
+    blockChunks.resize( blockChunkCount );
+
+    for( size_t x = 0; x < blockChunks.size(); ++x )
+    {
+      blockChunks[ x ].first = file.read< uint32_t >();
+      blockChunks[ x ].second = file.read< uint32_t >();
+    }
+
+    blockOffsetsOffset = file.tell();
+  }
+
+  #ifdef __BTREE_USE_ZSTD
+  if ( codec == CodecZstd )
+  {
+    zstdDctx = ZSTD_createDCtx();
+
+    if ( dictSize )
+    {
+      vector< char > dict( dictSize );
+
+      file.seek( dictOffset );
+      file.read( &dict.front(), dict.size() );
+
+      zstdDdict = ZSTD_createDDict( &dict.front(), dict.size() );
+    }
+
+    if ( !zstdDctx || ( dictSize && !zstdDdict ) )
+      throw exFailedToDecompressChunk();
+  }
+  #else
+  (void) dictOffset;
+  (void) dictSize;
+  #endif
+}
+
+Reader::~Reader()
+{
+  #ifdef __BTREE_USE_ZSTD
+  ZSTD_freeDDict( zstdDdict );
+  ZSTD_freeDCtx( zstdDctx );
+  #endif
 }
 
 char * Reader::getBlock( uint32_t address, vector< char > & chunk )
 {
   size_t chunkIdx = address >> 16;
+  size_t offsetInChunk = address & 0xffFF;
 
-  if ( chunkIdx >= offsets.size() )
-    throw exAddressOutOfRange();
-
-  // Read and decompress the chunk
+  if ( ( address & BlockTableAddress ) && blockCount )
   {
-    file.seek( offsets[ chunkIdx ] );
+    uint32_t blockIdx = address & ~(uint32_t) BlockTableAddress;
 
-    uint32_t uncompressedSize = file.read< uint32_t >();
-    uint32_t compressedSize = file.read< uint32_t >();
+    if ( blockIdx >= blockCount )
+      throw exAddressOutOfRange();
 
-    chunk.resize( uncompressedSize );
+    // Find the last chunk whose first block isn't past this one
+    vector< std::pair< uint32_t, uint32_t > >::const_iterator i =
+      std::upper_bound( blockChunks.begin(), blockChunks.end(),
+                        std::make_pair( blockIdx, 0xffffFFFFu ) );
 
-    vector< unsigned char > compressedData( compressedSize );
+    if ( i == blockChunks.begin() )
+      throw exAddressOutOfRange();
 
-    file.read( &compressedData.front(), compressedData.size() );
+    chunkIdx = ( --i )->second;
 
-    unsigned long decompressedLength = chunk.size();
+    file.seek( blockOffsetsOffset + blockIdx * (quint64) sizeof( uint16_t ) );
 
-    if ( uncompress( (unsigned char *)&chunk.front(),
-                     &decompressedLength,
-                     &compressedData.front(),
-                     compressedData.size() ) != Z_OK ||
-         decompressedLength != chunk.size() )
-      throw exFailedToDecompressChunk();
+    offsetInChunk = file.read< uint16_t >();
   }
 
-  size_t offsetInChunk = address & 0xffFF;
+  if ( chunkIdx >= offsets.size() )
+    throw exAddressOutOfRange();
+
+  quint64 key = ( (quint64) fileId << 32 ) | chunkIdx;
+
+  QByteArray cached;
+
+  if ( chunkCache.find( key, cached ) )
+    chunk.assign( cached.constData(), cached.constData() + cached.size() );
+  else
+  {
+    readChunk( chunkIdx, chunk );
+
+    if ( chunk.size() )
+      chunkCache.insert( key, QByteArray( &chunk.front(), chunk.size() ) );
+  }
 
   if ( offsetInChunk > chunk.size() ) // It can be equal to for 0-sized blocks
     throw exAddressOutOfRange();
@@ -163,4 +678,61 @@ char * Reader::getBlock( uint32_t address, vector< char > & chunk )
   return &chunk.front() + offsetInChunk;
 }
 
+void Reader::readChunk( size_t chunkIdx, vector< char > & chunk )
+{
+  file.seek( offsets[ chunkIdx ] );
+
+  uint32_t uncompressedSize = file.read< uint32_t >();
+  uint32_t compressedSize = file.read< uint32_t >();
+
+  chunk.resize( uncompressedSize );
+
+  vector< unsigned char > compressedData( compressedSize );
+
+  file.read( &compressedData.front(), compressedData.size() );
+
+  switch( codec )
+  {
+    case CodecZlib:
+    {
+      unsigned long decompressedLength = chunk.size();
+
+      if ( uncompress( (unsigned char *)&chunk.front(),
+                       &decompressedLength,
+                       &compressedData.front(),
+                       compressedData.size() ) != Z_OK ||
+           decompressedLength != chunk.size() )
+        throw exFailedToDecompressChunk();
+
+      return;
+    }
+
+    #ifdef __BTREE_USE_ZSTD
+    case CodecZstd:
+    {
+      Mutex::Lock _( zstdDctxMutex );
+
+      size_t result;
+
+      if ( zstdDdict )
+        result = ZSTD_decompress_usingDDict( zstdDctx, &chunk.front(), chunk.size(),
+                                             &compressedData.front(), compressedData.size(),
+                                             zstdDdict );
+      else
+        result = ZSTD_decompressDCtx( zstdDctx, &chunk.front(), chunk.size(),
+                                      &compressedData.front(), compressedData.size() );
+
+      if ( ZSTD_isError( result ) || result != chunk.size() )
+        throw exFailedToDecompressChunk();
+
+      return;
+    }
+    #endif
+
+    default:
+      // Either garbage or a codec we were built without
+      throw exFailedToDecompressChunk();
+  }
+}
+
 }
@@ -6,14 +6,25 @@
 
 #include "ex.hh"
 #include "file.hh"
+#include "lrucache.hh"
+#include "mutex.hh"
 
 #include <vector>
+#include <deque>
+#include <utility>
+#include <QThreadPool>
 #if defined( _MSC_VER ) && _MSC_VER < 1800 // VS2012 and older
 #include <stdint_msvc.h>
 #else
 #include <stdint.h>
 #endif
 
+// The zstd contexts, which we only hold pointers to
+struct ZSTD_CCtx_s;
+struct ZSTD_CDict_s;
+struct ZSTD_DCtx_s;
+struct ZSTD_DDict_s;
+
 /// A chunked compression storage. We use this for articles' bodies. The idea
 /// is to store data in a separately-compressed chunks, much like in dictzip,
 /// but without any fancy gzip-compatibility or whatever. Another difference
@@ -29,17 +40,53 @@ DEF_EX( Ex, "Chunked storage exception", std::exception )
 DEF_EX( exFailedToCompressChunk, "Failed to compress a chunk", Ex )
 DEF_EX( exAddressOutOfRange, "The given chunked address is out of range", Ex )
 DEF_EX( exFailedToDecompressChunk, "Failed to decompress a chunk", Ex )
+DEF_EX( exTooManyChunks, "Too much data for a chunked storage", Ex )
+
+/// Statistics of the cache of decompressed chunks, which is shared by all
+/// the readers.
+typedef LruCache< quint64 >::Stats ChunkCacheStats;
+
+ChunkCacheStats getChunkCacheStats();
 
-/// This class writes data blocks in chunks.
+/// Sets the maximum total size of the chunks held in the chunk cache, in
+/// bytes. Zero disables the cache.
+void setChunkCacheMaxSize( size_t );
+
+/// The codecs the chunks can be compressed with. The one used is recorded
+/// along with the chunk table, so the reader doesn't need to be told.
+enum Codec
+{
+  CodecZlib = 0,
+  /// zstd, with a dictionary trained on the first chunks written. It is
+  /// only available when built with CONFIG+=btree_zstd.
+  CodecZstd = 1,
+
+#ifdef __BTREE_USE_ZSTD
+  DefaultCodec = CodecZstd
+#else
+  DefaultCodec = CodecZlib
+#endif
+};
+
+class ChunkCompressor;
+
+/// This class writes data blocks in chunks. The chunks are compressed on a
+/// pool of worker threads shared by all the writers, but are always written
+/// out in the order they were filled, so the addresses handed out stay valid.
 class Writer
 {
-  vector< uint32_t > offsets;
+  friend class ChunkCompressor;
+
+  vector< quint64 > offsets;
   File::Class & file;
-  size_t scratchPadOffset, scratchPadSize;
+  quint64 scratchPadOffset;
+  size_t scratchPadSize;
 
 public:
 
-  Writer( File::Class & );
+  Writer( File::Class &, Codec = (Codec) DefaultCodec );
+
+  ~Writer();
 
   /// Starts new block. Returns its address.
   uint32_t startNewBlock();
@@ -61,32 +108,97 @@ private:
   // stored (>=ChunkMaxSize), or there's no more data left to store.
   vector< unsigned char > buffer;
 
-  // Here we compress the chunk before writing it out to file.
-  vector< unsigned char > bufferCompressed;
-
   // The amount of data stored in buffer so far. We keep it separate
   // from buffer.size() for performance reasons; the latter one only
   // grows, but never shrinks.
   size_t bufferUsed;
 
+  Codec codec;
+
+  // With zstd, the chunks are held back uncompressed until there's enough
+  // of them to train the dictionary on. The sizes of the blocks they have
+  // are the training samples.
+  bool training;
+  vector< vector< unsigned char > > pendingChunks;
+  size_t pendingSize;
+  vector< size_t > blockStarts, sampleSizes;
+
+  quint64 dictOffset;
+  uint32_t dictSize;
+  struct ZSTD_CDict_s * zstdCdict;
+
+  // The compression contexts not used by any worker at the moment
+  Mutex zstdCctxsMutex;
+  vector< struct ZSTD_CCtx_s * > zstdCctxs;
+
+  // The pool shared by all the writers
+  QThreadPool & pool;
+
+  // The chunks being compressed, in the order they are to be written
+  std::deque< ChunkCompressor * > compressing;
+
   void saveCurrentChunk();
+
+  /// Trains the zstd dictionary on the pending chunks, writes it out and
+  /// then queues the chunks themselves.
+  void trainDictionary();
+
+  /// Queues the chunk for compression, taking its data over.
+  void queueChunk( vector< unsigned char > & data );
+
+  /// Writes out the chunks at the front of the queue. If all is true, waits
+  /// for and writes out all of them, otherwise just the ones which are
+  /// already compressed, and also waits if too many of them are queued.
+  void writeCompressed( bool all );
+
+  // The block table, addressing the blocks past the chunks which can be
+  // addressed directly. For every chunk in it, the index of its first block
+  // and the chunk number, and for every block, its offset within the chunk.
+  vector< std::pair< uint32_t, uint32_t > > blockChunks;
+  vector< uint16_t > blockOffsets;
+
+  Writer( Writer const & );
+  Writer & operator = ( Writer const & );
 };
 
 /// This class reads data blocks previously written by Writer.
 class Reader
 {
-  vector< uint32_t > offsets;
+  vector< quint64 > offsets;
   File::Class & file;
+  unsigned fileId; // Identifies the file in the chunk cache
+
+  // The chunks of the block table, see Writer, and where the offsets of its
+  // blocks are
+  vector< std::pair< uint32_t, uint32_t > > blockChunks;
+  quint64 blockOffsetsOffset;
+  uint32_t blockCount;
 
 public:
   /// Creates reader by giving it a file to read from and the offset returned
   /// by Writer::finish().
   Reader( File::Class &, uint32_t );
 
+  ~Reader();
+
   /// Reads the block previously written by Writer, identified by its address.
   /// Uses the user-provided storage to load the entire chunk, and then to
-  /// return a pointer to the requested block inside it.
+  /// return a pointer to the requested block inside it. The chunks are kept
+  /// decompressed in a cache, so the neighbouring blocks come cheap.
   char * getBlock( uint32_t address, vector< char > & );
+
+private:
+
+  Codec codec;
+
+  struct ZSTD_DDict_s * zstdDdict;
+  struct ZSTD_DCtx_s * zstdDctx;
+  Mutex zstdDctxMutex;
+
+  void readChunk( size_t chunkIdx, vector< char > & );
+
+  Reader( Reader const & );
+  Reader & operator = ( Reader const & );
 };
 
 }
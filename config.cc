@@ -1077,6 +1077,12 @@ Class load() THROW_SPEC( exError )
     }
   }
 
+  if ( !root.namedItem( "indexingMemoryLimit" ).isNull() )
+    c.indexingMemoryLimit = root.namedItem( "indexingMemoryLimit" ).toElement().text().toUInt();
+
+  if ( !root.namedItem( "mergedHeadwordIndex" ).isNull() )
+    c.mergedHeadwordIndex = ( root.namedItem( "mergedHeadwordIndex" ).toElement().text() == "1" );
+
   if ( !root.namedItem( "maxHeadwordsToExpand" ).isNull() )
     c.maxHeadwordsToExpand = root.namedItem( "maxHeadwordsToExpand" ).toElement().text().toUInt();
 
@@ -2068,6 +2074,14 @@ void save( Class const & c ) THROW_SPEC( exError )
     opt.appendChild( dd.createTextNode( QString::number( c.maxHeadwordSize ) ) );
     root.appendChild( opt );
 
+    opt = dd.createElement( "indexingMemoryLimit" );
+    opt.appendChild( dd.createTextNode( QString::number( c.indexingMemoryLimit ) ) );
+    root.appendChild( opt );
+
+    opt = dd.createElement( "mergedHeadwordIndex" );
+    opt.appendChild( dd.createTextNode( c.mergedHeadwordIndex ? "1" : "0" ) );
+    root.appendChild( opt );
+
     opt = dd.createElement( "maxHeadwordsToExpand" );
     opt.appendChild( dd.createTextNode( QString::number( c.maxHeadwordsToExpand ) ) );
     root.appendChild( opt );
@@ -670,6 +670,16 @@ struct Class
 
   unsigned int maxHeadwordsToExpand;
 
+  /// Maximum memory, in megabytes, the headwords of a single dictionary may
+  /// take while it is being indexed. The excess goes to temporary files in
+  /// the index directory. Zero means no limit.
+  unsigned int indexingMemoryLimit;
+
+  /// Whether to merge the headwords of all the local dictionaries into a
+  /// single index in background, so that the word list is looked up in it
+  /// instead of in each dictionary.
+  bool mergedHeadwordIndex;
+
   HeadwordsDialog headwordsDialog;
 
 #ifdef Q_OS_WIN
@@ -683,7 +693,8 @@ struct Class
            pinPopupWindow( false ), showingDictBarNames( false ),
            usingSmallIconsInToolbars( false ),
            maxPictureWidth( 0 ), maxHeadwordSize ( 256U ),
-           maxHeadwordsToExpand( 0 )
+           maxHeadwordsToExpand( 0 ), indexingMemoryLimit( 0 ),
+           mergedHeadwordIndex( false )
   {}
   Group * getGroup( unsigned id );
   Group const * getGroup( unsigned id ) const;
@@ -6,6 +6,11 @@
 #include "lzma.h"
 #endif
 
+#ifdef MAKE_ZIM_ZSTD_SUPPORT
+#include <zstd.h>
+#include <vector>
+#endif
+
 #define CHUNK_SIZE 2048
 
 QByteArray zlibDecompress( const char * bufptr, unsigned length )
@@ -131,4 +136,56 @@ char buf[CHUNK_SIZE];
   return str;
 }
 
+#ifdef MAKE_ZIM_ZSTD_SUPPORT
+
+string decompressZstd( const char * bufptr, unsigned length )
+{
+  string str;
+
+  ZSTD_DCtx * dctx = ZSTD_createDCtx();
+  if( !dctx )
+    return str;
+
+  // Most frames record their size, which saves reallocating the result
+  unsigned long long contentSize = ZSTD_getFrameContentSize( bufptr, length );
+  if( contentSize != ZSTD_CONTENTSIZE_UNKNOWN && contentSize != ZSTD_CONTENTSIZE_ERROR &&
+      contentSize <= 0x10000000 )
+    str.reserve( contentSize );
+
+  std::vector< char > buf( ZSTD_DStreamOutSize() );
+
+  ZSTD_inBuffer in = { bufptr, length, 0 };
+
+  for( ;; )
+  {
+    ZSTD_outBuffer out = { &buf.front(), buf.size(), 0 };
+
+    size_t res = ZSTD_decompressStream( dctx, &out, &in );
+
+    if( ZSTD_isError( res ) )
+    {
+      str.clear();
+      break;
+    }
+
+    str.append( &buf.front(), out.pos );
+
+    if( res == 0 )
+      break; // The frame is complete
+
+    if( in.pos == in.size && out.pos < out.size )
+    {
+      // The frame is truncated
+      str.clear();
+      break;
+    }
+  }
+
+  ZSTD_freeDCtx( dctx );
+
+  return str;
+}
+
+#endif
+
 #endif
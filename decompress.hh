@@ -17,6 +17,13 @@ string decompressBzip2( const char * bufptr, unsigned length );
 string decompressLzma2( const char * bufptr, unsigned length,
                         bool raw_decoder = false );
 
+#ifdef MAKE_ZIM_ZSTD_SUPPORT
+
+/// Decompresses a single zstd frame. Anything following it is ignored.
+string decompressZstd( const char * bufptr, unsigned length );
+
+#endif
+
 #endif
 
 #endif // DECOMPRESS_HH
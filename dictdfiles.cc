@@ -6,6 +6,7 @@
 #include "folding.hh"
 #include "utf8.hh"
 #include "dictzip.h"
+#include "dictzipcache.hh"
 #include "htmlescape.hh"
 #include "fsencoding.hh"
 #include "langcoder.hh"
@@ -93,7 +94,7 @@ class DictdDictionary: public BtreeIndexing::BtreeDictionary
   IdxHeader idxHeader;
   dictData * dz;
   string dictionaryName;
-  Mutex indexFileMutex, dzMutex;
+  Mutex indexFileMutex;
 
 public:
 
@@ -327,11 +328,7 @@ sptr< Dictionary::DataRequest > DictdDictionary::getArticle( wstring const & wor
 
       string articleText;
 
-      char * articleBody;
-      {
-        Mutex::Lock _( dzMutex );
-        articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
-      }
+      char * articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
 
       if ( !articleBody )
       {
@@ -500,6 +497,9 @@ void DictdDictionary::makeFTSIndex( QAtomicInt & isCancelled, bool firstIteratio
 
   try
   {
+    // The articles are read in the order of their offsets
+    DictZip::Readahead readahead( dz );
+
     FtsHelpers::makeFTSIndex( this, isCancelled );
     FTS_index_completed.ref();
   }
@@ -553,11 +553,7 @@ void DictdDictionary::getArticleText( uint32_t articleAddress, QString & headwor
 
     string articleText;
 
-    char * articleBody;
-    {
-      Mutex::Lock _( dzMutex );
-      articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
-    }
+    char * articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
 
     if ( !articleBody )
     {
@@ -359,6 +359,16 @@ public:
                                                   unsigned maxSuffixVariation,
                                                   unsigned long maxResults ) THROW_SPEC( std::exception );
 
+  /// Looks up the words which are within the given Levenshtein distance of
+  /// the given one, that is, which can be turned into it by at most that many
+  /// insertions, deletions or substitutions of characters. The words are
+  /// compared after being folded. Each match has the negated distance as its
+  /// weight, and the closest matches are supposed to be found first.
+  /// The default implementation does nothing, returning an empty result.
+  virtual sptr< WordSearchRequest > fuzzyMatch( wstring const &,
+                                                unsigned maxDistance,
+                                                unsigned long maxResults ) THROW_SPEC( std::exception );
+
   /// Finds known headwords for the given word, that is, the words for which
   /// the given word is a synonym. If a dictionary can't perform this operation,
   /// it should leave the default implementation which always returns an empty
@@ -366,6 +376,13 @@ public:
   virtual sptr< WordSearchRequest > findHeadwordsForSynonym( wstring const & )
     THROW_SPEC( std::exception );
 
+  /// Returns false if the dictionary is known to have no articles for the
+  /// given word, so that looking it up can be skipped altogether. True only
+  /// means that it may have them. This is supposed to be very fast. The
+  /// default implementation always returns true.
+  virtual bool mayContainWord( wstring const & )
+  { return true; }
+
   /// For a given word, provides alternate writings of it which are to be looked
   /// up alongside with it. Transliteration dictionaries implement this. The
   /// default implementation returns an empty list. Note that this function is
@@ -33,6 +33,10 @@
 
 #include "ufile.hh"
 
+#ifndef __WIN32
+#include <unistd.h>
+#endif
+
 #define BUFFERSIZE 10240
 
 #define OUT_BUFFER_SIZE 0xffffL
@@ -91,6 +95,16 @@
 #define GZ_CHUNKCNT     20	/* Number of chunks (16bit)                */
 #define GZ_RNDDATA      22	/* Random access data (16bit)              */
 
+/* The error of the last read, kept for each thread apart, since the reads
+   of one file can go on in several threads at once */
+#ifdef _MSC_VER
+#define DICT_THREAD_LOCAL __declspec( thread )
+#else
+#define DICT_THREAD_LOCAL __thread
+#endif
+
+static DICT_THREAD_LOCAL char errorString[ 512 ];
+
 
 #define DBG_VERBOSE     (0<<30|1<< 0) /* Verbose                            */
 #define DBG_ZIP         (0<<30|1<< 1) /* Zip                                */
@@ -139,8 +153,6 @@
 
 #include <sys/stat.h>
 
-#define USE_CACHE 1
-
 #define dict_data_filter( ... )
 #define PRINTF( ... )
 
@@ -464,7 +476,6 @@ dictData *dict_data_open( const char *filename,
 {
    dictData    *h = NULL;
 //   struct stat sb;
-   int         j;
 
    if (!filename)
    {
@@ -483,7 +494,6 @@ dictData *dict_data_open( const char *filename,
 #ifdef __WIN32
    h->fd = INVALID_HANDLE_VALUE;
 #endif
-   h->initialized = 0;
 
    for(;;)
    {
@@ -529,12 +539,7 @@ dictData *dict_data_open( const char *filename,
      h->size = ftell( h->fd );
 #endif
 
-     for (j = 0; j < DICT_CACHE_SIZE; j++) {
-        h->cache[j].chunk    = -1;
-        h->cache[j].stamp    = -1;
-        h->cache[j].inBuffer = NULL;
-        h->cache[j].count    = 0;
-     }
+     h->fileId = dict_cache_file_id( filename );
 
      *error = DZ_NOERROR;
      return h;
@@ -545,8 +550,6 @@ dictData *dict_data_open( const char *filename,
 
 void dict_data_close( dictData *header )
 {
-   int i;
-
    if (!header)
       return;
 
@@ -561,20 +564,132 @@ void dict_data_close( dictData *header )
    if (header->chunks)       xfree( header->chunks );
    if (header->offsets)      xfree( header->offsets );
 
-   if (header->initialized) {
-      if (inflateEnd( &header->zStream ))
-	 err_internal( __func__,
-		       "Cannot shut down inflation engine: %s\n",
-		       header->zStream.msg );
+   memset( header, 0, sizeof( struct dictData ) );
+   xfree( header );
+}
+
+/* Reads size bytes at the given offset. No file position is used, so any
+   number of threads can read the same file at once. Returns 1 on success. */
+static int dict_pread( dictData *h, void *buf, unsigned long size,
+                       unsigned long offset )
+{
+#ifdef __WIN32
+   OVERLAPPED ov;
+   DWORD readed = 0;
+
+   memset( &ov, 0, sizeof( ov ) );
+   ov.Offset = offset;
+
+   return ReadFile( h->fd, buf, size, &readed, &ov ) && readed == size;
+#else
+   char *pt = buf;
+
+   while ( size ) {
+      ssize_t result = pread( fileno( h->fd ), pt, size, offset );
+
+      if ( result < 0 && errno == EINTR )
+         continue;
+
+      if ( result <= 0 )
+         return 0;
+
+      pt += result;
+      size -= result;
+      offset += result;
+   }
+
+   return 1;
+#endif
+}
+
+/* Reads and inflates the given chunk to inBuffer, which must have room for
+   a whole chunk, using outBuffer of OUT_BUFFER_SIZE for the compressed data.
+   The chunk is stored in the cache as well. Returns the size of the chunk,
+   or -1 on error. */
+static int dict_inflate_chunk( dictData *h, int i, char *inBuffer, char *outBuffer )
+{
+   z_stream zStream;
+   int      count;
+
+   if (h->chunks[i] >= OUT_BUFFER_SIZE ) {
+      sprintf( errorString, "h->chunks[%d] = %d >= %ld (OUT_BUFFER_SIZE)\n",
+               i, h->chunks[i], OUT_BUFFER_SIZE );
+      return -1;
    }
 
-   for (i = 0; i < DICT_CACHE_SIZE; ++i){
-      if (header -> cache [i].inBuffer)
-	 xfree (header -> cache [i].inBuffer);
+   if ( !dict_pread( h, outBuffer, h->chunks[ i ], h->offsets[ i ] ) )
+   {
+      strcpy( errorString, dz_error_str( DZ_ERR_READFILE ) );
+      return -1;
    }
 
-   memset( header, 0, sizeof( struct dictData ) );
-   xfree( header );
+   /* Each chunk is flushed fully, so it inflates on its own */
+   memset( &zStream, 0, sizeof( zStream ) );
+   if (inflateInit2( &zStream, -15 ) != Z_OK)
+   {
+      sprintf( errorString, "Cannot initialize inflation engine: %s", zStream.msg );
+      return -1;
+   }
+
+   zStream.next_in   = (Bytef *)outBuffer;
+   zStream.avail_in  = h->chunks[i];
+   zStream.next_out  = (Bytef *)inBuffer;
+   zStream.avail_out = h->chunkLength;
+   if (inflate( &zStream,  Z_PARTIAL_FLUSH ) != Z_OK)
+   {
+      sprintf( errorString, "inflate: %s\n", zStream.msg );
+      inflateEnd( &zStream );
+      return -1;
+   }
+   if (zStream.avail_in)
+   {
+      sprintf( errorString, "inflate did not flush (%d pending, %d avail)\n",
+               zStream.avail_in, zStream.avail_out );
+      inflateEnd( &zStream );
+      return -1;
+   }
+
+   count = h->chunkLength - zStream.avail_out;
+   inflateEnd( &zStream );
+
+   dict_cache_insert( h->fileId, i, inBuffer, count );
+
+   return count;
+}
+
+int dict_data_chunk_length( dictData *h )
+{
+   switch ( h->type ) {
+   case DICT_TEXT:
+      return 0;
+   case DICT_DZIP:
+      return h->chunkLength;
+   default:
+      return -1;
+   }
+}
+
+int dict_data_prefetch( dictData *h, int chunk )
+{
+   char *inBuffer, *outBuffer;
+   int  result = 1;
+
+   if ( h->type != DICT_DZIP || chunk < 0 || chunk >= h->chunkCount )
+      return 1;
+
+   inBuffer = xmalloc( h->chunkLength );
+   outBuffer = xmalloc( OUT_BUFFER_SIZE );
+
+   if ( !inBuffer || !outBuffer )
+      result = 0;
+   else
+   if ( dict_cache_find( h->fileId, chunk, inBuffer, h->chunkLength ) < 0 )
+      result = dict_inflate_chunk( h, chunk, inBuffer, outBuffer ) >= 0;
+
+   xfree( inBuffer );
+   xfree( outBuffer );
+
+   return result;
 }
 
 char *dict_data_read_ (
@@ -585,12 +700,11 @@ char *dict_data_read_ (
    char * pt;
    unsigned long end;
    int           count;
-   char          *inBuffer;
-   char          outBuffer[OUT_BUFFER_SIZE];
+   char          *inBuffer = NULL;
+   char          *outBuffer = NULL;
    int           firstChunk, lastChunk;
    int           firstOffset, lastOffset;
-   int           i, j;
-   int           found, target, lastStamp;
+   int           i;
    (void) preFilter;
    (void) postFilter;
 
@@ -599,7 +713,7 @@ char *dict_data_read_ (
    buffer = xmalloc( size + 1 );
    if( !buffer )
    {
-     strcpy( h->errorString, dz_error_str( DZ_ERR_NOMEMORY ) );
+     strcpy( errorString, dz_error_str( DZ_ERR_NOMEMORY ) );
      return 0;
    }
 
@@ -623,53 +737,20 @@ char *dict_data_read_ (
 		 " or dzip format (for space savings).\n" );
       break;
 */
-      strcpy( h->errorString, "Cannot seek on pure gzip format files" );
+      strcpy( errorString, "Cannot seek on pure gzip format files" );
       xfree( buffer );
       return 0;
    case DICT_TEXT:
-   {
-#ifdef __WIN32
-     long hiPtr = 0;
-     DWORD pos = SetFilePointer( h->fd, start, &hiPtr, FILE_BEGIN );
-     DWORD readed = 0;
-     if( pos != INVALID_SET_FILE_POINTER || GetLastError() != NO_ERROR )
-       ReadFile( h->fd, buffer, size, &readed, 0 );
-     if( size != readed )
-#else
-     if ( fseek( h->fd, start, SEEK_SET ) != 0 ||
-          fread( buffer, size, 1, h->fd ) != 1 )
-#endif
+     if ( !dict_pread( h, buffer, size, start ) )
      {
-       strcpy( h->errorString, dz_error_str( DZ_ERR_READFILE ) );
+       strcpy( errorString, dz_error_str( DZ_ERR_READFILE ) );
        xfree( buffer );
        return 0;
      }
 
      buffer[size] = '\0';
-   }
    break;
    case DICT_DZIP:
-      if (!h->initialized) {
-	 h->zStream.zalloc    = NULL;
-	 h->zStream.zfree     = NULL;
-	 h->zStream.opaque    = NULL;
-	 h->zStream.next_in   = 0;
-	 h->zStream.avail_in  = 0;
-	 h->zStream.next_out  = NULL;
-	 h->zStream.avail_out = 0;
-	 if (inflateInit2( &h->zStream, -15 ) != Z_OK)
-/*
-	    err_internal( __func__,
-			  "Cannot initialize inflation engine: %s\n",
-			  h->zStream.msg );
-*/
-	 {
-	   sprintf( h->errorString, "Cannot initialize inflation engine: %s", h->zStream.msg );
-	   xfree( buffer );
-	   return 0;
-	 }
-	 ++h->initialized;
-      }
       firstChunk  = start / h->chunkLength;
       firstOffset = start - firstChunk * h->chunkLength;
       lastChunk   = end / h->chunkLength;
@@ -679,129 +760,37 @@ char *dict_data_read_ (
 	      "firstChunk = %d, firstOffset = %d,"
 	      " lastChunk = %d, lastOffset = %d\n",
 	      start, end, firstChunk, firstOffset, lastChunk, lastOffset ));
-      for (pt = buffer, i = firstChunk; i <= lastChunk; i++) {
-
-				/* Access cache */
-	 found  = 0;
-	 target = 0;
-	 lastStamp = INT_MAX;
-	 for (j = 0; j < DICT_CACHE_SIZE; j++) {
-#if USE_CACHE
-	    if (h->cache[j].chunk == i) {
-	       found  = 1;
-	       target = j;
-	       break;
-	    }
-#endif
-	    if (h->cache[j].stamp < lastStamp) {
-	       lastStamp = h->cache[j].stamp;
-	       target = j;
-	    }
-	 }
-
-	 h->cache[target].stamp = ++h->stamp;
-	 if( h->stamp < 0 )
-	 {
-	    h->stamp = 0;
-	    for (j = 0; j < DICT_CACHE_SIZE; j++)
-	      h->cache[j].stamp = -1;
-	 }
-	 if (found) {
-	    count = h->cache[target].count;
-	    inBuffer = h->cache[target].inBuffer;
-	 } else {
-#ifdef __WIN32
-        DWORD pos ;
-        DWORD readed;
-#endif
-	    h->cache[target].chunk = -1;
-	    if (!h->cache[target].inBuffer)
-	       h->cache[target].inBuffer = xmalloc( h->chunkLength );
-	    inBuffer = h->cache[target].inBuffer;
-	    if( !inBuffer )
-	    {
-	      strcpy( h->errorString, dz_error_str( DZ_ERR_NOMEMORY ) );
-	      xfree( buffer );
-	      return 0;
-	    }
 
-	    if (h->chunks[i] >= OUT_BUFFER_SIZE ) {
-/*
-	       err_internal( __func__,
-			     "h->chunks[%d] = %d >= %ld (OUT_BUFFER_SIZE)\n",
-			     i, h->chunks[i], OUT_BUFFER_SIZE );
-*/
-              sprintf( h->errorString, "h->chunks[%d] = %d >= %ld (OUT_BUFFER_SIZE)\n",
-                       i, h->chunks[i], OUT_BUFFER_SIZE );
-              xfree( buffer );
-              return 0;
-	    }
-
-#ifdef __WIN32
-      pos = SetFilePointer( h->fd, h->offsets[ i ], 0, FILE_BEGIN );
-      readed = 0;
-      if( pos != INVALID_SET_FILE_POINTER || GetLastError() != NO_ERROR )
-        ReadFile( h->fd, outBuffer, h->chunks[ i ], &readed, 0 );
-      if( h->chunks[ i ] != (int)readed )
-#else
-      if ( fseek( h->fd, h->offsets[ i ], SEEK_SET ) != 0 ||
-           fread( outBuffer, h->chunks[ i ], 1, h->fd ) != 1 )
-#endif
+      inBuffer = xmalloc( h->chunkLength );
+      outBuffer = xmalloc( OUT_BUFFER_SIZE );
+      if( !inBuffer || !outBuffer )
       {
-        strcpy( h->errorString, dz_error_str( DZ_ERR_READFILE ) );
-        xfree( buffer );
-        return 0;
+        strcpy( errorString, dz_error_str( DZ_ERR_NOMEMORY ) );
+        goto dzip_error;
       }
 
-      dict_data_filter( outBuffer, &count, OUT_BUFFER_SIZE, preFilter );
-	 
-	    h->zStream.next_in   = (Bytef *)outBuffer;
-	    h->zStream.avail_in  = h->chunks[i];
-	    h->zStream.next_out  = (Bytef *)inBuffer;
-	    h->zStream.avail_out = h->chunkLength;
-	    if (inflate( &h->zStream,  Z_PARTIAL_FLUSH ) != Z_OK)
-	    {
-//	       err_fatal( __func__, "inflate: %s\n", h->zStream.msg );
-	      sprintf( h->errorString, "inflate: %s\n", h->zStream.msg );
-	      xfree( buffer );
-	      return 0;
-	    }
-	    if (h->zStream.avail_in)
-/*
-	       err_internal( __func__,
-			     "inflate did not flush (%d pending, %d avail)\n",
-			     h->zStream.avail_in, h->zStream.avail_out );
-*/
-	    {
-	      sprintf( h->errorString, "inflate did not flush (%d pending, %d avail)\n",
-		       h->zStream.avail_in, h->zStream.avail_out );
-	      xfree( buffer );
-	      return 0;
-	    }
-	    
-	    count = h->chunkLength - h->zStream.avail_out;
-      dict_data_filter( inBuffer, &count, h->chunkLength, postFilter );
+      for (pt = buffer, i = firstChunk; i <= lastChunk; i++) {
+
+				/* Access cache */
+	 count = dict_cache_find( h->fileId, i, inBuffer, h->chunkLength );
+
+	 if ( count < 0 ) {
+	    count = dict_inflate_chunk( h, i, inBuffer, outBuffer );
 
-	    h->cache[target].count = count;
-	    h->cache[target].chunk = i;
+	    if ( count < 0 )
+	       goto dzip_error;
 	 }
-	 
+
 	 if (i == firstChunk) {
 	    if (i == lastChunk) {
 	       memcpy( pt, inBuffer + firstOffset, lastOffset-firstOffset);
 	       pt += lastOffset - firstOffset;
 	    } else {
 	       if (count != h->chunkLength )
-/*
-		  err_internal( __func__,
-				"Length = %d instead of %d\n",
-				count, h->chunkLength );
-*/
 	       {
-		 sprintf( h->errorString, "Length = %d instead of %d\n",
+		 sprintf( errorString, "Length = %d instead of %d\n",
 			  count, h->chunkLength );
-		 xfree( buffer );
-		 return 0;
+		 goto dzip_error;
 	       }
 	       memcpy( pt, inBuffer + firstOffset,
 		       h->chunkLength - firstOffset );
@@ -817,20 +806,32 @@ char *dict_data_read_ (
 	 }
       }
       *pt = '\0';
+      xfree( inBuffer );
+      xfree( outBuffer );
+
+      dict_readahead_notify( h, lastChunk );
       break;
+
+   dzip_error:
+      xfree( inBuffer );
+      xfree( outBuffer );
+      xfree( buffer );
+      return 0;
    case DICT_UNKNOWN:
 //      err_fatal( __func__, "Cannot read unknown file type\n" );
-      strcpy( h->errorString, "Cannot read unknown file type" );
+      strcpy( errorString, "Cannot read unknown file type" );
       xfree( buffer );
       return 0;
    }
-   h->errorString[ 0 ] = 0;
+   errorString[ 0 ] = 0;
    return buffer;
 }
 
 char *dict_error_str( dictData *data )
 {
-  return data->errorString;
+  (void) data;
+
+  return errorString;
 }
 
 const char * dz_error_str( enum DZ_ERRORS error )
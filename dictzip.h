@@ -39,15 +39,6 @@ extern "C"
 
 /* Excerpts from defs.h */
 
-#define DICT_CACHE_SIZE 5
-
-typedef struct dictCache {
-   int           chunk;
-   char          *inBuffer;
-   int           stamp;
-   int           count;
-} dictCache;
-
 enum DZ_ERRORS {
   DZ_NOERROR = 0,
   DZ_ERR_INTERNAL,
@@ -69,8 +60,7 @@ typedef struct dictData {
    
    int           type;
    const char    *filename;
-   z_stream      zStream;
-   int           initialized;
+   unsigned      fileId;	/* identifies the file in the chunk cache */
 
    int           headerLength;
    int           method;
@@ -88,9 +78,6 @@ typedef struct dictData {
    unsigned long crc;
    unsigned long length;
    unsigned long compressedLength;
-   int           stamp;
-   dictCache     cache[DICT_CACHE_SIZE];
-   char          errorString[512];
 } dictData;
 
 
@@ -101,12 +88,48 @@ extern dictData *dict_data_open (
 extern void dict_data_close (
    dictData *data);
 
+/* Reads the given range of data. The file is read with positional reads
+   and the chunks are inflated without any locking, so this can be called
+   from several threads on the same dictData at once. */
 extern char *dict_data_read_ (
    dictData *data,
    unsigned long start, unsigned long end,
    const char *preFilter,
    const char *postFilter );
 
+/* Inflates the given chunk into the cache, unless it's already there. Does
+   nothing for the files which aren't dictzipped. Returns 0 on error. */
+extern int dict_data_prefetch( dictData *data, int chunk );
+
+/* Returns the uncompressed length of the chunks the file is split into,
+   0 for plain text files, or -1 if the file can't be read at random
+   offsets (a pure gzip one). */
+extern int dict_data_chunk_length( dictData *data );
+
+/* The inflated chunks of all the dictzip files are kept in a single cache,
+   limited by the total size of the chunks held. It's implemented on the
+   C++ side, in dictzipcache.cc. */
+
+/* Returns the id of the file with the given name in the cache. */
+extern unsigned dict_cache_file_id( const char *filename );
+
+/* Copies the chunk to out, which must have room for outSize bytes. Returns
+   the size of the chunk, or -1 if it's not in the cache. */
+extern int dict_cache_find( unsigned fileId, int chunk, char *out, int outSize );
+
+extern void dict_cache_insert( unsigned fileId, int chunk,
+                               const char *data, int count );
+
+/* Gets called after each read with the last chunk it went through, to
+   drive the readahead, if there is any for the file. See DictZip::Readahead. */
+extern void dict_readahead_notify( dictData *data, int lastChunk );
+
+/* Sets the maximum total size of the chunks in the cache, in bytes. */
+extern void dict_cache_set_max_size( unsigned long bytes );
+
+/* Returns the error of the last dict_data_read_() made by the calling
+   thread, or an empty string if it succeeded. Each thread gets its own, so
+   the concurrent reads don't overwrite each other's errors. */
 extern char *dict_error_str( dictData *data );
 
 extern const char *dz_error_str( enum DZ_ERRORS error );
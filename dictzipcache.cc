@@ -0,0 +1,160 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the LICENSE file */
+
+#include "dictzipcache.hh"
+#include "fsencoding.hh"
+#include "lrucache.hh"
+#include "qt4x5.hh"
+#include <map>
+#include <string.h>
+
+namespace {
+
+enum
+{
+  // The default size of the inflated dictzip chunks cache
+  DictZipCacheMaxSize = 32 * 1024 * 1024,
+
+  // How many chunks Readahead inflates past the last one read
+  ReadaheadChunks = 32
+};
+
+/// The inflated chunks of all the dictzip files. The keys are the file ids
+/// in the upper 32 bits, and chunk numbers in the lower ones.
+LruCache< quint64 > dictZipCache( DictZipCacheMaxSize );
+
+/// The readaheads active, by the files they are for
+Mutex readaheadsMutex;
+std::map< dictData *, DictZip::Readahead * > readaheads;
+
+/// The number of the readaheads active. Every read checks it, so the mutex
+/// is only taken while there are any.
+QAtomicInt readaheadCount;
+
+quint64 cacheKey( unsigned fileId, int chunk )
+{
+  return ( (quint64) fileId << 32 ) | (quint32) chunk;
+}
+
+}
+
+extern "C" unsigned dict_cache_file_id( const char * filename )
+{
+  return getCachedFileId( QFile( FsEncoding::decode( filename ) ) );
+}
+
+extern "C" int dict_cache_find( unsigned fileId, int chunk, char * out, int outSize )
+{
+  QByteArray data;
+
+  if ( !dictZipCache.find( cacheKey( fileId, chunk ), data ) || data.size() > outSize )
+    return -1;
+
+  memcpy( out, data.constData(), data.size() );
+
+  return data.size();
+}
+
+extern "C" void dict_cache_insert( unsigned fileId, int chunk,
+                                   const char * data, int count )
+{
+  dictZipCache.insert( cacheKey( fileId, chunk ), QByteArray( data, count ) );
+}
+
+extern "C" void dict_readahead_notify( dictData * data, int lastChunk )
+{
+  if ( !Qt4x5::AtomicInt::loadAcquire( readaheadCount ) )
+    return;
+
+  Mutex::Lock _( readaheadsMutex );
+
+  std::map< dictData *, DictZip::Readahead * >::iterator i = readaheads.find( data );
+
+  if ( i != readaheads.end() )
+    i->second->chunkRead( lastChunk );
+}
+
+extern "C" void dict_cache_set_max_size( unsigned long bytes )
+{
+  dictZipCache.setMaxBytes( bytes );
+}
+
+namespace DictZip {
+
+Readahead::Readahead( dictData * dz_ ): dz( dz_ ), lastRead( -1 ), next( 0 ),
+  stopping( false )
+{
+  if ( !dz || dz->chunkCount <= 0 )
+    return;
+
+  {
+    Mutex::Lock _( readaheadsMutex );
+
+    readaheads[ dz ] = this;
+  }
+
+  readaheadCount.ref();
+
+  start();
+}
+
+Readahead::~Readahead()
+{
+  if ( !dz || dz->chunkCount <= 0 )
+    return;
+
+  {
+    Mutex::Lock _( readaheadsMutex );
+
+    readaheads.erase( dz );
+  }
+
+  readaheadCount.deref();
+
+  mutex.lock();
+  stopping = true;
+  wakeUp.wakeAll();
+  mutex.unlock();
+
+  wait();
+}
+
+void Readahead::chunkRead( int lastChunk )
+{
+  Mutex::Lock _( mutex );
+
+  lastRead = lastChunk;
+  wakeUp.wakeAll();
+}
+
+void Readahead::run()
+{
+  mutex.lock();
+
+  while( !stopping )
+  {
+    // Follow the reads, should they skip forward or go back
+    if ( next <= lastRead || next > lastRead + ReadaheadChunks + 1 )
+      next = lastRead + 1;
+
+    if ( next > lastRead + ReadaheadChunks || next >= dz->chunkCount )
+    {
+      wakeUp.wait( &mutex );
+      continue;
+    }
+
+    int chunk = next++;
+
+    mutex.unlock();
+
+    bool ok = dict_data_prefetch( dz, chunk );
+
+    mutex.lock();
+
+    if ( !ok )
+      break;
+  }
+
+  mutex.unlock();
+}
+
+}
@@ -0,0 +1,50 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the LICENSE file */
+
+#ifndef __DICTZIPCACHE_HH_INCLUDED__
+#define __DICTZIPCACHE_HH_INCLUDED__
+
+#include <QThread>
+#include <QWaitCondition>
+#include "dictzip.h"
+#include "mutex.hh"
+
+/// The C++ side of the dictzip reader: the cache of the inflated chunks it
+/// uses, and the readahead for the sequential passes over its files.
+namespace DictZip {
+
+/// Inflates the chunks of a dictzipped file into the cache on a background
+/// thread, ahead of the chunks being read. It is meant for the sequential
+/// passes over all the articles, such as building the full-text index, so
+/// that inflating goes on while the articles already read get processed.
+/// It works for as long as it exists, and only one may exist for a file at
+/// a time. Does nothing for the files which aren't dictzipped.
+class Readahead: public QThread
+{
+public:
+
+  Readahead( dictData * );
+
+  ~Readahead();
+
+protected:
+
+  virtual void run();
+
+private:
+
+  dictData * dz;
+
+  Mutex mutex;
+  QWaitCondition wakeUp;
+  int lastRead; // The last chunk read, as reported by dz
+  int next; // The next chunk to inflate
+  bool stopping;
+
+  friend void ::dict_readahead_notify( dictData *, int );
+
+  void chunkRead( int lastChunk );
+};
+
+}
+
+#endif
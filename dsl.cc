@@ -8,6 +8,7 @@
 #include "utf8.hh"
 #include "chunkedstorage.hh"
 #include "dictzip.h"
+#include "dictzipcache.hh"
 #include "htmlescape.hh"
 #include "iconv.hh"
 #include "filetype.hh"
@@ -29,6 +30,7 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <deque>
 #include <wctype.h>
 
 #ifdef _MSC_VER
@@ -37,6 +39,7 @@
 
 #include <QSemaphore>
 #include <QThreadPool>
+#include <QThread>
 #include <QAtomicInt>
 #include <QUrl>
 
@@ -85,6 +88,7 @@ namespace {
 DEF_EX_STR( exCantReadFile, "Can't read file", Dictionary::Ex )
 DEF_EX( exUserAbort, "User abort", Dictionary::Ex )
 DEF_EX_STR( exDictzipError, "DICTZIP error", Dictionary::Ex )
+DEF_EX_STR( exIndexingFailed, "Indexing failed:", Dictionary::Ex )
 
 enum
 {
@@ -154,13 +158,13 @@ bool indexIsOldOrBad( string const & indexFile, bool hasZipFile )
 class DslDictionary: public BtreeIndexing::BtreeDictionary
 {
   Mutex idxMutex;
+  string idxFileName;
   File::Class idx;
   IdxHeader idxHeader;
   sptr< ChunkedStorage::Reader > chunks;
   string dictionaryName;
   string preferredSoundDictionary;
   map< string, string > abrv;
-  Mutex dzMutex;
   dictData * dz;
   Mutex resourceZipMutex;
   IndexedZip resourceZip;
@@ -258,6 +262,10 @@ protected:
 private:
 
   virtual string const & ensureInitDone();
+
+  virtual void copyHeadwordsTo( IndexedWords &, uint32_t articleOffset,
+                                QAtomicInt * isCancelled );
+
   void doDeferredInit();
 
   /// Loads the article. Does not process the DSL language.
@@ -289,6 +297,7 @@ DslDictionary::DslDictionary( string const & id,
                               vector< string > const & dictionaryFiles,
                               int maxPictureWidth_ ):
   BtreeDictionary( id, dictionaryFiles ),
+  idxFileName( indexFile ),
   idx( indexFile, "rb" ),
   idxHeader( idx.read< IdxHeader >() ),
   dz( 0 ),
@@ -385,6 +394,20 @@ string const & DslDictionary::ensureInitDone()
   return initError;
 }
 
+void DslDictionary::copyHeadwordsTo( IndexedWords & words, uint32_t articleOffset,
+                                     QAtomicInt * isCancelled )
+{
+  // The index is read by itself until the deferred init is done, so that
+  // merging the headwords doesn't force it
+  if ( Qt4x5::AtomicInt::loadAcquire( deferredInitDone ) )
+    BtreeDictionary::copyHeadwordsTo( words, articleOffset, isCancelled );
+  else
+    copyHeadwordsFromFile( idxFileName,
+                           IndexInfo( idxHeader.indexBtreeMaxElements,
+                                      idxHeader.indexRootOffset ),
+                           words, articleOffset, isCancelled );
+}
+
 void DslDictionary::doDeferredInit()
 {
   if ( !Qt4x5::AtomicInt::loadAcquire( deferredInitDone ) )
@@ -557,13 +580,7 @@ void DslDictionary::loadArticle( uint32_t address,
     GD_DPRINTF( "offset = %x\n", articleOffset );
 
 
-    char * articleBody;
-
-    {
-      Mutex::Lock _( dzMutex );
-
-      articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
-    }
+    char * articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
 
     if ( !articleBody )
     {
@@ -785,7 +802,7 @@ string DslDictionary::nodeToHtml( ArticleDom::Node const & node )
 
   if ( !node.isTag )
   {
-    result = Html::escape( Utf8::encode( node.text ) );
+    result = Html::escape( Utf8::encode( wstring( node.text, node.textSize ) ) );
 
     // Handle all end-of-line
 
@@ -1276,6 +1293,9 @@ void DslDictionary::makeFTSIndex( QAtomicInt & isCancelled, bool firstIteration
 
   try
   {
+    // The articles are read in the order of their offsets
+    DictZip::Readahead readahead( dz );
+
     FtsHelpers::makeFTSIndex( this, isCancelled );
     FTS_index_completed.ref();
   }
@@ -1307,12 +1327,7 @@ void DslDictionary::getArticleText( uint32_t articleAddress, QString & headword,
   memcpy( &articleSize, articleProps + sizeof( articleOffset ),
           sizeof( articleSize ) );
 
-  char * articleBody;
-
-  {
-    Mutex::Lock _( dzMutex );
-    articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
-  }
+  char * articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
 
   if ( !articleBody )
   {
@@ -2001,6 +2016,653 @@ sptr< Dictionary::DataRequest > DslDictionary::getSearchResults( QString const &
   return new FtsHelpers::FTSResultsRequest( *this, searchString,searchMode, matchCase, distanceBetweenWords, maxResults, ignoreWordsOrder, ignoreDiacritics );
 }
 
+/// Indexing
+
+/// A card found in the .dsl file, along with the embedded ('@') cards it has.
+/// All the headwords are already expanded, unescaped and normalized.
+struct ParsedCard
+{
+  uint32_t articleOffset;
+  uint32_t articleSize;
+  list< wstring > headwords;
+  QVector< InsidedCard > insidedCards;
+};
+
+/// Receives what parseCards() finds, in the order it's found in the file.
+class CardSink
+{
+public:
+
+  virtual void addCard( ParsedCard & ) = 0;
+
+  /// The line is the scanner's one. The format has a single %i for it.
+  virtual void lineWarning( char const * format, int line ) = 0;
+
+  /// A warning which doesn't refer to a line.
+  virtual void warning( string const & message ) = 0;
+
+  virtual ~CardSink()
+  {}
+};
+
+/// Stores the cards into the chunks and the headwords into the index.
+class CardWriter: public CardSink
+{
+  ChunkedStorage::Writer & chunks;
+  IndexedWords & indexedWords;
+  unsigned maxHeadwordSize;
+
+public:
+
+  uint32_t articleCount, wordCount;
+
+  CardWriter( ChunkedStorage::Writer & chunks_, IndexedWords & indexedWords_,
+              unsigned maxHeadwordSize_ ):
+    chunks( chunks_ ), indexedWords( indexedWords_ ),
+    maxHeadwordSize( maxHeadwordSize_ ), articleCount( 0 ), wordCount( 0 )
+  {}
+
+  virtual void addCard( ParsedCard & );
+
+  virtual void lineWarning( char const * format, int line )
+  { gdWarning( format, line ); }
+
+  virtual void warning( string const & message )
+  { gdWarning( "%s\n", message.c_str() ); }
+};
+
+void CardWriter::addCard( ParsedCard & card )
+{
+  uint32_t descOffset = chunks.startNewBlock();
+
+  chunks.addToBlock( &card.articleOffset, sizeof( card.articleOffset ) );
+
+  for( list< wstring >::iterator j = card.headwords.begin();
+       j != card.headwords.end(); ++j )
+    indexedWords.addWord( *j, descOffset, maxHeadwordSize );
+
+  ++articleCount;
+  wordCount += card.headwords.size();
+
+  chunks.addToBlock( &card.articleSize, sizeof( card.articleSize ) );
+
+  for( QVector< InsidedCard >::iterator i = card.insidedCards.begin(); i != card.insidedCards.end(); ++i )
+  {
+    uint32_t descOffset = chunks.startNewBlock();
+    chunks.addToBlock( &(*i).offset, sizeof( (*i).offset ) );
+    chunks.addToBlock( &(*i).size, sizeof( (*i).size ) );
+
+    for( int x = 0; x < (*i).headwords.size(); x++ )
+      indexedWords.addWord( (*i).headwords[ x ], descOffset, maxHeadwordSize );
+
+    wordCount += (*i).headwords.size();
+    ++articleCount;
+  }
+}
+
+/// Reads the next line, remembering the number of lines read before it.
+inline bool readLine( DslScanner & scanner, wstring & curString,
+                      size_t & curOffset, unsigned & linesBefore )
+{
+  linesBefore = scanner.getLinesRead();
+  return scanner.readNextLineWithoutComments( curString, curOffset );
+}
+
+/// Parses the cards, passing them to the sink. If hasString is true, starts
+/// with the card whose headword is in curString. If limit is non-zero, stops
+/// at the first card whose preceding body line starts at or past it, and
+/// returns true, leaving the card's headword in curString. Otherwise parses
+/// till the end of file and returns false. linesBefore receives the number of
+/// lines read before the last line.
+bool parseCards( DslScanner & scanner, string const & fileName, size_t limit,
+                 bool hasString, wstring & curString, size_t & curOffset,
+                 unsigned & linesBefore, CardSink & sink )
+{
+  size_t bodyLineOffset = 0;
+
+  for( ; ; )
+  {
+    // Find the main headword
+
+    if ( !hasString && !readLine( scanner, curString, curOffset, linesBefore ) )
+      break; // Clean end of file
+
+    hasString = false;
+
+    // The line read should either consist of pure whitespace, or be a
+    // headword
+
+    if ( curString.empty() )
+      continue;
+
+    if ( isDslWs( curString[ 0 ] ) )
+    {
+      // The first character is blank. Let's make sure that all other
+      // characters are blank, too.
+      for( size_t x = 1; x < curString.size(); ++x )
+      {
+        if ( !isDslWs( curString[ x ] ) )
+        {
+          sink.warning( "Garbage string in " + fileName + " at offset 0x" +
+                        QByteArray::number( (qulonglong) curOffset, 16 ).toUpper().data() );
+          break;
+        }
+      }
+      continue;
+    }
+
+    // Ok, got the headword
+
+    if ( limit && bodyLineOffset >= limit )
+      return true;
+
+    ParsedCard card;
+
+    list< wstring > & allEntryWords = card.headwords;
+
+    processUnsortedParts( curString, true );
+    expandOptionalParts( curString, &allEntryWords );
+
+    card.articleOffset = curOffset;
+
+    //DPRINTF( "Headword: %ls\n", curString.c_str() );
+
+    // More headwords may follow
+
+    for( ; ; )
+    {
+      if ( ! ( hasString = readLine( scanner, curString, curOffset, linesBefore ) ) )
+      {
+        sink.warning( "Premature end of file " + fileName );
+        break;
+      }
+
+      // Lingvo skips empty strings between the headwords
+      if ( curString.empty() )
+        continue;
+
+      if ( isDslWs( curString[ 0 ] ) )
+        break; // No more headwords
+
+#ifdef QT_DEBUG
+      qDebug() << "Alt headword" << gd::toQString( curString );
+#endif
+
+      processUnsortedParts( curString, true );
+      expandTildes( curString, allEntryWords.front() );
+      expandOptionalParts( curString, &allEntryWords );
+    }
+
+    if ( !hasString )
+      break;
+
+    bodyLineOffset = curOffset;
+
+    for( list< wstring >::iterator j = allEntryWords.begin();
+         j != allEntryWords.end(); ++j )
+    {
+      unescapeDsl( *j );
+      normalizeHeadword( *j );
+    }
+
+    int insideInsided = 0;
+    wstring headword;
+    QVector< InsidedCard > insidedCards;
+    uint32_t offset = curOffset;
+    QVector< wstring > insidedHeadwords;
+    unsigned linesInsideCard = 0;
+    int dogLine = 0;
+    bool wasEmptyLine = false;
+    int headwordLine = scanner.getLinesRead() - 2;
+    bool noSignificantLines = Folding::applyWhitespaceOnly( curString ).empty();
+
+    // Skip the article's body
+    for( ; ; )
+    {
+      if ( ! ( hasString = readLine( scanner, curString, curOffset, linesBefore ) )
+           || ( curString.size() && !isDslWs( curString[ 0 ] ) ) )
+      {
+        if( insideInsided )
+        {
+          sink.lineWarning( "Unclosed tag '@' at line %i", dogLine );
+          insidedCards.append( InsidedCard( offset, curOffset - offset, insidedHeadwords ) );
+        }
+        if( noSignificantLines )
+          sink.lineWarning( "Orphan headword at line %i", headwordLine );
+
+        break;
+      }
+
+      // Check for orphan strings
+
+      if( curString.empty() )
+      {
+        wasEmptyLine = true;
+        continue;
+      }
+      else
+      {
+        if( wasEmptyLine && !Folding::applyWhitespaceOnly( curString ).empty() )
+          sink.lineWarning( "Orphan string at line %i", scanner.getLinesRead() - 1 );
+      }
+
+      bodyLineOffset = curOffset;
+
+      if( noSignificantLines )
+        noSignificantLines = Folding::applyWhitespaceOnly( curString ).empty();
+
+      // Find embedded cards
+
+      wstring::size_type n = curString.find( L'@' );
+      if( n == wstring::npos || curString[ n - 1 ] == L'\\' )
+      {
+        if( insideInsided )
+          linesInsideCard++;
+
+        continue;
+      }
+      else
+      {
+        // Embedded card tag must be placed at first position in line after spaces
+        if( !isAtSignFirst( curString ) )
+        {
+          sink.lineWarning( "Unescaped '@' symbol at line %i", scanner.getLinesRead() - 1 );
+
+          if( insideInsided )
+            linesInsideCard++;
+
+          continue;
+        }
+      }
+
+      dogLine = scanner.getLinesRead() - 1;
+
+      // Handle embedded card
+
+      if( insideInsided )
+      {
+        if( linesInsideCard )
+        {
+          insidedCards.append( InsidedCard( offset, curOffset - offset, insidedHeadwords ) );
+
+          insidedHeadwords.clear();
+          linesInsideCard = 0;
+          offset = curOffset;
+        }
+      }
+      else
+      {
+        offset = curOffset;
+        linesInsideCard = 0;
+      }
+
+      headword = Folding::trimWhitespace( curString.substr( n + 1 ) );
+
+      if( !headword.empty() )
+      {
+        processUnsortedParts( headword, true );
+        expandTildes( headword, allEntryWords.front() );
+        insidedHeadwords.append( headword );
+        insideInsided = true;
+      }
+      else
+        insideInsided = false;
+    }
+
+    // Now that we're having read the first string after the article
+    // itself, we can use its offset to calculate the article's size.
+    // An end of file works here, too.
+
+    card.articleSize = ( curOffset - card.articleOffset );
+
+    // Expand the headwords of the embedded cards
+
+    for( QVector< InsidedCard >::iterator i = insidedCards.begin(); i != insidedCards.end(); ++i )
+    {
+      QVector< wstring > words;
+
+      for( int x = 0; x < (*i).headwords.size(); x++ )
+      {
+        list< wstring > expanded;
+        expandOptionalParts( (*i).headwords[ x ], &expanded );
+
+        for( list< wstring >::iterator j = expanded.begin();
+             j != expanded.end(); ++j )
+        {
+          unescapeDsl( *j );
+          normalizeHeadword( *j );
+          words.append( *j );
+        }
+      }
+
+      card.insidedCards.append( InsidedCard( (*i).offset, (*i).size, words ) );
+    }
+
+    sink.addCard( card );
+
+    if ( !hasString )
+      break;
+  }
+
+  return false;
+}
+
+/// Skips to the first headword following a body line, which is where a card
+/// begins. Returns false if there's none till the end of file.
+bool findCardStart( DslScanner & scanner, wstring & curString,
+                    size_t & curOffset, unsigned & linesBefore )
+{
+  bool hadBodyLine = false;
+
+  while( readLine( scanner, curString, curOffset, linesBefore ) )
+  {
+    if ( curString.empty() )
+      continue;
+
+    if ( isDslWs( curString[ 0 ] ) )
+      hadBodyLine = true;
+    else
+    if ( hadBodyLine )
+      return true;
+  }
+
+  return false;
+}
+
+/// Large .dsl files are indexed in parts of about this size, in parallel
+enum
+{
+  RegionSize = 8 * 1024 * 1024
+};
+
+/// A part of the .dsl file, parsed on a thread pool. The part starts with the
+/// first card past the given offset (or just after the headers, for the
+/// first one), and lasts till the first card past the next part's offset.
+/// The cards are kept till they're written by indexCards(). Since the part
+/// is scanned without knowing what was before it, its start can be found
+/// wrong (e.g. inside of a multiline comment) -- indexCards() checks it
+/// against where the previous part has actually ended, and reparses the part
+/// from there if they don't match.
+class DslRegion: public QRunnable, public CardSink
+{
+  dictData * dz;
+  string fileName;
+  DslScanner * firstScanner; // The one to use for the first part
+  DslEncoding encoding;
+  size_t from, limit;
+
+public:
+
+  std::deque< ParsedCard > cards;
+
+  // The warnings, which are reported once the part is done with, so that
+  // they come in order, and only once should the part be reparsed. The ones
+  // without a format are just the message, the others have the line, which
+  // is relative to the start.
+  struct Warning
+  {
+    char const * format;
+    int line;
+    string message;
+  };
+
+  vector< Warning > warnings;
+
+  bool hasStart; // False if there's no card in the part
+  size_t startOffset;
+  unsigned linesAtStart; // Scanner lines before the first card's headword
+
+  bool hasEnd; // False if the part lasts till the end of file
+  size_t endOffset;
+  unsigned linesAtEnd;
+
+  string error; // Non-empty if the parsing failed
+  unsigned errorLine;
+
+  QSemaphore hasFinished;
+
+  DslRegion( dictData * dz_, string const & fileName_,
+             DslScanner * firstScanner_, DslEncoding encoding_,
+             size_t from_, size_t limit_ ):
+    dz( dz_ ), fileName( fileName_ ), firstScanner( firstScanner_ ), encoding( encoding_ ),
+    from( from_ ), limit( limit_ ), hasStart( false ), startOffset( 0 ),
+    linesAtStart( 0 ), hasEnd( false ), endOffset( 0 ), linesAtEnd( 0 ),
+    errorLine( 0 )
+  {
+    setAutoDelete( false );
+  }
+
+  /// Parses the part, looking for its start
+  virtual void run();
+
+  /// Parses the part again, starting with the card at the given offset
+  void reparse( size_t offset );
+
+  virtual void addCard( ParsedCard & card );
+
+  virtual void lineWarning( char const * format, int line )
+  {
+    Warning w = { format, line - (int) linesAtStart, string() };
+    warnings.push_back( w );
+  }
+
+  virtual void warning( string const & message )
+  {
+    Warning w = { 0, 0, message };
+    warnings.push_back( w );
+  }
+
+private:
+
+  void parse( bool searchStart, size_t offset );
+};
+
+void DslRegion::run()
+{
+  parse( !firstScanner, from );
+  hasFinished.release();
+}
+
+void DslRegion::reparse( size_t offset )
+{
+  cards.clear();
+  warnings.clear();
+  error.clear();
+  firstScanner = 0;
+
+  parse( false, offset );
+}
+
+void DslRegion::parse( bool searchStart, size_t offset )
+{
+  sptr< DslScanner > ownScanner;
+  DslScanner * scanner = firstScanner;
+
+  hasStart = hasEnd = false;
+  linesAtStart = 0;
+
+  try
+  {
+    if ( !scanner )
+    {
+      ownScanner = new DslScanner( dz, encoding, offset );
+      scanner = ownScanner.get();
+    }
+
+    wstring curString;
+    size_t curOffset = 0;
+    unsigned linesBefore = 0;
+
+    if ( searchStart )
+      hasStart = findCardStart( *scanner, curString, curOffset, linesBefore );
+    else
+    if ( firstScanner )
+      hasStart = true; // The first part begins right after the headers
+    else
+      hasStart = readLine( *scanner, curString, curOffset, linesBefore );
+
+    if ( !hasStart )
+      return;
+
+    startOffset = curOffset;
+    linesAtStart = firstScanner ? 0 : linesBefore;
+
+    hasEnd = parseCards( *scanner, fileName, limit, !firstScanner,
+                         curString, curOffset, linesBefore, *this );
+
+    endOffset = curOffset;
+    linesAtEnd = linesBefore;
+  }
+  catch( std::exception & e )
+  {
+    error = e.what();
+    errorLine = ( scanner ? scanner->getLinesRead() : 0 ) - linesAtStart;
+  }
+}
+
+void DslRegion::addCard( ParsedCard & card )
+{
+  cards.push_back( ParsedCard() );
+
+  ParsedCard & c = cards.back();
+
+  c.articleOffset = card.articleOffset;
+  c.articleSize = card.articleSize;
+  c.headwords.swap( card.headwords );
+  c.insidedCards = card.insidedCards;
+}
+
+/// Indexes all the cards, passing them to the writer in the order they're
+/// in the file. Large files which can be read at random offsets are split
+/// into parts parsed in parallel, aligned to the dictzip chunks if the file
+/// is compressed. The result is the same as when parsing them in a row.
+/// On failure, errorLine receives the line it happened at, if the scanner
+/// can't tell it.
+void indexCards( DslScanner & scanner, string const & fileName,
+                 CardWriter & writer, unsigned & errorLine )
+{
+  int threads = QThread::idealThreadCount();
+  dictData * dz = 0;
+  size_t regionSize = RegionSize;
+
+  if ( threads > 1 )
+  {
+    DZ_ERRORS error;
+    dz = dict_data_open( fileName.c_str(), &error, 0 );
+
+    int chunkLength = dz ? dict_data_chunk_length( dz ) : -1;
+
+    if ( chunkLength > 0 )
+      regionSize = chunkLength * ( ( RegionSize + chunkLength - 1 ) / chunkLength );
+
+    if ( chunkLength < 0 || dz->length < 2 * regionSize )
+    {
+      if ( dz )
+        dict_data_close( dz );
+      dz = 0;
+    }
+  }
+
+  if ( !dz )
+  {
+    wstring curString;
+    size_t curOffset;
+    unsigned linesBefore;
+
+    parseCards( scanner, fileName, 0, false, curString, curOffset, linesBefore, writer );
+    return;
+  }
+
+  size_t regionCount = ( dz->length + regionSize - 1 ) / regionSize;
+
+  vector< sptr< DslRegion > > regions;
+
+  for( size_t x = 0; x < regionCount; ++x )
+    regions.push_back( new DslRegion( dz, fileName, x ? 0 : &scanner,
+                                      scanner.getEncoding(), x * regionSize,
+                                      x + 1 < regionCount ? ( x + 1 ) * regionSize : 0 ) );
+
+  // Only a few parts are kept parsed ahead, to limit the memory used
+
+  size_t const maxQueued = threads * 2;
+
+  QThreadPool pool;
+  pool.setMaxThreadCount( threads );
+
+  size_t queued = 0;
+
+  for( ; queued < regionCount && queued < maxQueued; ++queued )
+    pool.start( regions[ queued ].get() );
+
+  try
+  {
+    bool atEnd = false;
+    size_t expectedStart = 0;
+    unsigned linesBase = 0;
+
+    for( size_t x = 0; x < regionCount; ++x )
+    {
+      DslRegion & region = *regions[ x ];
+
+      region.hasFinished.acquire();
+
+      if ( queued < regionCount )
+        pool.start( regions[ queued++ ].get() );
+
+      if ( atEnd )
+      {
+        regions[ x ].reset();
+        continue;
+      }
+
+      if ( x && ( !region.error.empty() || !region.hasStart ||
+                  region.startOffset != expectedStart ) )
+      {
+        GD_DPRINTF( "Dsl: reparsing part %u of %s\n", (unsigned) x, fileName.c_str() );
+        region.reparse( expectedStart );
+      }
+
+      if ( !region.error.empty() )
+      {
+        errorLine = linesBase + region.errorLine;
+        throw exIndexingFailed( region.error );
+      }
+
+      for( size_t y = 0; y < region.warnings.size(); ++y )
+      {
+        DslRegion::Warning const & w = region.warnings[ y ];
+
+        if ( w.format )
+          gdWarning( w.format, linesBase + w.line );
+        else
+          gdWarning( "%s\n", w.message.c_str() );
+      }
+
+      for( std::deque< ParsedCard >::iterator i = region.cards.begin();
+           i != region.cards.end(); ++i )
+        writer.addCard( *i );
+
+      if ( region.hasEnd )
+      {
+        expectedStart = region.endOffset;
+        linesBase += region.linesAtEnd - region.linesAtStart;
+      }
+      else
+        atEnd = true;
+
+      regions[ x ].reset(); // Release the cards
+    }
+  }
+  catch( ... )
+  {
+    pool.waitForDone();
+    dict_data_close( dz );
+    throw;
+  }
+
+  dict_data_close( dz );
+}
+
 } // anonymous namespace
 
 /// makeDictionaries
@@ -2073,6 +2735,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
            indexIsOldOrBad( indexFile, zipFileName.size() ) )
       {
         DslScanner scanner( *i );
+        unsigned regionErrorLine = 0;
 
         try { // Here we intercept any errors during the read to save line at
               // which the incident happened. We need alive scanner for that.
@@ -2114,6 +2777,8 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
         IndexedWords indexedWords;
 
+        indexedWords.enableSpilling();
+
         ChunkedStorage::Writer chunks( idx );
 
         // Read the abbreviations
@@ -2210,236 +2875,9 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
           }
         }
 
-        bool hasString = false;
-        wstring curString;
-        size_t curOffset;
-
-        uint32_t articleCount = 0, wordCount = 0;
-
-        for( ; ; )
-        {
-          // Find the main headword
-
-          if ( !hasString && !scanner.readNextLineWithoutComments( curString, curOffset ) )
-            break; // Clean end of file
-
-          hasString = false;
-
-          // The line read should either consist of pure whitespace, or be a
-          // headword
-
-          if ( curString.empty() )
-            continue;
-
-          if ( isDslWs( curString[ 0 ] ) )
-          {
-            // The first character is blank. Let's make sure that all other
-            // characters are blank, too.
-            for( size_t x = 1; x < curString.size(); ++x )
-            {
-              if ( !isDslWs( curString[ x ] ) )
-              {
-                gdWarning( "Garbage string in %s at offset 0x%lX\n", i->c_str(), (unsigned long) curOffset );
-                break;
-              }
-            }
-            continue;
-          }
-
-          // Ok, got the headword
-
-          list< wstring > allEntryWords;
-
-          processUnsortedParts( curString, true );
-          expandOptionalParts( curString, &allEntryWords );
-
-          uint32_t articleOffset = curOffset;
-
-          //DPRINTF( "Headword: %ls\n", curString.c_str() );
-
-          // More headwords may follow
-
-          for( ; ; )
-          {
-            if ( ! ( hasString = scanner.readNextLineWithoutComments( curString, curOffset ) ) )
-            {
-              gdWarning( "Premature end of file %s\n", i->c_str() );
-              break;
-            }
-
-            // Lingvo skips empty strings between the headwords
-            if ( curString.empty() )
-              continue;
-
-            if ( isDslWs( curString[ 0 ] ) )
-              break; // No more headwords
-
-#ifdef QT_DEBUG
-            qDebug() << "Alt headword" << gd::toQString( curString );
-#endif
-
-            processUnsortedParts( curString, true );
-            expandTildes( curString, allEntryWords.front() );
-            expandOptionalParts( curString, &allEntryWords );
-          }
-
-          if ( !hasString )
-            break;
-
-          // Insert new entry
-
-          uint32_t descOffset = chunks.startNewBlock();
-
-          chunks.addToBlock( &articleOffset, sizeof( articleOffset ) );
-
-          for( list< wstring >::iterator j = allEntryWords.begin();
-               j != allEntryWords.end(); ++j )
-          {
-            unescapeDsl( *j );
-            normalizeHeadword( *j );
-            indexedWords.addWord( *j, descOffset, maxHeadwordSize );
-          }
-
-          ++articleCount;
-          wordCount += allEntryWords.size();
-
-          int insideInsided = 0;
-          wstring headword;
-          QVector< InsidedCard > insidedCards;
-          uint32_t offset = curOffset;
-          QVector< wstring > insidedHeadwords;
-          unsigned linesInsideCard = 0;
-          int dogLine = 0;
-          bool wasEmptyLine = false;
-          int headwordLine = scanner.getLinesRead() - 2;
-          bool noSignificantLines = Folding::applyWhitespaceOnly( curString ).empty();
-
-          // Skip the article's body
-          for( ; ; )
-          {
-            if ( ! ( hasString = scanner.readNextLineWithoutComments( curString, curOffset ) )
-                 || ( curString.size() && !isDslWs( curString[ 0 ] ) ) )
-            {
-              if( insideInsided )
-              {
-                gdWarning( "Unclosed tag '@' at line %i", dogLine );
-                insidedCards.append( InsidedCard( offset, curOffset - offset, insidedHeadwords ) );
-              }
-              if( noSignificantLines )
-                gdWarning( "Orphan headword at line %i", headwordLine );
-
-              break;
-            }
+        CardWriter writer( chunks, indexedWords, maxHeadwordSize );
 
-            // Check for orphan strings
-
-            if( curString.empty() )
-            {
-              wasEmptyLine = true;
-              continue;
-            }
-            else
-            {
-              if( wasEmptyLine && !Folding::applyWhitespaceOnly( curString ).empty() )
-                gdWarning( "Orphan string at line %i", scanner.getLinesRead() - 1 );
-            }
-
-            if( noSignificantLines )
-              noSignificantLines = Folding::applyWhitespaceOnly( curString ).empty();
-
-            // Find embedded cards
-
-            wstring::size_type n = curString.find( L'@' );
-            if( n == wstring::npos || curString[ n - 1 ] == L'\\' )
-            {
-              if( insideInsided )
-                linesInsideCard++;
-
-              continue;
-            }
-            else
-            {
-              // Embedded card tag must be placed at first position in line after spaces
-              if( !isAtSignFirst( curString ) )
-              {
-                gdWarning( "Unescaped '@' symbol at line %i", scanner.getLinesRead() - 1 );
-
-                if( insideInsided )
-                  linesInsideCard++;
-
-                continue;
-              }
-            }
-
-            dogLine = scanner.getLinesRead() - 1;
-
-            // Handle embedded card
-
-            if( insideInsided )
-            {
-              if( linesInsideCard )
-              {
-                insidedCards.append( InsidedCard( offset, curOffset - offset, insidedHeadwords ) );
-
-                insidedHeadwords.clear();
-                linesInsideCard = 0;
-                offset = curOffset;
-              }
-            }
-            else
-            {
-              offset = curOffset;
-              linesInsideCard = 0;
-            }
-
-            headword = Folding::trimWhitespace( curString.substr( n + 1 ) );
-
-            if( !headword.empty() )
-            {
-              processUnsortedParts( headword, true );
-              expandTildes( headword, allEntryWords.front() );
-              insidedHeadwords.append( headword );
-              insideInsided = true;
-            }
-            else
-              insideInsided = false;
-          }
-
-          // Now that we're having read the first string after the article
-          // itself, we can use its offset to calculate the article's size.
-          // An end of file works here, too.
-
-          uint32_t articleSize = ( curOffset - articleOffset );
-
-          chunks.addToBlock( &articleSize, sizeof( articleSize ) );
-
-          for( QVector< InsidedCard >::iterator i = insidedCards.begin(); i != insidedCards.end(); ++i )
-          {
-            uint32_t descOffset = chunks.startNewBlock();
-            chunks.addToBlock( &(*i).offset, sizeof( (*i).offset ) );
-            chunks.addToBlock( &(*i).size, sizeof( (*i).size ) );
-
-            for( int x = 0; x < (*i).headwords.size(); x++ )
-            {
-              allEntryWords.clear();
-              expandOptionalParts( (*i).headwords[ x ], &allEntryWords );
-
-              for( list< wstring >::iterator j = allEntryWords.begin();
-                   j != allEntryWords.end(); ++j )
-              {
-                unescapeDsl( *j );
-                normalizeHeadword( *j );
-                indexedWords.addWord( *j, descOffset, maxHeadwordSize );
-              }
-
-              wordCount += allEntryWords.size();
-            }
-            ++articleCount;
-          }
-
-          if ( !hasString )
-            break;
-        }
+        indexCards( scanner, *i, writer, regionErrorLine );
 
         // Finish with the chunks
 
@@ -2472,7 +2910,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
           {
             // Build the resulting zip file index
 
-            IndexInfo idxInfo = BtreeIndexing::buildIndex( zipFileNames, idx );
+            IndexInfo idxInfo = BtreeIndexing::buildIndex( zipFileNames, idx, 0, true );
 
             idxHeader.zipIndexBtreeMaxElements = idxInfo.btreeMaxElements;
             idxHeader.zipIndexRootOffset = idxInfo.rootOffset;
@@ -2494,8 +2932,8 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
         idxHeader.formatVersion = CurrentFormatVersion;
         idxHeader.zipSupportVersion = CurrentZipSupportVersion;
 
-        idxHeader.articleCount = articleCount;
-        idxHeader.wordCount = wordCount;
+        idxHeader.articleCount = writer.articleCount;
+        idxHeader.wordCount = writer.wordCount;
 
         idxHeader.langFrom = dslLanguageToId( scanner.getLangFrom() );
         idxHeader.langTo = dslLanguageToId( scanner.getLangTo() );
@@ -2507,7 +2945,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
       } // In-place try for saving line count
       catch( ... )
       {
-        atLine = scanner.getLinesRead();
+        atLine = regionErrorLine ? regionErrorLine : scanner.getLinesRead();
         throw;
       }
 
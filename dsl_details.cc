@@ -9,9 +9,18 @@
 #include "ufile.hh"
 #include "wstring_qt.hh"
 #include "utf8.hh"
+#include "dictzip.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <wctype.h>
+#include <deque>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define DSL_DECODE_SSE2
+#include <emmintrin.h>
+#endif
 
 namespace Dsl {
 namespace Details {
@@ -148,20 +157,104 @@ bool isAtSignFirst( wstring const & str )
 
 /////////////// ArticleDom
 
-wstring ArticleDom::Node::renderAsText( bool stripTrsTag ) const
+/// Holds the nodes and the text of a dom, along with the ones of the doms
+/// nested in it
+class ArticleDom::Arena
 {
-  if ( !isTag )
-    return text;
+  std::deque< Node > nodes;
+  vector< wchar * > blocks;
+  wchar * blockPos;
+  size_t blockLeft;
+
+public:
+
+  Arena(): blockPos( 0 ), blockLeft( 0 )
+  {}
+
+  ~Arena()
+  {
+    for( size_t x = 0; x < blocks.size(); ++x )
+      delete[] blocks[ x ];
+  }
+
+  Node * newNode( Node const & node )
+  {
+    nodes.push_back( node );
+    return &nodes.back();
+  }
+
+  wchar * allocText( size_t size );
+
+private:
+
+  Arena( Arena const & );
+  Arena & operator = ( Arena const & );
+};
+
+wchar * ArticleDom::Arena::allocText( size_t size )
+{
+  if ( size > blockLeft )
+  {
+    size_t blockSize = size > 4096 ? size : 4096;
+
+    blocks.push_back( new wchar[ blockSize ] );
+    blockPos = blocks.back();
+    blockLeft = blockSize;
+  }
+
+  wchar * result = blockPos;
 
+  blockPos += size;
+  blockLeft -= size;
+
+  return result;
+}
+
+wstring ArticleDom::Node::renderAsText( bool stripTrsTag ) const
+{
   wstring result;
 
-  for( list< Node >::const_iterator i = begin(); i != end(); ++i )
-    if( !stripTrsTag || i->tagName != GD_NATIVE_TO_WS( L"!trs" ) )
-      result += i->renderAsText( stripTrsTag );
+  renderAsTextTo( result, stripTrsTag );
 
   return result;
 }
 
+void ArticleDom::Node::renderAsTextTo( wstring & result, bool stripTrsTag ) const
+{
+  if ( !isTag )
+  {
+    result.append( text, textSize );
+    return;
+  }
+
+  for( Node const * i = firstChild; i; i = i->nextSibling )
+    if( !stripTrsTag || i->tagName != GD_NATIVE_TO_WS( L"!trs" ) )
+      i->renderAsTextTo( result, stripTrsTag );
+}
+
+void ArticleDom::Node::pushBack( Node * node )
+{
+  node->prevSibling = lastChild;
+  node->nextSibling = 0;
+
+  if ( lastChild )
+    lastChild->nextSibling = node;
+  else
+    firstChild = node;
+
+  lastChild = node;
+}
+
+void ArticleDom::Node::popBack()
+{
+  lastChild = lastChild->prevSibling;
+
+  if ( lastChild )
+    lastChild->nextSibling = 0;
+  else
+    firstChild = 0;
+}
+
 // Returns true if src == 'm' and dest is 'mX', where X is a digit
 static inline bool checkM( wstring const & dest, wstring const & src )
 {
@@ -171,13 +264,78 @@ static inline bool checkM( wstring const & dest, wstring const & src )
 
 ArticleDom::ArticleDom( wstring const & str, string const & dictName,
                         wstring const & headword_):
-  root( Node::Tag(), wstring(), wstring() ), stringPos( str.c_str() ),
-  lineStartPos( str.c_str() ),
+  root( Node::Tag(), wstring(), wstring() ),
+  arena( new Arena ),
   transcriptionCount( 0 ),
   dictionaryName( dictName ),
   headword( headword_ )
 {
-  list< Node * > stack; // Currently opened tags
+  parse( str );
+}
+
+ArticleDom::ArticleDom( wstring const & str, ArticleDom & parent ):
+  root( Node::Tag(), wstring(), wstring() ),
+  arena( parent.arena ),
+  transcriptionCount( 0 ),
+  dictionaryName( parent.dictionaryName ),
+  headword( parent.headword )
+{
+  parse( str );
+}
+
+ArticleDom::~ArticleDom()
+{
+}
+
+ArticleDom::Node * ArticleDom::newTag( wstring const & name, wstring const & attrs )
+{
+  return arena->newNode( Node( Node::Tag(), name, attrs ) );
+}
+
+ArticleDom::Node * ArticleDom::newText()
+{
+  return arena->newNode( Node( Node::Text() ) );
+}
+
+void ArticleDom::appendText( Node & textNode, wchar ch, wchar const * source )
+{
+  if ( !textNode.textCapacity && source && *source == ch &&
+       ( !textNode.textSize || textNode.text + textNode.textSize == source ) )
+  {
+    // The text keeps on following the source
+    if ( !textNode.textSize )
+      textNode.text = source;
+
+    ++textNode.textSize;
+    return;
+  }
+
+  if ( textNode.textSize >= textNode.textCapacity )
+  {
+    // Move the text to a larger place in the arena
+    size_t capacity = textNode.textSize * 2 + 16;
+    wchar * text = arena->allocText( capacity );
+
+    if ( textNode.textSize )
+      memcpy( text, textNode.text, textNode.textSize * sizeof( wchar ) );
+
+    textNode.text = text;
+    textNode.textCapacity = capacity;
+  }
+
+  const_cast< wchar * >( textNode.text )[ textNode.textSize++ ] = ch;
+}
+
+void ArticleDom::parse( wstring const & str )
+{
+  // The text nodes point into this copy of the source whenever they can
+  wchar * source = arena->allocText( str.size() + 1 );
+
+  memcpy( source, str.c_str(), ( str.size() + 1 ) * sizeof( wchar ) );
+
+  stringPos = lineStartPos = source;
+
+  vector< Node * > stack; // Currently opened tags
 
   Node * textNode = 0; // A leaf node which currently accumulates text.
 
@@ -192,10 +350,10 @@ ArticleDom::ArticleDom( wstring const & str, string const & dictName,
         if( !atSignFirstInLine() )
         {
           // Not insided card
-          if( dictName.empty() )
+          if( dictionaryName.empty() )
             gdWarning( "Unescaped '@' symbol found" );
           else
-            gdWarning( "Unescaped '@' symbol found in \"%s\"", dictName.c_str() );
+            gdWarning( "Unescaped '@' symbol found in \"%s\"", dictionaryName.c_str() );
         }
         else
         {
@@ -221,23 +379,13 @@ ArticleDom::ArticleDom( wstring const & str, string const & dictName,
             {
               if ( !textNode )
               {
-                Node text = Node( Node::Text(), wstring() );
-
-                if ( stack.empty() )
-                {
-                  root.push_back( text );
-                  stack.push_back( &root.back() );
-                }
-                else
-                {
-                  stack.back()->push_back( text );
-                  stack.push_back( &stack.back()->back() );
-                }
-
-                textNode = stack.back();
+                textNode = newText();
+
+                ( stack.empty() ? root : *stack.back() ).pushBack( textNode );
+                stack.push_back( textNode );
               }
-              textNode->text.push_back( L'-' );
-              textNode->text.push_back( L' ' );
+              appendText( *textNode, L'-' );
+              appendText( *textNode, L' ' );
 
               // Close the currently opened text node
               stack.pop_back();
@@ -245,25 +393,25 @@ ArticleDom::ArticleDom( wstring const & str, string const & dictName,
 
               wstring linkText = Folding::trimWhitespace( *entry );
               processUnsortedParts( linkText, true );
-              ArticleDom nodeDom( linkText, dictName, headword_ );
+              ArticleDom nodeDom( linkText, *this );
 
-              Node link( Node::Tag(), GD_NATIVE_TO_WS( L"@" ), wstring() );
-              for( Node::iterator n = nodeDom.root.begin(); n != nodeDom.root.end(); ++n )
-                link.push_back( *n );
+              Node * link = newTag( GD_NATIVE_TO_WS( L"@" ), wstring() );
+              link->firstChild = nodeDom.root.firstChild;
+              link->lastChild = nodeDom.root.lastChild;
 
               ++entry;
 
               if ( stack.empty() )
               {
-                root.push_back( link );
+                root.pushBack( link );
                 if( entry != allLinkEntries.end() ) // Add line break before next entry
-                  root.push_back( Node( Node::Tag(), GD_NATIVE_TO_WS( L"br" ), wstring() ) );
+                  root.pushBack( newTag( GD_NATIVE_TO_WS( L"br" ), wstring() ) );
               }
               else
               {
-                stack.back()->push_back( link );
+                stack.back()->pushBack( link );
                 if( entry != allLinkEntries.end() )
-                  stack.back()->push_back( Node( Node::Tag(), GD_NATIVE_TO_WS( L"br" ), wstring() ) );
+                  stack.back()->pushBack( newTag( GD_NATIVE_TO_WS( L"br" ), wstring() ) );
               }
             }
 
@@ -446,16 +594,16 @@ ArticleDom::ArticleDom( wstring const & str, string const & dictName,
 
           linkText = Folding::trimWhitespace( linkText );
           processUnsortedParts( linkText, true );
-          ArticleDom nodeDom( linkText, dictName, headword_ );
+          ArticleDom nodeDom( linkText, *this );
 
-          Node link( Node::Tag(), GD_NATIVE_TO_WS( L"ref" ), wstring() );
-          for( Node::iterator n = nodeDom.root.begin(); n != nodeDom.root.end(); ++n )
-            link.push_back( *n );
+          Node * link = newTag( GD_NATIVE_TO_WS( L"ref" ), wstring() );
+          link->firstChild = nodeDom.root.firstChild;
+          link->lastChild = nodeDom.root.lastChild;
 
           if ( stack.empty() )
-            root.push_back( link );
+            root.pushBack( link );
           else
-            stack.back()->push_back( link );
+            stack.back()->pushBack( link );
 
           continue;
         }
@@ -505,20 +653,10 @@ ArticleDom::ArticleDom( wstring const & str, string const & dictName,
       // If there's currently no text node, open one
       if ( !textNode )
       {
-        Node text = Node( Node::Text(), wstring() );
-
-        if ( stack.empty() )
-        {
-          root.push_back( text );
-          stack.push_back( &root.back() );
-        }
-        else
-        {
-          stack.back()->push_back( text );
-          stack.push_back( &stack.back()->back() );
-        }
+        textNode = newText();
 
-        textNode = stack.back();
+        ( stack.empty() ? root : *stack.back() ).pushBack( textNode );
+        stack.push_back( textNode );
       }
 
       // If we're inside the transcription, do old-encoding conversion
@@ -562,17 +700,17 @@ ArticleDom::ArticleDom( wstring const & str, string const & dictName,
           case 0x2018: ch = 0x251; break;
           case 0x457: ch = 0x265; break;
           case 0x458: ch = 0x153; break;
-          case 0x405: textNode->text.push_back( 0x153 ); ch = 0x303; break;
+          case 0x405: appendText( *textNode, 0x153 ); ch = 0x303; break;
           case 0x441: ch = 0x272; break;
-          case 0x442: textNode->text.push_back( 0x254 ); ch = 0x303; break;
+          case 0x442: appendText( *textNode, 0x254 ); ch = 0x303; break;
           case 0x443: ch = 0xF8; break;
-          case 0x445: textNode->text.push_back(0x25B ); ch = 0x303; break;
+          case 0x445: appendText( *textNode, 0x25B ); ch = 0x303; break;
           case 0x446: ch = 0xE7; break;
-          case 0x44C: textNode->text.push_back( 0x251 ); ch = 0x303; break;
+          case 0x44C: appendText( *textNode, 0x251 ); ch = 0x303; break;
           case 0x44D: ch = 0x26A; break;
           case 0x44F: ch = 0x252; break;
           case 0x30: ch = 0x3B2; break;
-          case 0x31: textNode->text.push_back( 0x65 ); ch = 0x303; break;
+          case 0x31: appendText( *textNode, 0x65 ); ch = 0x303; break;
           case 0x32: ch = 0x25C; break;
           case 0x33: ch = 0x129; break;
           case 0x34: ch = 0xF5; break;
@@ -586,22 +724,22 @@ ArticleDom::ArticleDom( wstring const & str, string const & dictName,
 
           case 0x00a0: ch = 0x02A7; break;
           //case 0x00b1: ch = 0x0261; break;
-          case 0x0402: textNode->text.push_back( 0x0069 ); ch = L':'; break;
-          case 0x0403: textNode->text.push_back( 0x0251 ); ch = L':'; break;
+          case 0x0402: appendText( *textNode, 0x0069 ); ch = L':'; break;
+          case 0x0403: appendText( *textNode, 0x0251 ); ch = L':'; break;
           //case 0x040b: ch = 0x03b8; break;
           //case 0x040e: ch = 0x026a; break;
           case 0x0428: ch = 0x0061; break;
-          case 0x0453: textNode->text.push_back( 0x0075 ); ch = L':'; break;
+          case 0x0453: appendText( *textNode, 0x0075 ); ch = L':'; break;
           case 0x201a: ch = 0x0254; break;
           case 0x201e: ch = 0x0259; break;
-          case 0x2039: textNode->text.push_back( 0x0064 ); ch = 0x0292; break;
+          case 0x2039: appendText( *textNode, 0x0064 ); ch = 0x0292; break;
         }
       }
 
       if ( escaped && ch == L' ' )
         ch = 0xA0; // Escaped spaces turn into non-breakable ones in Lingvo
             
-      textNode->text.push_back( ch );
+      appendText( *textNode, ch, stringPos - 1 );
     } // for( ; ; )
   }
   catch( eot )
@@ -619,9 +757,9 @@ ArticleDom::ArticleDom( wstring const & str, string const & dictName,
 
 void ArticleDom::openTag( wstring const & name,
                           wstring const & attrs,
-                          list<Node *> &stack )
+                          vector< Node * > & stack )
 {
-  list< Node > nodesToReopen;
+  vector< Node * > nodesToReopen;
 
   if( name == GD_NATIVE_TO_WS( L"m" ) || checkM( name, GD_NATIVE_TO_WS( L"m" ) ) )
   {
@@ -630,8 +768,8 @@ void ArticleDom::openTag( wstring const & name,
 
     while( stack.size() )
     {
-      nodesToReopen.push_back( Node( Node::Tag(), stack.back()->tagName,
-                                     stack.back()->tagAttrs ) );
+      nodesToReopen.push_back( newTag( stack.back()->tagName,
+                                       stack.back()->tagAttrs ) );
 
       if ( stack.back()->empty() )
       {
@@ -641,7 +779,7 @@ void ArticleDom::openTag( wstring const & name,
 
         Node * parent = stack.size() ? stack.back() : &root;
 
-        parent->pop_back();
+        parent->popBack();
       }
       else
         stack.pop_back();
@@ -650,33 +788,17 @@ void ArticleDom::openTag( wstring const & name,
 
   // Add tag
 
-  Node node( Node::Tag(), name, attrs );
+  Node * node = newTag( name, attrs );
 
-  if ( stack.empty() )
-  {
-    root.push_back( node );
-    stack.push_back( &root.back() );
-  }
-  else
-  {
-    stack.back()->push_back( node );
-    stack.push_back( &stack.back()->back() );
-  }
+  ( stack.empty() ? root : *stack.back() ).pushBack( node );
+  stack.push_back( node );
 
   // Reopen tags if needed
 
   while( nodesToReopen.size() )
   {
-    if ( stack.empty() )
-    {
-      root.push_back( nodesToReopen.back() );
-      stack.push_back( &root.back() );
-    }
-    else
-    {
-      stack.back()->push_back( nodesToReopen.back() );
-      stack.push_back( &stack.back()->back() );
-    }
+    ( stack.empty() ? root : *stack.back() ).pushBack( nodesToReopen.back() );
+    stack.push_back( nodesToReopen.back() );
 
     nodesToReopen.pop_back();
   }
@@ -684,12 +806,12 @@ void ArticleDom::openTag( wstring const & name,
 }
 
 void ArticleDom::closeTag( wstring const & name,
-                           list< Node * > & stack,
+                           vector< Node * > & stack,
                            bool warn )
 {
   // Find the tag which is to be closed
 
-  list< Node * >::reverse_iterator n;
+  vector< Node * >::reverse_iterator n;
 
   for( n = stack.rbegin(); n != stack.rend(); ++n )
   {
@@ -706,7 +828,7 @@ void ArticleDom::closeTag( wstring const & name,
     // then close the tag itself, then reopen all the tags which got
     // closed.
 
-    list< Node > nodesToReopen;
+    vector< Node * > nodesToReopen;
 
     while( stack.size() )
     {
@@ -714,8 +836,8 @@ void ArticleDom::closeTag( wstring const & name,
                    checkM( stack.back()->tagName, name );
 
       if ( !found )
-        nodesToReopen.push_back( Node( Node::Tag(), stack.back()->tagName,
-                                       stack.back()->tagAttrs ) );
+        nodesToReopen.push_back( newTag( stack.back()->tagName,
+                                         stack.back()->tagAttrs ) );
 
       if ( stack.back()->empty() && stack.back()->tagName != GD_NATIVE_TO_WS( L"br" ) )
       {
@@ -725,7 +847,7 @@ void ArticleDom::closeTag( wstring const & name,
 
         Node * parent = stack.size() ? stack.back() : &root;
 
-        parent->pop_back();
+        parent->popBack();
       }
       else
         stack.pop_back();
@@ -736,16 +858,8 @@ void ArticleDom::closeTag( wstring const & name,
 
     while( nodesToReopen.size() )
     {
-      if ( stack.empty() )
-      {
-        root.push_back( nodesToReopen.back() );
-        stack.push_back( &root.back() );
-      }
-      else
-      {
-        stack.back()->push_back( nodesToReopen.back() );
-        stack.push_back( &stack.back()->back() );
-      }
+      ( stack.empty() ? root : *stack.back() ).pushBack( nodesToReopen.back() );
+      stack.push_back( nodesToReopen.back() );
 
       nodesToReopen.pop_back();
     }
@@ -807,11 +921,298 @@ bool ArticleDom::atSignFirstInLine()
   return isAtSignFirst( wstring( lineStartPos ) );
 }
 
+/////////////// Decoders
+
+// The lines are decoded by hand for all the encodings .dsl files use, since
+// iconv is slow on the short runs of chars a line has. Iconv is only used for
+// the lines these can't decode, so the errors get reported the same way.
+
+namespace {
+
+/// Marks the bytes a code page doesn't have
+wchar const InvalidChar = (wchar) -1;
+
+#ifdef DSL_DECODE_SSE2
+
+/// Widens 16 bytes, which must all be ASCII, to 16 wchars.
+inline void widenAscii16( __m128i bytes, wchar * out )
+{
+  __m128i const zero = _mm_setzero_si128();
+  __m128i lo = _mm_unpacklo_epi8( bytes, zero );
+  __m128i hi = _mm_unpackhi_epi8( bytes, zero );
+
+  _mm_storeu_si128( (__m128i *) out, _mm_unpacklo_epi16( lo, zero ) );
+  _mm_storeu_si128( (__m128i *)( out + 4 ), _mm_unpackhi_epi16( lo, zero ) );
+  _mm_storeu_si128( (__m128i *)( out + 8 ), _mm_unpacklo_epi16( hi, zero ) );
+  _mm_storeu_si128( (__m128i *)( out + 12 ), _mm_unpackhi_epi16( hi, zero ) );
+}
+
+/// Loads 8 Utf16 chars, converting them to the native byte order.
+inline __m128i loadUtf16( char const * in, bool bigEndian )
+{
+  __m128i units = _mm_loadu_si128( (__m128i const *) in );
+
+  if ( bigEndian )
+    units = _mm_or_si128( _mm_slli_epi16( units, 8 ), _mm_srli_epi16( units, 8 ) );
+
+  return units;
+}
+
+#endif
+
+/// Returns the offset of the first newline in the data, or npos if there's
+/// none. Utf16 data must consist of whole chars.
+size_t findNewLine( char const * data, size_t size, DslEncoding encoding )
+{
+  if ( encoding != Utf16LE && encoding != Utf16BE )
+  {
+    // Newlines can't be a part of a multibyte Utf8 sequence. memchr() is
+    // vectorized by all the C libraries around.
+    char const * found = (char const *) memchr( data, '\n', size );
+
+    return found ? found - data : string::npos;
+  }
+
+  bool bigEndian = ( encoding == Utf16BE );
+  size_t x = 0;
+
+#ifdef DSL_DECODE_SSE2
+  __m128i const newLine = _mm_set1_epi16( '\n' );
+
+  for( ; x + 16 <= size; x += 16 )
+  {
+    int mask = _mm_movemask_epi8( _mm_cmpeq_epi16( loadUtf16( data + x, bigEndian ),
+                                                   newLine ) );
+    if ( mask )
+    {
+      // Each matching char sets two adjacent bits
+      size_t y = 0;
+
+      while( !( mask & 1 ) )
+      {
+        mask >>= 1;
+        ++y;
+      }
+
+      return x + y;
+    }
+  }
+#endif
+
+  for( ; x + 2 <= size; x += 2 )
+  {
+    if ( bigEndian ? ( !data[ x ] && data[ x + 1 ] == '\n' ) :
+                     ( data[ x ] == '\n' && !data[ x + 1 ] ) )
+      return x;
+  }
+
+  return string::npos;
+}
+
+/// The decoders below return false if the data is malformed. The output
+/// must have room for as many chars as there are bytes (or Utf16 chars).
+
+bool decodeSingleByte( char const * in, size_t size, wchar const * table,
+                       wchar * out, size_t & outSize )
+{
+  wchar * outStart = out;
+
+  while( size )
+  {
+    size_t chunk = size < 16 ? size : 16;
+
+#ifdef DSL_DECODE_SSE2
+    if ( chunk == 16 )
+    {
+      __m128i bytes = _mm_loadu_si128( (__m128i const *) in );
+
+      if ( !_mm_movemask_epi8( bytes ) )
+      {
+        // All ASCII, which all the supported code pages keep as is
+        widenAscii16( bytes, out );
+        in += 16;
+        out += 16;
+        size -= 16;
+        continue;
+      }
+    }
+#endif
+
+    for( size_t x = 0; x < chunk; ++x )
+    {
+      wchar ch = table[ (unsigned char) in[ x ] ];
+
+      if ( ch == InvalidChar )
+        return false;
+
+      out[ x ] = ch;
+    }
+
+    in += chunk;
+    out += chunk;
+    size -= chunk;
+  }
+
+  outSize = out - outStart;
+
+  return true;
+}
+
+bool decodeUtf8( char const * in, size_t size, wchar * out, size_t & outSize )
+{
+  unsigned char const * ptr = (unsigned char const *) in;
+  unsigned char const * end = ptr + size;
+  wchar * outStart = out;
+
+  while( ptr != end )
+  {
+#ifdef DSL_DECODE_SSE2
+    if ( end - ptr >= 16 )
+    {
+      __m128i bytes = _mm_loadu_si128( (__m128i const *) ptr );
+
+      if ( !_mm_movemask_epi8( bytes ) )
+      {
+        widenAscii16( bytes, out );
+        ptr += 16;
+        out += 16;
+        continue;
+      }
+    }
+#endif
+
+    // Decode up to 16 bytes' worth of chars one by one
+
+    unsigned char const * blockEnd = end - ptr > 16 ? ptr + 16 : end;
+
+    while( ptr < blockEnd )
+    {
+      unsigned ch = *ptr++;
+
+      if ( ch < 0x80 )
+      {
+        *out++ = ch;
+        continue;
+      }
+
+      unsigned extra, min;
+
+      if ( ( ch & 0xE0 ) == 0xC0 )
+      {
+        extra = 1;
+        min = 0x80;
+        ch &= 0x1F;
+      }
+      else
+      if ( ( ch & 0xF0 ) == 0xE0 )
+      {
+        extra = 2;
+        min = 0x800;
+        ch &= 0x0F;
+      }
+      else
+      if ( ( ch & 0xF8 ) == 0xF0 )
+      {
+        extra = 3;
+        min = 0x10000;
+        ch &= 0x07;
+      }
+      else
+        return false;
+
+      if ( (size_t)( end - ptr ) < extra )
+        return false;
+
+      for( ; extra--; ++ptr )
+      {
+        if ( ( *ptr & 0xC0 ) != 0x80 )
+          return false;
+
+        ch = ( ch << 6 ) | ( *ptr & 0x3F );
+      }
+
+      if ( ch < min || ch > 0x10FFFF || ( ch >= 0xD800 && ch <= 0xDFFF ) )
+        return false;
+
+      *out++ = ch;
+    }
+  }
+
+  outSize = out - outStart;
+
+  return true;
+}
+
+bool decodeUtf16( char const * in, size_t size, bool bigEndian,
+                  wchar * out, size_t & outSize )
+{
+  unsigned char const * ptr = (unsigned char const *) in;
+  unsigned char const * end = ptr + ( size & ~(size_t) 1 );
+  wchar * outStart = out;
+
+#ifdef DSL_DECODE_SSE2
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const surrogateMask = _mm_set1_epi16( (short) 0xF800 );
+  __m128i const surrogate = _mm_set1_epi16( (short) 0xD800 );
+#endif
+
+  while( ptr != end )
+  {
+#ifdef DSL_DECODE_SSE2
+    if ( end - ptr >= 16 )
+    {
+      __m128i units = loadUtf16( (char const *) ptr, bigEndian );
+
+      if ( !_mm_movemask_epi8( _mm_cmpeq_epi16( _mm_and_si128( units, surrogateMask ),
+                                                surrogate ) ) )
+      {
+        // No surrogates, so each char is a code point of its own
+        _mm_storeu_si128( (__m128i *) out, _mm_unpacklo_epi16( units, zero ) );
+        _mm_storeu_si128( (__m128i *)( out + 4 ), _mm_unpackhi_epi16( units, zero ) );
+        ptr += 16;
+        out += 8;
+        continue;
+      }
+    }
+#endif
+
+    unsigned char const * blockEnd = end - ptr > 16 ? ptr + 16 : end;
+
+    while( ptr < blockEnd )
+    {
+      unsigned ch = bigEndian ? ( ptr[ 0 ] << 8 ) | ptr[ 1 ] : ( ptr[ 1 ] << 8 ) | ptr[ 0 ];
+      ptr += 2;
+
+      if ( ch >= 0xD800 && ch <= 0xDFFF )
+      {
+        if ( ch >= 0xDC00 || ptr == end )
+          return false;
+
+        unsigned low = bigEndian ? ( ptr[ 0 ] << 8 ) | ptr[ 1 ] : ( ptr[ 1 ] << 8 ) | ptr[ 0 ];
+
+        if ( low < 0xDC00 || low > 0xDFFF )
+          return false;
+
+        ptr += 2;
+        ch = 0x10000 + ( ( ch - 0xD800 ) << 10 ) + ( low - 0xDC00 );
+      }
+
+      *out++ = ch;
+    }
+  }
+
+  outSize = out - outStart;
+
+  return true;
+}
+
+}
+
 /////////////// DslScanner
 
 DslScanner::DslScanner( string const & fileName ) THROW_SPEC( Ex, Iconv::Ex ):
-  encoding( Windows1252 ), iconv( encoding ), readBufferPtr( readBuffer ),
-  readBufferLeft( 0 ), wcharBuffer( 64 ), linesRead( 0 )
+  dz( 0 ), dzOffset( 0 ), dzLength( 0 ), encoding( Windows1252 ), iconv( encoding ), readBufferPtr( readBuffer ),
+  readBufferLeft( 0 ), linesRead( 0 )
 {
   // Since .dz is backwards-compatible with .gz, we use gz- functions to
   // read it -- they are much nicer than the dict_data- ones.
@@ -877,7 +1278,7 @@ DslScanner::DslScanner( string const & fileName ) THROW_SPEC( Ex, Iconv::Ex ):
     }
   }
 
-  iconv.reinit( encoding );
+  initDecoder();
 
   // We now can use our own readNextLine() function
 
@@ -973,117 +1374,261 @@ DslScanner::DslScanner( string const & fileName ) THROW_SPEC( Ex, Iconv::Ex ):
   readBufferLeft = 0;
 
   if ( needExactEncoding )
-    iconv.reinit( encoding );
+    initDecoder();
+}
+
+DslScanner::DslScanner( dictData * dz_, DslEncoding encoding_, size_t offset )
+  THROW_SPEC( Ex, Iconv::Ex ):
+  f( 0 ), dz( dz_ ), dzOffset( 0 ), dzLength( dz_->length ),
+  encoding( encoding_ ), iconv( encoding_ ), readBufferPtr( readBuffer ),
+  readBufferLeft( 0 ), linesRead( 0 )
+{
+  initDecoder();
+
+  size_t charSize = distanceToBytes( 1 );
+
+  offset -= offset % charSize;
+
+  // We start one char before the offset and skip up to the next newline,
+  // so a line beginning right at the offset is kept
+  dzOffset = offset - charSize;
+
+  for( ; ; )
+  {
+    if ( !fillReadBuffer() )
+    {
+      readBufferLeft = 0;
+      return;
+    }
+
+    size_t found = findNewLine( readBufferPtr, readBufferLeft, encoding );
+
+    if ( found != string::npos )
+    {
+      readBufferPtr += found + charSize;
+      readBufferLeft -= found + charSize;
+      return;
+    }
+
+    readBufferPtr += readBufferLeft - readBufferLeft % charSize;
+    readBufferLeft %= charSize;
+  }
 }
 
 DslScanner::~DslScanner() throw()
 {
-  gzclose( f );
+  if ( f )
+    gzclose( f );
+}
+
+bool DslScanner::fillReadBuffer() THROW_SPEC( Ex )
+{
+  // To avoid having to deal with ring logic, we move the remaining bytes
+  // to the beginning
+  memmove( readBuffer, readBufferPtr, readBufferLeft );
+
+  size_t toRead = sizeof( readBuffer ) - readBufferLeft;
+  int result;
+
+  if ( !dz )
+    result = gzread( f, readBuffer + readBufferLeft, toRead );
+  else
+  {
+    if ( toRead > dzLength - dzOffset )
+      toRead = dzLength - dzOffset;
+
+    result = 0;
+
+    if ( toRead )
+    {
+      char * data = dict_data_read_( dz, dzOffset, toRead, 0, 0 );
+
+      if ( !data )
+        throw exCantReadDslFile();
+
+      memcpy( readBuffer + readBufferLeft, data, toRead );
+      free( data );
+
+      dzOffset += toRead;
+      result = (int) toRead;
+    }
+  }
+
+  if ( result == -1 )
+    throw exCantReadDslFile();
+
+  readBufferPtr = readBuffer;
+  readBufferLeft += (size_t) result;
+
+  return result > 0;
+}
+
+size_t DslScanner::tell()
+{
+  return dz ? dzOffset : (size_t) gztell( f );
+}
+
+bool DslScanner::atEof()
+{
+  return dz ? dzOffset >= dzLength : gzeof( f );
 }
 
 bool DslScanner::readNextLine( wstring & out, size_t & offset ) THROW_SPEC( Ex,
                                                                        Iconv::Ex )
 {
-  offset = (size_t)( gztell( f ) - readBufferLeft );
+  offset = tell() - readBufferLeft;
 
-  // For now we just read one char at a time
-  size_t readMultiple = distanceToBytes( 1 );
+  size_t charSize = distanceToBytes( 1 );
 
-  size_t leftInOut = wcharBuffer.size();
+  // The number of bytes at readBufferPtr known to have no newline
+  size_t scanned = 0;
 
-  wchar * outPtr = &wcharBuffer.front();
+  longLine.clear();
 
   for( ; ; )
   {
-    // Check that we have bytes to read
-    if ( readBufferLeft < 4 ) // To convert one char, we need at most 4 bytes
+    size_t found = findNewLine( readBufferPtr + scanned, readBufferLeft - scanned,
+                                encoding );
+
+    if ( found != string::npos )
     {
-      if ( !gzeof( f ) )
+      size_t lineSize = scanned + found;
+
+      if ( longLine.empty() )
+        decode( readBufferPtr, lineSize, out );
+      else
       {
-        // To avoid having to deal with ring logic, we move the remaining bytes
-        // to the beginning
-        memmove( readBuffer, readBufferPtr, readBufferLeft );
+        longLine.insert( longLine.end(), readBufferPtr, readBufferPtr + lineSize );
+        decode( &longLine.front(), longLine.size(), out );
+      }
+
+      readBufferPtr += lineSize + charSize;
+      readBufferLeft -= lineSize + charSize;
 
-        // Read some more bytes to readBuffer
-        int result = gzread( f, readBuffer + readBufferLeft,
-                             sizeof( readBuffer ) - readBufferLeft );
+      // Now kill a \r if there is one, and return the result.
+      if ( !out.empty() && out[ out.size() - 1 ] == L'\r' )
+        out.erase( out.size() - 1 );
 
-        if ( result == -1 )
-          throw exCantReadDslFile();
+      ++linesRead;
 
-        readBufferPtr = readBuffer;
-        readBufferLeft += (size_t) result;
-      }
+      return true;
     }
 
-    if ( readBufferLeft < readMultiple )
+    scanned = readBufferLeft - readBufferLeft % charSize;
+
+    if ( scanned > sizeof( readBuffer ) / 2 )
+    {
+      // The line is too long to fit into readBuffer, so we move what we've
+      // got so far out of the way
+      longLine.insert( longLine.end(), readBufferPtr, readBufferPtr + scanned );
+      readBufferPtr += scanned;
+      readBufferLeft -= scanned;
+      scanned = 0;
+    }
+
+    if ( atEof() || !fillReadBuffer() )
     {
       // No more data. Return what we've got so far, forget the last byte if
       // it was a 16-bit Unicode and a file had an odd number of bytes.
+      longLine.insert( longLine.end(), readBufferPtr, readBufferPtr + scanned );
       readBufferLeft = 0;
 
-      if ( outPtr != &wcharBuffer.front() )
-      {
-        // If there was a stray \r, remove it
-        if ( outPtr[ -1 ] == L'\r' )
-          --outPtr;
+      if ( longLine.empty() )
+        return false;
 
-        out = wstring( &wcharBuffer.front(), outPtr - &wcharBuffer.front() );
+      decode( &longLine.front(), longLine.size(), out );
 
-        ++linesRead;
+      // If there was a stray \r, remove it
+      if ( !out.empty() && out[ out.size() - 1 ] == L'\r' )
+        out.erase( out.size() - 1 );
 
-        return true;
-      }
-      else
-        return false;
-    }
+      ++linesRead;
 
-    // Check that we have chars to write
-    if ( leftInOut < 2 ) // With 16-bit wchars, 2 is needed for a surrogate pair
-    {
-      wcharBuffer.resize( wcharBuffer.size() + 64 );
-      outPtr = &wcharBuffer.front() + wcharBuffer.size() - 64 - leftInOut;
-      leftInOut += 64;
+      return true;
     }
+  }
+}
+
+void DslScanner::initDecoder() THROW_SPEC( Iconv::Ex )
+{
+  iconv.reinit( encoding );
 
-    // Ok, now convert one char
-    size_t outBytesLeft = sizeof( wchar );
+  charTable.clear();
 
-    Iconv::Result r =
-      iconv.convert( (void const *&)readBufferPtr, readBufferLeft,
-                     (void *&)outPtr, outBytesLeft );
+  if ( encoding == Utf16LE || encoding == Utf16BE || encoding == Utf8 )
+    return;
 
-    if ( r == Iconv::NeedMoreOut && outBytesLeft == sizeof( wchar ) )
-    {
-      // Seems to be a surrogate pair with a 16-bit target wchar
+  // Let iconv tell what each byte stands for in the code page
 
-      outBytesLeft *= 2;
-      r = iconv.convert( (void const *&)readBufferPtr, readBufferLeft,
-                     (void *&)outPtr, outBytesLeft );
-      --leftInOut; // Complements the next decremention
-    }
+  charTable.resize( 256 );
 
-    if ( outBytesLeft )
-      throw exEncodingError();
+  for( unsigned x = 0; x < 256; ++x )
+  {
+    char byte = (char) x;
+    wchar ch;
 
-    --leftInOut;
+    void const * inPtr = &byte;
+    size_t inLeft = 1;
+    void * outPtr = &ch;
+    size_t outLeft = sizeof( ch );
 
-    // Have we got \n?
-    if ( outPtr[ -1 ] == L'\n' )
+    try
     {
-      --outPtr;
+      if ( iconv.convert( inPtr, inLeft, outPtr, outLeft ) != Iconv::Success || outLeft )
+        ch = InvalidChar;
+    }
+    catch( Iconv::Ex & )
+    {
+      ch = InvalidChar;
+    }
 
-      // Now kill a \r if there is one, and return the result.
-      if ( outPtr != &wcharBuffer.front() && outPtr[ -1 ] == L'\r' )
-          --outPtr;
+    charTable[ x ] = ch;
+  }
+}
 
-      out = wstring( &wcharBuffer.front(), outPtr - &wcharBuffer.front() );
+void DslScanner::decode( char const * data, size_t size, wstring & out )
+  THROW_SPEC( Ex, Iconv::Ex )
+{
+  // No encoding produces more chars than there are bytes (or Utf16 chars)
+  out.resize( size / distanceToBytes( 1 ) );
 
-      ++linesRead;
+  if ( out.empty() )
+    return;
 
-      return true;
+  size_t outSize;
+  bool decoded = false;
+
+  if ( sizeof( wchar ) == 4 )
+  {
+    switch( encoding )
+    {
+      case Utf16LE:
+      case Utf16BE:
+        decoded = decodeUtf16( data, size, encoding == Utf16BE, &out[ 0 ], outSize );
+        break;
+      case Utf8:
+        decoded = decodeUtf8( data, size, &out[ 0 ], outSize );
+        break;
+      default:
+        decoded = decodeSingleByte( data, size, &charTable.front(), &out[ 0 ], outSize );
     }
   }
+
+  if ( !decoded )
+  {
+    // Let iconv deal with it
+    void const * inPtr = data;
+    size_t inLeft = size;
+    void * outPtr = &out[ 0 ];
+    size_t outLeft = out.size() * sizeof( wchar );
+
+    if ( iconv.convert( inPtr, inLeft, outPtr, outLeft ) != Iconv::Success || inLeft )
+      throw exEncodingError();
+
+    outSize = (wchar *) outPtr - &out[ 0 ];
+  }
+
+  out.resize( outSize );
 }
 
 bool DslScanner::readNextLineWithoutComments( wstring & out, size_t & offset )
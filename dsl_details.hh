@@ -10,6 +10,9 @@
 #include <zlib.h>
 #include "dictionary.hh"
 #include "iconv.hh"
+#include "sptr.hh"
+
+struct dictData;
 
 // Implementation details for Dsl, not part of its interface
 namespace Dsl {
@@ -43,30 +46,86 @@ string findCodeForDslId( int id );
 bool isAtSignFirst( wstring const & str );
 
 /// Parses the DSL language, representing it in its structural DOM form.
+/// The nodes and their text are kept in an arena, which is freed all at
+/// once along with the dom. Most text nodes just point into the dom's own
+/// copy of the source text.
 struct ArticleDom
 {
-  struct Node: public list< Node >
+  class Arena;
+
+  struct Node
   {
     bool isTag; // true if it is a tag with subnodes, false if it's a leaf text
                 // data.
     // Those are only used if isTag is true
     wstring tagName;
     wstring tagAttrs;
-    wstring text; // This is only used if isTag is false
+    // Those are only used if isTag is false. The text is not 0-terminated.
+    wchar const * text;
+    size_t textSize;
 
     class Text {};
     class Tag {};
 
     Node( Tag, wstring const & name, wstring const & attrs ): isTag( true ),
-      tagName( name ), tagAttrs( attrs )
+      tagName( name ), tagAttrs( attrs ), text( 0 ), textSize( 0 ),
+      textCapacity( 0 ), firstChild( 0 ), lastChild( 0 ), prevSibling( 0 ),
+      nextSibling( 0 )
     {}
 
-    Node( Text, wstring const & text_ ): isTag( false ), text( text_ )
+    Node( Text ): isTag( false ), text( 0 ), textSize( 0 ), textCapacity( 0 ),
+      firstChild( 0 ), lastChild( 0 ), prevSibling( 0 ), nextSibling( 0 )
     {}
 
+    /// Iterates over the node's children
+    class const_iterator
+    {
+      Node const * node;
+
+    public:
+
+      explicit const_iterator( Node const * node_ = 0 ): node( node_ )
+      {}
+
+      Node const & operator * () const
+      { return *node; }
+
+      Node const * operator -> () const
+      { return node; }
+
+      const_iterator & operator ++ ()
+      { node = node->nextSibling; return *this; }
+
+      bool operator == ( const_iterator const & other ) const
+      { return node == other.node; }
+
+      bool operator != ( const_iterator const & other ) const
+      { return node != other.node; }
+    };
+
+    const_iterator begin() const
+    { return const_iterator( firstChild ); }
+
+    const_iterator end() const
+    { return const_iterator(); }
+
+    bool empty() const
+    { return !firstChild; }
+
     /// Concatenates all childen text nodes recursively to form all text
     /// the node contains stripped of any markup.
     wstring renderAsText( bool stripTrsTag = false ) const;
+
+  private:
+
+    friend struct ArticleDom;
+
+    size_t textCapacity; // Non-zero once the text is stored in the arena
+    Node * firstChild, * lastChild, * prevSibling, * nextSibling;
+
+    void renderAsTextTo( wstring &, bool stripTrsTag ) const;
+    void pushBack( Node * );
+    void popBack();
   };
 
   /// Does the parse at construction. Refer to the 'root' member variable
@@ -74,18 +133,35 @@ struct ArticleDom
   ArticleDom( wstring const &, string const & dictName = string(),
               wstring const & headword_ = wstring() );
 
+  ~ArticleDom();
+
   /// Root of DOM's tree
   Node root;
 
 private:
 
-  void openTag( wstring const & name, wstring const & attr, list< Node * > & stack );
+  /// Parses a nested piece of markup, such as a link's body, into the
+  /// parent's arena.
+  ArticleDom( wstring const &, ArticleDom & parent );
+
+  void parse( wstring const & );
+
+  Node * newTag( wstring const & name, wstring const & attrs );
+  Node * newText();
+
+  /// Appends the char to the text node. The source is where the char is in
+  /// the source text, if it was taken from there unchanged.
+  void appendText( Node & textNode, wchar ch, wchar const * source = 0 );
 
-  void closeTag( wstring const & name, list< Node * > & stack,
+  void openTag( wstring const & name, wstring const & attr, vector< Node * > & stack );
+
+  void closeTag( wstring const & name, vector< Node * > & stack,
                  bool warn = true );
 
   bool atSignFirstInLine();
 
+  sptr< Arena > arena;
+
   wchar const * stringPos, * lineStartPos;
 
   class eot {};
@@ -117,6 +193,8 @@ public:
 class DslScanner
 {
   gzFile f;
+  dictData * dz; // Used instead of f when scanning a part of the file
+  size_t dzOffset, dzLength;
   DslEncoding encoding;
   DslIconv iconv;
   wstring dictionaryName;
@@ -125,7 +203,8 @@ class DslScanner
   char readBuffer[ 65536 ];
   char * readBufferPtr;
   size_t readBufferLeft;
-  vector< wchar > wcharBuffer;
+  vector< char > longLine; // Holds the start of a line longer than readBuffer
+  vector< wchar > charTable; // Decodes the single-byte encodings
   unsigned linesRead;
 
 public:
@@ -138,6 +217,13 @@ public:
   DEF_EX( exEncodingError, "Encoding error", Ex ) // Should never happen really
 
   DslScanner( string const & fileName ) THROW_SPEC( Ex, Iconv::Ex );
+
+  /// Scans the file through the given dictData, which must allow reading at
+  /// random offsets and must outlive the scanner. Reading begins from the
+  /// first line starting at or past the given offset, which must be past the
+  /// headers. This allows scanning different parts of the file in parallel.
+  DslScanner( dictData *, DslEncoding, size_t offset ) THROW_SPEC( Ex, Iconv::Ex );
+
   ~DslScanner() throw();
 
   /// Returns the detected encoding of this file.
@@ -179,6 +265,19 @@ public:
   /// would occupy in the file, knowing its encoding. It's possible to know
   /// that because no multibyte encodings are supported in .dsls.
   inline size_t distanceToBytes( size_t ) const;
+
+private:
+
+  /// Sets iconv and the char table up for the current encoding.
+  void initDecoder() THROW_SPEC( Iconv::Ex );
+  /// Decodes the bytes of a line, newline excluded.
+  void decode( char const * data, size_t size, wstring & out ) THROW_SPEC( Ex, Iconv::Ex );
+  /// Moves the unread bytes to the beginning of readBuffer and reads more
+  /// bytes after them. Returns false if there were no more bytes.
+  bool fillReadBuffer() THROW_SPEC( Ex );
+  /// Returns the offset of the next byte to be put into readBuffer.
+  size_t tell();
+  bool atEof();
 };
 
 /// This function either removes parts of string enclosed in braces, or leaves
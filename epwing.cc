@@ -161,6 +161,15 @@ public:
                                                               unsigned long maxResults )
     THROW_SPEC( std::exception );
 
+  /// The articles are also looked up in the book's own index, which the
+  /// filter knows nothing about
+  virtual bool mayContainWord( wstring const & )
+  { return true; }
+
+  /// The book's own index is searched as well
+  virtual bool hasAllHeadwordsIndexed()
+  { return false; }
+
 protected:
 
   void loadIcon() throw();
@@ -438,7 +438,6 @@ class GlsDictionary: public BtreeIndexing::BtreeDictionary
   IdxHeader idxHeader;
   dictData * dz;
   ChunkedStorage::Reader chunks;
-  Mutex dzMutex;
   Mutex resourceZipMutex;
   IndexedZip resourceZip;
   string dictionaryName;
@@ -702,13 +701,7 @@ void GlsDictionary::loadArticleText( uint32_t address,
   memcpy( &articleSize, articleProps + sizeof( articleOffset ),
           sizeof( articleSize ) );
 
-  char * articleBody;
-
-  {
-    Mutex::Lock _( dzMutex );
-
-    articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
-  }
+  char * articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
 
   headwords.clear();
   articleText.clear();
@@ -1732,7 +1725,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
             {
               // Build the resulting zip file index
 
-              IndexInfo idxInfo = BtreeIndexing::buildIndex( zipFileNames, idx );
+              IndexInfo idxInfo = BtreeIndexing::buildIndex( zipFileNames, idx, 0, true );
 
               idxHeader.zipIndexBtreeMaxElements = idxInfo.btreeMaxElements;
               idxHeader.zipIndexRootOffset = idxInfo.rootOffset;
@@ -361,7 +361,10 @@ HEADERS += folding.hh \
     splitfile.hh \
     favoritespanewidget.hh \
     cpp_features.hh \
-    treeview.hh
+    treeview.hh \
+    lrucache.hh \
+    dictzipcache.hh \
+    mergedindex.hh
 
 FORMS += groups.ui \
     dictgroupwidget.ui \
@@ -492,7 +495,10 @@ SOURCES += folding.cc \
     gls.cc \
     splitfile.cc \
     favoritespanewidget.cc \
-    treeview.cc
+    treeview.cc \
+    mergedindex.cc \
+    lrucache.cc \
+    dictzipcache.cc
 
 win32 {
     FORMS   += texttospeechsource.ui
@@ -536,6 +542,13 @@ greaterThan(QT_MAJOR_VERSION, 4) {
 CONFIG( zim_support ) {
   DEFINES += MAKE_ZIM_SUPPORT
   LIBS += -llzma
+  unix:!mac:!CONFIG( no_zim_zstd ) {
+    CONFIG += zim_zstd
+  }
+  CONFIG( zim_zstd ) {
+    DEFINES += MAKE_ZIM_ZSTD_SUPPORT
+    LIBS += -lzstd
+  }
 }
 
 !CONFIG( no_extra_tiff_handler ) {
@@ -543,6 +556,20 @@ CONFIG( zim_support ) {
   LIBS += -ltiff
 }
 
+CONFIG( no_btree_mmap ) {
+  DEFINES += NO_BTREE_MMAP
+}
+
+CONFIG( btree_zstd ) {
+  DEFINES += __BTREE_USE_ZSTD
+  LIBS += -lzstd
+} else {
+  CONFIG( btree_lz4 ) {
+    DEFINES += __BTREE_USE_LZ4
+    LIBS += -llz4
+  }
+}
+
 CONFIG( no_epwing_support ) {
   DEFINES += NO_EPWING_SUPPORT
 }
@@ -28,9 +28,9 @@ bool IndexedZip::hasFile( gd::wstring const & name )
   if ( !zipIsOpen )
     return false;
 
-  vector< WordArticleLink > links = findArticles( name );
+  uint32_t offset;
 
-  return !links.empty();
+  return findFile( name, offset );
 }
 
 bool IndexedZip::loadFile( gd::wstring const & name, vector< char > & data )
@@ -38,12 +38,12 @@ bool IndexedZip::loadFile( gd::wstring const & name, vector< char > & data )
   if ( !zipIsOpen )
     return false;
 
-  vector< WordArticleLink > links = findArticles( name );
+  uint32_t offset;
 
-  if ( links.empty() )
+  if ( !findFile( name, offset ) )
     return false;
 
-  return loadFile( links[ 0 ].articleOffset, data );
+  return loadFile( offset, data );
 }
 
 bool IndexedZip::loadFile( uint32_t offset, vector< char > & data )
@@ -22,6 +22,7 @@
 #include "voiceengines.hh"
 #include "gddebug.hh"
 #include "fsencoding.hh"
+#include "btreeidx.hh"
 #include "xdxf.hh"
 #include "sdict.hh"
 #include "aard.hh"
@@ -58,6 +59,9 @@ LoadDictionaries::LoadDictionaries( Config::Class const & cfg ):
   maxHeadwordSize( cfg.maxHeadwordSize ),
   maxHeadwordToExpand( cfg.maxHeadwordsToExpand )
 {
+  BtreeIndexing::setIndexingMemoryLimit( (size_t) cfg.indexingMemoryLimit * 1024 * 1024,
+                                         Config::getIndexDir() );
+
   // Populate name filters
 
   nameFilters << "*.bgl" << "*.ifo" << "*.lsa" << "*.dat"
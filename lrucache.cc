@@ -0,0 +1,48 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the LICENSE file */
+
+#include "lrucache.hh"
+#include <QFileInfo>
+#include <QDateTime>
+#include <QMap>
+
+namespace {
+
+/// The id given to the current contents of a file
+struct FileId
+{
+  QString stamp; // The size and the modification time of the file
+  unsigned id;
+};
+
+Mutex fileIdsMutex;
+QMap< QString, FileId > fileIds;
+unsigned lastFileId = 0;
+
+}
+
+unsigned getCachedFileId( QFile const & file )
+{
+  QFileInfo fi( file.fileName() );
+
+  QString path = fi.absoluteFilePath();
+
+  QString stamp = QString::number( fi.size() ) + QChar( '\n' )
+                  + QString::number( fi.lastModified().toMSecsSinceEpoch() );
+
+  Mutex::Lock _( fileIdsMutex );
+
+  QMap< QString, FileId >::iterator i = fileIds.find( path );
+
+  if ( i != fileIds.end() && i.value().stamp == stamp )
+    return i.value().id;
+
+  // Either a new file, or a changed one. In the latter case the old id is
+  // replaced, so that there's only one entry for each file, and the data
+  // cached under the old id just ages out of the caches.
+  FileId & fileId = fileIds[ path ];
+
+  fileId.stamp = stamp;
+  fileId.id = ++lastFileId;
+
+  return fileId.id;
+}
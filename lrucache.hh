@@ -0,0 +1,179 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the LICENSE file */
+
+#ifndef __LRUCACHE_HH_INCLUDED__
+#define __LRUCACHE_HH_INCLUDED__
+
+#include <map>
+#include <list>
+#include <QByteArray>
+#include <QFile>
+#include "mutex.hh"
+
+/// A thread-safe cache of data buffers, limited by the total size of the
+/// buffers held rather than by their number. When the limit is exceeded,
+/// the least recently used buffers are dropped first. The buffers are
+/// QByteArrays, so handing them out doesn't copy any data -- they are
+/// shared, and should be treated as immutable by everyone.
+/// The Key is anything which has operator <.
+template< class Key >
+class LruCache
+{
+public:
+
+  /// Statistics of the cache usage
+  struct Stats
+  {
+    quint64 hits, misses;
+    size_t usedBytes, maxBytes;
+    size_t entries;
+
+    Stats(): hits( 0 ), misses( 0 ), usedBytes( 0 ), maxBytes( 0 ), entries( 0 )
+    {}
+  };
+
+  LruCache( size_t maxBytes_ ): maxBytes( maxBytes_ ), usedBytes( 0 ),
+    hits( 0 ), misses( 0 )
+  {}
+
+  /// Looks up the buffer by its key. Returns true and sets the data if it
+  /// was found, returns false otherwise. Every call gets counted as either
+  /// a hit or a miss.
+  bool find( Key const & key, QByteArray & data )
+  {
+    Mutex::Lock _( mutex );
+
+    typename Entries::iterator i = entries.find( key );
+
+    if ( i == entries.end() )
+    {
+      ++misses;
+      return false;
+    }
+
+    ++hits;
+
+    // Move it to the front, since it's now the most recently used one
+    lru.splice( lru.begin(), lru, i->second.lruPos );
+
+    data = i->second.data;
+
+    return true;
+  }
+
+  /// Stores the buffer under the given key, replacing any previous one.
+  /// Buffers larger than a quarter of the whole cache aren't stored at all,
+  /// since they would flush too much of it.
+  void insert( Key const & key, QByteArray const & data )
+  {
+    size_t size = data.size();
+
+    Mutex::Lock _( mutex );
+
+    if ( size > maxBytes / 4 )
+      return;
+
+    typename Entries::iterator i = entries.find( key );
+
+    if ( i != entries.end() )
+    {
+      usedBytes -= i->second.data.size();
+      i->second.data = data;
+      lru.splice( lru.begin(), lru, i->second.lruPos );
+    }
+    else
+    {
+      lru.push_front( key );
+
+      Entry & entry = entries[ key ];
+
+      entry.data = data;
+      entry.lruPos = lru.begin();
+    }
+
+    usedBytes += size;
+
+    trim();
+  }
+
+  /// Changes the maximum total size of the buffers held, dropping the
+  /// excess ones if needed. Zero effectively disables the cache.
+  void setMaxBytes( size_t value )
+  {
+    Mutex::Lock _( mutex );
+
+    maxBytes = value;
+
+    trim();
+  }
+
+  /// Drops all the buffers.
+  void clear()
+  {
+    Mutex::Lock _( mutex );
+
+    entries.clear();
+    lru.clear();
+    usedBytes = 0;
+  }
+
+  Stats getStats()
+  {
+    Mutex::Lock _( mutex );
+
+    Stats result;
+
+    result.hits = hits;
+    result.misses = misses;
+    result.usedBytes = usedBytes;
+    result.maxBytes = maxBytes;
+    result.entries = entries.size();
+
+    return result;
+  }
+
+private:
+
+  typedef std::list< Key > Lru;
+
+  struct Entry
+  {
+    QByteArray data;
+    typename Lru::iterator lruPos;
+  };
+
+  typedef std::map< Key, Entry > Entries;
+
+  Mutex mutex;
+  Entries entries;
+  Lru lru; // Most recently used keys are at the front
+
+  size_t maxBytes, usedBytes;
+  quint64 hits, misses;
+
+  /// Drops least recently used buffers until we fit. The mutex must be locked.
+  void trim()
+  {
+    while( usedBytes > maxBytes && !lru.empty() )
+    {
+      typename Entries::iterator i = entries.find( lru.back() );
+
+      usedBytes -= i->second.data.size();
+
+      entries.erase( i );
+      lru.pop_back();
+    }
+  }
+
+  LruCache( LruCache const & );
+  LruCache & operator = ( LruCache const & );
+};
+
+/// Returns a number identifying the contents of the given file, to be used
+/// in the cache keys. The same file gets the same id, unless its size or its
+/// modification time, to the millisecond, have changed since, so its data
+/// can be shared in a cache between different readers. Only the id of the
+/// latest contents of each file is kept, so the ids take no more memory than
+/// one entry per file ever opened.
+unsigned getCachedFileId( QFile const & );
+
+#endif
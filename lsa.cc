@@ -48,7 +48,7 @@ DEF_EX( exFailedToRetrieveVorbisInfo, "Failed to retrieve Vorbis info", Dictiona
 enum
 {
   Signature = 0x5841534c, // LSAX on little-endian, XASL on big-endian
-  CurrentFormatVersion = 5
+  CurrentFormatVersion = 5 + BtreeIndexing::FormatVersion
 };
 
 struct IdxHeader
@@ -307,6 +307,7 @@ MainWindow::MainWindow( Config::Class & cfg_ ):
     wordList = translateBox->wordList();
   }
   wordList->attachFinder( &wordFinder );
+  wordFinder.setFuzzyFallback( true );
 
   // for the old UI:
   ui.wordList->setTranslateLine( ui.translateLine );
@@ -975,6 +976,7 @@ MainWindow::~MainWindow()
   closeHeadwordsDialog();
 
   ftsIndexing.stopIndexing();
+  mergedIndexing.stopIndexing();
 
 #if QT_VERSION >= QT_VERSION_CHECK(4, 6, 0)
   ui.centralWidget->ungrabGesture( Gestures::GDPinchGestureType );
@@ -1255,7 +1257,9 @@ void MainWindow::makeDictionaries()
   dictionariesUnmuted.clear();
 
   ftsIndexing.stopIndexing();
+  mergedIndexing.stopIndexing();
   ftsIndexing.clearDictionaries();
+  mergedIndexing.clearDictionaries();
 
   loadDictionaries( this, isVisible(), cfg, dictionaries, dictNetMgr, false );
 
@@ -1268,6 +1272,10 @@ void MainWindow::makeDictionaries()
   ftsIndexing.setDictionaries( dictionaries );
   ftsIndexing.doIndexing();
 
+  mergedIndexing.setDictionaries( dictionaries );
+  if ( cfg.mergedHeadwordIndex )
+    mergedIndexing.doIndexing();
+
   updateStatusLine();
   updateGroupList();
   makeScanPopup();
@@ -1939,7 +1947,9 @@ void MainWindow::editDictionaries( unsigned editDictionaryGroup )
   closeFullTextSearchDialog();
 
   ftsIndexing.stopIndexing();
+  mergedIndexing.stopIndexing();
   ftsIndexing.clearDictionaries();
+  mergedIndexing.clearDictionaries();
 
   wordFinder.clear();
   dictionariesUnmuted.clear();
@@ -2002,6 +2012,10 @@ void MainWindow::editDictionaries( unsigned editDictionaryGroup )
 
   ftsIndexing.setDictionaries( dictionaries );
   ftsIndexing.doIndexing();
+
+  mergedIndexing.setDictionaries( dictionaries );
+  if ( cfg.mergedHeadwordIndex )
+    mergedIndexing.doIndexing();
 }
 
 void MainWindow::editCurrentGroup()
@@ -3497,7 +3511,9 @@ void MainWindow::on_rescanFiles_triggered()
   closeFullTextSearchDialog();
 
   ftsIndexing.stopIndexing();
+  mergedIndexing.stopIndexing();
   ftsIndexing.clearDictionaries();
+  mergedIndexing.clearDictionaries();
 
   groupInstances.clear(); // Release all the dictionaries they hold
   dictionaries.clear();
@@ -3515,6 +3531,10 @@ void MainWindow::on_rescanFiles_triggered()
   ftsIndexing.setDictionaries( dictionaries );
   ftsIndexing.doIndexing();
 
+  mergedIndexing.setDictionaries( dictionaries );
+  if ( cfg.mergedHeadwordIndex )
+    mergedIndexing.doIndexing();
+
   updateGroupList();
 
   makeScanPopup();
@@ -30,6 +30,7 @@
 #include "wordlist.hh"
 #include "dictheadwords.hh"
 #include "fulltextsearch.hh"
+#include "mergedindex.hh"
 #include "helpwindow.hh"
 
 #ifdef HAVE_X11
@@ -180,6 +181,7 @@ private:
   DictHeadwords * headwordsDlg;
 
   FTS::FtsIndexing ftsIndexing;
+  MergedIndex::Indexing mergedIndexing;
 
   FTS::FullTextSearchDialog * ftsDlg;
 
@@ -37,6 +37,10 @@
 #include <QDomDocument>
 #include <QTextDocumentFragment>
 #include <QDataStream>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
 
 #include "decompress.hh"
 #include "gddebug.hh"
@@ -79,6 +83,44 @@ static QDomNamedNodeMap parseHeaderAttributes( const QString & headerText )
   return attributes;
 }
 
+/// Decompresses and splits a single headword block. Runs in the decoding pool
+/// of the parser.
+class HeadWordBlockDecoder: public QRunnable
+{
+  MdictParser & parser;
+  QByteArray compressed;
+  qint64 decompressedSize;
+
+public:
+
+  MdictParser::HeadWordIndex headWordIndex;
+  bool succeeded;
+
+  QSemaphore hasFinished;
+
+  HeadWordBlockDecoder( MdictParser & parser_, QByteArray const & compressed_,
+                        qint64 decompressedSize_ ):
+    parser( parser_ ), compressed( compressed_ ),
+    decompressedSize( decompressedSize_ ), succeeded( false )
+  {
+    setAutoDelete( false );
+  }
+
+  virtual void run()
+  {
+    QByteArray decompressed;
+
+    succeeded = MdictParser::parseCompressedBlock( compressed.size(), compressed.constData(),
+                                                   decompressedSize, decompressed );
+    compressed.clear();
+
+    if ( succeeded )
+      headWordIndex = parser.splitHeadWordBlock( decompressed );
+
+    hasFinished.release();
+  }
+};
+
 size_t MdictParser::RecordIndex::bsearch( const vector<MdictParser::RecordIndex> & offsets, qint64 val )
 {
   if ( offsets.size() == 0 )
@@ -118,6 +160,11 @@ MdictParser::MdictParser() :
 {
 }
 
+MdictParser::~MdictParser()
+{
+  stopDecoding();
+}
+
 bool MdictParser::open( const char * filename )
 {
   filename_ = QString::fromUtf8( filename );
@@ -146,8 +193,22 @@ bool MdictParser::open( const char * filename )
   return true;
 }
 
+void MdictParser::enableParallelDecoding()
+{
+  int threads = QThread::idealThreadCount();
+
+  if ( threads < 2 || decodingPool_ )
+    return;
+
+  decodingPool_ = new QThreadPool;
+  decodingPool_->setMaxThreadCount( threads );
+}
+
 bool MdictParser::readNextHeadWordIndex( MdictParser::HeadWordIndex & headWordIndex )
 {
+  if ( decodingPool_ )
+    return decodeNextHeadWordIndex( headWordIndex );
+
   if ( headWordBlockInfosIter_ == headWordBlockInfos_.end() )
     return false;
 
@@ -172,6 +233,66 @@ bool MdictParser::readNextHeadWordIndex( MdictParser::HeadWordIndex & headWordIn
   return true;
 }
 
+bool MdictParser::decodeNextHeadWordIndex( MdictParser::HeadWordIndex & headWordIndex )
+{
+  // Only a few blocks are kept decoded ahead, to limit the memory used
+  size_t const maxQueued = decodingPool_->maxThreadCount() * 2;
+
+  while ( decoders_.size() < maxQueued && headWordBlockInfosIter_ != headWordBlockInfos_.end() )
+  {
+    qint64 compressedSize = headWordBlockInfosIter_->first;
+    qint64 decompressedSize = headWordBlockInfosIter_->second;
+
+    QByteArray compressed;
+
+    if ( compressedSize >= 8 && file_->seek( headWordPos_ ) )
+      compressed = file_->read( compressedSize );
+
+    if ( compressed.size() != compressedSize || compressedSize < 8 )
+    {
+      // Whatever is queued before this block still gets returned
+      headWordBlockInfosIter_ = headWordBlockInfos_.end();
+      break;
+    }
+
+    headWordPos_ += compressedSize;
+    headWordBlockInfosIter_++;
+
+    sptr< HeadWordBlockDecoder > decoder =
+      new HeadWordBlockDecoder( *this, compressed, decompressedSize );
+
+    decoders_.push_back( decoder );
+    decodingPool_->start( decoder.get() );
+  }
+
+  if ( decoders_.empty() )
+    return false;
+
+  sptr< HeadWordBlockDecoder > decoder = decoders_.front();
+  decoders_.pop_front();
+
+  decoder->hasFinished.acquire();
+
+  if ( !decoder->succeeded )
+  {
+    // The sequential reading stops at the broken block as well
+    stopDecoding();
+    headWordBlockInfosIter_ = headWordBlockInfos_.end();
+    return false;
+  }
+
+  headWordIndex.swap( decoder->headWordIndex );
+  return true;
+}
+
+void MdictParser::stopDecoding()
+{
+  if ( decodingPool_ )
+    decodingPool_->waitForDone();
+
+  decoders_.clear();
+}
+
 bool MdictParser::checkAdler32(const char * buffer, unsigned int len, quint32 checksum)
 {
   uLong adler = adler32( 0L, Z_NULL, 0 );
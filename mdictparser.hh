@@ -25,10 +25,15 @@
 #include <vector>
 #include <map>
 #include <utility>
+#include <deque>
 
 #include <QPointer>
 #include <QFile>
 
+#include "sptr.hh"
+
+class QThreadPool;
+
 namespace Mdict
 {
 
@@ -37,6 +42,8 @@ using std::vector;
 using std::pair;
 using std::map;
 
+class HeadWordBlockDecoder;
+
 // A helper class to handle memory map for QFile
 class ScopedMemMap
 {
@@ -154,9 +161,13 @@ public:
   }
 
   MdictParser();
-  ~MdictParser() {}
+  ~MdictParser();
 
   bool open( const char * filename );
+  /// Makes readNextHeadWordIndex() decompress and split the headword blocks
+  /// following the current one on a thread pool, ahead of time. The blocks
+  /// are still returned one by one, in the order of the file.
+  void enableParallelDecoding();
   bool readNextHeadWordIndex( HeadWordIndex & headWordIndex );
   bool readRecordBlock( HeadWordIndex & headWordIndex, RecordHandler & recordHandler );
 
@@ -186,6 +197,10 @@ protected:
   bool readRecordBlockInfos();
   BlockInfoVector decodeHeadWordBlockInfo( QByteArray const & headWordBlockInfo );
   HeadWordIndex splitHeadWordBlock( QByteArray const & block );
+  bool decodeNextHeadWordIndex( HeadWordIndex & headWordIndex );
+  void stopDecoding();
+
+  friend class HeadWordBlockDecoder;
 
 protected:
   QString filename_;
@@ -195,6 +210,10 @@ protected:
   BlockInfoVector::iterator headWordBlockInfosIter_;
   vector<RecordIndex> recordBlockInfos_;
 
+  // The headword blocks being decoded in parallel, in the order of the file
+  sptr<QThreadPool> decodingPool_;
+  std::deque< sptr<HeadWordBlockDecoder> > decoders_;
+
   QString encoding_;
   QString title_;
   QString description_;
@@ -18,6 +18,7 @@
 #include "filetype.hh"
 #include "ftshelpers.hh"
 #include "htmlescape.hh"
+#include "lrucache.hh"
 
 #include <algorithm>
 #include <map>
@@ -65,7 +66,7 @@ using namespace Mdict;
 enum
 {
   kSignature = 0x4349444d,  // MDIC
-  kCurrentFormatVersion = 11 + BtreeIndexing::FormatVersion + Folding::Version
+  kCurrentFormatVersion = 12 + BtreeIndexing::FormatVersion + Folding::Version
 };
 
 DEF_EX( exCorruptDictionary, "dictionary file was tampered or corrupted", std::exception )
@@ -89,7 +90,7 @@ struct IdxHeader
   uint32_t descriptionAddress; // Address of the dictionary description in the chunks' storage
   uint32_t descriptionSize; // Size of the description in the chunks' storage, 0 = no description
 
-  uint32_t styleSheetAddress;
+  quint64 styleSheetAddress;
   uint32_t styleSheetCount;
 
   uint32_t indexBtreeMaxElements; // Two fields from IndexInfo
@@ -98,7 +99,7 @@ struct IdxHeader
   uint32_t langFrom; // Source language
   uint32_t langTo; // Target language
 
-  uint32_t mddIndexInfosOffset; // address of IndexInfos for resource files (.mdd)
+  quint64 mddIndexInfosOffset; // address of IndexInfos for resource files (.mdd)
   uint32_t mddIndexInfosCount; // count of IndexInfos for resource files
 }
 #ifndef _MSC_VER
@@ -106,6 +107,61 @@ __attribute__( ( packed ) )
 #endif
 ;
 
+namespace {
+
+enum
+{
+  // The default size of the decompressed record blocks cache
+  RecordBlockCacheMaxSize = 32 * 1024 * 1024
+};
+
+/// The decompressed record blocks of all the mdx and mdd files. The keys are
+/// the file ids along with the positions of the compressed blocks.
+LruCache< pair< unsigned, qint64 > > recordBlockCache( RecordBlockCacheMaxSize );
+
+/// Gets the decompressed record block the given record is in, taking it from
+/// the cache if it's there. The file mutex is only held while the compressed
+/// block is being mapped and unmapped, not while it is being decompressed.
+/// Returns false if the block couldn't be read, or doesn't hold the record.
+bool loadRecordBlock( QFile & file, unsigned fileId, Mutex & fileMutex,
+                      MdictParser::RecordInfo const & recordInfo,
+                      QByteArray & block )
+{
+  pair< unsigned, qint64 > key( fileId, recordInfo.compressedBlockPos );
+
+  if ( !recordBlockCache.find( key, block ) )
+  {
+    uchar * compressed;
+
+    {
+      Mutex::Lock _( fileMutex );
+      compressed = file.map( recordInfo.compressedBlockPos, recordInfo.compressedBlockSize );
+    }
+
+    if ( !compressed )
+      return false;
+
+    bool ok = MdictParser::parseCompressedBlock( recordInfo.compressedBlockSize, ( char * )compressed,
+                                                 recordInfo.decompressedBlockSize, block );
+
+    {
+      Mutex::Lock _( fileMutex );
+      file.unmap( compressed );
+    }
+
+    if ( !ok )
+      return false;
+
+    recordBlockCache.insert( key, block );
+  }
+
+  return recordInfo.recordOffset >= 0 && recordInfo.recordSize >= 0 &&
+         recordInfo.recordOffset <= ( qint64 )block.size() &&
+         recordInfo.recordSize <= ( qint64 )block.size() - recordInfo.recordOffset;
+}
+
+}
+
 // A helper method to read resources from .mdd file
 class IndexedMdd: public BtreeIndexing::BtreeIndex
 {
@@ -113,6 +169,7 @@ class IndexedMdd: public BtreeIndexing::BtreeIndex
   Mutex fileMutex;
   ChunkedStorage::Reader & chunks;
   QFile mddFile;
+  unsigned fileId;
   bool isFileOpen;
 
 public:
@@ -120,6 +177,7 @@ public:
   IndexedMdd( Mutex & idxMutex, ChunkedStorage::Reader & chunks ):
     idxMutex( idxMutex ),
     chunks( chunks ),
+    fileId( 0 ),
     isFileOpen( false )
   {}
 
@@ -131,6 +189,8 @@ public:
   {
     mddFile.setFileName( QString::fromUtf8( fileName ) );
     isFileOpen = mddFile.open( QFile::ReadOnly );
+    if ( isFileOpen )
+      fileId = getCachedFileId( mddFile );
     return isFileOpen;
   }
 
@@ -146,8 +206,8 @@ public:
   {
     if ( !isFileOpen )
       return false;
-    vector< WordArticleLink > links = findArticles( name );
-    return !links.empty();
+    uint32_t offset;
+    return findFile( name, offset );
   }
 
   /// Attempts loading the given file into the given vector. Returns true on
@@ -157,28 +217,22 @@ public:
     if ( !isFileOpen )
       return false;
 
-    vector< WordArticleLink > links = findArticles( name );
-    if ( links.empty() )
+    uint32_t offset;
+    if ( !findFile( name, offset ) )
       return false;
 
     MdictParser::RecordInfo indexEntry;
     vector< char > chunk;
-    Mutex::Lock _( idxMutex );
-    const char * indexEntryPtr = chunks.getBlock( links[ 0 ].articleOffset, chunk );
-    memcpy( &indexEntry, indexEntryPtr, sizeof( indexEntry ) );
 
-    ScopedMemMap compressed( mddFile, indexEntry.compressedBlockPos, indexEntry.compressedBlockSize );
-    if ( !compressed.startAddress() )
     {
-      return false;
+      Mutex::Lock _( idxMutex );
+      const char * indexEntryPtr = chunks.getBlock( offset, chunk );
+      memcpy( &indexEntry, indexEntryPtr, sizeof( indexEntry ) );
     }
 
     QByteArray decompressed;
-    if ( !MdictParser::parseCompressedBlock( indexEntry.compressedBlockSize, ( char * )compressed.startAddress(),
-                                             indexEntry.decompressedBlockSize, decompressed ) )
-    {
+    if ( !loadRecordBlock( mddFile, fileId, fileMutex, indexEntry, decompressed ) )
       return false;
-    }
 
     result.resize( indexEntry.recordSize );
     memcpy( &result.front(), decompressed.constData() + indexEntry.recordOffset, indexEntry.recordSize );
@@ -190,12 +244,14 @@ public:
 class MdxDictionary: public BtreeIndexing::BtreeDictionary
 {
   Mutex idxMutex;
+  string idxFileName;
   File::Class idx;
   IdxHeader idxHeader;
   string dictionaryName;
   string encoding;
   ChunkedStorage::Reader chunks;
   QFile dictFile;
+  unsigned dictFileId;
   vector< sptr< IndexedMdd > > mddResources;
   MdictParser::StyleSheets styleSheets;
 
@@ -277,6 +333,10 @@ protected:
 private:
 
   virtual string const & ensureInitDone();
+
+  virtual void copyHeadwordsTo( IndexedWords &, uint32_t articleOffset,
+                                QAtomicInt * isCancelled );
+
   void doDeferredInit();
 
   /// Loads an article with the given offset, filling the given strings.
@@ -294,6 +354,7 @@ private:
 MdxDictionary::MdxDictionary( string const & id, string const & indexFile,
                               vector<string> const & dictionaryFiles ):
   BtreeDictionary( id, dictionaryFiles ),
+  idxFileName( indexFile ),
   idx( indexFile, "rb" ),
   idxHeader( idx.read< IdxHeader >() ),
   chunks( idx, idxHeader.chunksOffset ),
@@ -314,6 +375,7 @@ MdxDictionary::MdxDictionary( string const & id, string const & indexFile,
 
   dictFile.setFileName( QString::fromUtf8( dictionaryFiles[ 0 ].c_str() ) );
   dictFile.open( QIODevice::ReadOnly );
+  dictFileId = getCachedFileId( dictFile );
 
   // Full-text search parameters
 
@@ -387,6 +449,20 @@ string const & MdxDictionary::ensureInitDone()
   return initError;
 }
 
+void MdxDictionary::copyHeadwordsTo( IndexedWords & words, uint32_t articleOffset,
+                                     QAtomicInt * isCancelled )
+{
+  // The index is read by itself until the deferred init is done, so that
+  // merging the headwords doesn't force it
+  if ( Qt4x5::AtomicInt::loadAcquire( deferredInitDone ) )
+    BtreeDictionary::copyHeadwordsTo( words, articleOffset, isCancelled );
+  else
+    copyHeadwordsFromFile( idxFileName,
+                           IndexInfo( idxHeader.indexBtreeMaxElements,
+                                      idxHeader.indexRootOffset ),
+                           words, articleOffset, isCancelled );
+}
+
 void MdxDictionary::doDeferredInit()
 {
   if ( !Qt4x5::AtomicInt::loadAcquire( deferredInitDone ) )
@@ -979,24 +1055,24 @@ void MdxDictionary::loadIcon() throw()
 void MdxDictionary::loadArticle( uint32_t offset, string & articleText, bool noFilter )
 {
   vector< char > chunk;
-  Mutex::Lock _( idxMutex );
 
   // Load record info from index
   MdictParser::RecordInfo recordInfo;
-  char * pRecordInfo = chunks.getBlock( offset, chunk );
-  memcpy( &recordInfo, pRecordInfo, sizeof( recordInfo ) );
-
-  // Make a sub unique id for this article
   QString articleId;
-  articleId.setNum( ( quint64 )pRecordInfo, 16 );
 
-  ScopedMemMap compressed( dictFile, recordInfo.compressedBlockPos, recordInfo.compressedBlockSize );
-  if ( !compressed.startAddress() )
-    throw exCorruptDictionary();
+  {
+    Mutex::Lock _( idxMutex );
+    char * pRecordInfo = chunks.getBlock( offset, chunk );
+    memcpy( &recordInfo, pRecordInfo, sizeof( recordInfo ) );
 
+    // Make a sub unique id for this article
+    articleId.setNum( ( quint64 )pRecordInfo, 16 );
+  }
+
+  // The mutex also guards the dictionary file, but the block is decompressed
+  // without holding it
   QByteArray decompressed;
-  if ( !MdictParser::parseCompressedBlock( recordInfo.compressedBlockSize, ( char * )compressed.startAddress(),
-                                           recordInfo.decompressedBlockSize, decompressed ) )
+  if ( !loadRecordBlock( dictFile, dictFileId, idxMutex, recordInfo, decompressed ) )
     throw exCorruptDictionary();
 
   QString article = MdictParser::toUtf16( encoding.c_str(),
@@ -1445,6 +1521,8 @@ vector< sptr< Dictionary::Class > > makeDictionaries( vector< string > const & f
       if ( !parser.open( i->c_str() ) )
         continue;
 
+      parser.enableParallelDecoding();
+
       string title = string( parser.title().toUtf8().constData() );
       initializing.indexingDictionary( title );
 
@@ -1459,6 +1537,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries( vector< string > const & f
             gdWarning( "Broken mdd (resource) file: %s\n", mddIter->c_str() );
             continue;
           }
+          mddParser->enableParallelDecoding();
           mddParsers.push_back( mddParser );
         }
       }
@@ -1487,6 +1566,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries( vector< string > const & f
       // This map maps folded words to the original words and the corresponding
       // articles' offsets.
       IndexedWords indexedWords;
+      indexedWords.enableSpilling();
       ChunkedStorage::Writer chunks( idx );
 
       idxHeader.isRightToLeft = parser.isRightToLeft();
@@ -1515,6 +1595,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries( vector< string > const & f
       {
         sptr< MdictParser > mddParser = mddParsers.front();
         sptr< IndexedWords > mddIndexedWords = new IndexedWords();
+        mddIndexedWords->enableSpilling();
         MdictParser::HeadWordIndex resourcesIndex;
         ResourceHandler resourceHandler( chunks, *mddIndexedWords );
 
@@ -1581,7 +1662,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries( vector< string > const & f
       for ( vector< sptr< IndexedWords > >::const_iterator mddIndexIter = mddIndices.begin();
             mddIndexIter != mddIndices.end(); mddIndexIter++ )
       {
-        IndexInfo resourceIdxInfo = BtreeIndexing::buildIndex( *( *mddIndexIter ), idx );
+        IndexInfo resourceIdxInfo = BtreeIndexing::buildIndex( *( *mddIndexIter ), idx, 0, true );
         mddIndexInfos.push_back( resourceIdxInfo );
       }
 
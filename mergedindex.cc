@@ -0,0 +1,289 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the LICENSE file */
+
+#include "mergedindex.hh"
+#include "config.hh"
+#include "folding.hh"
+#include "fsencoding.hh"
+#include "gddebug.hh"
+#include "qt4x5.hh"
+#include <QDir>
+#include <QThreadPool>
+
+namespace MergedIndex {
+
+using BtreeIndexing::BtreeDictionary;
+using BtreeIndexing::BtreeWordSearchRequest;
+using BtreeIndexing::IndexedWords;
+using BtreeIndexing::IndexInfo;
+using std::pair;
+
+namespace {
+
+sptr< Index > currentIndex;
+
+DEF_EX( exCantCreateIndex, "Can't create the merged headword index file", Dictionary::Ex )
+
+}
+
+Index::Index( sptr< QTemporaryFile > const & file, IndexInfo const & indexInfo,
+              vector< string > const & dictionaryIds_ ):
+  BtreeDictionary( "merged-headword-index", vector< string >() ),
+  tempFile( file ),
+  idx( FsEncoding::encode( file->fileName() ), "rb" ),
+  dictionaryIds( dictionaryIds_ )
+{
+  for( unsigned x = 0; x < dictionaryIds.size(); ++x )
+    if ( dictionaryIds[ x ].size() )
+      dictionaryNumbers[ dictionaryIds[ x ] ] = x;
+
+  openIndex( indexInfo, idx, idxMutex );
+}
+
+int Index::getDictionaryNumber( string const & id ) const
+{
+  map< string, int >::const_iterator i = dictionaryNumbers.find( id );
+
+  return i == dictionaryNumbers.end() ? -1 : i->second;
+}
+
+/// Only takes the links of the dictionaries wanted.
+class MergedWordSearchRequest: public BtreeWordSearchRequest
+{
+  friend class MergedWordSearchRunnable;
+
+  vector< char > dicts;
+
+  // The matches by their case-folded words, see addFoundWord()
+  map< wstring, size_t > lowerCasedMatches;
+
+protected:
+
+  virtual bool acceptsArticle( uint32_t articleOffset )
+  { return articleOffset < dicts.size() && dicts[ articleOffset ]; }
+
+  virtual void addFoundWord( wstring const & word );
+
+public:
+
+  MergedWordSearchRequest( Index & index, vector< char > const & dicts_,
+                           wstring const & str_,
+                           unsigned minLength_,
+                           int maxSuffixVariation_,
+                           bool allowMiddleMatches_,
+                           unsigned long maxResults_ );
+};
+
+class MergedWordSearchRunnable: public QRunnable
+{
+  MergedWordSearchRequest & r;
+  QSemaphore & hasExited;
+
+public:
+
+  MergedWordSearchRunnable( MergedWordSearchRequest & r_,
+                            QSemaphore & hasExited_ ): r( r_ ),
+                                                       hasExited( hasExited_ )
+  {}
+
+  ~MergedWordSearchRunnable()
+  {
+    hasExited.release();
+  }
+
+  virtual void run()
+  { r.run(); }
+};
+
+MergedWordSearchRequest::MergedWordSearchRequest( Index & index,
+                                                  vector< char > const & dicts_,
+                                                  wstring const & str_,
+                                                  unsigned minLength_,
+                                                  int maxSuffixVariation_,
+                                                  bool allowMiddleMatches_,
+                                                  unsigned long maxResults_ ):
+  BtreeWordSearchRequest( index, str_, minLength_, maxSuffixVariation_,
+                          allowMiddleMatches_, maxResults_, false ),
+  dicts( dicts_ )
+{
+  QThreadPool::globalInstance()->start(
+    new MergedWordSearchRunnable( *this, hasExited ) );
+}
+
+void MergedWordSearchRequest::addFoundWord( wstring const & word )
+{
+  // The same headword is often found in several of the dictionaries, in
+  // different cases. WordFinder would fold these into one result anyway, so
+  // they are folded here already and don't count against maxResults more
+  // than once.
+  wstring lowerCased = Folding::applySimpleCaseOnly( word );
+
+  pair< map< wstring, size_t >::iterator, bool > inserted =
+    lowerCasedMatches.insert( pair< wstring, size_t >( lowerCased, matches.size() ) );
+
+  if ( inserted.second )
+    addMatch( word );
+  else
+  if ( matches[ inserted.first->second ].word != word )
+  {
+    // The case is different -- agree on a lowercase version
+    matches[ inserted.first->second ].word = lowerCased;
+  }
+}
+
+sptr< Dictionary::WordSearchRequest > Index::prefixMatchIn( vector< char > const & dicts,
+                                                            wstring const & str,
+                                                            unsigned long maxResults )
+{
+  return new MergedWordSearchRequest( *this, dicts, str, 0, -1, true, maxResults );
+}
+
+sptr< Dictionary::WordSearchRequest > Index::stemmedMatchIn( vector< char > const & dicts,
+                                                             wstring const & str,
+                                                             unsigned minLength,
+                                                             unsigned maxSuffixVariation,
+                                                             unsigned long maxResults )
+{
+  return new MergedWordSearchRequest( *this, dicts, str, minLength,
+                                      (int)maxSuffixVariation, false, maxResults );
+}
+
+sptr< Index > current()
+{
+  return currentIndex;
+}
+
+void Builder::run()
+{
+  try
+  {
+    IndexedWords indexedWords;
+
+    indexedWords.enableSpilling();
+
+    // The ids of the dictionaries merged, in the order of their numbers. The
+    // ones which failed halfway get empty ids, so their links are never used.
+    vector< string > ids;
+
+    for( size_t x = 0; x < dictionaries.size(); ++x )
+    {
+      if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+        return;
+
+      BtreeDictionary * dict =
+        dynamic_cast< BtreeDictionary * >( dictionaries[ x ].get() );
+
+      if ( !dict || !dict->hasAllHeadwordsIndexed() )
+        continue;
+
+      ids.push_back( dict->getId() );
+
+      try
+      {
+        // The dictionaries with deferred init read their indices by
+        // themselves, without getting initialized
+        dict->copyHeadwordsTo( indexedWords, ids.size() - 1, &isCancelled );
+      }
+      catch( std::exception & e )
+      {
+        gdWarning( "Can't merge the headwords of \"%s\", error: %s\n",
+                   dict->getName().c_str(), e.what() );
+
+        ids.back().clear();
+      }
+    }
+
+    if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+      return;
+
+    sptr< QTemporaryFile > tempFile =
+      new QTemporaryFile( QDir( Config::getIndexDir() ).filePath( "gd_merged_XXXXXX" ) );
+
+    if ( !tempFile->open() )
+      throw exCantCreateIndex();
+
+    IndexInfo indexInfo( 0, 0 );
+
+    {
+      File::Class file( FsEncoding::encode( tempFile->fileName() ), "w+b" );
+
+      indexInfo = BtreeIndexing::buildIndex( indexedWords, file );
+    }
+
+    indexedWords.clear();
+
+    Index * index = new Index( tempFile, indexInfo, ids );
+
+    GD_DPRINTF( "Merged the headwords of %u dictionaries\n", (unsigned) ids.size() );
+
+    {
+      Mutex::Lock _( resultMutex );
+
+      delete result;
+      result = index;
+    }
+
+    emit built();
+  }
+  catch( std::exception & e )
+  {
+    gdWarning( "Merged headword index building failed: %s\n", e.what() );
+  }
+}
+
+Indexing::Indexing():
+  started( false ), result( 0 )
+{
+}
+
+void Indexing::doIndexing()
+{
+  if( started )
+    stopIndexing();
+
+  while( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+    isCancelled.deref();
+
+  Builder * builder = new Builder( isCancelled, dictionaries, resultMutex, result,
+                                   indexingExited );
+
+  connect( builder, SIGNAL( built() ), this, SLOT( indexBuilt() ),
+           Qt::QueuedConnection );
+
+  QThreadPool::globalInstance()->start( builder );
+
+  started = true;
+}
+
+void Indexing::stopIndexing()
+{
+  if( started )
+  {
+    if( !Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+      isCancelled.ref();
+
+    indexingExited.acquire();
+    started = false;
+  }
+
+  {
+    Mutex::Lock _( resultMutex );
+
+    delete result;
+    result = 0;
+  }
+
+  currentIndex.reset();
+}
+
+void Indexing::indexBuilt()
+{
+  Mutex::Lock _( resultMutex );
+
+  if ( result )
+  {
+    currentIndex = result;
+    result = 0;
+  }
+}
+
+}
@@ -0,0 +1,175 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the LICENSE file */
+
+#ifndef __MERGEDINDEX_HH_INCLUDED__
+#define __MERGEDINDEX_HH_INCLUDED__
+
+#include <QObject>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QTemporaryFile>
+#include "btreeidx.hh"
+#include "file.hh"
+#include "mutex.hh"
+#include "sptr.hh"
+
+/// The headwords of all the local btree-indexed dictionaries, merged into
+/// a single btree built in background out of their indices. WordFinder
+/// searches it instead of each of those dictionaries, so a single descent
+/// finds the words of all of them.
+namespace MergedIndex {
+
+using std::string;
+using std::vector;
+using std::map;
+using gd::wstring;
+
+/// The merged index itself. Each folded key leads to the headwords of all
+/// the dictionaries having it, and the article offset of each link is the
+/// number of the dictionary it comes from.
+class Index: public BtreeIndexing::BtreeDictionary
+{
+public:
+
+  /// Opens the index built in the given file, which it takes over. The ids
+  /// of the dictionaries merged are given in the order of their numbers.
+  Index( sptr< QTemporaryFile > const & file, BtreeIndexing::IndexInfo const &,
+         vector< string > const & dictionaryIds );
+
+  /// Returns the number of the dictionary with the given id in the index,
+  /// or -1 if it isn't there.
+  int getDictionaryNumber( string const & id ) const;
+
+  unsigned getDictionaryCount() const
+  { return dictionaryIds.size(); }
+
+  /// Same as prefixMatch() and stemmedMatch(), but only find the words of
+  /// the given dictionaries. They are given as flags indexed by their numbers.
+  /// Unlike with the separate searches of those dictionaries, maxResults
+  /// limits the words found in all of them together. The words which only
+  /// differ in case are counted once, and given in lowercase.
+  sptr< Dictionary::WordSearchRequest > prefixMatchIn( vector< char > const & dicts,
+                                                       wstring const &,
+                                                       unsigned long maxResults );
+
+  sptr< Dictionary::WordSearchRequest > stemmedMatchIn( vector< char > const & dicts,
+                                                        wstring const &,
+                                                        unsigned minLength,
+                                                        unsigned maxSuffixVariation,
+                                                        unsigned long maxResults );
+
+  virtual string getName() throw()
+  { return "Merged headword index"; }
+
+  virtual map< Dictionary::Property, string > getProperties() throw()
+  { return map< Dictionary::Property, string >(); }
+
+  virtual unsigned long getArticleCount() throw()
+  { return 0; }
+
+  virtual unsigned long getWordCount() throw()
+  { return 0; }
+
+  /// There are no articles in here, only the headwords.
+  virtual sptr< Dictionary::DataRequest > getArticle( wstring const &,
+                                                      vector< wstring > const &,
+                                                      wstring const &,
+                                                      bool )
+    THROW_SPEC( std::exception )
+  { return new Dictionary::DataRequestInstant( false ); }
+
+private:
+
+  sptr< QTemporaryFile > tempFile;
+  File::Class idx;
+  Mutex idxMutex;
+  vector< string > dictionaryIds;
+  map< string, int > dictionaryNumbers;
+};
+
+/// Returns the merged index built last, or a null pointer if there's none.
+/// This must only be used from the main thread.
+sptr< Index > current();
+
+/// Builds the merged index. Run from the pool by Indexing.
+class Builder: public QObject, public QRunnable
+{
+  Q_OBJECT
+
+  QAtomicInt & isCancelled;
+  vector< sptr< Dictionary::Class > > const & dictionaries;
+  Mutex & resultMutex;
+  Index * & result;
+  QSemaphore & hasExited;
+
+public:
+
+  Builder( QAtomicInt & cancelled, vector< sptr< Dictionary::Class > > const & dicts,
+           Mutex & resultMutex_, Index * & result_, QSemaphore & hasExited_ ):
+    isCancelled( cancelled ),
+    dictionaries( dicts ),
+    resultMutex( resultMutex_ ),
+    result( result_ ),
+    hasExited( hasExited_ )
+  {}
+
+  ~Builder()
+  {
+    hasExited.release();
+  }
+
+  virtual void run();
+
+signals:
+
+  /// Emitted once the index is stored to the result.
+  void built();
+};
+
+/// Builds the merged index in background, and makes it current() once it's
+/// done. The dictionaries are given the same way FTS::FtsIndexing gets them.
+class Indexing: public QObject
+{
+  Q_OBJECT
+
+public:
+
+  Indexing();
+
+  virtual ~Indexing()
+  { stopIndexing(); }
+
+  void setDictionaries( vector< sptr< Dictionary::Class > > const & dicts )
+  {
+    clearDictionaries();
+    dictionaries = dicts;
+  }
+
+  void clearDictionaries()
+  { dictionaries.clear(); }
+
+  /// Starts building the index for the dictionaries given.
+  void doIndexing();
+
+  /// Stops building the index, if it's underway, and drops the current one,
+  /// since the dictionaries it refers to are likely to go.
+  void stopIndexing();
+
+private:
+
+  QAtomicInt isCancelled;
+  QSemaphore indexingExited;
+  vector< sptr< Dictionary::Class > > dictionaries;
+  bool started;
+
+  // The index the builder has just built, not yet made current
+  Mutex resultMutex;
+  Index * result;
+
+private slots:
+
+  void indexBuilt();
+};
+
+}
+
+#endif
@@ -122,6 +122,7 @@ ScanPopup::ScanPopup( QWidget * parent,
   ui.mainLayout->addWidget( definition );
 
   ui.translateBox->wordList()->attachFinder( &wordFinder );
+  wordFinder.setFuzzyFallback( true );
   ui.translateBox->wordList()->setFocusPolicy(Qt::ClickFocus);
   ui.translateBox->translateLine()->installEventFilter( this );
 
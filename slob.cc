@@ -1659,6 +1659,9 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
           IndexedWords indexedWords, indexedResources;
 
+          indexedWords.enableSpilling();
+          indexedResources.enableSpilling();
+
           set< quint64 > articlesPos;
           quint32 articleCount = 0, wordCount = 0;
 
@@ -7,6 +7,7 @@
 #include "utf8.hh"
 #include "chunkedstorage.hh"
 #include "dictzip.h"
+#include "dictzipcache.hh"
 #include "xdxf2html.hh"
 #include "htmlescape.hh"
 #include "langcoder.hh"
@@ -141,7 +142,6 @@ class StardictDictionary: public BtreeIndexing::BtreeDictionary
   string bookName;
   string sameTypeSequence;
   ChunkedStorage::Reader chunks;
-  Mutex dzMutex;
   dictData * dz;
   Mutex resourceZipMutex;
   IndexedZip resourceZip;
@@ -982,14 +982,8 @@ void StardictDictionary::loadArticle( uint32_t address,
 
   getArticleProps( address, headword, offset, size );
 
-  char * articleBody;
-
-  {
-    Mutex::Lock _( dzMutex );
-
-    // Note that the function always zero-pads the result.
-    articleBody = dict_data_read_( dz, offset, size, 0, 0 );
-  }
+  // Note that the function always zero-pads the result.
+  char * articleBody = dict_data_read_( dz, offset, size, 0, 0 );
 
   if ( !articleBody )
   {
@@ -1233,6 +1227,9 @@ void StardictDictionary::makeFTSIndex( QAtomicInt & isCancelled, bool firstItera
 
   try
   {
+    // The articles are read in the order of their offsets
+    DictZip::Readahead readahead( dz );
+
     FtsHelpers::makeFTSIndex( this, isCancelled );
     FTS_index_completed.ref();
   }
@@ -2195,6 +2192,8 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
         IndexedWords indexedWords;
 
+        indexedWords.enableSpilling();
+
         ChunkedStorage::Writer chunks( idx );
 
         // Load indices
@@ -2269,7 +2268,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
           {
             // Build the resulting zip file index
 
-            IndexInfo idxInfo = BtreeIndexing::buildIndex( zipFileNames, idx );
+            IndexInfo idxInfo = BtreeIndexing::buildIndex( zipFileNames, idx, 0, true );
 
             idxHeader.zipIndexBtreeMaxElements = idxInfo.btreeMaxElements;
             idxHeader.zipIndexRootOffset = idxInfo.rootOffset;
@@ -15,10 +15,22 @@ using gd::wchar;
 using std::map;
 using std::pair;
 
+namespace {
+
+enum
+{
+  // The shortest words a fuzzy-match search is done for when the prefix-match
+  // one finds nothing, and the shortest ones allowed two typos rather than one
+  FuzzyFallbackMinLength = 3,
+  FuzzyFallbackTwoTyposLength = 6
+};
+
+}
+
 WordFinder::WordFinder( QObject * parent ):
   QObject( parent ), searchInProgress( false ),
   updateResultsTimer( this ),
-  searchQueued( false )
+  searchQueued( false ), fuzzyFallback( false )
 {
   updateResultsTimer.setInterval( 1000 ); // We use a one second update timer
   updateResultsTimer.setSingleShot( true );
@@ -86,6 +98,30 @@ void WordFinder::stemmedMatch( QString const & str,
     startSearch();
 }
 
+void WordFinder::fuzzyMatch( QString const & str,
+                             std::vector< sptr< Dictionary::Class > > const & dicts,
+                             unsigned maxDistance,
+                             unsigned long maxResults,
+                             Dictionary::Features features )
+{
+  cancel();
+
+  searchQueued = true;
+  searchType = FuzzyMatch;
+  inputWord = str;
+  inputDicts = &dicts;
+  requestedMaxResults = maxResults;
+  requestedFeatures = features;
+  fuzzyMaxDistance = maxDistance;
+
+  resultsArray.clear();
+  resultsIndex.clear();
+  searchResults.clear();
+
+  if ( queuedRequests.empty() )
+    startSearch();
+}
+
 void WordFinder::expressionMatch( QString const & str,
                                   std::vector< sptr< Dictionary::Class > > const & dicts,
                                   unsigned long maxResults,
@@ -140,6 +176,19 @@ void WordFinder::startSearch()
     allWordWritings.insert( allWordWritings.end(), writings.begin(), writings.end() );
   }
 
+  // The merged index, if there's one, stands in for all the dictionaries it
+  // has. Fuzzy matching isn't done with it.
+
+  mergedIndex = ( searchType == FuzzyMatch ) ? sptr< MergedIndex::Index >() :
+                                               MergedIndex::current();
+
+  vector< char > mergedDicts;
+
+  if ( mergedIndex.get() )
+    mergedDicts.resize( mergedIndex->getDictionaryCount(), 0 );
+
+  bool anyMergedDicts = false;
+
   // Query each dictionary for all word writings
 
   for( size_t x = 0; x < inputDicts->size(); ++x )
@@ -147,6 +196,18 @@ void WordFinder::startSearch()
     if ( ( (*inputDicts)[ x ]->getFeatures() & requestedFeatures ) != requestedFeatures )
       continue;
 
+    if ( mergedIndex.get() )
+    {
+      int n = mergedIndex->getDictionaryNumber( (*inputDicts)[ x ]->getId() );
+
+      if ( n >= 0 )
+      {
+        mergedDicts[ n ] = 1;
+        anyMergedDicts = true;
+        continue;
+      }
+    }
+
     for( size_t y = 0; y < allWordWritings.size(); ++y )
     {
       try
@@ -154,6 +215,8 @@ void WordFinder::startSearch()
         sptr< Dictionary::WordSearchRequest > sr =
           ( searchType == PrefixMatch || searchType == ExpressionMatch ) ?
             (*inputDicts)[ x ]->prefixMatch( allWordWritings[ y ], requestedMaxResults ) :
+          searchType == FuzzyMatch ?
+            (*inputDicts)[ x ]->fuzzyMatch( allWordWritings[ y ], fuzzyMaxDistance, requestedMaxResults ) :
             (*inputDicts)[ x ]->stemmedMatch( allWordWritings[ y ], stemmedMinLength, stemmedMaxSuffixVariation, requestedMaxResults );
 
         connect( sr.get(), SIGNAL( finished() ),
@@ -169,6 +232,31 @@ void WordFinder::startSearch()
     }
   }
 
+  if ( anyMergedDicts )
+  {
+    for( size_t y = 0; y < allWordWritings.size(); ++y )
+    {
+      try
+      {
+        sptr< Dictionary::WordSearchRequest > sr =
+          ( searchType == PrefixMatch || searchType == ExpressionMatch ) ?
+            mergedIndex->prefixMatchIn( mergedDicts, allWordWritings[ y ], requestedMaxResults ) :
+            mergedIndex->stemmedMatchIn( mergedDicts, allWordWritings[ y ], stemmedMinLength,
+                                         stemmedMaxSuffixVariation, requestedMaxResults );
+
+        connect( sr.get(), SIGNAL( finished() ),
+                 this, SLOT( requestFinished() ), Qt::QueuedConnection );
+
+        queuedRequests.push_back( sr );
+      }
+      catch( std::exception & e )
+      {
+        gdWarning( "Word \"%s\" search error (%s) in the merged headword index\n",
+                   inputWord.toUtf8().data(), e.what() );
+      }
+    }
+  }
+
   // Handle any requests finished already
 
   requestFinished();
@@ -187,6 +275,7 @@ void WordFinder::clear()
   cancel();
   queuedRequests.clear();
   finishedRequests.clear();
+  mergedIndex.reset();
 }
 
 void WordFinder::requestFinished()
@@ -358,6 +447,11 @@ void WordFinder::updateResults()
 
         insertResult.first->second = --resultsArray.end();
       }
+
+      // Fuzzy matches are ranked by their distance, which is the negated
+      // weight. The best one found for the word counts.
+      if ( searchType == FuzzyMatch && -weight < insertResult.first->second->rank )
+        insertResult.first->second->rank = -weight;
     }
     finishedRequests.erase( i++ );
   }
@@ -486,6 +580,14 @@ void WordFinder::updateResults()
 
       maxSearchResults = 15;
     }
+    else
+    if( searchType == FuzzyMatch )
+    {
+      // The ranks were assigned as the results came
+      resultsArray.sort( SortByRankAndLength() );
+
+      maxSearchResults = requestedMaxResults;
+    }
   }
 
   searchResults.clear();
@@ -508,6 +610,17 @@ void WordFinder::updateResults()
     emit updated();
   }
   else
+  if ( fuzzyFallback && searchType == PrefixMatch && resultsArray.empty() &&
+       inputWord.size() >= FuzzyFallbackMinLength )
+  {
+    // Nothing starts with the word, so look for the words close to it instead
+    searchType = FuzzyMatch;
+    fuzzyMaxDistance = inputWord.size() >= FuzzyFallbackTwoTyposLength ? 2 : 1;
+    searchQueued = true;
+
+    startSearch();
+  }
+  else
   {
     // That were all of them.
     searchInProgress = false;
@@ -12,6 +12,7 @@
 #include <QWaitCondition>
 #include <QRunnable>
 #include "dictionary.hh"
+#include "mergedindex.hh"
 
 /// This component takes care of finding words. The search is asynchronous.
 /// This means the GUI doesn't get blocked during the sometimes lenghtly
@@ -42,15 +43,22 @@ private:
   {
     PrefixMatch,
     StemmedMatch,
-    ExpressionMatch
+    ExpressionMatch,
+    FuzzyMatch
   } searchType;
   unsigned long requestedMaxResults;
   Dictionary::Features requestedFeatures;
   unsigned stemmedMinLength;
   unsigned stemmedMaxSuffixVariation;
+  unsigned fuzzyMaxDistance;
+  bool fuzzyFallback;
 
   std::vector< sptr< Dictionary::Class > > const * inputDicts;
 
+  // The merged index the current search uses, if any. It is kept here for as
+  // long as there are requests to it.
+  sptr< MergedIndex::Index > mergedIndex;
+
   std::vector< gd::wstring > allWordWritings; // All writings of the inputWord
   
   struct OneResult
@@ -81,6 +89,9 @@ public:
   /// the dictionaries which possess all the features requested.
   /// If there already was a prefixMatch operation underway, it gets cancelled
   /// and the new one replaces it.
+  /// The dictionaries which are in the current merged headword index (see
+  /// MergedIndex) are all searched at once with a single request to it, so
+  /// maxResults limits their results together rather than each one's.
   void prefixMatch( QString const &,
                     std::vector< sptr< Dictionary::Class > > const &,
                     unsigned long maxResults = 40,
@@ -102,6 +113,22 @@ public:
                         unsigned long maxResults = 40,
                         Dictionary::Features = Dictionary::NoFeatures );
 
+  /// Do a fuzzy-match search in the given list of dictionaries, finding the
+  /// words which differ from the given one by at most maxDistance inserted,
+  /// deleted or substituted characters. The results are ranked by their
+  /// distance, the exact matches being first. All comments from prefixMatch()
+  /// generally apply as well.
+  void fuzzyMatch( QString const &,
+                   std::vector< sptr< Dictionary::Class > > const &,
+                   unsigned maxDistance = 2,
+                   unsigned long maxResults = 30,
+                   Dictionary::Features = Dictionary::NoFeatures );
+
+  /// If enabled, a prefix-match search which finds nothing continues as a
+  /// fuzzy-match one, so the words close to a misspelled one are suggested.
+  void setFuzzyFallback( bool enabled )
+  { fuzzyFallback = enabled; }
+
   /// Returns the vector containing search results from the last operation.
   /// If it didn't finish yet, the result is not final and may be changing
   /// over time.
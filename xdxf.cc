@@ -131,7 +131,6 @@ class XdxfDictionary: public BtreeIndexing::BtreeDictionary
   File::Class idx;
   IdxHeader idxHeader;
   sptr< ChunkedStorage::Reader > chunks;
-  Mutex dzMutex;
   dictData * dz;
   Mutex resourceZipMutex;
   IndexedZip resourceZip;
@@ -658,14 +657,8 @@ void XdxfDictionary::loadArticle( uint32_t address,
 
   // Load the article
 
-  char * articleBody;
-
-  {
-    Mutex::Lock _( dzMutex );
-
-    // Note that the function always zero-pads the result.
-    articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
-  }
+  // Note that the function always zero-pads the result.
+  char * articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
 
   if ( !articleBody )
   {
@@ -1437,7 +1430,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
                 {
                   // Build the resulting zip file index
 
-                  IndexInfo idxInfo = BtreeIndexing::buildIndex( zipFileNames, idx );
+                  IndexInfo idxInfo = BtreeIndexing::buildIndex( zipFileNames, idx, 0, true );
 
                   idxHeader.zipIndexBtreeMaxElements = idxInfo.btreeMaxElements;
                   idxHeader.zipIndexRootOffset = idxInfo.rootOffset;
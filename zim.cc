@@ -19,6 +19,7 @@
 #include "ftshelpers.hh"
 #include "htmlescape.hh"
 #include "splitfile.hh"
+#include "lrucache.hh"
 
 #ifdef _MSC_VER
 #include <stub_msvc.h>
@@ -45,8 +46,6 @@
 
 namespace Zim {
 
-#define CACHE_SIZE 3
-
 using std::string;
 using std::map;
 using std::vector;
@@ -72,7 +71,16 @@ class ZimFile;
 
 enum CompressionType
 {
-  Default = 0, None, Zlib, Bzip2, Lzma2
+  Default = 0, None, Zlib, Bzip2, Lzma2, Zstd
+};
+
+enum
+{
+  // The low bits of the byte each cluster begins with are its compression
+  // type, and this bit marks the extended clusters, whose blob offsets are
+  // 64-bit rather than 32-bit
+  ClusterCompressionMask = 0x0F,
+  ClusterExtended = 0x10
 };
 
 /// Zim file header
@@ -151,71 +159,62 @@ __attribute__((packed))
 
 #pragma pack( pop )
 
-// Class for support of split zim files
-
-struct Cache
+enum
 {
-  char * data;
-  quint32 clusterNumber;
-  int stamp;
-  int count, size;
-
-  Cache() :
-    data( 0 ),
-    clusterNumber( 0 ),
-    stamp( -1 ),
-    count( 0 ),
-    size( 0 )
-  {}
+  // The default size of the decompressed clusters cache
+  ClusterCacheMaxSize = 64 * 1024 * 1024
 };
 
+/// The decompressed clusters of all the zim files. The keys are the file
+/// ids along with the cluster numbers. Each buffer begins with the info byte
+/// of its cluster, which tells whether it's extended, followed by the data.
+LruCache< pair< unsigned, quint32 > > clusterCache( ClusterCacheMaxSize );
+
+// Class for support of split zim files
+
 class ZimFile : public SplitFile::SplitFile
 {
 public:
   ZimFile();
   ZimFile( const QString & name );
-  ~ZimFile();
 
   virtual void setFileName( const QString & name );
   bool open();
-  void close()
-  {
-    SplitFile::close();
-    clearCache();
-  }
   const ZIM_header & header() const
   { return zimHeader; }
-  string getClusterData( quint32 cluster_nom );
+
+  /// Returns the cluster info byte followed by the decompressed cluster, or
+  /// an empty buffer on error. The buffer is shared with the cluster cache,
+  /// and the file is only locked while the cluster is read, not while it's
+  /// being decompressed.
+  QByteArray getClusterData( quint32 cluster_nom );
+
+  /// The mutex to hold while seeking in and reading from the file
+  Mutex & mutex()
+  { return fileMutex; }
 
 private:
   ZIM_header zimHeader;
-  Cache cache[ CACHE_SIZE ];
-  int stamp;
-
-  void clearCache();
+  unsigned fileId;
+  Mutex fileMutex;
 };
 
 ZimFile::ZimFile() :
-  stamp( 0 )
+  fileId( 0 )
 {
   memset( &zimHeader, 0, sizeof( zimHeader ) );
 }
 
-ZimFile::ZimFile( const QString & name )
+ZimFile::ZimFile( const QString & name ) :
+  fileId( 0 )
 {
   setFileName( name );
 }
 
-ZimFile::~ZimFile()
-{
-  clearCache();
-}
-
 void ZimFile::setFileName( const QString & name )
 {
   close();
   memset( &zimHeader, 0, sizeof( zimHeader ) );
-  clearCache();
 
   appendFile( name );
 
@@ -243,101 +242,124 @@ void ZimFile::setFileName( const QString & name )
   }
 }
 
-void ZimFile::clearCache()
+bool ZimFile::open()
+{
+  if( !SplitFile::open( QIODevice::ReadOnly ) )
+    return false;
+
+  memset( &zimHeader, 0, sizeof( zimHeader ) );
+
+  if( read( reinterpret_cast< char * >( &zimHeader ), sizeof( zimHeader ) ) != sizeof( zimHeader ) )
+    return false;
+
+  fileId = getCachedFileId( *files.first() );
+
+  return true;
+}
+
+/// Reads the n-th blob offset of the decompressed cluster, which must have
+/// it. The offsets are 32-bit, or 64-bit in the extended clusters.
+quint64 getClusterBlobOffset( char const * cluster, bool extended, quint64 n )
 {
-  for( int i = 0; i < CACHE_SIZE; i++ )
+  if( extended )
   {
-    if( cache[ i ].data )
-    {
-      free( cache[ i ].data );
-      cache[ i ].data = 0;
-    }
-    cache[ i ].clusterNumber = 0;
-    cache[ i ].stamp = -1;
-    cache[ i ].count = 0;
-    cache[ i ].size = 0;
+    quint64 offset;
+    memcpy( &offset, cluster + n * sizeof( offset ), sizeof( offset ) );
+    return offset;
   }
-  stamp = 0;
+
+  quint32 offset;
+  memcpy( &offset, cluster + n * sizeof( offset ), sizeof( offset ) );
+  return offset;
 }
 
-bool ZimFile::open()
+/// Returns the number of blobs in the decompressed cluster. The blob offsets
+/// come first, and the first one points right past them.
+quint64 getClusterBlobCount( char const * cluster, size_t size, bool extended )
 {
-  if( !SplitFile::open( QIODevice::ReadOnly ) )
+  size_t offsetSize = extended ? sizeof( quint64 ) : sizeof( quint32 );
+
+  if( size < offsetSize )
+    return 0;
+
+  quint64 offsetCount = getClusterBlobOffset( cluster, extended, 0 ) / offsetSize;
+
+  return offsetCount ? offsetCount - 1 : 0;
+}
+
+/// Appends the given blob of the cluster, as returned by getClusterData(),
+/// to the result. Returns false if there's no such blob in the cluster.
+bool appendClusterBlob( QByteArray const & clusterData, quint32 blobNumber, string & result )
+{
+  if( clusterData.isEmpty() )
     return false;
 
-  memset( &zimHeader, 0, sizeof( zimHeader ) );
+  bool extended = clusterData[ 0 ] & ClusterExtended;
+  char const * cluster = clusterData.constData() + 1;
+  size_t size = clusterData.size() - 1;
 
-  if( read( reinterpret_cast< char * >( &zimHeader ), sizeof( zimHeader ) ) != sizeof( zimHeader ) )
+  size_t offsetSize = extended ? sizeof( quint64 ) : sizeof( quint32 );
+
+  if( blobNumber >= getClusterBlobCount( cluster, size, extended ) ||
+      ( (quint64) blobNumber + 2 ) * offsetSize > size )
+    return false;
+
+  quint64 begin = getClusterBlobOffset( cluster, extended, blobNumber );
+  quint64 end = getClusterBlobOffset( cluster, extended, (quint64) blobNumber + 1 );
+
+  if( begin > end || end > size )
     return false;
 
+  result.append( cluster + begin, end - begin );
+
   return true;
 }
 
-string ZimFile::getClusterData( quint32 cluster_nom )
+QByteArray ZimFile::getClusterData( quint32 cluster_nom )
 {
-  // Check cache
-  int target = 0;
-  bool found = false;
-  int lastStamp = INT_MAX;
+  pair< unsigned, quint32 > key( fileId, cluster_nom );
+  QByteArray result;
 
-  for( int i = 0; i < CACHE_SIZE; i++ )
-  {
-    if( cache[ i ].clusterNumber == cluster_nom && cache[ i ].count )
-    {
-      found = true;
-      target = i;
-      break;
-    }
+  if( clusterCache.find( key, result ) )
+    return result;
 
-    if( cache[ i ].stamp < lastStamp )
-    {
-      lastStamp = cache[ i ].stamp;
-      target = i;
-    }
-  }
+  // Cache miss, read data from file
 
-  cache[ target ].stamp = ++stamp;
-  if( stamp < 0 )
-  {
-     stamp = 0;
-     for (int i = 0; i < CACHE_SIZE; i++)
-       cache[ i ].stamp = -1;
-  }
+  char clusterInfo;
+  QByteArray data;
 
-  if( found )
   {
-    // Cache hit
-    return string( cache[ target ].data, cache[ target ].count );
-  }
+    Mutex::Lock _( fileMutex );
 
-  // Cache miss, read data from file
+    // Read cluster pointers
 
-  // Read cluster pointers
+    quint64 clusters[ 2 ];
+    seek( zimHeader.clusterPtrPos + (quint64)cluster_nom * 8 );
+    if( read( reinterpret_cast< char * >( clusters ), sizeof(clusters) ) != sizeof(clusters) )
+      return result;
 
-  quint64 clusters[ 2 ];
-  seek( zimHeader.clusterPtrPos + cluster_nom * 8 );
-  if( read( reinterpret_cast< char * >( clusters ), sizeof(clusters) ) != sizeof(clusters) )
-    return string();
+    // Calculate cluster size
 
-  // Calculate cluster size
+    quint64 clusterSize;
+    if( cluster_nom < zimHeader.clusterCount - 1 )
+      clusterSize = clusters[ 1 ] - clusters[ 0 ];
+    else
+      clusterSize = size() - clusters[ 0 ];
 
-  quint64 clusterSize;
-  if( cluster_nom < zimHeader.clusterCount - 1 )
-    clusterSize = clusters[ 1 ] - clusters[ 0 ];
-  else
-    clusterSize = size() - clusters[ 0 ];
+    // Read cluster data
 
-  // Read cluster data
+    seek( clusters[ 0 ] );
 
-  seek( clusters[ 0 ] );
+    if( !getChar( &clusterInfo ) )
+      return result;
 
-  char compressionType;
-  if( !getChar( &compressionType ) )
-    return string();
+    data = read( clusterSize );
+  }
 
-  string decompressedData;
+  int compressionType = clusterInfo & ClusterCompressionMask;
+  bool extended = clusterInfo & ClusterExtended;
 
-  QByteArray data = read( clusterSize );
+  string decompressedData;
 
   if( compressionType == Default || compressionType == None )
     decompressedData = string( data.data(), data.size() );
@@ -351,41 +373,33 @@ string ZimFile::getClusterData( quint32 cluster_nom )
   if( compressionType == Lzma2 )
     decompressedData = decompressLzma2( data.constData(), data.size() );
   else
-    return string();
+#ifdef MAKE_ZIM_ZSTD_SUPPORT
+  if( compressionType == Zstd )
+    decompressedData = decompressZstd( data.constData(), data.size() );
+  else
+#endif
+  {
+    gdWarning( "Zim: unsupported compression type %i of cluster %u\n",
+               compressionType, cluster_nom );
+    return result;
+  }
+
+  if( decompressedData.empty() )
+    return result;
+
+  data.clear();
+
+  result.reserve( decompressedData.size() + 1 );
+  result.append( clusterInfo );
+  result.append( decompressedData.data(), decompressedData.size() );
 
   // Check BLOBs number in the cluster
   // We cache multi-element clusters only
 
-  quint32 firstOffset;
-  memcpy( &firstOffset, decompressedData.data(), sizeof(firstOffset) );
-  quint32 blobCount = ( firstOffset - 4 ) / 4;
-
-  if( blobCount > 1 )
-  {
-    // Fill cache
-    int size = decompressedData.size();
-    if( cache[ target ].count < size )
-    {
-      if( cache[ target ].data )
-        free( cache[ target ].data );
-      cache[ target ].data = ( char * )malloc( size );
-      if( cache[ target ].data )
-        cache[ target ].size = size;
-      else
-      {
-        cache[ target ].size = 0;
-        cache[ target ].count = 0;
-      }
-    }
-    if( cache[ target ].size )
-    {
-      memcpy( cache[ target ].data, decompressedData.c_str(), size );
-      cache[ target ].count = size;
-      cache[ target ].clusterNumber = cluster_nom;
-    }
-  }
+  if( getClusterBlobCount( decompressedData.data(), decompressedData.size(), extended ) > 1 )
+    clusterCache.insert( key, result );
 
-  return decompressedData;
+  return result;
 }
 
 // Some supporting functions
@@ -409,6 +423,8 @@ quint32 getArticleCluster( ZimFile & file, quint32 articleNumber )
     if( articleNumber >= header.articleCount )
       break;
 
+    Mutex::Lock _( file.mutex() );
+
     file.seek( header.urlPtrPos + (quint64)articleNumber * 8 );
     quint64 pos;
     if( file.read( reinterpret_cast< char * >( &pos ), sizeof(pos) ) != sizeof(pos) )
@@ -454,58 +470,53 @@ quint32 readArticle( ZimFile & file, quint32 articleNumber, string & result,
     if( articleNumber >= header.articleCount )
       break;
 
-    file.seek( header.urlPtrPos + (quint64)articleNumber * 8 );
-    quint64 pos;
-    if( file.read( reinterpret_cast< char * >( &pos ), sizeof(pos) ) != sizeof(pos) )
-      break;
+    ArticleEntry artEntry;
 
-    // Read article info
+    {
+      // The file is only locked while reading the directory entries
+      Mutex::Lock _( file.mutex() );
 
-    quint16 mimetype;
+      file.seek( header.urlPtrPos + (quint64)articleNumber * 8 );
+      quint64 pos;
+      if( file.read( reinterpret_cast< char * >( &pos ), sizeof(pos) ) != sizeof(pos) )
+        break;
 
-    file.seek( pos );
-    if( file.read( reinterpret_cast< char * >( &mimetype ), sizeof(mimetype) ) != sizeof(mimetype) )
-      break;
+      // Read article info
 
-    if( mimetype == 0xFFFF ) // Redirect to other article
-    {
-      RedirectEntry redEntry;
-      if( file.read( reinterpret_cast< char * >( &redEntry ) + 2, sizeof(redEntry) - 2 ) != sizeof(redEntry) - 2 )
-        break;
-      if( articleNumber == redEntry.redirectIndex )
+      quint16 mimetype;
+
+      file.seek( pos );
+      if( file.read( reinterpret_cast< char * >( &mimetype ), sizeof(mimetype) ) != sizeof(mimetype) )
         break;
-      articleNumber = redEntry.redirectIndex;
-      continue;
-    }
 
-    if( loadedArticles && loadedArticles->find( articleNumber ) != loadedArticles->end() )
-      break;
+      if( mimetype == 0xFFFF ) // Redirect to other article
+      {
+        RedirectEntry redEntry;
+        if( file.read( reinterpret_cast< char * >( &redEntry ) + 2, sizeof(redEntry) - 2 ) != sizeof(redEntry) - 2 )
+          break;
+        if( articleNumber == redEntry.redirectIndex )
+          break;
+        articleNumber = redEntry.redirectIndex;
+        continue;
+      }
 
-    ArticleEntry artEntry;
-    artEntry.mimetype = mimetype;
-    if( file.read( reinterpret_cast< char * >( &artEntry ) + 2, sizeof(artEntry) - 2 ) != sizeof(artEntry) - 2 )
-      break;
+      if( loadedArticles && loadedArticles->find( articleNumber ) != loadedArticles->end() )
+        break;
+
+      artEntry.mimetype = mimetype;
+      if( file.read( reinterpret_cast< char * >( &artEntry ) + 2, sizeof(artEntry) - 2 ) != sizeof(artEntry) - 2 )
+        break;
+    }
 
     // Read cluster data
 
-    string decompressedData = file.getClusterData( artEntry.clusterNumber );
-    if( decompressedData.empty() )
-      break;
+    QByteArray clusterData = file.getClusterData( artEntry.clusterNumber );
 
     // Take article data from cluster
 
-    quint32 firstOffset;
-    memcpy( &firstOffset, decompressedData.data(), sizeof(firstOffset) );
-    quint32 blobCount = ( firstOffset - 4 ) / 4;
-    if( artEntry.blobNumber > blobCount )
+    if( !appendClusterBlob( clusterData, artEntry.blobNumber, result ) )
       break;
 
-    quint32 offsets[ 2 ];
-    memcpy( offsets, decompressedData.data() + artEntry.blobNumber * 4, sizeof(offsets) );
-    quint32 size = offsets[ 1 ] - offsets[ 0 ];
-
-    result.append( decompressedData, offsets[ 0 ], size );
-
     return articleNumber;
   }
   return 0xFFFFFFFF;
@@ -518,7 +529,7 @@ class ZimDictionary: public BtreeIndexing::BtreeDictionary
     enum LINKS_TYPE { UNKNOWN, SLASH, NO_SLASH };
 
     Mutex idxMutex;
-    Mutex zimMutex, idxResourceMutex;
+    Mutex idxResourceMutex;
     File::Class idx;
     BtreeIndex resourceIndex;
     IdxHeader idxHeader;
@@ -682,11 +693,7 @@ quint32 ZimDictionary::loadArticle( quint32 address,
                                     set< quint32 > * loadedArticles,
                                     bool rawText )
 {
-quint32 ret;
-  {
-    Mutex::Lock _( zimMutex );
-    ret = readArticle( df, address, articleText, loadedArticles );
-  }
+  quint32 ret = readArticle( df, address, articleText, loadedArticles );
   if( !rawText )
     articleText = convert( articleText );
 
@@ -909,10 +916,7 @@ void ZimDictionary::loadResource( std::string & resourceName, string & data )
   if( link.empty() )
     return;
 
-  {
-    Mutex::Lock _( zimMutex );
-    readArticle( df, link[ 0 ].articleOffset, data );
-  }
+  readArticle( df, link[ 0 ].articleOffset, data );
 }
 
 QString const& ZimDictionary::getDescription()
@@ -921,10 +925,7 @@ QString const& ZimDictionary::getDescription()
         return dictionaryDescription;
 
     string str;
-    {
-      Mutex::Lock _( zimMutex );
-      readArticle( df, idxHeader.descriptionPtr, str );
-    }
+    readArticle( df, idxHeader.descriptionPtr, str );
 
     if( !str.empty() )
       dictionaryDescription = QString::fromUtf8( str.c_str(), str.size() );
@@ -988,7 +989,6 @@ void ZimDictionary::makeFTSIndex( QAtomicInt & isCancelled, bool firstIteration
       if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
         throw exUserAbort();
 
-      Mutex::Lock _( zimMutex );
       offsetsWithClusters.append( QPair< uint32_t, quint32 >( getArticleCluster( df, *it ), *it ) );
     }
 
@@ -1101,7 +1101,6 @@ void ZimDictionary::sortArticlesOffsetsForFTS( QVector< uint32_t > & offsets,
     if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
       return;
 
-    Mutex::Lock _( zimMutex );
     offsetsWithClusters.append( QPair< uint32_t, quint32 >( getArticleCluster( df, *it ), *it ) );
   }
 
@@ -1573,6 +1572,9 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
           IndexedWords indexedWords, indexedResources;
 
+          indexedWords.enableSpilling();
+          indexedResources.enableSpilling();
+
           QByteArray artEntries;
           df.seek( zh.urlPtrPos );
           artEntries = df.read( (quint64)zh.articleCount * 8 );